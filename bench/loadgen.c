@@ -0,0 +1,766 @@
+#define _GNU_SOURCE
+#include "../server_helpers.h"
+#include "../server_metrics.h"
+#include "../server_hpack.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+//epoll load generator for http_server
+//closed loop: every connection sends its next request as soon as the last finishes
+//open loop (-r): requests are scheduled at a fixed rate and latency is measured
+//from the scheduled time, so a stalled server cannot hide its queueing delay
+//with -2 every connection speaks HTTP/2 and keeps -m requests in flight as streams
+
+#define MAX_TARGETS 256
+#define MAX_CONNS 4096
+#define RESPONSE_HEAD_SIZE 8192
+#define MAX_STREAMS 128 //-m limit
+#define H2_BUFFER 65536
+
+typedef struct target {
+	char *path;
+	char *range; //"a-b" for a Range header, or NULL
+	int weight;
+} target;
+
+enum { C_IDLE, C_CONNECTING, C_WRITING, C_READING };
+
+typedef struct conn {
+	int fd;
+	int state;
+	int connected;
+
+	char request[1024];
+	size_t request_len;
+	size_t sent;
+
+	char head[RESPONSE_HEAD_SIZE];
+	size_t head_len;
+	int head_done;
+	long long body_left; //-1 reads until close
+	int server_closes;
+	int status;
+
+	long long start_us;
+
+	struct h2_state *h2; //-2 only
+} conn;
+
+//one request on an HTTP/2 connection
+typedef struct h2_slot {
+	uint32_t id; //0 when free
+	int status;
+	long long start_us;
+	int record;
+} h2_slot;
+
+typedef struct h2_state {
+	uint8_t out[H2_BUFFER];
+	size_t out_len;
+	size_t out_sent;
+	uint8_t in[H2_BUFFER];
+	size_t in_len;
+	hpack_table decoder;
+	uint32_t next_id;
+	uint64_t unacked; //DATA bytes not yet handed back with WINDOW_UPDATE
+	int inflight;
+	h2_slot slots[MAX_STREAMS];
+} h2_state;
+
+static target targets[MAX_TARGETS];
+static int num_targets = 0;
+static int total_weight = 0;
+
+static struct sockaddr_in server_addr;
+static char *host_header = "localhost";
+static int keep_alive = 0;
+static int http2 = 0;
+static int streams_per_conn = 8;
+static int epollfd;
+
+static latency_hist latency;
+static uint64_t statuses[6]; //by class, [0] for transport errors
+static uint64_t bytes_read = 0;
+static uint64_t completed = 0;
+static volatile sig_atomic_t stop = 0;
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [options] [path...]\n"
+			"\t-H host\t\tserver address (127.0.0.1)\n"
+			"\t-p port\t\tserver port (8080)\n"
+			"\t-c conns\tconcurrent connections (16)\n"
+			"\t-d seconds\ttest duration (10)\n"
+			"\t-w seconds\twarm-up excluded from results (1)\n"
+			"\t-r rate\t\topen loop at rate requests/s (closed loop if unset)\n"
+			"\t-k\t\tkeep connections alive when the server allows it\n"
+			"\t-f mixfile\tlines of \"weight path [range]\"\n"
+			"\t-2\t\tHTTP/2 with prior knowledge, requests are multiplexed\n"
+			"\t-m streams\trequests in flight per HTTP/2 connection (8)\n"
+			"paths default to /\n", name);
+	exit(2);
+}
+
+static void add_target(const char *path, const char *range, int weight) {
+	if (num_targets == MAX_TARGETS || weight <= 0) {
+		return;
+	}
+	targets[num_targets].path = strdup(path);
+	targets[num_targets].range = range ? strdup(range) : NULL;
+	targets[num_targets].weight = weight;
+	total_weight += weight;
+	num_targets += 1;
+}
+
+static void load_mix(const char *file) {
+	FILE *mix = fopen(file, "r");
+	if (mix == NULL) {
+		perror(file);
+		exit(1);
+	}
+
+	char line[1024];
+	while (fgets(line, sizeof(line), mix)) {
+		int weight;
+		char path[512], range[64];
+		int fields = sscanf(line, "%d %511s %63s", &weight, path, range);
+		if (line[0] == '#' || fields < 2) {
+			continue;
+		}
+		add_target(path, fields == 3 ? range : NULL, weight);
+	}
+	fclose(mix);
+}
+
+static const target *pick_target() {
+	int roll = rand() % total_weight;
+	for (int i = 0; i < num_targets; i++) {
+		roll -= targets[i].weight;
+		if (roll < 0) {
+			return &targets[i];
+		}
+	}
+	return &targets[0];
+}
+
+static int open_connection(conn *c) {
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	int one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1
+			&& errno != EINPROGRESS) {
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+	c->connected = 0;
+	return 0;
+}
+
+static void close_connection(conn *c) {
+	if (c->fd != -1) {
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+//start a request on c that was due at start_us
+static void begin_request(conn *c, long long start_us) {
+	const target *t = pick_target();
+
+	int len = snprintf(c->request, sizeof(c->request), "GET %s HTTP/1.1\r\nHost: %s\r\n", t->path, host_header);
+	if (t->range) {
+		len += snprintf(c->request + len, sizeof(c->request) - len, "Range: bytes=%s\r\n", t->range);
+	}
+	len += snprintf(c->request + len, sizeof(c->request) - len, "Connection: %s\r\n\r\n",
+			keep_alive ? "keep-alive" : "close");
+
+	c->request_len = len;
+	c->sent = 0;
+	c->head_len = 0;
+	c->head_done = 0;
+	c->body_left = -1;
+	c->server_closes = !keep_alive;
+	c->status = 0;
+	c->start_us = start_us;
+
+	if (c->fd == -1 && open_connection(c) == -1) {
+		statuses[0] += 1;
+		c->state = C_IDLE;
+		return;
+	}
+	c->state = c->connected ? C_WRITING : C_CONNECTING;
+}
+
+static void finish_request(conn *c, int ok, int record) {
+	if (record) {
+		if (ok && c->status >= 100 && c->status < 600) {
+			statuses[c->status / 100] += 1;
+			hist_record(&latency, monotonic_us() - c->start_us);
+			completed += 1;
+		} else {
+			statuses[0] += 1;
+		}
+	}
+
+	if (!ok || c->server_closes || !keep_alive) {
+		close_connection(c);
+	}
+	c->state = C_IDLE;
+}
+
+//parse status, length and connection handling once the head is complete
+static int parse_head(conn *c) {
+	char *end = strstr(c->head, "\r\n\r\n");
+	size_t head_size = end ? (size_t)(end - c->head) + 4 : 0;
+	if (end == NULL && (end = strstr(c->head, "\n\n")) != NULL) {
+		head_size = (size_t)(end - c->head) + 2;
+	}
+	if (end == NULL) {
+		return 0;
+	}
+
+	if (sscanf(c->head, "HTTP/1.%*d %d", &c->status) != 1) {
+		c->status = -1;
+	}
+
+	for (char *line = strchr(c->head, '\n'); line && line < c->head + head_size; line = strchr(line + 1, '\n')) {
+		if (strncasecmp(line + 1, "Content-Length:", 15) == 0) {
+			c->body_left = atoll(line + 16);
+		} else if (strncasecmp(line + 1, "Connection: close", 17) == 0) {
+			c->server_closes = 1;
+		}
+	}
+
+	//whatever came after the head is body
+	long long extra = (long long)(c->head_len - head_size);
+	bytes_read += extra;
+	if (c->body_left >= 0) {
+		c->body_left -= extra;
+	}
+	c->head_done = 1;
+	return 1;
+}
+
+//run c's state machine until it blocks, returns 1 when a response completed
+static int drive(conn *c, int record) {
+	char sink[65536];
+
+	while (c->state != C_IDLE) {
+		if (c->state == C_CONNECTING) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (err == EINPROGRESS || err == EALREADY) {
+				return 0;
+			} else if (err != 0) {
+				finish_request(c, 0, record);
+				return 1;
+			}
+			c->connected = 1;
+			c->state = C_WRITING;
+		}
+
+		if (c->state == C_WRITING) {
+			ssize_t result = send(c->fd, c->request + c->sent, c->request_len - c->sent, MSG_NOSIGNAL);
+			if (result == -1 && (errno == EAGAIN || errno == ENOTCONN)) {
+				return 0;
+			} else if (result == -1) {
+				finish_request(c, 0, record);
+				return 1;
+			}
+			c->sent += result;
+			if (c->sent == c->request_len) {
+				c->state = C_READING;
+			}
+			continue;
+		}
+
+		//C_READING
+		ssize_t result;
+		if (!c->head_done) {
+			result = read(c->fd, c->head + c->head_len, RESPONSE_HEAD_SIZE - 1 - c->head_len);
+		} else {
+			size_t want = sizeof(sink);
+			if (c->body_left >= 0 && (size_t)c->body_left < want) {
+				want = c->body_left;
+			}
+			result = want ? read(c->fd, sink, want) : 0;
+		}
+
+		if (result == -1 && errno == EAGAIN) {
+			return 0;
+		} else if (result == -1) {
+			finish_request(c, 0, record);
+			return 1;
+		} else if (result == 0) {
+			//closed: fine only if we were reading to close or had everything
+			int ok = c->head_done && c->body_left <= 0;
+			c->server_closes = 1;
+			finish_request(c, ok, record);
+			return 1;
+		}
+
+		if (!c->head_done) {
+			c->head_len += result;
+			c->head[c->head_len] = '\0';
+			if (!parse_head(c) && c->head_len == RESPONSE_HEAD_SIZE - 1) {
+				finish_request(c, 0, record);
+				return 1;
+			}
+		} else {
+			bytes_read += result;
+			if (c->body_left > 0) {
+				c->body_left -= result;
+			}
+		}
+
+		if (c->head_done && c->body_left == 0) {
+			finish_request(c, 1, record);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void h2_frame(h2_state *h, uint8_t type, uint8_t flags, uint32_t stream, const void *payload, size_t len) {
+	if (h->out_len + 9 + len > sizeof(h->out)) {
+		return; //full: only happens if the server stops reading, the run fails anyway
+	}
+	uint8_t *p = h->out + h->out_len;
+	p[0] = len >> 16;
+	p[1] = len >> 8;
+	p[2] = len;
+	p[3] = type;
+	p[4] = flags;
+	p[5] = stream >> 24;
+	p[6] = stream >> 16;
+	p[7] = stream >> 8;
+	p[8] = stream;
+	memcpy(p + 9, payload, len);
+	h->out_len += 9 + len;
+}
+
+static void h2_window_update(h2_state *h, uint32_t increment) {
+	uint8_t p[4] = { increment >> 24, increment >> 16, increment >> 8, increment };
+	h2_frame(h, 8, 0, 0, p, 4);
+}
+
+//literal field without indexing, name from the static table
+static size_t h2_literal(uint8_t *out, int name_index, const char *value) {
+	size_t pos = 0, len = strlen(value);
+	if (name_index < 15) {
+		out[pos++] = name_index;
+	} else {
+		out[pos++] = 15;
+		out[pos++] = name_index - 15;
+	}
+	if (len < 127) {
+		out[pos++] = len;
+	} else {
+		out[pos++] = 127;
+		for (len -= 127; len >= 128; len >>= 7) {
+			out[pos++] = (len & 0x7f) | 0x80;
+		}
+		out[pos++] = len;
+		len = strlen(value);
+	}
+	memcpy(out + pos, value, len);
+	return pos + len;
+}
+
+static void h2_open(conn *c) {
+	if (open_connection(c) == -1) {
+		return;
+	}
+	h2_state *h = c->h2;
+	h->out_len = h->out_sent = h->in_len = 0;
+	h->next_id = 1;
+	h->unacked = 0;
+	hpack_table_free(&h->decoder);
+	hpack_table_init(&h->decoder, HPACK_DEFAULT_TABLE_SIZE);
+
+	//windows as large as they go, so only the server's scheduling is measured
+	memcpy(h->out, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+	h->out_len = 24;
+	uint8_t settings[12] = { 0, 2, 0, 0, 0, 0, 0, 4, 0x7f, 0xff, 0xff, 0xff };
+	h2_frame(h, 4, 0, 0, settings, sizeof(settings));
+	h2_window_update(h, 0x7fffffff - 65535);
+}
+
+static void h2_fail_all(conn *c) {
+	h2_state *h = c->h2;
+	for (int i = 0; i < MAX_STREAMS; i++) {
+		if (h->slots[i].id != 0) {
+			if (h->slots[i].record) {
+				statuses[0] += 1;
+			}
+			h->slots[i].id = 0;
+		}
+	}
+	h->inflight = 0;
+	close_connection(c);
+}
+
+//queue a request as a new stream, the connection is opened on demand
+static void h2_begin_request(conn *c, long long start_us, int record) {
+	h2_state *h = c->h2;
+	if (c->fd == -1) {
+		h2_open(c);
+		if (c->fd == -1) {
+			statuses[0] += record;
+			return;
+		}
+	}
+
+	h2_slot *slot = NULL;
+	for (int i = 0; i < MAX_STREAMS && slot == NULL; i++) {
+		slot = h->slots[i].id == 0 ? &h->slots[i] : NULL;
+	}
+
+	const target *t = pick_target();
+	uint8_t block[1024];
+	size_t len = 0;
+	block[len++] = 0x82; //:method GET
+	block[len++] = 0x86; //:scheme http
+	len += h2_literal(block + len, 4, t->path);
+	len += h2_literal(block + len, 1, host_header);
+	if (t->range) {
+		char range[80];
+		snprintf(range, sizeof(range), "bytes=%s", t->range);
+		len += h2_literal(block + len, 50, range);
+	}
+
+	slot->id = h->next_id;
+	slot->status = 0;
+	slot->start_us = start_us;
+	slot->record = record;
+	h->next_id += 2;
+	h->inflight += 1;
+	h2_frame(h, 1, 0x5, slot->id, block, len); //END_STREAM | END_HEADERS
+}
+
+static int h2_status_field(void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+	if (name_len == 7 && memcmp(name, ":status", 7) == 0) {
+		*(int *)arg = atoi(value);
+	}
+	return 0;
+}
+
+static void h2_finish(conn *c, h2_slot *slot, int ok) {
+	if (slot->record) {
+		if (ok && slot->status >= 100 && slot->status < 600) {
+			statuses[slot->status / 100] += 1;
+			hist_record(&latency, monotonic_us() - slot->start_us);
+			completed += 1;
+		} else {
+			statuses[0] += 1;
+		}
+	}
+	slot->id = 0;
+	c->h2->inflight -= 1;
+}
+
+static h2_slot *h2_find(h2_state *h, uint32_t id) {
+	for (int i = 0; i < MAX_STREAMS; i++) {
+		if (h->slots[i].id == id && id != 0) {
+			return &h->slots[i];
+		}
+	}
+	return NULL;
+}
+
+//one frame from the server, returns -1 if the connection is done for
+static int h2_handle_frame(conn *c, uint8_t type, uint8_t flags, uint32_t id, uint8_t *p, size_t len) {
+	h2_state *h = c->h2;
+	h2_slot *slot = h2_find(h, id);
+
+	if (type == 0) { //DATA
+		bytes_read += len;
+		h->unacked += len;
+		if (h->unacked >= (1 << 30)) {
+			h2_window_update(h, h->unacked);
+			h->unacked = 0;
+		}
+	} else if (type == 1) { //HEADERS, the server never pads or sets priorities
+		int status = 0;
+		if (hpack_decode(&h->decoder, p, len, h2_status_field, &status) == -1) {
+			return -1;
+		}
+		if (slot != NULL) {
+			slot->status = status;
+		}
+	} else if (type == 3 && slot != NULL) { //RST_STREAM
+		h2_finish(c, slot, 0);
+		return 0;
+	} else if (type == 4 && !(flags & 1)) { //SETTINGS
+		h2_frame(h, 4, 1, 0, NULL, 0);
+	} else if (type == 7) { //GOAWAY
+		return -1;
+	}
+
+	if ((type == 0 || type == 1) && (flags & 1) && slot != NULL) {
+		h2_finish(c, slot, 1);
+	}
+	return 0;
+}
+
+static void h2_drive(conn *c) {
+	h2_state *h = c->h2;
+	if (c->fd == -1) {
+		return;
+	}
+
+	if (!c->connected) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err == EINPROGRESS || err == EALREADY) {
+			return;
+		} else if (err != 0) {
+			h2_fail_all(c);
+			return;
+		}
+		c->connected = 1;
+	}
+
+	while (1) {
+		int progress = 0;
+
+		while (h->out_sent < h->out_len) {
+			ssize_t result = send(c->fd, h->out + h->out_sent, h->out_len - h->out_sent, MSG_NOSIGNAL);
+			if (result == -1 && (errno == EAGAIN || errno == ENOTCONN)) {
+				break;
+			} else if (result == -1) {
+				h2_fail_all(c);
+				return;
+			}
+			h->out_sent += result;
+			progress = 1;
+		}
+		if (h->out_sent == h->out_len) {
+			h->out_sent = h->out_len = 0;
+		}
+
+		ssize_t result = read(c->fd, h->in + h->in_len, sizeof(h->in) - h->in_len);
+		if (result == 0 || (result == -1 && errno != EAGAIN)) {
+			h2_fail_all(c);
+			return;
+		} else if (result > 0) {
+			h->in_len += result;
+			progress = 1;
+		}
+
+		size_t pos = 0;
+		while (h->in_len - pos >= 9) {
+			uint8_t *f = h->in + pos;
+			size_t len = (size_t)f[0] << 16 | f[1] << 8 | f[2];
+			if (len + 9 > sizeof(h->in)) {
+				h2_fail_all(c);
+				return;
+			} else if (h->in_len - pos < len + 9) {
+				break;
+			}
+			uint32_t id = ((uint32_t)f[5] << 24 | f[6] << 16 | f[7] << 8 | f[8]) & 0x7fffffff;
+			if (h2_handle_frame(c, f[3], f[4], id, f + 9, len) == -1) {
+				h2_fail_all(c);
+				return;
+			}
+			pos += len + 9;
+		}
+		memmove(h->in, h->in + pos, h->in_len - pos);
+		h->in_len -= pos;
+
+		if (!progress) {
+			return;
+		}
+	}
+}
+
+//HdrHistogram style correction for closed loop runs: a response that took
+//longer than the expected interval also delayed the requests queued behind it
+static void correct_coordinated_omission(latency_hist *hist, uint64_t interval_us) {
+	if (interval_us == 0) {
+		return;
+	}
+
+	latency_hist raw = *hist;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		uint64_t value = hist_bucket_upper(i) - 1;
+		for (uint64_t missing = value - interval_us; raw.counts[i] && missing >= interval_us
+				&& missing < value; missing -= interval_us) {
+			hist_record_n(hist, missing, raw.counts[i]);
+		}
+	}
+}
+
+static void on_signal(int arg) {
+	stop = 1;
+}
+
+int main(int argc, char **argv) {
+
+	const char *host = "127.0.0.1";
+	char *port = "8080";
+	int conns = 16;
+	double duration = 10;
+	double warmup = 1;
+	double rate = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "H:p:c:d:w:r:kf:2m:")) != -1) {
+		switch (opt) {
+		case 'H': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 'c': conns = atoi(optarg); break;
+		case 'd': duration = atof(optarg); break;
+		case 'w': warmup = atof(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 'k': keep_alive = 1; break;
+		case 'f': load_mix(optarg); break;
+		case '2': http2 = 1; break;
+		case 'm': streams_per_conn = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	for (int i = optind; i < argc; i++) {
+		add_target(argv[i], NULL, 1);
+	}
+	if (num_targets == 0) {
+		add_target("/", NULL, 1);
+	}
+	if (conns < 1 || conns > MAX_CONNS || duration <= 0 || streams_per_conn < 1
+			|| streams_per_conn > MAX_STREAMS) {
+		usage(argv[0]);
+	}
+
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *info;
+	int result = getaddrinfo(host, port, &hints, &info);
+	if (result) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(result));
+		return 1;
+	}
+	memcpy(&server_addr, info->ai_addr, sizeof(server_addr));
+	freeaddrinfo(info);
+
+	signal(SIGINT, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+
+	conn *pool = calloc(conns, sizeof(conn));
+	for (int i = 0; i < conns; i++) {
+		pool[i].fd = -1;
+		if (http2) {
+			pool[i].h2 = calloc(1, sizeof(h2_state));
+			hpack_table_init(&pool[i].h2->decoder, HPACK_DEFAULT_TABLE_SIZE);
+		}
+	}
+
+	long long begin = monotonic_us();
+	long long measure_from = begin + (long long)(warmup * 1e6);
+	long long end = measure_from + (long long)(duration * 1e6);
+	long long interval = rate > 0 ? (long long)(1e6 / rate) : 0;
+	uint64_t scheduled = 0; //open loop: requests dispatched so far
+
+	struct epoll_event events[256];
+	while (!stop) {
+		long long now = monotonic_us();
+		if (now >= end) {
+			break;
+		}
+
+		//hand due requests to idle connections, or to free streams with -2
+		int due = 1;
+		for (int i = 0; i < conns && due; i++) {
+			while (due && (http2 ? pool[i].h2->inflight < streams_per_conn : pool[i].state == C_IDLE)) {
+				long long start = now;
+				if (interval > 0) {
+					start = begin + (long long)scheduled * interval;
+					if (start > now) {
+						due = 0;
+						break;
+					}
+					scheduled += 1;
+				}
+				if (http2) {
+					h2_begin_request(&pool[i], start, start >= measure_from);
+					if (pool[i].fd == -1) {
+						break;
+					}
+				} else {
+					begin_request(&pool[i], start);
+					drive(&pool[i], start >= measure_from);
+					break;
+				}
+			}
+			if (http2) {
+				h2_drive(&pool[i]);
+			}
+		}
+
+		int timeout = 100;
+		if (interval > 0) {
+			long long next = begin + (long long)scheduled * interval - monotonic_us();
+			timeout = next > 0 ? (int)(next / 1000) : 0;
+		}
+
+		int num_events = epoll_wait(epollfd, events, 256, timeout);
+		for (int i = 0; i < num_events; i++) {
+			conn *c = events[i].data.ptr;
+			if (http2) {
+				h2_drive(c);
+			} else {
+				drive(c, c->start_us >= measure_from);
+			}
+		}
+	}
+
+	double elapsed = (monotonic_us() - measure_from) / 1e6;
+	if (elapsed > duration) {
+		elapsed = duration;
+	}
+
+	//closed loop latency is corrected against the mean per-connection interval
+	if (interval == 0 && latency.total > 0) {
+		correct_coordinated_omission(&latency, (uint64_t)(elapsed * 1e6 * conns / latency.total));
+	}
+
+	char streams[32] = "";
+	if (http2) {
+		snprintf(streams, sizeof(streams), ", HTTP/2 x%d streams", streams_per_conn);
+	}
+	printf("mode\t\t%s, %d connections%s%s\n", interval ? "open loop" : "closed loop", conns,
+			keep_alive && !http2 ? ", keep-alive" : "", streams);
+	printf("requests\t%llu in %.2fs\n", (unsigned long long)completed, elapsed);
+	printf("throughput\t%.1f req/s, %.2f MB/s\n", completed / elapsed, bytes_read / elapsed / 1e6);
+	printf("responses\t2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, errors %llu\n",
+			(unsigned long long)statuses[2], (unsigned long long)statuses[3],
+			(unsigned long long)statuses[4], (unsigned long long)statuses[5],
+			(unsigned long long)statuses[0]);
+	printf("latency (us)\tp50 %llu, p99 %llu, p999 %llu, max %llu\n",
+			(unsigned long long)hist_quantile(&latency, 0.5),
+			(unsigned long long)hist_quantile(&latency, 0.99),
+			(unsigned long long)hist_quantile(&latency, 0.999),
+			(unsigned long long)hist_quantile(&latency, 1.0));
+
+	return statuses[0] > 0;
+}
@@ -0,0 +1,318 @@
+//microbenchmarks for the per-request functions in webserver.c
+//the server is compiled into this binary so its static helpers and
+//request_info are reachable; its main() is renamed out of the way
+#define main http_server_main
+#include "../webserver.c"
+#undef main
+
+#include <stdint.h>
+
+//count every allocation in the process, including those libc makes for us
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static uint64_t allocations = 0;
+
+void *malloc(size_t size) {
+	allocations += 1;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	allocations += 1;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	allocations += 1;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+
+#define MIN_BENCH_NS 200000000LL //run each case for at least 0.2s
+
+typedef struct bench_case {
+	const char *name;
+	const char *request;
+} bench_case;
+
+//real browser/tool traffic plus inputs that stress the parser
+static bench_case corpus[] = {
+	{ "curl", "GET /index.html HTTP/1.1\r\nHost: localhost\r\nUser-Agent: curl/8.4.0\r\nAccept: */*\r\n\r\n" },
+	{ "browser",
+		"GET /style.css HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+		"Accept: text/css,*/*;q=0.1\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Referer: https://www.example.com/\r\n"
+		"Connection: keep-alive\r\n"
+		"Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; consent=1\r\n"
+		"Sec-Fetch-Dest: style\r\n"
+		"Sec-Fetch-Mode: no-cors\r\n"
+		"Sec-Fetch-Site: same-origin\r\n\r\n" },
+	{ "head", "HEAD / HTTP/1.1\r\nHost: localhost\r\n\r\n" },
+	{ "range", "GET /style.css HTTP/1.1\r\nHost: localhost\r\nRange: bytes=0-99\r\n\r\n" },
+	{ "directory", "GET /docs/ HTTP/1.1\r\nHost: localhost\r\n\r\n" },
+	{ "missing", "GET /missing.png HTTP/1.1\r\nHost: localhost\r\n\r\n" },
+	{ "traversal", "GET /../../etc/passwd HTTP/1.1\r\nHost: localhost\r\n\r\n" },
+	{ "post", "POST /form HTTP/1.1\r\nHost: localhost\r\nContent-Length: 0\r\n\r\n" },
+	{ "unknown-verb", "BREW /pot HTTP/1.1\r\nHost: localhost\r\n\r\n" },
+	{ "no-host", "GET / HTTP/1.1\r\nUser-Agent: x\r\n\r\n" },
+	{ "bare-lf", "GET / HTTP/1.0\nHost: localhost\n\n" },
+	{ NULL, NULL }, //long path, filled in by main
+	{ NULL, NULL }, //many headers, filled in by main
+};
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+//extension fast paths and the libmagic fallback
+static const char *mime_files[] = {
+	"index.html", "style.css", "app.js", "photo.jpg", "README", "archive.tar.gz",
+};
+
+static char root[] = "/tmp/microbench-XXXXXX";
+static int devnull;
+
+typedef void (*bench_fn)(void *arg);
+
+static void report(const char *group, const char *name, bench_fn fn, void *arg) {
+
+	//warm up caches and lazy initialisation
+	fn(arg);
+
+	uint64_t iterations = 0;
+	uint64_t start_allocations = allocations;
+	long long start = monotonic_us() * 1000;
+	long long elapsed = 0;
+
+	for (uint64_t batch = 1; elapsed < MIN_BENCH_NS; batch *= 2) {
+		for (uint64_t i = 0; i < batch; i++) {
+			fn(arg);
+		}
+		iterations += batch;
+		elapsed = monotonic_us() * 1000 - start;
+	}
+
+	printf("%-14s %-14s %12.1f ns/op %8.2f allocs/op\n", group, name,
+			(double)elapsed / iterations,
+			(double)(allocations - start_allocations) / iterations);
+}
+
+static request_info *new_request(const char *request, int fd) {
+	request_info *req_info = __libc_calloc(1, sizeof(request_info));
+	req_info->event = __libc_calloc(1, sizeof(struct epoll_event));
+	req_info->event->data.fd = fd;
+	req_info->config = current_config;
+	req_info->host = current_config->default_host;
+	req_info->request_h = __libc_calloc(1, MAX_HEADER_SIZE);
+	strncpy(req_info->request_h, request, MAX_HEADER_SIZE - 1);
+	return req_info;
+}
+
+//return a request to the state handle_request sees after stage 0
+static void reset_request(request_info *req_info) {
+	free(req_info->response_h);
+	req_info->response_h = NULL;
+	free(req_info->body);
+	req_info->body = NULL;
+	file_map_release(req_info->map);
+	req_info->map = NULL;
+	if (req_info->file != NULL) {
+		fclose(req_info->file);
+		req_info->file = NULL;
+	}
+	free(req_info->redirect);
+	req_info->redirect = NULL;
+	req_info->location = NULL;
+	req_info->stage = 1;
+	req_info->progress = 0;
+	req_info->range_start = 0;
+	req_info->range_end = 0;
+	req_info->ranged = RANGE_NONE;
+	req_info->mime_type = NULL;
+	req_info->status = 0;
+}
+
+static void bench_check_verb(void *arg) {
+	volatile verb v = check_verb((char *)arg);
+	(void)v;
+}
+
+//header arrives on a socket, exactly as a client sends it
+typedef struct header_arg {
+	const char *request;
+	size_t length;
+	int client;
+	request_info *req_info;
+} header_arg;
+
+static void bench_get_header(void *arg) {
+	header_arg *h = arg;
+	request_info *req_info = h->req_info;
+
+	if (write(h->client, h->request, h->length) != (ssize_t)h->length) {
+		perror("write");
+		exit(1);
+	}
+
+	memset(req_info->request_h, 0, MAX_HEADER_SIZE);
+	req_info->progress = 0;
+	req_info->stage = 0;
+	errno = 0;
+	get_header(req_info);
+	reset_request(req_info);
+
+	//drain error responses and any unread bytes
+	char sink[MAX_HEADER_SIZE];
+	while (read(h->client, sink, sizeof(sink)) > 0);
+	while (read(req_info->event->data.fd, sink, sizeof(sink)) > 0);
+}
+
+static void bench_get(void *arg) {
+	request_info *req_info = arg;
+	req_info->req_type = check_verb(req_info->request_h);
+	req_info->req_type = req_info->req_type == GET ? HEAD : req_info->req_type;
+	errno = 0;
+	get(req_info);
+	reset_request(req_info);
+}
+
+//the file is stat'ed once, as get does before picking the type
+typedef struct mime_arg {
+	char *path;
+	struct stat st;
+} mime_arg;
+
+static void bench_set_mime_type(void *arg) {
+	mime_arg *m = arg;
+	request_info req_info = { 0 };
+	set_mime_type(m->path, &m->st, &req_info);
+}
+
+static void bench_send_status_n(void *arg) {
+	request_info *req_info = arg;
+	errno = 0;
+	send_status_n(devnull, 206, req_info, 123456);
+	reset_request(req_info);
+	req_info->mime_type = "text/html";
+	req_info->ranged = RANGE_FROM;
+	req_info->range_end = req_info->range_size = 123456;
+}
+
+static void make_fixtures() {
+	if (mkdtemp(root) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+
+	char path[256];
+	const char *files[] = { "index.html", "style.css", "app.js", "photo.jpg", "README",
+			"archive.tar.gz", "docs/a.txt", "docs/b.txt", "docs/c.txt" };
+	snprintf(path, sizeof(path), "%s/docs", root);
+	mkdir(path, 0755);
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", root, files[i]);
+		FILE *file = fopen(path, "w");
+		fputs("body { color: black; }\n", file);
+		fclose(file);
+	}
+
+	char conf_path[256];
+	snprintf(conf_path, sizeof(conf_path), "%s/server.conf", root);
+	FILE *conf = fopen(conf_path, "w");
+	fprintf(conf, "port = \"0\";\nwebserver_root = \"%s\";\n"
+			"security_headers = [\"Cache-Control: private, max-age=0\", "
+			"\"X-Frame-Options: SAMEORIGIN\", \"X-XSS-Protection: 1\"];\n", root);
+	fclose(conf);
+
+	current_config = server_config_load(conf_path);
+	if (current_config == NULL) {
+		exit(1);
+	}
+}
+
+static void remove_fixtures() {
+	char command[300];
+	snprintf(command, sizeof(command), "rm -rf %s", root);
+	if (system(command) != 0) {
+		fprintf(stderr, "could not remove %s\n", root);
+	}
+}
+
+int main(int argc, char **argv) {
+
+	if (argc > 1) {
+		fprintf(stderr, "Usage: %s\nruns every case and prints ns/op and allocs/op\n", argv[0]);
+		return 2;
+	}
+
+	//adversarial cases that are too big to write inline
+	static char long_path[MAX_HEADER_SIZE];
+	int len = sprintf(long_path, "GET /");
+	memset(long_path + len, 'a', MAX_PATHNAME_SIZE - 100);
+	len += MAX_PATHNAME_SIZE - 100;
+	sprintf(long_path + len, " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+	corpus[CORPUS_SIZE - 2] = (bench_case){ "long-path", long_path };
+
+	static char many_headers[MAX_HEADER_SIZE];
+	len = sprintf(many_headers, "GET / HTTP/1.1\r\n");
+	while (len < MAX_HEADER_SIZE - 200) {
+		len += sprintf(many_headers + len, "X-Padding-%d: %s\r\n", len, "0123456789abcdef");
+	}
+	sprintf(many_headers + len, "Host: localhost\r\n\r\n");
+	corpus[CORPUS_SIZE - 1] = (bench_case){ "many-headers", many_headers };
+
+	signal(SIGPIPE, SIG_IGN);
+	load_status_codes();
+	magic = magic_open(MAGIC_MIME_TYPE);
+	magic_load(magic, NULL);
+	devnull = open("/dev/null", O_WRONLY);
+	make_fixtures();
+
+	for (size_t i = 0; i < CORPUS_SIZE; i++) {
+		report("check_verb", corpus[i].name, bench_check_verb, (void *)corpus[i].request);
+	}
+
+	for (size_t i = 0; i < CORPUS_SIZE; i++) {
+		int pair[2];
+		socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair);
+		int size = 1 << 20;
+		setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+		header_arg h = { corpus[i].request, strlen(corpus[i].request), pair[0], new_request("", pair[1]) };
+		report("get_header", corpus[i].name, bench_get_header, &h);
+		close(pair[0]);
+		close(pair[1]);
+	}
+
+	for (size_t i = 0; i < CORPUS_SIZE; i++) {
+		verb v = check_verb((char *)corpus[i].request);
+		if (v == GET || v == HEAD) {
+			report("get", corpus[i].name, bench_get, new_request(corpus[i].request, devnull));
+		}
+	}
+
+	for (size_t i = 0; i < sizeof(mime_files) / sizeof(mime_files[0]); i++) {
+		char path[256];
+		snprintf(path, sizeof(path), "%s/%s", root, mime_files[i]);
+		mime_arg m = { path };
+		if (stat(path, &m.st) == -1) {
+			perror("stat");
+			exit(1);
+		}
+		report("set_mime_type", mime_files[i], bench_set_mime_type, &m);
+	}
+
+	request_info *status_req = new_request(corpus[0].request, devnull);
+	bench_send_status_n(status_req);
+	report("send_status_n", "206+range", bench_send_status_n, status_req);
+
+	remove_fixtures();
+	return 0;
+}
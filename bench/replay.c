@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include "../server_helpers.h"
+#include "../server_metrics.h"
+#include "../server_capture.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+//replays a capture_file against a server, in capture order, at the captured
+//timing (scaled with -s), and checks each response against the captured
+//status and optionally against body hashes from an earlier baseline run
+
+#define REPLAY_HEAD_SIZE 8192
+
+typedef struct replay_request {
+	uint64_t segment;
+	uint64_t conn_id;
+	long long time_us; //from the start of the capture
+	char *bytes;
+	size_t length;
+	int expected_status; //0 if the capture has none
+
+	int status; //-1 on transport errors
+	uint64_t hash;
+} replay_request;
+
+typedef struct replay_conn {
+	int fd;
+	replay_request *req;
+	size_t sent;
+
+	char head[REPLAY_HEAD_SIZE];
+	size_t head_len;
+	int head_done;
+	long long body_left; //-1 reads until close
+
+	long long started_us;
+} replay_conn;
+
+static replay_request *requests = NULL;
+static size_t num_requests = 0;
+
+static struct sockaddr_in server_addr;
+static int epollfd;
+static latency_hist latency;
+static latency_hist lateness; //how far behind schedule requests were sent
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [options] capture_file\n"
+			"\t-H host\t\tserver address (127.0.0.1)\n"
+			"\t-p port\t\tserver port (8080)\n"
+			"\t-s speed\ttiming scale, 2 replays twice as fast, 0 as fast as possible (1)\n"
+			"\t-c conns\tmost connections open at once (256)\n"
+			"\t-B file\t\twrite status and body hash of every response\n"
+			"\t-b file\t\tcompare against a file written with -B\n", name);
+	exit(2);
+}
+
+static int get_varint(FILE *file, uint64_t *value) {
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int c = fgetc(file);
+		if (c == EOF) {
+			return -1;
+		}
+		*value |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static replay_request *find_request(uint64_t segment, uint64_t conn_id) {
+	//statuses follow their request closely, search backwards
+	for (size_t i = num_requests; i-- > 0;) {
+		if (requests[i].segment == segment && requests[i].conn_id == conn_id) {
+			return &requests[i];
+		}
+		if (requests[i].segment != segment) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void load_capture(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		exit(1);
+	}
+
+	size_t capacity = 1024;
+	requests = calloc(capacity, sizeof(replay_request));
+
+	uint64_t segment = 0;
+	long long now = 0;
+	int type;
+	char magic[CAPTURE_MAGIC_LEN];
+
+	while ((type = fgetc(file)) != EOF) {
+		if (type == CAPTURE_MAGIC[0]) {
+			if (fread(magic + 1, CAPTURE_MAGIC_LEN - 1, 1, file) != 1
+					|| memcmp(magic + 1, CAPTURE_MAGIC + 1, CAPTURE_MAGIC_LEN - 1) != 0) {
+				break;
+			}
+			segment += 1;
+			continue;
+		}
+
+		uint64_t delta, conn_id, value;
+		if (segment == 0 || get_varint(file, &delta) || get_varint(file, &conn_id)
+				|| get_varint(file, &value)) {
+			break;
+		}
+		now += delta;
+
+		if (type == CAPTURE_REQUEST) {
+			if (num_requests == capacity) {
+				capacity *= 2;
+				requests = realloc(requests, capacity * sizeof(replay_request));
+			}
+			replay_request *req = &requests[num_requests];
+			memset(req, 0, sizeof(replay_request));
+			req->segment = segment;
+			req->conn_id = conn_id;
+			req->time_us = now;
+			req->length = value;
+			req->bytes = malloc(value);
+			if (fread(req->bytes, value, 1, file) != 1 && value > 0) {
+				break;
+			}
+			num_requests += 1;
+
+		} else if (type == CAPTURE_STATUS) {
+			replay_request *req = find_request(segment, conn_id);
+			if (req != NULL) {
+				req->expected_status = (int)value;
+			}
+		} else {
+			break;
+		}
+	}
+
+	if (!feof(file)) {
+		fprintf(stderr, "%s: stopped at a corrupt record, replaying %zu requests\n", path, num_requests);
+	}
+	fclose(file);
+}
+
+static void hash_bytes(uint64_t *hash, const char *bytes, size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		*hash = (*hash ^ (unsigned char)bytes[i]) * 1099511628211ull;
+	}
+}
+
+static void finish(replay_conn *c, int ok) {
+	if (!ok) {
+		c->req->status = -1;
+	} else {
+		hist_record(&latency, monotonic_us() - c->started_us);
+	}
+	close(c->fd);
+	c->fd = -1;
+	c->req = NULL;
+}
+
+static int parse_head(replay_conn *c) {
+	char *end = strstr(c->head, "\r\n\r\n");
+	size_t head_size = end ? (size_t)(end - c->head) + 4 : 0;
+	if (end == NULL && (end = strstr(c->head, "\n\n")) != NULL) {
+		head_size = (size_t)(end - c->head) + 2;
+	}
+	if (end == NULL) {
+		return 0;
+	}
+
+	if (sscanf(c->head, "HTTP/1.%*d %d", &c->req->status) != 1) {
+		c->req->status = -1;
+	}
+	char *length = strcasestr(c->head, "\nContent-Length:");
+	if (length != NULL && length < c->head + head_size) {
+		c->body_left = atoll(length + 16);
+	}
+
+	size_t extra = c->head_len - head_size;
+	hash_bytes(&c->req->hash, c->head + head_size, extra);
+	if (c->body_left >= 0) {
+		c->body_left -= extra;
+	}
+	c->head_done = 1;
+	return 1;
+}
+
+//returns 1 once the connection is finished
+static int drive(replay_conn *c) {
+	char buf[65536];
+
+	while (c->sent < c->req->length) {
+		ssize_t result = send(c->fd, c->req->bytes + c->sent, c->req->length - c->sent, MSG_NOSIGNAL);
+		if (result == -1 && (errno == EAGAIN || errno == ENOTCONN)) {
+			return 0;
+		} else if (result == -1) {
+			finish(c, 0);
+			return 1;
+		}
+		c->sent += result;
+	}
+
+	while (1) {
+		ssize_t result;
+		if (!c->head_done) {
+			result = read(c->fd, c->head + c->head_len, REPLAY_HEAD_SIZE - 1 - c->head_len);
+		} else {
+			result = read(c->fd, buf, sizeof(buf));
+		}
+
+		if (result == -1 && errno == EAGAIN) {
+			return 0;
+		} else if (result == -1) {
+			finish(c, 0);
+			return 1;
+		} else if (result == 0) {
+			finish(c, c->head_done && c->body_left <= 0);
+			return 1;
+		}
+
+		if (!c->head_done) {
+			c->head_len += result;
+			c->head[c->head_len] = '\0';
+			if (!parse_head(c) && c->head_len == REPLAY_HEAD_SIZE - 1) {
+				finish(c, 0);
+				return 1;
+			}
+		} else {
+			hash_bytes(&c->req->hash, buf, result);
+			if (c->body_left > 0) {
+				c->body_left -= result;
+			}
+		}
+
+		if (c->head_done && c->body_left == 0) {
+			finish(c, 1);
+			return 1;
+		}
+	}
+}
+
+static int start(replay_conn *c, replay_request *req) {
+	memset(c, 0, sizeof(replay_conn));
+	c->req = req;
+	c->body_left = -1;
+	c->started_us = monotonic_us();
+	req->hash = 14695981039346656037ull;
+
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (c->fd == -1 || (connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1
+			&& errno != EINPROGRESS)) {
+		req->status = -1;
+		if (c->fd != -1) {
+			close(c->fd);
+		}
+		c->fd = -1;
+		c->req = NULL;
+		return -1;
+	}
+
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	const char *host = "127.0.0.1";
+	char *port = "8080";
+	double speed = 1;
+	int max_conns = 256;
+	const char *baseline_out = NULL;
+	const char *baseline_in = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "H:p:s:c:B:b:")) != -1) {
+		switch (opt) {
+		case 'H': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 's': speed = atof(optarg); break;
+		case 'c': max_conns = atoi(optarg); break;
+		case 'B': baseline_out = optarg; break;
+		case 'b': baseline_in = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || max_conns < 1 || speed < 0) {
+		usage(argv[0]);
+	}
+
+	load_capture(argv[optind]);
+	if (num_requests == 0) {
+		fprintf(stderr, "No requests in %s\n", argv[optind]);
+		return 1;
+	}
+
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *info;
+	int result = getaddrinfo(host, port, &hints, &info);
+	if (result) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(result));
+		return 1;
+	}
+	memcpy(&server_addr, info->ai_addr, sizeof(server_addr));
+	freeaddrinfo(info);
+
+	signal(SIGPIPE, SIG_IGN);
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+
+	replay_conn *conns = calloc(max_conns, sizeof(replay_conn));
+	for (int i = 0; i < max_conns; i++) {
+		conns[i].fd = -1;
+	}
+
+	size_t next = 0;
+	int open_conns = 0;
+	long long begin = monotonic_us();
+	long long first = requests[0].time_us;
+	struct epoll_event events[256];
+
+	while (next < num_requests || open_conns > 0) {
+		long long now = monotonic_us();
+
+		//send everything that is due, in capture order
+		for (int i = 0; i < max_conns && next < num_requests; i++) {
+			if (conns[i].fd != -1) {
+				continue;
+			}
+			long long due = begin;
+			if (speed > 0) {
+				due += (long long)((requests[next].time_us - first) / speed);
+			}
+			if (due > now) {
+				break;
+			}
+
+			hist_record(&lateness, now - due);
+			if (start(&conns[i], &requests[next++]) == 0) {
+				open_conns += 1;
+				if (drive(&conns[i])) {
+					open_conns -= 1;
+				}
+			}
+		}
+
+		int timeout = 100;
+		if (next < num_requests && open_conns < max_conns) {
+			long long due = begin + (speed > 0 ? (long long)((requests[next].time_us - first) / speed) : 0);
+			timeout = due > now ? (int)((due - now) / 1000) : 0;
+		}
+
+		int num_events = epoll_wait(epollfd, events, 256, timeout);
+		for (int i = 0; i < num_events; i++) {
+			replay_conn *c = events[i].data.ptr;
+			if (c->fd != -1 && drive(c)) {
+				open_conns -= 1;
+			}
+		}
+	}
+
+	double elapsed = (monotonic_us() - begin) / 1e6;
+
+	//compare against the capture and the baseline
+	FILE *baseline = NULL;
+	if (baseline_in != NULL && (baseline = fopen(baseline_in, "r")) == NULL) {
+		perror(baseline_in);
+		return 1;
+	}
+
+	size_t errors = 0, status_mismatches = 0, hash_mismatches = 0;
+	for (size_t i = 0; i < num_requests; i++) {
+		replay_request *req = &requests[i];
+		if (req->status == -1) {
+			errors += 1;
+			continue;
+		}
+		if (req->expected_status && req->expected_status != req->status) {
+			if (status_mismatches++ < 10) {
+				printf("request %zu: status %d, captured %d\n", i, req->status, req->expected_status);
+			}
+		}
+
+		if (baseline != NULL) {
+			size_t index;
+			int status;
+			unsigned long long hash;
+			if (fscanf(baseline, "%zu %d %llx", &index, &status, &hash) != 3 || index != i) {
+				fprintf(stderr, "%s does not match this capture\n", baseline_in);
+				return 1;
+			}
+			if (status != req->status || hash != req->hash) {
+				if (hash_mismatches++ < 10) {
+					printf("request %zu: status %d hash %016llx, baseline %d %016llx\n", i,
+							req->status, (unsigned long long)req->hash, status, hash);
+				}
+			}
+		}
+	}
+
+	if (baseline_out != NULL) {
+		FILE *out = fopen(baseline_out, "w");
+		if (out == NULL) {
+			perror(baseline_out);
+			return 1;
+		}
+		for (size_t i = 0; i < num_requests; i++) {
+			fprintf(out, "%zu %d %016llx\n", i, requests[i].status, (unsigned long long)requests[i].hash);
+		}
+		fclose(out);
+	}
+
+	printf("replayed\t%zu requests in %.2fs (capture spans %.2fs)\n", num_requests, elapsed,
+			(requests[num_requests - 1].time_us - first) / 1e6);
+	printf("mismatches\t%zu status, %zu baseline, %zu errors\n", status_mismatches, hash_mismatches, errors);
+	printf("latency (us)\tp50 %llu, p99 %llu, max %llu\n",
+			(unsigned long long)hist_quantile(&latency, 0.5),
+			(unsigned long long)hist_quantile(&latency, 0.99),
+			(unsigned long long)hist_quantile(&latency, 1.0));
+	printf("send lag (us)\tp50 %llu, p99 %llu\n",
+			(unsigned long long)hist_quantile(&lateness, 0.5),
+			(unsigned long long)hist_quantile(&lateness, 0.99));
+
+	return errors + status_mismatches + hash_mismatches > 0;
+}
@@ -0,0 +1,67 @@
+#!/bin/bash
+
+#runs the standard load scenarios against a running http_server
+#usage: bench/suite.sh <webserver_root> [port] [extra http_loadgen options]
+#fixtures are written to <webserver_root>/__bench and removed afterwards
+
+ROOT="$1"
+PORT=8080
+shift
+#the port is optional, the loadgen options follow either way
+if [[ "$1" =~ ^[0-9]+$ ]]; then
+	PORT="$1"
+	shift
+fi
+BENCH="$(dirname $(realpath $0))"
+LOADGEN="$BENCH/http_loadgen"
+DURATION="${DURATION:-5}"
+
+if [ ! -d "$ROOT" ]; then
+	echo "Usage: $0 <webserver_root> [port] [http_loadgen options]"
+	exit 2
+fi
+
+[ -x "$LOADGEN" ] || "$BENCH/build" || exit 1
+
+FIXTURES="$ROOT/__bench"
+mkdir -p "$FIXTURES/listing" &&
+trap 'rm -rf "$FIXTURES"' EXIT
+
+#small pages, one large download, a directory without an index
+for i in $(seq 0 19); do
+	head -c 1024 /dev/urandom | base64 > "$FIXTURES/small$i.html"
+done
+head -c 10000000 /dev/urandom > "$FIXTURES/large.bin"
+for i in $(seq 0 49); do
+	touch "$FIXTURES/listing/entry$i.txt"
+done
+
+#realistic file size distribution: mostly small pages, some medium, few large
+head -c 100000 /dev/urandom > "$FIXTURES/medium.bin"
+MIX="$FIXTURES/mix.txt"
+{
+	for i in $(seq 0 19); do echo "4 /__bench/small$i.html"; done
+	echo "15 /__bench/medium.bin"
+	echo "4 /__bench/large.bin"
+	echo "1 /__bench/missing.html"
+} > "$MIX"
+
+run() {
+	echo "== $1"
+	shift
+	"$LOADGEN" -p "$PORT" -d "$DURATION" "$@"
+	echo
+}
+
+run "small files" -c 16 "$@" /__bench/small0.html /__bench/small1.html /__bench/small2.html
+run "large files" -c 4 "$@" /__bench/large.bin
+run "ranges" -c 16 -f <(echo "1 /__bench/large.bin 0-65535"; echo "1 /__bench/large.bin 5000000-5065535") "$@"
+run "404s" -c 16 "$@" /__bench/missing.html
+run "directory listings" -c 16 "$@" /__bench/listing/
+run "mixed sizes, open loop" -c 32 -r 500 -f "$MIX" "$@"
+
+#the same pages multiplexed on a few HTTP/2 connections
+if [ -n "$HTTP2" ]; then
+	run "small files, HTTP/2" -c 4 -2 -m 16 "$@" /__bench/small0.html /__bench/small1.html /__bench/small2.html
+	run "mixed sizes, HTTP/2 open loop" -c 4 -2 -m 16 -r 500 -f "$MIX" "$@"
+fi
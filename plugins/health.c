@@ -0,0 +1,114 @@
+//example handler module: a health check and a bearer token guard
+//  plugins = ( { path = "/usr/local/lib/epoll-webserver/health.so"; args = "protect=/private/ token=secret"; } );
+//GET /health answers with the uptime, /health?wait=ms answers after ms without
+//holding up the event loop. /health/ticks?n=5 streams a line every 200ms, and
+//POST /health/echo sends the request body back. requests under protect need
+//"Authorization: Bearer <token>", and go on to the server when they have it
+#include "server_plugin_api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const ews_api *api;
+static long uptime_s = 0;
+static char protect[256] = "";
+static char token[256] = "";
+
+static void tick(void *arg) {
+	uptime_s += 1;
+}
+
+static int health(ews_request *r, void *arg) {
+	//only the one segment, deeper paths go on to the server
+	if (strcmp(api->path(r), "/health") != 0) {
+		return EWS_NEXT;
+	}
+
+	//first call: wait if asked to, the marker in data says the wait is over
+	int wait_ms = 0;
+	sscanf(api->query(r), "wait=%d", &wait_ms);
+	if (wait_ms > 0 && api->data(r) == NULL) {
+		api->set_data(r, (void *)1, NULL);
+		api->wake_after(r, wait_ms);
+		return EWS_AGAIN;
+	}
+
+	char body[64];
+	int len = snprintf(body, sizeof(body), "{\"status\":\"ok\",\"uptime\":%ld}\n", uptime_s);
+	api->add_header(r, "Content-Type", "application/json");
+	api->add_header(r, "Cache-Control", "no-store");
+	api->write(r, body, len);
+	return EWS_DONE;
+}
+
+static int ticks(ews_request *r, void *arg) {
+	//the count of lines sent so far lives in data
+	int n = 5;
+	sscanf(api->query(r), "n=%d", &n);
+	long sent = (long)api->data(r);
+	if (sent == 0) {
+		api->add_header(r, "Content-Type", "text/plain");
+	}
+
+	char line[32];
+	int len = snprintf(line, sizeof(line), "tick %ld\n", sent + 1);
+	api->write(r, line, len);
+	if (sent + 1 >= n) {
+		return EWS_DONE;
+	}
+	api->set_data(r, (void *)(sent + 1), NULL);
+	api->flush(r);
+	api->wake_after(r, 200);
+	return EWS_AGAIN;
+}
+
+static int echo(ews_request *r, void *arg) {
+	size_t len;
+	const char *body = api->body(r, &len);
+	api->add_header(r, "Content-Type", "application/octet-stream");
+	api->write(r, body, len);
+	return EWS_DONE;
+}
+
+static int guard(ews_request *r, void *arg) {
+	size_t len;
+	const char *auth = api->header(r, "Authorization", &len);
+	if (auth != NULL && len == strlen(token) + 7 && strncmp(auth, "Bearer ", 7) == 0
+			&& strncmp(auth + 7, token, len - 7) == 0) {
+		return EWS_NEXT;
+	}
+
+	api->status(r, 401);
+	api->add_header(r, "WWW-Authenticate", "Bearer");
+	api->write(r, "unauthorized\n", 13);
+	return EWS_DONE;
+}
+
+int ews_plugin_init(const ews_api *server, const char *args) {
+	if (server->abi < EWS_PLUGIN_ABI) {
+		return -1;
+	}
+	api = server;
+
+	if (args != NULL) {
+		const char *p = strstr(args, "protect=");
+		const char *t = strstr(args, "token=");
+		if (p != NULL) {
+			sscanf(p, "protect=%255s", protect);
+		}
+		if (t != NULL) {
+			sscanf(t, "token=%255s", token);
+		}
+	}
+
+	api->every(1000, tick, NULL);
+	if (api->handle("/health/ticks", EWS_GET, ticks, NULL) == -1
+			|| api->handle("/health/echo", EWS_POST | EWS_PUT, echo, NULL) == -1
+			|| api->handle("/health", EWS_GET | EWS_HEAD, health, NULL) == -1) {
+		return -1;
+	}
+	if (protect[0] != '\0' && token[0] != '\0') {
+		return api->handle(protect, 0, guard, NULL);
+	}
+	return 0;
+}
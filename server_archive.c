@@ -0,0 +1,185 @@
+#include "server_archive.h"
+#include "server_helpers.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct site_archive {
+	char *data;
+	size_t size;
+	const archive_header *header;
+	const uint32_t *buckets;
+	const archive_entry *slots;
+};
+
+//FNV-1a over the path, finished with the splitmix64 mixer so every bit
+//of the result depends on every byte
+uint64_t archive_hash(const char *path, size_t len, uint64_t seed) {
+	uint64_t hash = 14695981039346656037ull ^ seed;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)path[i]) * 1099511628211ull;
+	}
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ull;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebull;
+	return hash ^ (hash >> 31);
+}
+
+uint32_t archive_slot(uint64_t hash, uint32_t displacement, uint32_t num_slots) {
+	uint64_t mixed = (hash ^ (displacement * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+	return (uint32_t)((mixed ^ (mixed >> 32)) % num_slots);
+}
+
+static int in_file(const site_archive *a, uint64_t offset, uint64_t len) {
+	return offset <= a->size && len <= a->size - offset;
+}
+
+//every offset is checked once here, lookups trust them afterwards
+static int check_entries(const site_archive *a) {
+	for (uint32_t i = 0; i < a->header->num_slots; i++) {
+		const archive_entry *e = &a->slots[i];
+		if (e->path_len == 0) {
+			continue;
+		}
+		if (!in_file(a, e->path_offset, e->path_len)
+				|| !in_file(a, e->fields_offset, (uint64_t)e->fields_len + e->gzip_fields_len)
+				|| !in_file(a, e->etag_offset, e->etag_len)
+				|| (e->etag_len < 2 && !(e->flags & ARCHIVE_REDIRECT))
+				|| !in_file(a, e->body_offset, e->body_len)
+				|| !in_file(a, e->gzip_offset, e->gzip_len)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+site_archive *archive_open(const char *path) {
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat archive_stat;
+	if (fd == -1 || fstat(fd, &archive_stat) == -1) {
+		perror(path);
+		if (fd != -1) {
+			close(fd);
+		}
+		return NULL;
+	}
+	if ((size_t)archive_stat.st_size < sizeof(archive_header)) {
+		fprintf(stderr, "%s is not a site archive\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	site_archive *a = calloc(1, sizeof(site_archive));
+	a->size = archive_stat.st_size;
+	a->data = mmap(NULL, a->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (a->data == MAP_FAILED) {
+		perror("mmap");
+		free(a);
+		return NULL;
+	}
+
+	const archive_header *h = (const archive_header *)a->data;
+	a->header = h;
+	if (memcmp(h->magic, ARCHIVE_MAGIC, sizeof(h->magic)) != 0 || h->version != ARCHIVE_VERSION) {
+		fprintf(stderr, "%s is not a version %d site archive\n", path, ARCHIVE_VERSION);
+		goto invalid;
+	}
+	if (h->size != a->size || h->num_buckets == 0 || h->num_slots == 0
+			|| !in_file(a, h->buckets_offset, (uint64_t)h->num_buckets * sizeof(uint32_t))
+			|| !in_file(a, h->slots_offset, (uint64_t)h->num_slots * sizeof(archive_entry))
+			|| h->slots_offset % sizeof(uint64_t) != 0 || h->buckets_offset % sizeof(uint32_t) != 0) {
+		fprintf(stderr, "%s is truncated or corrupt\n", path);
+		goto invalid;
+	}
+	a->buckets = (const uint32_t *)(a->data + h->buckets_offset);
+	a->slots = (const archive_entry *)(a->data + h->slots_offset);
+	if (check_entries(a) == -1) {
+		fprintf(stderr, "%s has entries outside the file\n", path);
+		goto invalid;
+	}
+
+	//the index is touched by every lookup, bodies are paged in as they are sent
+	madvise(a->data, h->slots_offset + (size_t)h->num_slots * sizeof(archive_entry), MADV_WILLNEED);
+	LOG("Site archive %s: %u paths, %zu bytes\n", path, h->num_entries, a->size);
+	return a;
+
+invalid:
+	munmap(a->data, a->size);
+	free(a);
+	return NULL;
+}
+
+void archive_close(site_archive *a) {
+	if (a != NULL) {
+		munmap(a->data, a->size);
+		free(a);
+	}
+}
+
+const archive_entry *archive_lookup(const site_archive *a, const char *path, size_t len) {
+	const archive_header *h = a->header;
+	uint64_t hash = archive_hash(path, len, h->seed);
+	const archive_entry *e = &a->slots[archive_slot(hash, a->buckets[hash % h->num_buckets], h->num_slots)];
+
+	//a perfect hash puts every known path somewhere, unknown ones still have to be told apart
+	if (e->hash != hash || e->path_len != len || memcmp(a->data + e->path_offset, path, len) != 0) {
+		return NULL;
+	}
+	return e;
+}
+
+const char *archive_body(const site_archive *a, const archive_entry *e, int gzip, size_t *len) {
+	if (gzip && e->gzip_len > 0) {
+		*len = e->gzip_len;
+		return a->data + e->gzip_offset;
+	}
+	*len = e->body_len;
+	return a->data + e->body_offset;
+}
+
+const char *archive_fields(const site_archive *a, const archive_entry *e, int gzip, size_t *len) {
+	if (gzip && e->gzip_len > 0) {
+		*len = e->gzip_fields_len;
+		return a->data + e->fields_offset + e->fields_len;
+	}
+	*len = e->fields_len;
+	return a->data + e->fields_offset;
+}
+
+int archive_etag_matches(const site_archive *a, const archive_entry *e, int gzip, const char *tags, size_t len) {
+	const char *etag = a->data + e->etag_offset;
+	size_t etag_len = e->etag_len;
+	gzip = gzip && e->gzip_len > 0;
+
+	//comma separated, weak tags compare equal to strong ones here
+	size_t pos = 0;
+	while (pos < len) {
+		pos += strspn(tags + pos, " \t,");
+		size_t tag_len = strcspn(tags + pos, " \t,");
+		if (tag_len > len - pos) {
+			tag_len = len - pos;
+		}
+		const char *tag = tags + pos;
+		pos += tag_len;
+
+		if (tag_len == 1 && tag[0] == '*') {
+			return 1;
+		}
+		if (tag_len > 2 && strncmp(tag, "W/", 2) == 0) {
+			tag += 2;
+			tag_len -= 2;
+		}
+		if (!gzip && tag_len == etag_len && memcmp(tag, etag, etag_len) == 0) {
+			return 1;
+		}
+		if (gzip && tag_len == etag_len + 3 && memcmp(tag, etag, etag_len - 1) == 0
+				&& memcmp(tag + etag_len - 1, "-gz\"", 4) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
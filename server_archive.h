@@ -0,0 +1,69 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+//a whole site root packed into one file by http_mkarchive and mapped read-only:
+//a perfect hash over the url paths, pre-rendered header fields per file and
+//the bodies (optionally also gzipped), so a lookup never makes a syscall
+//deploys write a new archive and rename it over the old one, a reload maps it
+
+#define ARCHIVE_MAGIC "EWSARCH1"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_PAGE 4096 //sections and bodies of a page or more start on a page
+#define ARCHIVE_BUCKET_LOAD 4 //keys per displacement bucket on average
+
+//entry flags
+#define ARCHIVE_REDIRECT 1 //a directory asked for without its trailing slash
+
+//file layout, little endian as written by the build host
+typedef struct archive_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_entries;
+	uint32_t num_buckets;
+	uint32_t num_slots; //entries table size, a little over num_entries
+	uint64_t seed;
+	uint64_t buckets_offset; //uint32_t displacement per bucket
+	uint64_t slots_offset; //archive_entry per slot, empty slots have no path
+	uint64_t size; //of the whole file, catches truncated copies
+} archive_header;
+
+typedef struct archive_entry {
+	uint64_t hash; //of the path, compared before the path itself
+	uint64_t path_offset;
+	uint32_t path_len;
+	uint32_t flags;
+
+	//"Content-Type: ...\nETag: ...\n" lines, one set per body
+	uint64_t fields_offset;
+	uint32_t fields_len;
+	uint32_t gzip_fields_len; //follow the plain fields
+	uint64_t etag_offset; //quoted, the gzip tag is the same plus "-gz" before the quote
+	uint32_t etag_len;
+	uint32_t reserved;
+
+	uint64_t body_offset;
+	uint64_t body_len;
+	uint64_t gzip_offset; //gzip_len 0 when it did not pay off
+	uint64_t gzip_len;
+} archive_entry;
+
+//the hash both sides use, slot of a key is archive_slot(hash, displacement of its bucket)
+uint64_t archive_hash(const char *path, size_t len, uint64_t seed);
+uint32_t archive_slot(uint64_t hash, uint32_t displacement, uint32_t num_slots);
+
+typedef struct site_archive site_archive;
+
+//map and check an archive, returns NULL with a message on stderr
+site_archive *archive_open(const char *path);
+void archive_close(site_archive *);
+
+//entry for a normalized url path, NULL if the site has no such file
+const archive_entry *archive_lookup(const site_archive *, const char *path, size_t len);
+
+//body and header fields of an entry, the gzipped ones if gzip is set and there are any
+const char *archive_body(const site_archive *, const archive_entry *, int gzip, size_t *len);
+const char *archive_fields(const site_archive *, const archive_entry *, int gzip, size_t *len);
+
+//entry's strong validator, for If-None-Match
+int archive_etag_matches(const site_archive *, const archive_entry *, int gzip, const char *tags, size_t len);
@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include "server_busypoll.h"
+#include "server_helpers.h"
+#include "server_metrics.h"
+#include <stdint.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+
+//linux/eventpoll.h, 6.9 and later; older kernels answer the ioctl with ENOTTY
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+static int enabled = 0;
+static int busy_us = DEFAULT_BUSY_POLL_US;
+static int idle_ms = DEFAULT_BUSY_POLL_IDLE_MS;
+
+static int spinning = 0;
+static long long last_event_ms = 0;
+static int batch = BUSY_POLL_MIN_EVENTS;
+static int published_batch = 0;
+static int warned = 0; //setsockopt failures are reported once
+
+static void set_spinning(int on) {
+	if (on == spinning) {
+		return;
+	}
+	spinning = on;
+	metrics_add(M_BUSY_POLLING, on ? 1 : -1);
+	LOG("%s\n", on ? "Busy polling" : "Idle, back to blocking waits");
+}
+
+void busypoll_configure(int on, int usecs, int idle) {
+	enabled = on;
+	busy_us = usecs;
+	idle_ms = idle;
+	if (!enabled) {
+		set_spinning(0);
+	}
+	LOG("Busy poll: %s, %dus per socket, blocking after %dms idle\n", on ? "on" : "off", usecs, idle);
+}
+
+void busypoll_socket(int fd) {
+	if (!enabled) {
+		return;
+	}
+
+	//raising SO_BUSY_POLL past net.core.busy_read needs CAP_NET_ADMIN
+	int prefer = 1;
+	int budget = BUSY_POLL_BUDGET;
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_us, sizeof(busy_us)) == -1
+			|| setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == -1
+			|| setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) == -1) {
+		if (!warned) {
+			perror("Busy poll socket options");
+			warned = 1;
+		}
+	}
+}
+
+void busypoll_epoll(int epollfd) {
+	if (!enabled) {
+		return;
+	}
+	struct epoll_params params = {
+		.busy_poll_usecs = busy_us,
+		.busy_poll_budget = BUSY_POLL_BUDGET,
+		.prefer_busy_poll = 1,
+	};
+	if (ioctl(epollfd, EPIOCSPARAMS, &params) == -1) {
+		LOG("No epoll busy poll parameters: %s\n", strerror(errno));
+		errno = 0;
+	}
+}
+
+int busypoll_timeout(int blocking_ms, long long now_ms) {
+	if (!enabled) {
+		return blocking_ms;
+	}
+	set_spinning(now_ms - last_event_ms < idle_ms);
+	return spinning ? 0 : blocking_ms;
+}
+
+int busypoll_batch(int default_batch) {
+	return enabled ? batch : default_batch;
+}
+
+void busypoll_events(int num_events, long long now_ms) {
+	if (!enabled) {
+		return;
+	}
+	if (num_events > 0) {
+		last_event_ms = now_ms;
+	}
+
+	//small batches keep each pass short, a full one means events are waiting
+	if (num_events == batch && batch < BUSY_POLL_MAX_EVENTS) {
+		batch *= 2;
+	} else if (num_events < batch / 4 && batch > BUSY_POLL_MIN_EVENTS) {
+		batch /= 2;
+	}
+	if (batch != published_batch) {
+		metrics_add(M_EVENT_BATCH, batch - published_batch);
+		published_batch = batch;
+	}
+}
+
+int busypoll_pin(const int *cpus, int num_cpus) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int i = 0; i < num_cpus; i++) {
+		CPU_SET(cpus[i], &set);
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		perror("sched_setaffinity");
+		return -1;
+	}
+	LOG("Pinned to %d CPUs\n", num_cpus);
+	return 0;
+}
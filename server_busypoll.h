@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+
+//busy-poll mode for the event loop
+//instead of sleeping in epoll_wait the loop spins on it with a zero timeout,
+//and sockets ask the kernel to poll the device queue (SO_BUSY_POLL and
+//SO_PREFER_BUSY_POLL, plus the epoll instance's own parameters where the
+//kernel has them). a packet is then picked up within microseconds rather than
+//after an interrupt and a wakeup, at the cost of a CPU kept at 100%.
+//after busy_poll_idle_ms without events the loop goes back to blocking waits
+//and spins again from the next event. the batch of events taken per wait
+//follows the load: it doubles while waits come back full and halves while
+//they come back mostly empty, so a quiet loop returns to the spin quickly
+
+#define DEFAULT_BUSY_POLL_US 50
+#define DEFAULT_BUSY_POLL_IDLE_MS 200
+#define BUSY_POLL_BUDGET 64 //packets per device poll
+#define BUSY_POLL_MIN_EVENTS 8
+#define BUSY_POLL_MAX_EVENTS 1024 //callers size their event arrays for this
+
+void busypoll_configure(int enabled, int usecs, int idle_ms);
+
+//ask for busy polling on a listener or client socket, nothing when disabled
+void busypoll_socket(int fd);
+
+//busy poll parameters of the epoll instance itself
+void busypoll_epoll(int epollfd);
+
+//timeout for the next epoll_wait, 0 while spinning
+int busypoll_timeout(int blocking_ms, long long now_ms);
+
+//events to ask for in the next epoll_wait, default_batch when disabled
+int busypoll_batch(int default_batch);
+
+//a wait returned num_events
+void busypoll_events(int num_events, long long now_ms);
+
+//pin the calling thread (and threads it starts later) to the listed CPUs
+//returns -1 if the kernel refused the set
+int busypoll_pin(const int *cpus, int num_cpus);
@@ -0,0 +1,83 @@
+#include "server_capture.h"
+#include "server_helpers.h"
+#include <stdlib.h>
+
+static FILE *capture = NULL;
+static long long last_us = 0;
+
+int capture_open(const char *path) {
+
+	FILE *file = fopen(path, "ae");
+	if (file == NULL) {
+		perror("Couldn't open capture file");
+		return -1;
+	}
+
+	//a large buffer keeps capture off the request path's syscalls
+	setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+	capture_close();
+	capture = file;
+	fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN, 1, capture);
+	last_us = 0;
+
+	LOG("Capturing requests to %s\n", path);
+	return 0;
+}
+
+void capture_close() {
+	if (capture != NULL) {
+		fclose(capture);
+		capture = NULL;
+	}
+}
+
+int capture_enabled() {
+	return capture != NULL;
+}
+
+static void put_varint(uint64_t value) {
+	unsigned char buf[10];
+	int len = 0;
+	do {
+		buf[len] = value & 0x7f;
+		value >>= 7;
+		if (value) {
+			buf[len] |= 0x80;
+		}
+		len += 1;
+	} while (value);
+	fwrite(buf, len, 1, capture);
+}
+
+//records are written in completion order, so a late arrival time is
+//clamped to keep deltas non-negative
+static void put_header(char type, uint64_t conn_id, long long time_us) {
+	if (time_us < last_us) {
+		time_us = last_us;
+	}
+
+	fputc(type, capture);
+	put_varint(last_us == 0 ? 0 : (uint64_t)(time_us - last_us));
+	put_varint(conn_id);
+	last_us = time_us;
+}
+
+void capture_request(uint64_t conn_id, long long arrival_us, const char *bytes, size_t length) {
+	if (capture == NULL) {
+		return;
+	}
+
+	put_header(CAPTURE_REQUEST, conn_id, arrival_us);
+	put_varint(length);
+	fwrite(bytes, length, 1, capture);
+}
+
+void capture_status(uint64_t conn_id, long long time_us, int status) {
+	if (capture == NULL) {
+		return;
+	}
+
+	put_header(CAPTURE_STATUS, conn_id, time_us);
+	put_varint(status);
+}
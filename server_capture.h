@@ -0,0 +1,30 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+//traffic capture for replay with bench/http_replay
+//
+//file layout: CAPTURE_MAGIC, then records of
+//    type (1 byte) | varint time delta us | varint connection id | payload
+//CAPTURE_REQUEST payload: varint length, then the raw request bytes
+//CAPTURE_STATUS payload:  varint status code of the response we sent
+//times are deltas from the previous record so a busy capture stays small,
+//varints are LEB128 (7 bits per byte, low bits first)
+//every open (startup, reload) appends a new CAPTURE_MAGIC, which starts a
+//new segment with its own time base and connection ids
+
+#define CAPTURE_MAGIC "EWCAP01\n"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_REQUEST 'Q'
+#define CAPTURE_STATUS 'S'
+
+//start writing to path (appending a new capture), returns -1 on failure
+int capture_open(const char *path);
+void capture_close();
+int capture_enabled();
+
+//arrival time and raw bytes of a request on connection conn_id
+void capture_request(uint64_t conn_id, long long arrival_us, const char *bytes, size_t length);
+
+//status the connection's request was answered with
+void capture_status(uint64_t conn_id, long long time_us, int status);
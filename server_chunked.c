@@ -0,0 +1,286 @@
+#include "server_chunked.h"
+#include "server_helpers.h"
+#include "server_metrics.h"
+#include "server_memory.h"
+#include <stdlib.h>
+#include <ctype.h>
+#include <sys/uio.h>
+
+enum { SIZE, EXTENSION, DATA, DATA_END, TRAILER, DONE };
+
+struct chunk_writer {
+	int fd;
+	chunk_send send;
+	void *arg;
+	int framed;
+
+	//the chunk going out: size line, data, then CRLF, and "0\r\n\r\n" after the last
+	int in_flight;
+	int direct; //its data is the caller's, only at hand during chunk_write
+	int last;
+	char line[24];
+	size_t line_len;
+	size_t line_sent;
+	const char *rest; //unsent data at hand
+	size_t rest_len;
+	size_t owed; //unsent data in all
+	char tail[8];
+	size_t tail_len;
+	size_t tail_sent;
+
+	size_t buffered;
+	char buf[CHUNK_BUFFER];
+};
+
+chunk_writer *chunk_writer_new(int fd, chunk_send send, void *arg, int framed) {
+	chunk_writer *w = calloc(1, sizeof(chunk_writer));
+	memory_charge(MEM_CONNECTIONS, sizeof(chunk_writer));
+	w->fd = fd;
+	w->send = send;
+	w->arg = arg;
+	w->framed = framed;
+	return w;
+}
+
+void chunk_writer_free(chunk_writer *w) {
+	if (w != NULL) {
+		free(w);
+		memory_release(MEM_CONNECTIONS, sizeof(chunk_writer));
+	}
+}
+
+static void commit(chunk_writer *w, const char *data, size_t len, int direct, int last) {
+	w->in_flight = 1;
+	w->direct = direct;
+	w->last = last;
+	w->rest = data;
+	w->rest_len = w->owed = len;
+	w->line_len = w->line_sent = w->tail_len = w->tail_sent = 0;
+	if (!w->framed) {
+		return;
+	}
+	if (len > 0) {
+		w->line_len = sprintf(w->line, "%zx\r\n", len);
+		memcpy(w->tail, "\r\n", 2);
+		w->tail_len = 2;
+	}
+	if (last) {
+		memcpy(w->tail + w->tail_len, "0\r\n\r\n", 5);
+		w->tail_len += 5;
+	}
+}
+
+static void advance(chunk_writer *w, size_t n) {
+	size_t k = w->line_len - w->line_sent < n ? w->line_len - w->line_sent : n;
+	w->line_sent += k;
+	n -= k;
+	k = w->rest_len < n ? w->rest_len : n;
+	w->rest += k;
+	w->rest_len -= k;
+	w->owed -= k;
+	n -= k;
+	w->tail_sent += n;
+}
+
+//returns 1 once the chunk in flight is out, 0 when blocked or when the caller
+//has the rest of its data, -1 on error
+static int push(chunk_writer *w) {
+	while (w->in_flight) {
+		struct iovec iov[3];
+		int n = 0;
+		if (w->line_sent < w->line_len) {
+			iov[n++] = (struct iovec){ w->line + w->line_sent, w->line_len - w->line_sent };
+		}
+		if (w->rest_len > 0) {
+			iov[n++] = (struct iovec){ (char *)w->rest, w->rest_len };
+		}
+		if (w->owed == 0 && w->tail_sent < w->tail_len) {
+			iov[n++] = (struct iovec){ w->tail + w->tail_sent, w->tail_len - w->tail_sent };
+		}
+		if (n == 0) {
+			if (w->owed > 0) {
+				return 0;
+			}
+			w->in_flight = 0;
+			if (!w->direct) {
+				w->buffered = 0;
+			}
+			break;
+		}
+
+		//other sinks take one piece at a time
+		errno = 0;
+		ssize_t result = w->fd != -1 ? writev(w->fd, iov, n) : w->send(w->arg, iov[0].iov_base, iov[0].iov_len);
+		if (result > 0) {
+			advance(w, result);
+			if (w->fd != -1) {
+				metrics_add(M_BYTES_SENT, result);
+			}
+		}
+		if (result == -1 && errno == EINTR) {
+			continue;
+		} else if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		} else if (result == -1) {
+			return -1;
+		} else if (result == 0 || errno == EAGAIN) {
+			errno = EAGAIN;
+			return 0;
+		}
+	}
+	errno = 0;
+	return 1;
+}
+
+ssize_t chunk_write(chunk_writer *w, const char *buf, size_t len) {
+	size_t taken = 0;
+	errno = 0;
+	while (1) {
+		if (w->in_flight) {
+			//a direct chunk cut short goes on with the caller's next bytes
+			if (w->direct && w->rest_len == 0 && w->owed > 0) {
+				w->rest = buf + taken;
+				w->rest_len = len - taken < w->owed ? len - taken : w->owed;
+			}
+			size_t owed = w->owed;
+			int ret = push(w);
+			if (w->direct) {
+				taken += owed - w->owed;
+				w->rest = NULL;
+				w->rest_len = 0;
+			}
+			if (ret == -1) {
+				return -1;
+			} else if (ret == 0) {
+				return taken;
+			}
+		}
+		if (taken == len) {
+			return taken;
+		}
+
+		size_t left = len - taken;
+		if (w->buffered + left <= CHUNK_BUFFER) {
+			memcpy(w->buf + w->buffered, buf + taken, left);
+			w->buffered += left;
+			return len;
+		} else if (w->buffered > 0) {
+			size_t n = CHUNK_BUFFER - w->buffered;
+			memcpy(w->buf + w->buffered, buf + taken, n);
+			w->buffered += n;
+			taken += n;
+			commit(w, w->buf, w->buffered, 0, 0);
+		} else {
+			commit(w, buf + taken, left, 1, 0);
+		}
+	}
+}
+
+int chunk_flush(chunk_writer *w) {
+	if (w->in_flight && w->direct && w->owed > 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	int ret;
+	if (w->in_flight && (ret = push(w)) != 1) {
+		return ret;
+	}
+	if (w->buffered > 0) {
+		commit(w, w->buf, w->buffered, 0, 0);
+		return push(w);
+	}
+	return 1;
+}
+
+int chunk_finish(chunk_writer *w) {
+	if (w->in_flight && w->direct && w->owed > 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (1) {
+		int ret;
+		if (w->in_flight && (ret = push(w)) != 1) {
+			return ret;
+		} else if (w->last) {
+			return 1;
+		}
+		commit(w, w->buf, w->buffered, 0, 1);
+	}
+}
+
+int chunk_decode(chunk_decoder *d, char *buf, size_t len, size_t *out_len, size_t *used) {
+	size_t out = 0;
+	size_t i = 0;
+	while (i < len && d->state != DONE) {
+		unsigned char c = buf[i];
+		switch (d->state) {
+		case SIZE:
+			if (isxdigit(c)) {
+				if (d->remaining >> 40) {
+					return -1;
+				}
+				d->remaining = d->remaining * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+				d->digits += 1;
+				i += 1;
+			} else if (d->digits > 0 && (c == ';' || c == ' ' || c == '\t' || c == '\r' || c == '\n')) {
+				d->state = EXTENSION;
+				d->line_len = 0;
+			} else {
+				return -1;
+			}
+			break;
+
+		case EXTENSION:
+			//extensions are skipped, only the line's length is checked
+			if (c == '\n') {
+				d->state = d->remaining > 0 ? DATA : TRAILER;
+				d->line_len = 0;
+			} else if (++d->line_len > MAX_CHUNK_LINE) {
+				return -1;
+			}
+			i += 1;
+			break;
+
+		case DATA: {
+			size_t n = len - i < d->remaining ? len - i : d->remaining;
+			memmove(buf + out, buf + i, n);
+			out += n;
+			i += n;
+			d->remaining -= n;
+			if (d->remaining == 0) {
+				d->state = DATA_END;
+			}
+			break;
+		}
+
+		case DATA_END:
+			if (c == '\r' && d->line_len == 0) {
+				d->line_len = 1;
+			} else if (c == '\n') {
+				d->state = SIZE;
+				d->digits = 0;
+				d->line_len = 0;
+			} else {
+				return -1;
+			}
+			i += 1;
+			break;
+
+		case TRAILER:
+			//fields after the last chunk are dropped, a blank line ends them
+			if (c == '\n' && d->line_len == 0) {
+				d->state = DONE;
+			} else if (c == '\n') {
+				d->line_len = 0;
+			} else if (c != '\r' && ++d->line_len > MAX_CHUNK_LINE) {
+				return -1;
+			}
+			i += 1;
+			break;
+		}
+	}
+
+	*out_len = out;
+	*used = i;
+	return d->state == DONE;
+}
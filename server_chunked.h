@@ -0,0 +1,48 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+//chunked transfer coding
+//a response body whose length is not known when its header goes out is
+//streamed through a chunk_writer. small writes collect into one chunk of up to
+//CHUNK_BUFFER bytes; a chunk goes out with its size line and CRLF in one writev,
+//and writes of at least that much are framed around the caller's buffer instead
+//of being copied. sinks that delimit the body themselves (an HTTP/2 stream, a
+//connection closed after the response) get the same batching without framing
+
+#define CHUNK_BUFFER 16384
+#define MAX_CHUNK_LINE 1024 //chunk size line with its extensions, or a trailer line
+
+//like client_write: bytes taken, errno EAGAIN when not everything was, -1 on error
+typedef ssize_t (*chunk_send)(void *arg, const void *buf, size_t len);
+
+typedef struct chunk_writer chunk_writer;
+
+//fd is written with writev, or -1 to go through send
+chunk_writer *chunk_writer_new(int fd, chunk_send send, void *arg, int framed);
+void chunk_writer_free(chunk_writer *);
+
+//like write: returns how much of buf was taken, with errno EAGAIN when that is
+//less than len because the client is not keeping up, -1 on error
+//the caller resumes with the rest, before flushing or finishing
+ssize_t chunk_write(chunk_writer *, const char *buf, size_t len);
+
+//send what has been collected so far
+//returns 1 once it is all out, 0 when blocked, -1 on error
+int chunk_flush(chunk_writer *);
+
+//send what is left and end the body with the last chunk, same returns
+int chunk_finish(chunk_writer *);
+
+//a chunked request body, decoded as it arrives
+typedef struct chunk_decoder {
+	int state;
+	unsigned long long remaining; //size, then bytes left, of the current chunk
+	int digits;
+	size_t line_len;
+} chunk_decoder;
+
+//decodes len bytes at buf in place, the first *out_len bytes are then body data
+//returns 1 after the last chunk and the trailer, with *used the bytes that took,
+//0 when more is needed, -1 if the framing is broken
+int chunk_decode(chunk_decoder *, char *buf, size_t len, size_t *out_len, size_t *used);
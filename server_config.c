@@ -0,0 +1,727 @@
+#define _GNU_SOURCE
+#include "server_config.h"
+#include "server_helpers.h"
+#include "server_filecache.h"
+#include "server_ratelimit.h"
+#include "server_trace.h"
+#include "server_router.h"
+#include "server_vhost.h"
+#include "server_proxy.h"
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <libconfig.h>
+
+static char *DEFAULT_SECURITY_HEADERS = "Cache-Control: private, max-age=0\n"
+				"X-Frame-Options: SAMEORIGIN\n"
+				"X-XSS-Protection: 1\n\n";
+				//"X-Content-Type-Options: nosniff\n\n";
+
+static void free_config(server_config *conf) {
+	listener_specs_free(conf->listeners, conf->num_listeners);
+	tls_context_free(conf->tls);
+	free(conf->root_site);
+	free(conf->log_file);
+	free(conf->warmup_snapshot);
+	free(conf->security_headers);
+	free(conf->status_path);
+	free(conf->capture_file);
+	free(conf->fastcgi_pass);
+	free(conf->proxy_health_path);
+	free(conf->cpu_affinity);
+	plugin_specs_free(conf->plugins, conf->num_plugins);
+	vhost_free(conf->default_host);
+	vhost_table_free(conf->vhosts);
+	free(conf);
+}
+
+//join the security_headers array into one block that can be copied
+//straight into every response header
+static char *render_security_headers(const config_setting_t *s_headers) {
+
+	if (s_headers == NULL) {
+		return strdup(DEFAULT_SECURITY_HEADERS);
+	}
+
+	size_t len = 2;
+	for (int i = 0; i < config_setting_length(s_headers); i++) {
+		const char *header = config_setting_get_string_elem(s_headers, i);
+		if (header == NULL) {
+			fprintf(stderr, "security_headers[%d] is not a string\n", i);
+			return NULL;
+		}
+		len += strlen(header) + 1;
+	}
+
+	char *rendered = malloc(len);
+	rendered[0] = '\0';
+	for (int i = 0; i < config_setting_length(s_headers); i++) {
+		strcat(rendered, config_setting_get_string_elem(s_headers, i));
+		strcat(rendered, "\n");
+	}
+	strcat(rendered, "\n");
+
+	return rendered;
+}
+
+//security headers with Cache-Control swapped for the location's policy,
+//followed by its own headers
+static char *render_location_headers(const char *security_headers, const char *cache_control,
+		const config_setting_t *s_headers) {
+
+	size_t len = strlen(security_headers) + 1;
+	if (cache_control != NULL) {
+		len += strlen("Cache-Control: \n") + strlen(cache_control);
+	}
+	for (int i = 0; s_headers != NULL && i < config_setting_length(s_headers); i++) {
+		const char *header = config_setting_get_string_elem(s_headers, i);
+		if (header == NULL) {
+			fprintf(stderr, "location headers[%d] is not a string\n", i);
+			return NULL;
+		}
+		len += strlen(header) + 1;
+	}
+
+	char *rendered = malloc(len);
+	char *end = rendered;
+	const char *line = security_headers;
+	while (*line != '\n' && *line != '\0') {
+		size_t line_len = strcspn(line, "\n") + 1;
+		if (cache_control == NULL || strncasecmp(line, "Cache-Control:", 14) != 0) {
+			memcpy(end, line, line_len);
+			end += line_len;
+		}
+		line += line_len;
+	}
+	if (cache_control != NULL) {
+		end += sprintf(end, "Cache-Control: %s\n", cache_control);
+	}
+	for (int i = 0; s_headers != NULL && i < config_setting_length(s_headers); i++) {
+		end += sprintf(end, "%s\n", config_setting_get_string_elem(s_headers, i));
+	}
+	strcpy(end, "\n");
+
+	return rendered;
+}
+
+static location *new_location(const char *prefix, const char *root, const char *security_headers) {
+	location *loc = calloc(1, sizeof(location));
+	loc->prefix = strdup(prefix);
+	loc->prefix_len = strlen(prefix);
+	loc->root = strdup(root);
+	loc->root_len = strlen(root);
+	while (loc->root_len > 1 && loc->root[loc->root_len - 1] == '/') {
+		loc->root[--loc->root_len] = '\0';
+	}
+	loc->root_fd = open(loc->root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	loc->listing = 1;
+	loc->index[loc->num_index++] = strdup("index.php");
+	loc->index[loc->num_index++] = strdup("index.html");
+	loc->headers = strdup(security_headers);
+	loc->headers_len = strlen(loc->headers);
+	return loc;
+}
+
+//a bare port listens on every IPv4 address, as port and tls_port always have
+static char *listen_address(const char *address) {
+	if (strchr(address, ':') != NULL || address[0] == '/') {
+		return strdup(address);
+	}
+	char *full = malloc(strlen(address) + 9);
+	sprintf(full, "0.0.0.0:%s", address);
+	return full;
+}
+
+static listener_spec port_listener(const char *port, int tls) {
+	return (listener_spec){ .address = listen_address(port), .tls = tls, .backlog = DEFAULT_BACKLOG };
+}
+
+//listen = ( { address = "[::]:8080"; defer_accept = 1; ... }, ... ), a plain string for defaults
+static int parse_listeners(const config_setting_t *s_listen, server_config *conf) {
+	int count = config_setting_length(s_listen);
+	if (count < 1 || count > MAX_LISTENERS) {
+		fprintf(stderr, "listen needs 1 to %d entries\n", MAX_LISTENERS);
+		return -1;
+	}
+
+	conf->listeners = calloc(count, sizeof(listener_spec));
+	for (int i = 0; i < count; i++) {
+		const config_setting_t *s_l = config_setting_get_elem(s_listen, i);
+		const char *address = config_setting_get_string(s_l);
+		if (address == NULL) {
+			config_setting_lookup_string(s_l, "address", &address);
+		}
+		if (address == NULL) {
+			fprintf(stderr, "listen[%d] needs an address\n", i);
+			return -1;
+		}
+
+		listener_spec *l = &conf->listeners[conf->num_listeners++];
+		*l = port_listener(address, 0);
+		if (config_setting_type(s_l) == CONFIG_TYPE_GROUP) {
+			config_setting_lookup_bool(s_l, "tls", &l->tls);
+			config_setting_lookup_int(s_l, "backlog", &l->backlog);
+			config_setting_lookup_int(s_l, "defer_accept", &l->defer_accept);
+			config_setting_lookup_int(s_l, "fastopen", &l->fastopen);
+			config_setting_lookup_bool(s_l, "nodelay", &l->nodelay);
+			config_setting_lookup_int(s_l, "sndbuf", &l->sndbuf);
+			config_setting_lookup_int(s_l, "rcvbuf", &l->rcvbuf);
+		}
+		if (l->backlog <= 0 || l->defer_accept < 0 || l->fastopen < 0 || l->sndbuf < 0 || l->rcvbuf < 0) {
+			fprintf(stderr, "listen %s: invalid options\n", l->address);
+			return -1;
+		}
+		for (int j = 0; j < i; j++) {
+			if (strcmp(conf->listeners[j].address, l->address) == 0) {
+				fprintf(stderr, "listen %s is listed twice\n", l->address);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+//upstream pool for a location's proxy_pass, one "host:port" or a list of them
+static proxy_pool *new_proxy(const char *prefix, const config_setting_t *s_pass, const server_config *conf) {
+	int single = config_setting_type(s_pass) == CONFIG_TYPE_STRING;
+	int count = single ? 1 : config_setting_length(s_pass);
+	if (count < 1 || count > MAX_UPSTREAMS) {
+		fprintf(stderr, "location %s: proxy_pass needs 1 to %d upstreams\n", prefix, MAX_UPSTREAMS);
+		return NULL;
+	}
+
+	const char *addresses[MAX_UPSTREAMS];
+	for (int i = 0; i < count; i++) {
+		addresses[i] = single ? config_setting_get_string(s_pass) : config_setting_get_string_elem(s_pass, i);
+		if (addresses[i] == NULL) {
+			fprintf(stderr, "location %s: proxy_pass[%d] must be a string\n", prefix, i);
+			return NULL;
+		}
+	}
+	return proxy_pool_new(addresses, count, conf->proxy_idle_connections, conf->proxy_timeout_ms,
+			conf->proxy_max_fails, conf->proxy_health_interval_ms, conf->proxy_health_path);
+}
+
+//compile the locations list into a router, "/" always resolves to root_site
+//unless a location overrides it
+static router *compile_locations(const config_setting_t *s_locations, const char *root_site,
+		const char *security_headers, const server_config *conf) {
+
+	router *r = router_new();
+
+	for (int i = 0; s_locations != NULL && i < config_setting_length(s_locations); i++) {
+		const config_setting_t *s_loc = config_setting_get_elem(s_locations, i);
+
+		const char *prefix = NULL, *root = NULL, *alias = NULL, *redirect = NULL, *cache_control = NULL;
+		config_setting_lookup_string(s_loc, "prefix", &prefix);
+		config_setting_lookup_string(s_loc, "root", &root);
+		config_setting_lookup_string(s_loc, "alias", &alias);
+		config_setting_lookup_string(s_loc, "redirect", &redirect);
+		config_setting_lookup_string(s_loc, "cache_control", &cache_control);
+
+		if (prefix == NULL || prefix[0] != '/') {
+			fprintf(stderr, "locations[%d]: prefix must start with /\n", i);
+			goto invalid;
+		}
+		if (root != NULL && alias != NULL) {
+			fprintf(stderr, "location %s: root and alias are exclusive\n", prefix);
+			goto invalid;
+		}
+		const config_setting_t *s_pass = config_setting_get_member(s_loc, "proxy_pass");
+		if (s_pass != NULL && redirect != NULL) {
+			fprintf(stderr, "location %s: proxy_pass and redirect are exclusive\n", prefix);
+			goto invalid;
+		}
+
+		const char *dir = alias != NULL ? alias : root != NULL ? root : root_site;
+		location *loc = new_location(prefix, dir, security_headers);
+		if (redirect == NULL && s_pass == NULL && loc->root_fd == -1) {
+			fprintf(stderr, "location %s: %s is not a directory\n", prefix, dir);
+			location_free(loc);
+			goto invalid;
+		}
+
+		loc->alias = alias != NULL;
+		loc->site_root = alias == NULL && root == NULL;
+		loc->redirect = redirect != NULL ? strdup(redirect) : NULL;
+		if (s_pass != NULL && (loc->proxy = new_proxy(prefix, s_pass, conf)) == NULL) {
+			location_free(loc);
+			goto invalid;
+		}
+		config_setting_lookup_bool(s_loc, "listing", &loc->listing);
+
+		const config_setting_t *s_index = config_setting_get_member(s_loc, "index");
+		if (s_index != NULL) {
+			for (int j = 0; j < loc->num_index; j++) {
+				free(loc->index[j]);
+			}
+			loc->num_index = 0;
+			for (int j = 0; j < config_setting_length(s_index) && j < MAX_INDEX_FILES; j++) {
+				const char *name = config_setting_get_string_elem(s_index, j);
+				if (name == NULL || strchr(name, '/') != NULL) {
+					fprintf(stderr, "location %s: index[%d] must be a file name\n", prefix, j);
+					location_free(loc);
+					goto invalid;
+				}
+				loc->index[loc->num_index++] = strdup(name);
+			}
+		}
+
+		free(loc->headers);
+		loc->headers = render_location_headers(security_headers, cache_control,
+				config_setting_get_member(s_loc, "headers"));
+		if (loc->headers == NULL) {
+			location_free(loc);
+			goto invalid;
+		}
+		loc->headers_len = strlen(loc->headers);
+
+		if (router_add(r, loc) == -1) {
+			fprintf(stderr, "location %s is defined twice\n", prefix);
+			location_free(loc);
+			goto invalid;
+		}
+		LOG("Location %s -> %s%s\n", prefix, redirect != NULL ? "redirect " : s_pass != NULL ? "proxy " : "",
+				redirect != NULL ? redirect : s_pass != NULL ? "upstreams" : dir);
+	}
+
+	location *fallback = new_location("/", root_site, security_headers);
+	fallback->site_root = 1;
+	if (fallback->root_fd == -1) {
+		perror(root_site);
+		location_free(fallback);
+		goto invalid;
+	}
+	if (router_add(r, fallback) == -1) {
+		location_free(fallback);
+	}
+
+	return r;
+
+invalid:
+	router_free(r);
+	return NULL;
+}
+
+//root, headers, cache budget and locations of one site, the top level
+//settings are the defaults for every vhost
+static vhost *load_vhost(const config_setting_t *s_site, const char *root, const server_config *conf) {
+
+	vhost *host = calloc(1, sizeof(vhost));
+	host->root_site = strdup(root);
+
+	const config_setting_t *s_headers = config_setting_get_member(s_site, "security_headers");
+	host->security_headers = s_headers != NULL ? render_security_headers(s_headers)
+			: strdup(conf->security_headers);
+	if (host->security_headers == NULL) {
+		goto invalid;
+	}
+	host->security_headers_len = strlen(host->security_headers);
+
+	int cache_size = conf->mmap_cache_size;
+	config_setting_lookup_int(s_site, "mmap_cache_size", &cache_size);
+	if (cache_size < 0) {
+		fprintf(stderr, "mmap_cache_size must not be negative\n");
+		goto invalid;
+	}
+	host->cache = file_cache_new(cache_size);
+
+	host->router = compile_locations(config_setting_get_member(s_site, "locations"),
+			host->root_site, host->security_headers, conf);
+	if (host->router == NULL) {
+		goto invalid;
+	}
+
+	const char *fastcgi_pass = conf->fastcgi_pass;
+	config_setting_lookup_string(s_site, "fastcgi_pass", &fastcgi_pass);
+	if (fastcgi_pass != NULL && fastcgi_pass[0] != '\0') {
+		host->fastcgi = fastcgi_pool_new(fastcgi_pass, conf->fastcgi_connections,
+				conf->fastcgi_requests_per_connection, conf->fastcgi_timeout_ms,
+				conf->fastcgi_buffer_size, conf->fastcgi_queue);
+		if (host->fastcgi == NULL) {
+			goto invalid;
+		}
+		LOG("Passing %s files under %s to %s\n", FASTCGI_EXTENSION, root, fastcgi_pass);
+	}
+
+	//mapped again on every reload, so a renamed-over archive is picked up
+	const char *archive = NULL;
+	config_setting_lookup_string(s_site, "archive", &archive);
+	if (archive != NULL && (host->archive = archive_open(archive)) == NULL) {
+		goto invalid;
+	}
+
+	return host;
+
+invalid:
+	vhost_free(host);
+	return NULL;
+}
+
+//one vhost per entry of the vhosts list, hashed by every name it answers to
+static vhost_table *load_vhosts(const config_setting_t *s_vhosts, const server_config *conf) {
+
+	int count = config_setting_length(s_vhosts);
+	vhost **hosts = calloc(count > 0 ? count : 1, sizeof(vhost *));
+
+	for (int i = 0; i < count; i++) {
+		const config_setting_t *s_site = config_setting_get_elem(s_vhosts, i);
+		const config_setting_t *s_names = config_setting_get_member(s_site, "hosts");
+		const char *root = NULL;
+		config_setting_lookup_string(s_site, "root", &root);
+
+		if (s_names == NULL || config_setting_length(s_names) == 0 || root == NULL) {
+			fprintf(stderr, "vhosts[%d] needs hosts and root\n", i);
+			goto invalid;
+		}
+
+		hosts[i] = load_vhost(s_site, root, conf);
+		if (hosts[i] == NULL) {
+			fprintf(stderr, "vhosts[%d] is invalid\n", i);
+			goto invalid;
+		}
+
+		hosts[i]->names = calloc(config_setting_length(s_names), sizeof(char *));
+		for (int j = 0; j < config_setting_length(s_names); j++) {
+			const char *name = config_setting_get_string_elem(s_names, j);
+			if (name == NULL || strlen(name) == 0 || strlen(name) > MAX_HOST_NAME
+					|| (strchr(name, '*') != NULL && strncmp(name, "*.", 2) != 0)
+					|| strchr(name + 1, '*') != NULL) {
+				fprintf(stderr, "vhosts[%d]: hosts[%d] is not a host name or *.domain\n", i, j);
+				goto invalid;
+			}
+			char *lower = strdup(name);
+			for (char *c = lower; *c; c++) {
+				*c = tolower((unsigned char)*c);
+			}
+			hosts[i]->names[hosts[i]->num_names++] = lower;
+		}
+		LOG("Vhost %s -> %s\n", hosts[i]->names[0], root);
+	}
+
+	vhost_table *table = vhost_table_build(hosts, count);
+	if (table != NULL) {
+		return table;
+	}
+	//the table freed the hosts
+	return NULL;
+
+invalid:
+	for (int i = 0; i < count; i++) {
+		vhost_free(hosts[i]);
+	}
+	free(hosts);
+	return NULL;
+}
+
+server_config *server_config_load(const char *path) {
+
+	config_t cfg, *cf;
+	cf = &cfg;
+	config_init(cf);
+
+	if (!config_read_file(cf, path)) {
+		fprintf(stderr, "Couldn't read config file %s: %s (line %d)\n",
+				path, config_error_text(cf), config_error_line(cf));
+		config_destroy(cf);
+		return NULL;
+	}
+
+	server_config *conf = calloc(1, sizeof(server_config));
+	conf->refcount = 1;
+
+	//root path
+	const char *temp_root = NULL;
+	config_lookup_string(cf, "webserver_root", &temp_root);
+
+	//port, or a listen list
+	const char *temp_port = NULL;
+	config_lookup_string(cf, "port", &temp_port);
+	const config_setting_t *s_listen = config_lookup(cf, "listen");
+
+	if (temp_root == NULL || (temp_port == NULL && s_listen == NULL)) {
+		fprintf(stderr, "port or listen, and webserver_root must be set in %s\n", path);
+		goto invalid;
+	}
+
+	struct stat root_stat;
+	if (stat(temp_root, &root_stat) == -1 || !S_ISDIR(root_stat.st_mode)) {
+		fprintf(stderr, "webserver_root %s is not a directory\n", temp_root);
+		goto invalid;
+	}
+
+	conf->root_site = strdup(temp_root);
+	conf->root_len = strlen(conf->root_site);
+	LOG("Root of webserver: %s\n", conf->root_site);
+
+	//log
+	const char *log_file_path = NULL;
+	config_lookup_string(cf, "log_file", &log_file_path);
+	if (log_file_path != NULL) {
+		conf->log_file = strdup(log_file_path);
+		LOG("Using log file at %s\n", conf->log_file);
+	}
+
+	conf->security_headers = render_security_headers(config_lookup(cf, "security_headers"));
+	if (conf->security_headers == NULL) {
+		goto invalid;
+	}
+	conf->security_headers_len = strlen(conf->security_headers);
+	LOG("Security headers:\n\n%s", conf->security_headers);
+
+
+	config_lookup_int(cf, "max_file_size", &conf->max_file_size);
+	LOG("Using max file size of %d\n", conf->max_file_size);
+
+	config_lookup_int(cf, "timeout_ms", &conf->timeout_ms);
+	if (conf->timeout_ms <= 0) {
+		conf->timeout_ms = DEFAULT_TIMEOUT_MS;
+	}
+	LOG("Using timeout of %d\n", conf->timeout_ms);
+
+	config_lookup_int(cf, "drain_timeout_ms", &conf->drain_timeout_ms);
+	if (conf->drain_timeout_ms <= 0) {
+		conf->drain_timeout_ms = DEFAULT_DRAIN_TIMEOUT_MS;
+	}
+
+	conf->http2 = 1;
+	config_lookup_bool(cf, "http2", &conf->http2);
+	LOG("HTTP/2: %s\n", conf->http2 ? "on" : "off");
+
+	if (s_listen != NULL) {
+		if (temp_port != NULL) {
+			fprintf(stderr, "listen is set, ignoring port and tls_port\n");
+		}
+		if (parse_listeners(s_listen, conf) == -1) {
+			goto invalid;
+		}
+	} else {
+		const char *tls_port = NULL;
+		config_lookup_string(cf, "tls_port", &tls_port);
+		conf->listeners = calloc(2, sizeof(listener_spec));
+		conf->listeners[conf->num_listeners++] = port_listener(temp_port, 0);
+		if (tls_port != NULL) {
+			conf->listeners[conf->num_listeners++] = port_listener(tls_port, 1);
+		}
+	}
+
+	//TLS listeners, the certificate is read again on every reload
+	int any_tls = 0;
+	for (int i = 0; i < conf->num_listeners; i++) {
+		any_tls |= conf->listeners[i].tls;
+		LOG("Listen: %s%s\n", conf->listeners[i].address, conf->listeners[i].tls ? " (TLS)" : "");
+	}
+	if (any_tls) {
+		const char *certificate = NULL;
+		const char *key = NULL;
+		config_lookup_string(cf, "tls_certificate", &certificate);
+		config_lookup_string(cf, "tls_key", &key);
+		if (certificate == NULL) {
+			fprintf(stderr, "TLS listeners need a tls_certificate\n");
+			goto invalid;
+		}
+
+		conf->tls = tls_context_new(certificate, key != NULL ? key : certificate, conf->http2);
+		if (conf->tls == NULL) {
+			goto invalid;
+		}
+	}
+
+	config_lookup_bool(cf, "warmup", &conf->warmup);
+	config_lookup_int(cf, "warmup_threads", &conf->warmup_threads);
+	const char *warmup_snapshot = NULL;
+	config_lookup_string(cf, "warmup_snapshot", &warmup_snapshot);
+	conf->warmup_snapshot = warmup_snapshot != NULL ? strdup(warmup_snapshot) : NULL;
+	if (conf->warmup_threads < 0) {
+		fprintf(stderr, "warmup_threads must not be negative\n");
+		goto invalid;
+	}
+
+	config_lookup_bool(cf, "mmap_files", &conf->mmap_files);
+	conf->mmap_cache_size = DEFAULT_MMAP_CACHE_SIZE;
+	config_lookup_int(cf, "mmap_cache_size", &conf->mmap_cache_size);
+	if (conf->mmap_cache_size < 0) {
+		fprintf(stderr, "mmap_cache_size must not be negative\n");
+		goto invalid;
+	}
+	LOG("mmap file serving: %s, cache of %d bytes\n",
+			conf->mmap_files ? "on" : "off", conf->mmap_cache_size);
+
+	const char *fastcgi_pass = NULL;
+	config_lookup_string(cf, "fastcgi_pass", &fastcgi_pass);
+	conf->fastcgi_pass = fastcgi_pass != NULL ? strdup(fastcgi_pass) : NULL;
+	conf->fastcgi_connections = DEFAULT_FASTCGI_CONNECTIONS;
+	config_lookup_int(cf, "fastcgi_connections", &conf->fastcgi_connections);
+	conf->fastcgi_requests_per_connection = DEFAULT_FASTCGI_REQUESTS_PER_CONNECTION;
+	config_lookup_int(cf, "fastcgi_requests_per_connection", &conf->fastcgi_requests_per_connection);
+	conf->fastcgi_timeout_ms = DEFAULT_FASTCGI_TIMEOUT_MS;
+	config_lookup_int(cf, "fastcgi_timeout_ms", &conf->fastcgi_timeout_ms);
+	conf->fastcgi_buffer_size = DEFAULT_FASTCGI_BUFFER_SIZE;
+	config_lookup_int(cf, "fastcgi_buffer_size", &conf->fastcgi_buffer_size);
+	conf->fastcgi_queue = DEFAULT_FASTCGI_QUEUE;
+	config_lookup_int(cf, "fastcgi_queue", &conf->fastcgi_queue);
+	if (conf->fastcgi_connections < 1 || conf->fastcgi_requests_per_connection < 1
+			|| conf->fastcgi_requests_per_connection > 65535 || conf->fastcgi_timeout_ms < 1
+			|| conf->fastcgi_buffer_size < 1 || conf->fastcgi_queue < 0) {
+		fprintf(stderr, "Invalid FastCGI settings\n");
+		goto invalid;
+	}
+
+	const char *proxy_health_path = NULL;
+	config_lookup_string(cf, "proxy_health_path", &proxy_health_path);
+	conf->proxy_health_path = proxy_health_path != NULL ? strdup(proxy_health_path) : NULL;
+	conf->proxy_idle_connections = DEFAULT_PROXY_IDLE_CONNECTIONS;
+	config_lookup_int(cf, "proxy_idle_connections", &conf->proxy_idle_connections);
+	conf->proxy_timeout_ms = DEFAULT_PROXY_TIMEOUT_MS;
+	config_lookup_int(cf, "proxy_timeout_ms", &conf->proxy_timeout_ms);
+	conf->proxy_max_fails = DEFAULT_PROXY_MAX_FAILS;
+	config_lookup_int(cf, "proxy_max_fails", &conf->proxy_max_fails);
+	conf->proxy_health_interval_ms = DEFAULT_PROXY_HEALTH_INTERVAL_MS;
+	config_lookup_int(cf, "proxy_health_interval_ms", &conf->proxy_health_interval_ms);
+	if (conf->proxy_idle_connections < 0 || conf->proxy_timeout_ms < 1 || conf->proxy_max_fails < 1
+			|| conf->proxy_health_interval_ms < 0
+			|| (proxy_health_path != NULL && (proxy_health_path[0] != '/' || strlen(proxy_health_path) > MAX_PATHNAME_SIZE))) {
+		fprintf(stderr, "Invalid proxy settings\n");
+		goto invalid;
+	}
+
+	conf->default_host = load_vhost(config_root_setting(cf), conf->root_site, conf);
+	if (conf->default_host == NULL) {
+		goto invalid;
+	}
+
+	const config_setting_t *s_vhosts = config_lookup(cf, "vhosts");
+	if (s_vhosts != NULL) {
+		conf->vhosts = load_vhosts(s_vhosts, conf);
+		if (conf->vhosts == NULL) {
+			goto invalid;
+		}
+	}
+
+	config_lookup_int(cf, "overload_lag_ms", &conf->overload_lag_ms);
+	config_lookup_int(cf, "overload_queue_ms", &conf->overload_queue_ms);
+	conf->overload_idle_ms = DEFAULT_OVERLOAD_IDLE_MS;
+	config_lookup_int(cf, "overload_idle_ms", &conf->overload_idle_ms);
+	conf->overload_retry_after = DEFAULT_OVERLOAD_RETRY_AFTER;
+	config_lookup_int(cf, "overload_retry_after", &conf->overload_retry_after);
+	if (conf->overload_lag_ms < 0 || conf->overload_queue_ms < 0 || conf->overload_idle_ms < 1
+			|| conf->overload_retry_after < 0) {
+		fprintf(stderr, "Invalid overload settings\n");
+		goto invalid;
+	}
+
+	config_lookup_int(cf, "memory_budget_mb", &conf->memory_budget_mb);
+	config_lookup_bool(cf, "memory_cgroup", &conf->memory_cgroup);
+	if (conf->memory_budget_mb < 0) {
+		fprintf(stderr, "memory_budget_mb must not be negative\n");
+		goto invalid;
+	}
+
+	config_lookup_bool(cf, "busy_poll", &conf->busy_poll);
+	conf->busy_poll_us = DEFAULT_BUSY_POLL_US;
+	config_lookup_int(cf, "busy_poll_us", &conf->busy_poll_us);
+	conf->busy_poll_idle_ms = DEFAULT_BUSY_POLL_IDLE_MS;
+	config_lookup_int(cf, "busy_poll_idle_ms", &conf->busy_poll_idle_ms);
+	if (conf->busy_poll_us < 0 || conf->busy_poll_idle_ms < 0) {
+		fprintf(stderr, "Invalid busy poll settings\n");
+		goto invalid;
+	}
+
+	const config_setting_t *s_cpus = config_lookup(cf, "cpu_affinity");
+	if (s_cpus != NULL && config_setting_length(s_cpus) > 0) {
+		conf->num_cpu_affinity = config_setting_length(s_cpus);
+		conf->cpu_affinity = calloc(conf->num_cpu_affinity, sizeof(int));
+		for (int i = 0; i < conf->num_cpu_affinity; i++) {
+			conf->cpu_affinity[i] = config_setting_get_int_elem(s_cpus, i);
+			if (conf->cpu_affinity[i] < 0 || conf->cpu_affinity[i] >= CPU_SETSIZE) {
+				fprintf(stderr, "cpu_affinity[%d] is not a CPU\n", i);
+				goto invalid;
+			}
+		}
+	}
+
+	//plugins = ( "/path/module.so", { path = "/path/auth.so"; args = "..."; } )
+	const config_setting_t *s_plugins = config_lookup(cf, "plugins");
+	if (s_plugins != NULL && config_setting_length(s_plugins) > 0) {
+		conf->plugins = calloc(config_setting_length(s_plugins), sizeof(plugin_spec));
+		for (int i = 0; i < config_setting_length(s_plugins); i++) {
+			const config_setting_t *s_p = config_setting_get_elem(s_plugins, i);
+			const char *plugin_path = config_setting_get_string(s_p);
+			const char *args = NULL;
+			if (plugin_path == NULL) {
+				config_setting_lookup_string(s_p, "path", &plugin_path);
+				config_setting_lookup_string(s_p, "args", &args);
+			}
+			if (plugin_path == NULL) {
+				fprintf(stderr, "plugins[%d] needs a path\n", i);
+				goto invalid;
+			}
+			conf->plugins[i].path = strdup(plugin_path);
+			conf->plugins[i].args = args != NULL ? strdup(args) : NULL;
+			conf->num_plugins += 1;
+		}
+	}
+
+	conf->zerocopy_threshold = DEFAULT_ZEROCOPY_THRESHOLD;
+	config_lookup_int(cf, "zerocopy_threshold", &conf->zerocopy_threshold);
+	if (conf->zerocopy_threshold < 0) {
+		fprintf(stderr, "zerocopy_threshold must not be negative\n");
+		goto invalid;
+	}
+
+	config_lookup_int(cf, "rate_limit_rps", &conf->rate_limit_rps);
+	config_lookup_int(cf, "rate_limit_burst", &conf->rate_limit_burst);
+	config_lookup_int(cf, "max_connections_per_ip", &conf->max_connections_per_ip);
+	conf->rate_limit_table_size = DEFAULT_RATE_LIMIT_TABLE_SIZE;
+	config_lookup_int(cf, "rate_limit_table_size", &conf->rate_limit_table_size);
+	if (conf->rate_limit_rps < 0 || conf->rate_limit_burst < 0
+			|| conf->max_connections_per_ip < 0 || conf->rate_limit_table_size < RATE_LIMIT_PROBE) {
+		fprintf(stderr, "Invalid rate limit settings\n");
+		goto invalid;
+	}
+
+	const char *status_path = NULL;
+	config_lookup_string(cf, "status_path", &status_path);
+	if (status_path != NULL) {
+		if (status_path[0] != '/') {
+			fprintf(stderr, "status_path must start with /\n");
+			goto invalid;
+		}
+		conf->status_path = strdup(status_path);
+		LOG("Serving metrics at %s\n", conf->status_path);
+	}
+
+	conf->slow_request_ms = DEFAULT_SLOW_REQUEST_MS;
+	config_lookup_int(cf, "slow_request_ms", &conf->slow_request_ms);
+
+	const char *capture_file = NULL;
+	config_lookup_string(cf, "capture_file", &capture_file);
+	if (capture_file != NULL) {
+		conf->capture_file = strdup(capture_file);
+	}
+
+	config_destroy(cf);
+	return conf;
+
+invalid:
+	config_destroy(cf);
+	free_config(conf);
+	return NULL;
+}
+
+server_config *server_config_acquire(server_config *conf) {
+	if (conf != NULL) {
+		conf->refcount += 1;
+	}
+	return conf;
+}
+
+void server_config_release(server_config *conf) {
+	if (conf != NULL && --conf->refcount == 0) {
+		LOG("Freeing retired config %p\n", (void*)conf);
+		free_config(conf);
+	}
+}
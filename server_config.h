@@ -0,0 +1,100 @@
+#pragma once
+#include <stddef.h>
+#include "server_vhost.h"
+#include "server_tls.h"
+#include "server_overload.h"
+#include "server_busypoll.h"
+#include "server_listen.h"
+#include "server_zerocopy.h"
+#include "server_plugin.h"
+
+#define DEFAULT_TIMEOUT_MS 1000
+#define DEFAULT_DRAIN_TIMEOUT_MS 30000
+
+//immutable snapshot of server.conf
+//requests hold a reference for their lifetime, so a reload never
+//changes settings underneath an in-flight response
+typedef struct server_config {
+	int refcount;
+
+	//sockets to accept on, from listen or port and tls_port; only read at startup
+	listener_spec *listeners;
+	int num_listeners;
+	tls_context *tls; //certificate and key for new TLS clients, NULL without a TLS listener
+	char *root_site;
+	size_t root_len;
+	char *log_file;
+
+	int max_file_size;
+	int timeout_ms;
+	int drain_timeout_ms; //how long an upgraded-away process serves its clients
+
+	int http2; //cleartext HTTP/2 by prior knowledge or Upgrade: h2c
+
+	//startup crawl of root_site, only read when the process starts
+	int warmup;
+	int warmup_threads; //0 for one per CPU
+	char *warmup_snapshot; //index loaded instead of crawling, rewritten on exit; NULL for none
+
+	int mmap_files; //serve bodies from shared mappings instead of fread
+	int mmap_cache_size; //bytes of mappings kept between requests
+
+	//per client address limits, 0 disables
+	int rate_limit_rps;
+	int rate_limit_burst;
+	int max_connections_per_ip;
+	int rate_limit_table_size;
+
+	//shed load past these, 0 ignores the signal
+	int overload_lag_ms;
+	int overload_queue_ms;
+	int overload_idle_ms; //connections idle this long are closed while shedding
+	int overload_retry_after; //seconds, in 503 responses
+
+	//memory governor, both off leaves memory unbounded
+	int memory_budget_mb;
+	int memory_cgroup; //budget a share of the cgroup's memory.max
+
+	//spin on epoll_wait instead of sleeping, for latency at the cost of a CPU
+	int busy_poll;
+	int busy_poll_us; //SO_BUSY_POLL, how long a socket read polls the device
+	int busy_poll_idle_ms; //blocking waits again after this long without events
+	int *cpu_affinity; //CPUs the loop is pinned to at startup, NULL to leave it
+	int num_cpu_affinity;
+
+	int zerocopy_threshold; //in-memory bodies this large go out with MSG_ZEROCOPY, 0 disables
+
+	plugin_spec *plugins; //handler modules, only loaded at startup
+	int num_plugins;
+
+	char *status_path; //metrics for loopback clients, NULL when disabled
+	char *capture_file; //request capture for replay, NULL when disabled
+	int slow_request_ms; //requests slower than this are kept for inspection, 0 disables
+
+	//FastCGI responder for .php files, NULL to send them as files
+	char *fastcgi_pass;
+	int fastcgi_connections;
+	int fastcgi_requests_per_connection;
+	int fastcgi_timeout_ms;
+	int fastcgi_buffer_size;
+	int fastcgi_queue;
+
+	//locations with proxy_pass
+	int proxy_idle_connections; //per upstream
+	int proxy_timeout_ms;
+	int proxy_max_fails;
+	int proxy_health_interval_ms; //0 disables probes
+	char *proxy_health_path; //NULL to probe with a bare connect
+
+	char *security_headers; //pre-rendered, ends with the blank line
+	size_t security_headers_len;
+
+	vhost *default_host; //top level root, headers and locations, for unknown hosts
+	vhost_table *vhosts; //NULL without a vhosts section
+} server_config;
+
+//parse and validate a config file, returns NULL if it is unusable
+server_config *server_config_load(const char *path);
+
+server_config *server_config_acquire(server_config *);
+void server_config_release(server_config *);
@@ -0,0 +1,672 @@
+#define _GNU_SOURCE
+#include "server_fastcgi.h"
+#include "server_helpers.h"
+#include "server_memory.h"
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+//FastCGI client for the event loop
+//connections are nonblocking, kept open between requests (FCGI_KEEP_CONN) and
+//carry up to requests_per_connection requests at once, told apart by id
+//a client that falls behind pauses reading on its connection (backpressure),
+//requests that see nothing from the responder for timeout_ms fail with 504
+
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+#define FCGI_MAX_RECORD (FCGI_HEADER_LEN + FCGI_MAX_CONTENT + 255)
+
+typedef struct fastcgi_conn {
+	int fd;
+	int connecting;
+	int paused; //not reading until clients catch up
+	fastcgi_pool *pool;
+
+	fastcgi_request **requests; //in flight, indexed by id - 1
+	int active;
+
+	char *out; //records not yet written
+	size_t out_start;
+	size_t out_len;
+	size_t out_cap;
+
+	char in[FCGI_MAX_RECORD]; //at most one partial record
+	size_t in_len;
+
+	struct fastcgi_conn *next;
+} fastcgi_conn;
+
+struct fastcgi_pool {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+
+	int max_connections;
+	int requests_per_connection;
+	int timeout_ms;
+	size_t buffer_size; //per request stdout held before reading pauses
+	int max_waiting;
+	int closing;
+
+	fastcgi_conn *conns;
+	int num_conns;
+
+	fastcgi_request *waiting_head; //FIFO of requests without a connection
+	fastcgi_request *waiting_tail;
+	int num_waiting;
+
+	struct fastcgi_pool *next;
+};
+
+static int epoll_fd = -1;
+static void (*notify)(int client_fd) = NULL;
+static fastcgi_pool *pools = NULL;
+
+//clients to notify, each entry holds a reference
+static fastcgi_request *ready_head = NULL;
+static fastcgi_request *ready_tail = NULL;
+
+static void conn_close(fastcgi_conn *, int status);
+static void pump_waiting(fastcgi_pool *);
+
+void fastcgi_init(int epollfd, void (*ready)(int client_fd)) {
+	epoll_fd = epollfd;
+	notify = ready;
+}
+
+static void append(char **buf, size_t *len, size_t *cap, const void *data, size_t n) {
+	if (*len + n > *cap) {
+		*cap = *cap == 0 ? 4096 : *cap;
+		while (*len + n > *cap) {
+			*cap *= 2;
+		}
+		*buf = realloc(*buf, *cap);
+	}
+	memcpy(*buf + *len, data, n);
+	*len += n;
+}
+
+static void unref(fastcgi_request *r) {
+	if (--r->refcount > 0) {
+		return;
+	}
+	memory_release(MEM_UPSTREAM, r->out_cap);
+	free(r->params);
+	free(r->headers);
+	free(r->out);
+	free(r);
+}
+
+static void queue_ready(fastcgi_request *r) {
+	if (r->client_fd < 0 || r->ready_queued) {
+		return;
+	}
+	r->ready_queued = 1;
+	r->refcount += 1;
+	r->next_ready = NULL;
+	if (ready_tail != NULL) {
+		ready_tail->next_ready = r;
+	} else {
+		ready_head = r;
+	}
+	ready_tail = r;
+}
+
+static void dispatch_ready() {
+	while (ready_head != NULL) {
+		fastcgi_request *r = ready_head;
+		ready_head = r->next_ready;
+		if (ready_head == NULL) {
+			ready_tail = NULL;
+		}
+		r->ready_queued = 0;
+
+		if (r->client_fd >= 0 && notify != NULL) {
+			notify(r->client_fd);
+		}
+		unref(r);
+	}
+}
+
+static void fail_request(fastcgi_request *r, int status) {
+	if (r->ended || r->error != 0) {
+		return;
+	}
+	r->error = status;
+	queue_ready(r);
+}
+
+static void set_events(fastcgi_conn *conn) {
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLOUT | EPOLLET | (conn->paused ? 0 : EPOLLIN);
+	ev.data.fd = conn->fd;
+
+	//re-arming EPOLLIN reports data that arrived while paused
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static size_t buffered(const fastcgi_request *r) {
+	return r->out_len - r->out_start;
+}
+
+static void maybe_resume(fastcgi_conn *conn) {
+	if (conn == NULL || !conn->paused) {
+		return;
+	}
+	for (int i = 0; i < conn->pool->requests_per_connection; i++) {
+		fastcgi_request *r = conn->requests[i];
+		if (r != NULL && r->client_fd >= 0 && buffered(r) > conn->pool->buffer_size) {
+			return;
+		}
+	}
+	conn->paused = 0;
+	set_events(conn);
+}
+
+static void write_record(fastcgi_conn *conn, int type, uint16_t id, const char *content, size_t len) {
+	unsigned char header[FCGI_HEADER_LEN] = {
+		FCGI_VERSION_1, type, id >> 8, id & 0xff, len >> 8, len & 0xff, 0, 0
+	};
+	append(&conn->out, &conn->out_len, &conn->out_cap, header, sizeof(header));
+	if (len > 0) {
+		append(&conn->out, &conn->out_len, &conn->out_cap, content, len);
+	}
+}
+
+//returns -1 if the connection broke
+static int conn_flush(fastcgi_conn *conn) {
+	while (!conn->connecting && conn->out_start < conn->out_len) {
+		ssize_t n = write(conn->fd, conn->out + conn->out_start, conn->out_len - conn->out_start);
+		if (n > 0) {
+			conn->out_start += n;
+		} else if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		} else {
+			perror("FastCGI write");
+			return -1;
+		}
+	}
+	if (conn->out_start == conn->out_len) {
+		conn->out_start = conn->out_len = 0;
+	}
+	return 0;
+}
+
+static fastcgi_conn *conn_open(fastcgi_pool *pool) {
+	int fd = socket(pool->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("FastCGI socket");
+		return NULL;
+	}
+
+	int connecting = 0;
+	if (connect(fd, (struct sockaddr *)&pool->addr, pool->addr_len) == -1) {
+		if (errno != EINPROGRESS) {
+			perror("FastCGI connect");
+			close(fd);
+			return NULL;
+		}
+		connecting = 1;
+	}
+
+	fastcgi_conn *conn = calloc(1, sizeof(fastcgi_conn));
+	conn->fd = fd;
+	conn->connecting = connecting;
+	conn->pool = pool;
+	conn->requests = calloc(pool->requests_per_connection, sizeof(fastcgi_request *));
+
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.fd = fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+	conn->next = pool->conns;
+	pool->conns = conn;
+	pool->num_conns += 1;
+	LOG("Opened FastCGI connection %d (%d open)\n", fd, pool->num_conns);
+	return conn;
+}
+
+//fails every unfinished request it carries with status
+static void conn_close(fastcgi_conn *conn, int status) {
+	fastcgi_pool *pool = conn->pool;
+
+	fastcgi_conn **slot = &pool->conns;
+	while (*slot != conn) {
+		slot = &(*slot)->next;
+	}
+	*slot = conn->next;
+	pool->num_conns -= 1;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	LOG("Closed FastCGI connection %d\n", conn->fd);
+
+	for (int i = 0; i < pool->requests_per_connection; i++) {
+		fastcgi_request *r = conn->requests[i];
+		if (r != NULL) {
+			r->conn = NULL;
+			fail_request(r, status);
+			unref(r);
+		}
+	}
+	free(conn->requests);
+	free(conn->out);
+	free(conn);
+
+	pump_waiting(pool);
+}
+
+//put r on a connection with a free id, opening one if the pool allows
+//returns 1 if assigned, 0 if the pool is saturated, -1 if r failed
+static int assign(fastcgi_pool *pool, fastcgi_request *r) {
+	fastcgi_conn *conn = pool->conns;
+	while (conn != NULL && conn->active >= pool->requests_per_connection) {
+		conn = conn->next;
+	}
+	if (conn == NULL) {
+		if (pool->num_conns >= pool->max_connections) {
+			return 0;
+		}
+		conn = conn_open(pool);
+		if (conn == NULL) {
+			fail_request(r, 502);
+			return -1;
+		}
+	}
+
+	int slot = 0;
+	while (conn->requests[slot] != NULL) {
+		slot += 1;
+	}
+	conn->requests[slot] = r;
+	conn->active += 1;
+	r->refcount += 1;
+	r->conn = conn;
+	r->id = slot + 1;
+	r->deadline_ms = monotonic_ms() + pool->timeout_ms;
+
+	const char begin[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0 };
+	write_record(conn, FCGI_BEGIN_REQUEST, r->id, begin, sizeof(begin));
+	for (size_t sent = 0; sent < r->params_len; sent += FCGI_MAX_CONTENT) {
+		size_t len = r->params_len - sent < FCGI_MAX_CONTENT ? r->params_len - sent : FCGI_MAX_CONTENT;
+		write_record(conn, FCGI_PARAMS, r->id, r->params + sent, len);
+	}
+	write_record(conn, FCGI_PARAMS, r->id, NULL, 0);
+	write_record(conn, FCGI_STDIN, r->id, NULL, 0);
+
+	free(r->params);
+	r->params = NULL;
+	r->params_len = r->params_cap = 0;
+
+	if (conn_flush(conn) == -1) {
+		conn_close(conn, 502);
+		return -1;
+	}
+	return 1;
+}
+
+static void pump_waiting(fastcgi_pool *pool) {
+	while (!pool->closing && pool->waiting_head != NULL) {
+
+		//off the queue first, assign can come back here through conn_close
+		fastcgi_request *r = pool->waiting_head;
+		pool->waiting_head = r->next_waiting;
+		if (pool->waiting_head == NULL) {
+			pool->waiting_tail = NULL;
+		}
+		pool->num_waiting -= 1;
+
+		if (assign(pool, r) == 0) {
+			r->next_waiting = pool->waiting_head;
+			pool->waiting_head = r;
+			if (pool->waiting_tail == NULL) {
+				pool->waiting_tail = r;
+			}
+			pool->num_waiting += 1;
+			return;
+		}
+	}
+}
+
+static void remove_waiting(fastcgi_pool *pool, fastcgi_request *r) {
+	fastcgi_request **slot = &pool->waiting_head;
+	fastcgi_request *prev = NULL;
+	while (*slot != NULL && *slot != r) {
+		prev = *slot;
+		slot = &(*slot)->next_waiting;
+	}
+	if (*slot == NULL) {
+		return;
+	}
+	*slot = r->next_waiting;
+	if (pool->waiting_tail == r) {
+		pool->waiting_tail = prev;
+	}
+	pool->num_waiting -= 1;
+}
+
+fastcgi_pool *fastcgi_pool_new(const char *address, int connections, int requests_per_connection,
+		int timeout_ms, size_t buffer_size, int queue) {
+
+	fastcgi_pool *pool = calloc(1, sizeof(fastcgi_pool));
+	pool->max_connections = connections;
+	pool->requests_per_connection = requests_per_connection;
+	pool->timeout_ms = timeout_ms;
+	pool->buffer_size = buffer_size;
+	pool->max_waiting = queue;
+
+	if (resolve_stream_address(address, &pool->addr, &pool->addr_len) == -1) {
+		free(pool);
+		return NULL;
+	}
+
+	pool->next = pools;
+	pools = pool;
+	return pool;
+}
+
+//only called once no client holds a request of the pool
+void fastcgi_pool_free(fastcgi_pool *pool) {
+	if (pool == NULL) {
+		return;
+	}
+	pool->closing = 1;
+	while (pool->conns != NULL) {
+		conn_close(pool->conns, 502);
+	}
+	while (pool->waiting_head != NULL) {
+		fastcgi_request *r = pool->waiting_head;
+		remove_waiting(pool, r);
+		r->pool = NULL;
+	}
+
+	fastcgi_pool **slot = &pools;
+	while (*slot != pool) {
+		slot = &(*slot)->next;
+	}
+	*slot = pool->next;
+	free(pool);
+}
+
+fastcgi_request *fastcgi_request_new(fastcgi_pool *pool, int client_fd) {
+	if (pool->num_waiting >= pool->max_waiting) {
+		LOG("FastCGI queue is full\n");
+		return NULL;
+	}
+	fastcgi_request *r = calloc(1, sizeof(fastcgi_request));
+	r->refcount = 1;
+	r->client_fd = client_fd;
+	r->pool = pool;
+	r->status = 200;
+	return r;
+}
+
+static void put_length(char **buf, size_t *len, size_t *cap, size_t n) {
+	if (n < 128) {
+		unsigned char b = n;
+		append(buf, len, cap, &b, 1);
+	} else {
+		unsigned char b[4] = { (n >> 24) | 0x80, n >> 16, n >> 8, n };
+		append(buf, len, cap, b, 4);
+	}
+}
+
+void fastcgi_param(fastcgi_request *r, const char *name, const char *value, size_t value_len) {
+	size_t name_len = strlen(name);
+	put_length(&r->params, &r->params_len, &r->params_cap, name_len);
+	put_length(&r->params, &r->params_len, &r->params_cap, value_len);
+	append(&r->params, &r->params_len, &r->params_cap, name, name_len);
+	append(&r->params, &r->params_len, &r->params_cap, value, value_len);
+}
+
+void fastcgi_submit(fastcgi_request *r) {
+	fastcgi_pool *pool = r->pool;
+	r->deadline_ms = monotonic_ms() + pool->timeout_ms;
+
+	//first come first served, even when a slot is free right now
+	if (pool->waiting_head != NULL || assign(pool, r) == 0) {
+		r->next_waiting = NULL;
+		if (pool->waiting_tail != NULL) {
+			pool->waiting_tail->next_waiting = r;
+		} else {
+			pool->waiting_head = r;
+		}
+		pool->waiting_tail = r;
+		pool->num_waiting += 1;
+		pump_waiting(pool);
+	}
+}
+
+void fastcgi_consume(fastcgi_request *r, size_t n) {
+	r->out_start += n;
+	if (r->out_start == r->out_len) {
+		r->out_start = r->out_len = 0;
+	}
+	maybe_resume(r->conn);
+}
+
+void fastcgi_release(fastcgi_request *r) {
+	if (r == NULL) {
+		return;
+	}
+	r->client_fd = -1;
+	memory_release(MEM_UPSTREAM, r->out_cap);
+	free(r->out);
+	r->out = NULL;
+	r->out_start = r->out_len = r->out_cap = 0;
+
+	if (r->conn != NULL && !r->ended) {
+		//the id stays busy until the responder ends it
+		fastcgi_conn *conn = r->conn;
+		write_record(conn, FCGI_ABORT_REQUEST, r->id, NULL, 0);
+		if (conn_flush(conn) == -1) {
+			conn_close(conn, 502);
+		} else {
+			maybe_resume(conn);
+		}
+	} else if (r->conn == NULL && r->pool != NULL && r->id == 0) {
+		remove_waiting(r->pool, r);
+	}
+	unref(r);
+}
+
+//split the CGI header off stdout, returns -1 if it is malformed
+static int parse_header(fastcgi_request *r) {
+	char *start = r->out + r->out_start;
+	size_t len = buffered(r);
+
+	char *end = memmem(start, len, "\n\r\n", 3);
+	size_t sep = 3;
+	char *lf_end = memmem(start, len, "\n\n", 2);
+	if (lf_end != NULL && (end == NULL || lf_end < end)) {
+		end = lf_end;
+		sep = 2;
+	}
+	if (end == NULL) {
+		return len > MAX_HEADER_SIZE / 2 ? -1 : 0;
+	}
+
+	size_t headers_len = 0, headers_cap = 0;
+	int has_status = 0;
+	for (char *line = start; line <= end; ) {
+		char *eol = memchr(line, '\n', end + 1 - line);
+		size_t line_len = eol - line;
+		if (line_len > 0 && line[line_len - 1] == '\r') {
+			line_len -= 1;
+		}
+
+		if (line_len >= 7 && strncasecmp(line, "Status:", 7) == 0) {
+			r->status = atoi(line + 7);
+			has_status = 1;
+		} else if (line_len > 0) {
+			if (!has_status && line_len >= 9 && strncasecmp(line, "Location:", 9) == 0) {
+				r->status = 302;
+			}
+			append(&r->headers, &headers_len, &headers_cap, line, line_len);
+			append(&r->headers, &headers_len, &headers_cap, "\n", 1);
+		}
+		line = eol + 1;
+	}
+	append(&r->headers, &headers_len, &headers_cap, "", 1);
+
+	if (r->status < 100 || r->status > 509) {
+		return -1;
+	}
+
+	r->header_done = 1;
+	fastcgi_consume(r, end + sep - start);
+	return 0;
+}
+
+static void handle_record(fastcgi_conn *conn, int type, uint16_t id, const char *content, size_t len) {
+	fastcgi_pool *pool = conn->pool;
+	if (id == 0 || id > pool->requests_per_connection || conn->requests[id - 1] == NULL) {
+		return;
+	}
+	fastcgi_request *r = conn->requests[id - 1];
+	r->deadline_ms = monotonic_ms() + pool->timeout_ms;
+
+	if (type == FCGI_STDOUT && len > 0 && r->client_fd >= 0 && r->error == 0) {
+		size_t cap = r->out_cap;
+		append(&r->out, &r->out_len, &r->out_cap, content, len);
+		memory_charge(MEM_UPSTREAM, r->out_cap - cap);
+		if (!r->header_done && parse_header(r) == -1) {
+			LOG("Malformed CGI header from FastCGI request %d\n", id);
+			fail_request(r, 502);
+			return;
+		}
+		if (buffered(r) > pool->buffer_size && !conn->paused) {
+			LOG("Pausing FastCGI connection %d\n", conn->fd);
+			conn->paused = 1;
+			set_events(conn);
+		}
+		if (r->header_done) {
+			queue_ready(r);
+		}
+
+	} else if (type == FCGI_STDERR && len > 0) {
+		LOG("FastCGI stderr: %.*s\n", (int)len, content);
+
+	} else if (type == FCGI_END_REQUEST) {
+		if (!r->header_done) {
+			fail_request(r, 502);
+		}
+		r->ended = 1;
+		queue_ready(r);
+
+		conn->requests[id - 1] = NULL;
+		conn->active -= 1;
+		r->conn = NULL;
+		unref(r);
+	}
+}
+
+//returns -1 if the connection was closed
+static int conn_read(fastcgi_conn *conn) {
+	while (!conn->paused) {
+		ssize_t n = read(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		} else if (n <= 0) {
+			if (n == -1) {
+				perror("FastCGI read");
+			}
+			conn_close(conn, 502);
+			return -1;
+		}
+		conn->in_len += n;
+
+		size_t pos = 0;
+		while (conn->in_len - pos >= FCGI_HEADER_LEN) {
+			unsigned char *h = (unsigned char *)conn->in + pos;
+			size_t content_len = (h[4] << 8) | h[5];
+			size_t record_len = FCGI_HEADER_LEN + content_len + h[6];
+			if (conn->in_len - pos < record_len) {
+				break;
+			}
+			handle_record(conn, h[1], (h[2] << 8) | h[3], conn->in + pos + FCGI_HEADER_LEN, content_len);
+			pos += record_len;
+		}
+		memmove(conn->in, conn->in + pos, conn->in_len - pos);
+		conn->in_len -= pos;
+	}
+	return 0;
+}
+
+int fastcgi_handle_event(int fd, uint32_t events) {
+	fastcgi_conn *conn = NULL;
+	for (fastcgi_pool *pool = pools; pool != NULL && conn == NULL; pool = pool->next) {
+		for (conn = pool->conns; conn != NULL && conn->fd != fd; conn = conn->next);
+	}
+	if (conn == NULL) {
+		return 0;
+	}
+	fastcgi_pool *pool = conn->pool;
+
+	if (conn->connecting) {
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+		if (err != 0) {
+			LOG("FastCGI connect failed: %s\n", strerror(err));
+			conn_close(conn, 502);
+			dispatch_ready();
+			return 1;
+		}
+		if (!(events & EPOLLOUT)) {
+			return 1;
+		}
+		conn->connecting = 0;
+	}
+
+	if ((events & EPOLLOUT) && conn_flush(conn) == -1) {
+		conn_close(conn, 502);
+	} else if (conn_read(conn) == 0) {
+		pump_waiting(pool);
+	}
+
+	dispatch_ready();
+	return 1;
+}
+
+void fastcgi_expire(long long now_ms) {
+	for (fastcgi_pool *pool = pools; pool != NULL; pool = pool->next) {
+
+		//the responder's state for a stuck id is unknown, so drop the connection
+		fastcgi_conn *conn = pool->conns;
+		while (conn != NULL) {
+			fastcgi_conn *next = conn->next;
+			for (int i = 0; i < pool->requests_per_connection; i++) {
+				fastcgi_request *r = conn->requests[i];
+				if (r != NULL && !r->ended && now_ms >= r->deadline_ms) {
+					LOG("FastCGI request %d timed out\n", r->id);
+					conn_close(conn, 504);
+					break;
+				}
+			}
+			conn = next;
+		}
+
+		while (pool->waiting_head != NULL && now_ms >= pool->waiting_head->deadline_ms) {
+			fastcgi_request *r = pool->waiting_head;
+			remove_waiting(pool, r);
+			fail_request(r, 504);
+		}
+	}
+
+	dispatch_ready();
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define FASTCGI_EXTENSION ".php" //files handed to the pool instead of being sent
+#define DEFAULT_FASTCGI_CONNECTIONS 4
+#define DEFAULT_FASTCGI_REQUESTS_PER_CONNECTION 1 //php-fpm does not multiplex
+#define DEFAULT_FASTCGI_TIMEOUT_MS 30000
+#define DEFAULT_FASTCGI_BUFFER_SIZE 65536
+#define DEFAULT_FASTCGI_QUEUE 256
+
+typedef struct fastcgi_pool fastcgi_pool;
+struct fastcgi_conn;
+
+//one request to the responder, shared by the client and the connection
+//carrying it until both let go
+typedef struct fastcgi_request {
+	int refcount;
+	int client_fd; //-1 once the client let go
+	uint16_t id; //0 while waiting for a connection
+	fastcgi_pool *pool; //NULL once the pool is gone
+	struct fastcgi_conn *conn;
+	long long deadline_ms; //pushed back by every record from the responder
+
+	char *params; //encoded FCGI_PARAMS stream, freed once sent
+	size_t params_len;
+	size_t params_cap;
+
+	//stdout of the responder, the CGI header is parsed out of it
+	int header_done;
+	int status;
+	char *headers; //"Name: value\n" lines, without Status
+	char *out;
+	size_t out_start;
+	size_t out_len;
+	size_t out_cap;
+
+	int ended; //FCGI_END_REQUEST received
+	int error; //502 or 504 once the request failed
+
+	struct fastcgi_request *next_waiting;
+	struct fastcgi_request *next_ready;
+	int ready_queued;
+} fastcgi_request;
+
+//clients are told about progress through ready(client_fd), only ever
+//from fastcgi_handle_event and fastcgi_expire, never from a call made
+//while serving a client
+void fastcgi_init(int epollfd, void (*ready)(int client_fd));
+
+//address is "unix:/path", "/path" or "host:port", connections are opened on demand
+//returns NULL if the address cannot be resolved
+fastcgi_pool *fastcgi_pool_new(const char *address, int connections, int requests_per_connection,
+		int timeout_ms, size_t buffer_size, int queue);
+void fastcgi_pool_free(fastcgi_pool *);
+
+//returns NULL when the wait queue is full
+fastcgi_request *fastcgi_request_new(fastcgi_pool *, int client_fd);
+void fastcgi_param(fastcgi_request *, const char *name, const char *value, size_t value_len);
+
+//queue the request for a connection, error is set if that fails right away
+void fastcgi_submit(fastcgi_request *);
+
+//the client sent n bytes of out
+void fastcgi_consume(fastcgi_request *, size_t n);
+
+void fastcgi_release(fastcgi_request *);
+
+//returns 0 if fd is not a pool connection
+int fastcgi_handle_event(int fd, uint32_t events);
+
+//fail requests past their deadline and deliver pending notifications
+void fastcgi_expire(long long now_ms);
@@ -0,0 +1,221 @@
+#include "server_filecache.h"
+#include "server_helpers.h"
+#include "server_memory.h"
+#include "server_metrics.h"
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//files replaced in place (rather than by rename) can still SIGBUS a request
+//that is mid-send; the stat check below only catches changes between requests
+
+struct file_cache {
+	file_map *buckets[FILE_CACHE_BUCKETS];
+	file_map *lru_head; //most recently used
+	file_map *lru_tail;
+	size_t cached_bytes;
+	size_t max_cached_bytes;
+};
+
+static size_t page_size = 0;
+
+static unsigned int hash_path(const char *path) {
+	unsigned int hash = 2166136261u;
+	for (; *path; path++) {
+		hash = (hash ^ (unsigned char)*path) * 16777619u;
+	}
+	return hash % FILE_CACHE_BUCKETS;
+}
+
+static void lru_unlink(file_cache *cache, file_map *map) {
+	if (map->lru_prev) {
+		map->lru_prev->lru_next = map->lru_next;
+	} else {
+		cache->lru_head = map->lru_next;
+	}
+	if (map->lru_next) {
+		map->lru_next->lru_prev = map->lru_prev;
+	} else {
+		cache->lru_tail = map->lru_prev;
+	}
+	map->lru_prev = map->lru_next = NULL;
+}
+
+static void lru_push(file_cache *cache, file_map *map) {
+	map->lru_next = cache->lru_head;
+	if (cache->lru_head) {
+		cache->lru_head->lru_prev = map;
+	}
+	cache->lru_head = map;
+	if (cache->lru_tail == NULL) {
+		cache->lru_tail = map;
+	}
+}
+
+//remove an entry from the cache and drop the cache's reference
+static void evict(file_cache *cache, file_map *map) {
+	file_map **slot = &cache->buckets[hash_path(map->path)];
+	while (*slot != map) {
+		slot = &(*slot)->next_hash;
+	}
+	*slot = map->next_hash;
+
+	lru_unlink(cache, map);
+	cache->cached_bytes -= map->size;
+	memory_release(MEM_FILE_CACHE, map->size);
+	map->cached = 0;
+
+	LOG("Evicted mapping of %s (%zu bytes)\n", map->path, map->size);
+	file_map_release(map);
+}
+
+static file_map *map_file(const char *path, int fd, struct stat *file_stat) {
+
+	file_map *map = calloc(1, sizeof(file_map));
+	map->refcount = 1;
+	map->path = strdup(path);
+	map->dev = file_stat->st_dev;
+	map->ino = file_stat->st_ino;
+	map->mtime = file_stat->st_mtim;
+	map->size = file_stat->st_size;
+
+	if (map->size > 0) {
+		map->data = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map->data == MAP_FAILED) {
+			perror("mmap");
+			free(map->path);
+			free(map);
+			return NULL;
+		}
+		//most requests stream the whole file front to back
+		madvise(map->data, map->size, MADV_SEQUENTIAL);
+	}
+
+	return map;
+}
+
+//least recently used mappings go first under memory pressure
+static size_t reclaim(void *arg, size_t want) {
+	file_cache *cache = arg;
+	size_t freed = 0;
+	while (freed < want && cache->lru_tail != NULL) {
+		freed += cache->lru_tail->size;
+		evict(cache, cache->lru_tail);
+	}
+	return freed;
+}
+
+file_cache *file_cache_new(size_t max_bytes) {
+	file_cache *cache = calloc(1, sizeof(file_cache));
+	cache->max_cached_bytes = max_bytes;
+	memory_reclaimer_add(MEM_FILE_CACHE, reclaim, cache);
+	LOG("Mapped file cache budget: %zu bytes\n", max_bytes);
+	return cache;
+}
+
+void file_cache_free(file_cache *cache) {
+	if (cache != NULL) {
+		memory_reclaimer_remove(reclaim, cache);
+		file_cache_flush(cache);
+		free(cache);
+	}
+}
+
+file_map *file_cache_get(file_cache *cache, const char *path, int fd) {
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+		return NULL;
+	}
+
+	file_map *map = cache->buckets[hash_path(path)];
+	while (map != NULL && strcmp(map->path, path) != 0) {
+		map = map->next_hash;
+	}
+
+	if (map != NULL) {
+		if (map->ino == file_stat.st_ino && map->dev == file_stat.st_dev
+				&& map->size == (size_t)file_stat.st_size
+				&& map->mtime.tv_sec == file_stat.st_mtim.tv_sec
+				&& map->mtime.tv_nsec == file_stat.st_mtim.tv_nsec) {
+			lru_unlink(cache, map);
+			lru_push(cache, map);
+			map->refcount += 1;
+			metrics_add(M_CACHE_HITS, 1);
+			return map;
+		}
+
+		//file changed on disk, requests still sending the old one keep it alive
+		evict(cache, map);
+	}
+
+	metrics_add(M_CACHE_MISSES, 1);
+	map = map_file(path, fd, &file_stat);
+	if (map == NULL) {
+		return NULL;
+	}
+
+	//too big to share, the request owns the only reference
+	if (map->size > cache->max_cached_bytes) {
+		return map;
+	}
+
+	while (cache->cached_bytes + map->size > cache->max_cached_bytes && cache->lru_tail != NULL) {
+		evict(cache, cache->lru_tail);
+	}
+
+	unsigned int bucket = hash_path(path);
+	map->next_hash = cache->buckets[bucket];
+	cache->buckets[bucket] = map;
+	lru_push(cache, map);
+	cache->cached_bytes += map->size;
+	memory_charge(MEM_FILE_CACHE, map->size);
+	map->cached = 1;
+	map->refcount += 1;
+
+	LOG("Mapped %s (%zu bytes, %zu cached)\n", path, map->size, cache->cached_bytes);
+	return map;
+}
+
+file_map *file_map_acquire(file_map *map) {
+	if (map != NULL) {
+		map->refcount += 1;
+	}
+	return map;
+}
+
+void file_map_release(file_map *map) {
+	if (map == NULL || --map->refcount > 0) {
+		return;
+	}
+
+	if (map->data != NULL) {
+		munmap(map->data, map->size);
+	}
+	free(map->path);
+	free(map);
+}
+
+void file_map_advise(file_map *map, size_t offset, size_t length) {
+	if (map->data == NULL || offset >= map->size) {
+		return;
+	}
+
+	if (page_size == 0) {
+		page_size = sysconf(_SC_PAGESIZE);
+	}
+
+	if (length > map->size - offset) {
+		length = map->size - offset;
+	}
+
+	//madvise wants a page aligned start
+	size_t start = offset - offset % page_size;
+	madvise(map->data + start, length + (offset - start), MADV_WILLNEED);
+}
+
+void file_cache_flush(file_cache *cache) {
+	while (cache->lru_tail != NULL) {
+		evict(cache, cache->lru_tail);
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define DEFAULT_MMAP_CACHE_SIZE (256 * 1024 * 1024)
+#define FILE_CACHE_BUCKETS 1024
+
+//read-only shared mapping of a file in the webroot
+//the cache holds one reference and every request serving it holds another,
+//so evicting or invalidating an entry never unmaps a body mid-send
+typedef struct file_map {
+	int refcount;
+	int cached;
+
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+
+	char *data; //NULL for empty files
+	size_t size;
+
+	struct file_map *next_hash;
+	struct file_map *lru_prev;
+	struct file_map *lru_next;
+} file_map;
+
+//mappings kept between requests, up to max_bytes, one cache per site
+typedef struct file_cache file_cache;
+
+file_cache *file_cache_new(size_t max_bytes);
+
+//drop every entry, requests still sending a body keep their mapping
+void file_cache_free(file_cache *);
+
+//map the open file fd, cached under path (or reuse a current mapping)
+//returns a new reference or NULL
+file_map *file_cache_get(file_cache *, const char *path, int fd);
+
+//another reference to a mapping, for sends that outlive the request
+file_map *file_map_acquire(file_map *);
+
+void file_map_release(file_map *);
+
+//hint the kernel about the part of the file a request is about to send
+void file_map_advise(file_map *, size_t offset, size_t length);
+
+void file_cache_flush(file_cache *);
@@ -0,0 +1,1040 @@
+#define _GNU_SOURCE
+#include "server_h2.h"
+#include "server_helpers.h"
+#include "server_memory.h"
+#include "server_metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+enum {
+	F_DATA, F_HEADERS, F_PRIORITY, F_RST_STREAM, F_SETTINGS, F_PUSH_PROMISE,
+	F_PING, F_GOAWAY, F_WINDOW_UPDATE, F_CONTINUATION,
+	F_PRIORITY_UPDATE = 0x10 //RFC 9218
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define S_HEADER_TABLE_SIZE 0x1
+#define S_ENABLE_PUSH 0x2
+#define S_MAX_CONCURRENT_STREAMS 0x3
+#define S_INITIAL_WINDOW_SIZE 0x4
+#define S_MAX_FRAME_SIZE 0x5
+#define S_NO_RFC7540_PRIORITIES 0x9
+
+#define MAX_WINDOW 0x7fffffff
+#define MAX_HEADER_BLOCK 65536 //request header block across CONTINUATION frames
+#define OUT_LOW_WATER (2 * H2_MAX_FRAME_SIZE) //DATA is framed only while less than this is queued
+
+struct h2_conn {
+	int fd;
+	const h2_callbacks *cb;
+	void *conn_data;
+
+	size_t preface_left; //bytes of H2_PREFACE still to come
+	uint8_t in[H2_FRAME_HEADER + H2_MAX_FRAME_SIZE];
+	size_t in_len;
+
+	uint8_t *out; //frames waiting for the socket
+	size_t out_start;
+	size_t out_len;
+	size_t out_cap;
+
+	hpack_table decoder;
+	hpack_table encoder;
+
+	int64_t send_window;
+	int64_t initial_window; //the peer's SETTINGS_INITIAL_WINDOW_SIZE
+	uint32_t peer_max_frame;
+
+	h2_stream *streams; //by id
+	int num_streams;
+	uint32_t last_stream_id; //highest the client opened
+	uint32_t last_sent_id; //round robin point for incremental streams
+
+	//header block being assembled from CONTINUATION frames
+	uint8_t *block;
+	size_t block_len;
+	uint32_t block_stream;
+	int block_end_stream;
+
+	int settings_received; //no DATA before the client's preface is complete
+	int goaway; //the peer opens no more streams
+	int error; //GOAWAY queued, the connection closes
+	int eof;
+};
+
+//the request as an HTTP/1.1 style head for the handlers
+typedef struct request_builder {
+	char method[16];
+	size_t method_len;
+	char path[MAX_PATHNAME_SIZE + 1];
+	size_t path_len;
+	char authority[256];
+	size_t authority_len;
+	int has_scheme;
+
+	char fields[MAX_HEADER_SIZE];
+	size_t fields_len;
+	int regular_seen; //pseudo fields must come first
+
+	int malformed;
+	int too_large;
+	int urgency;
+	int incremental;
+} request_builder;
+
+static uint32_t get32(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+//append a frame header, returns where its payload of len bytes goes
+static uint8_t *queue_frame(h2_conn *c, uint8_t type, uint8_t flags, uint32_t stream, size_t len) {
+	size_t need = H2_FRAME_HEADER + len;
+	if (c->out_len + need > c->out_cap && c->out_start > 0) {
+		memmove(c->out, c->out + c->out_start, c->out_len - c->out_start);
+		c->out_len -= c->out_start;
+		c->out_start = 0;
+	}
+	if (c->out_len + need > c->out_cap) {
+		size_t cap = c->out_len + need > 2 * c->out_cap ? c->out_len + need : 2 * c->out_cap;
+		cap = cap < 2 * OUT_LOW_WATER ? 2 * OUT_LOW_WATER : cap; //after a trim
+		memory_charge(MEM_H2, cap - c->out_cap);
+		c->out_cap = cap;
+		c->out = realloc(c->out, c->out_cap);
+	}
+
+	uint8_t *p = c->out + c->out_len;
+	p[0] = len >> 16;
+	p[1] = len >> 8;
+	p[2] = len;
+	p[3] = type;
+	p[4] = flags;
+	put32(p + 5, stream);
+	c->out_len += need;
+	return p + H2_FRAME_HEADER;
+}
+
+static void queue_rst(h2_conn *c, uint32_t stream, uint32_t error) {
+	put32(queue_frame(c, F_RST_STREAM, 0, stream, 4), error);
+}
+
+static void queue_window_update(h2_conn *c, uint32_t stream, uint32_t increment) {
+	put32(queue_frame(c, F_WINDOW_UPDATE, 0, stream, 4), increment);
+}
+
+//GOAWAY, then the connection is closed once it is flushed
+static void conn_error(h2_conn *c, uint32_t error) {
+	LOG("h2 connection error %u on %d\n", error, c->fd);
+	uint8_t *p = queue_frame(c, F_GOAWAY, 0, 0, 8);
+	put32(p, c->last_stream_id);
+	put32(p + 4, error);
+	c->error = 1;
+}
+
+static h2_stream *find_stream(h2_conn *c, uint32_t id) {
+	for (h2_stream *s = c->streams; s != NULL; s = s->next) {
+		if (s->id == id) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+static h2_stream *new_stream(h2_conn *c, uint32_t id) {
+	h2_stream *s = calloc(1, sizeof(h2_stream));
+	s->id = id;
+	s->conn = c;
+	s->send_window = c->initial_window;
+	s->urgency = H2_DEFAULT_URGENCY;
+
+	//ids only grow, so appending keeps the list ordered
+	h2_stream **tail = &c->streams;
+	while (*tail != NULL) {
+		tail = &(*tail)->next;
+	}
+	*tail = s;
+	c->num_streams += 1;
+	return s;
+}
+
+static void close_stream(h2_conn *c, h2_stream *s) {
+	h2_stream **link = &c->streams;
+	while (*link != s) {
+		link = &(*link)->next;
+	}
+	*link = s->next;
+	c->num_streams -= 1;
+
+	if (s->data != NULL) {
+		c->cb->close(s->data);
+	}
+	if (s->head != NULL) {
+		memory_release(MEM_H2, MAX_HEADER_SIZE);
+	}
+	if (s->buf != NULL) {
+		memory_release(MEM_H2, H2_STREAM_BUFFER);
+	}
+	free(s->head);
+	free(s->buf);
+	free(s);
+}
+
+//RFC 9218 priority field value, "u=N" and "i" are all that matter here
+static void parse_priority(const char *value, size_t len, int *urgency, int *incremental) {
+	size_t pos = 0;
+	while (pos < len) {
+		while (pos < len && (value[pos] == ' ' || value[pos] == ',')) {
+			pos += 1;
+		}
+		size_t end = pos;
+		while (end < len && value[end] != ',') {
+			end += 1;
+		}
+
+		if (end - pos >= 3 && value[pos] == 'u' && value[pos + 1] == '='
+				&& value[pos + 2] >= '0' && value[pos + 2] <= '7') {
+			*urgency = value[pos + 2] - '0';
+		} else if (value[pos] == 'i' && (end - pos == 1 || value[pos + 1] == ' ' || value[pos + 1] == ';'
+				|| (end - pos >= 4 && strncmp(value + pos + 1, "=?1", 3) == 0))) {
+			*incremental = 1;
+		} else if (end - pos >= 4 && strncmp(value + pos, "i=?0", 4) == 0) {
+			*incremental = 0;
+		}
+		pos = end;
+	}
+}
+
+static int is_connection_field(const char *name, size_t len) {
+	static const char *fields[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade" };
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		if (len == strlen(fields[i]) && memcmp(name, fields[i], len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int pseudo_is(const char *name, size_t len, const char *pseudo) {
+	return len == strlen(pseudo) && memcmp(name, pseudo, len) == 0;
+}
+
+//copies a pseudo field value, a space would split the request line
+static void copy_pseudo(request_builder *b, char *dst, size_t cap, size_t *dst_len,
+		const char *value, size_t len) {
+	if (len == 0 || memchr(value, ' ', len) != NULL) {
+		b->malformed = 1;
+	} else if (len >= cap) {
+		b->too_large = 1;
+	} else {
+		memcpy(dst, value, len);
+		dst[len] = '\0';
+		*dst_len = len;
+	}
+}
+
+//always 0, every block is decoded to the end to keep the tables in step
+static int build_field(void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+	request_builder *b = arg;
+
+	//no field may smuggle in a line of its own
+	if (name_len == 0 || memchr(value, '\r', value_len) || memchr(value, '\n', value_len)
+			|| memchr(value, '\0', value_len)) {
+		b->malformed = 1;
+		return 0;
+	}
+	for (size_t i = name[0] == ':' ? 1 : 0; i < name_len; i++) {
+		if ((name[i] >= 'A' && name[i] <= 'Z') || name[i] <= ' ' || name[i] == ':' || name[i] >= 127) {
+			b->malformed = 1;
+			return 0;
+		}
+	}
+
+	if (name[0] == ':') {
+		if (b->regular_seen) {
+			b->malformed = 1;
+		} else if (pseudo_is(name, name_len, ":method")) {
+			copy_pseudo(b, b->method, sizeof(b->method), &b->method_len, value, value_len);
+		} else if (pseudo_is(name, name_len, ":path")) {
+			copy_pseudo(b, b->path, sizeof(b->path), &b->path_len, value, value_len);
+		} else if (pseudo_is(name, name_len, ":authority")) {
+			copy_pseudo(b, b->authority, sizeof(b->authority), &b->authority_len, value, value_len);
+		} else if (pseudo_is(name, name_len, ":scheme")) {
+			b->has_scheme = 1;
+		} else {
+			b->malformed = 1;
+		}
+		return 0;
+	}
+	b->regular_seen = 1;
+
+	if (is_connection_field(name, name_len)
+			|| (name_len == 2 && memcmp(name, "te", 2) == 0 && !(value_len == 8 && memcmp(value, "trailers", 8) == 0))) {
+		b->malformed = 1;
+		return 0;
+	}
+	if (name_len == 4 && memcmp(name, "host", 4) == 0 && b->authority_len > 0) {
+		return 0;
+	}
+	if (name_len == 8 && memcmp(name, "priority", 8) == 0) {
+		parse_priority(value, value_len, &b->urgency, &b->incremental);
+	}
+
+	//"Name: value\r\n", capitalized the way the handlers look fields up
+	if (b->fields_len + name_len + value_len + 4 >= sizeof(b->fields)) {
+		b->too_large = 1;
+		return 0;
+	}
+	char *p = b->fields + b->fields_len;
+	for (size_t i = 0; i < name_len; i++) {
+		p[i] = (i == 0 || name[i - 1] == '-') && name[i] >= 'a' && name[i] <= 'z' ? name[i] - 32 : name[i];
+	}
+	p += name_len;
+	p[0] = ':';
+	p[1] = ' ';
+	memcpy(p + 2, value, value_len);
+	p[2 + value_len] = '\r';
+	p[3 + value_len] = '\n';
+	b->fields_len += name_len + value_len + 4;
+	return 0;
+}
+
+//only there to keep the decoder in step
+static int ignore_field(void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+	return 0;
+}
+
+//a complete request header block, opens the stream
+static void process_block(h2_conn *c, uint32_t id, const uint8_t *block, size_t len, int end_stream) {
+
+	//trailers of an open request, or a stream that is already gone
+	if (id <= c->last_stream_id) {
+		if (hpack_decode(&c->decoder, block, len, ignore_field, NULL) == -1) {
+			conn_error(c, H2_COMPRESSION_ERROR);
+			return;
+		}
+		h2_stream *s = find_stream(c, id);
+		if (s != NULL && end_stream) {
+			s->remote_closed = 1;
+		}
+		return;
+	}
+	c->last_stream_id = id;
+
+	request_builder *b = malloc(sizeof(request_builder));
+	b->method_len = b->path_len = b->authority_len = b->fields_len = 0;
+	b->has_scheme = b->regular_seen = b->malformed = b->too_large = 0;
+	b->urgency = H2_DEFAULT_URGENCY;
+	b->incremental = 0;
+
+	if (hpack_decode(&c->decoder, block, len, build_field, b) == -1) {
+		free(b);
+		conn_error(c, H2_COMPRESSION_ERROR);
+		return;
+	}
+
+	if (c->num_streams >= H2_MAX_STREAMS) {
+		queue_rst(c, id, H2_REFUSED_STREAM);
+		free(b);
+		return;
+	} else if (b->malformed || b->method_len == 0 || b->path_len == 0 || !b->has_scheme) {
+		queue_rst(c, id, H2_PROTOCOL_ERROR);
+		free(b);
+		return;
+	}
+
+	char head[MAX_HEADER_SIZE];
+	int head_len = snprintf(head, sizeof(head), "%s %s HTTP/2\r\n", b->method, b->path);
+	if (b->authority_len > 0 && head_len >= 0 && (size_t)head_len < sizeof(head)) {
+		head_len += snprintf(head + head_len, sizeof(head) - head_len, "Host: %s\r\n", b->authority);
+	}
+	if (b->too_large || head_len < 0 || (size_t)head_len + b->fields_len + 3 > sizeof(head)) {
+		queue_rst(c, id, H2_REFUSED_STREAM);
+		free(b);
+		return;
+	}
+	memcpy(head + head_len, b->fields, b->fields_len);
+	head_len += b->fields_len;
+	memcpy(head + head_len, "\r\n", 3);
+	head_len += 2;
+
+	h2_stream *s = new_stream(c, id);
+	s->urgency = b->urgency;
+	s->incremental = b->incremental;
+	s->remote_closed = end_stream;
+	free(b);
+
+	LOG("h2 stream %u on %d: %.*s", id, c->fd, (int)strcspn(head, "\n") + 1, head);
+	s->data = c->cb->open(s, head, head_len, c->conn_data);
+	if (s->data == NULL) {
+		h2_stream_reset(s, H2_REFUSED_STREAM);
+	}
+}
+
+//returns 0 or an error code for the connection
+static uint32_t apply_settings(h2_conn *c, const uint8_t *p, size_t len) {
+	for (size_t i = 0; i + 6 <= len; i += 6) {
+		uint16_t id = p[i] << 8 | p[i + 1];
+		uint32_t value = get32(p + i + 2);
+
+		if (id == S_HEADER_TABLE_SIZE) {
+			hpack_encoder_limit(&c->encoder, value);
+		} else if (id == S_ENABLE_PUSH && value > 1) {
+			return H2_PROTOCOL_ERROR;
+		} else if (id == S_INITIAL_WINDOW_SIZE) {
+			if (value > MAX_WINDOW) {
+				return H2_FLOW_CONTROL_ERROR;
+			}
+			//applies to open streams too
+			int64_t delta = (int64_t)value - c->initial_window;
+			for (h2_stream *s = c->streams; s != NULL; s = s->next) {
+				s->send_window += delta;
+				if (s->send_window > MAX_WINDOW) {
+					return H2_FLOW_CONTROL_ERROR;
+				}
+			}
+			c->initial_window = value;
+		} else if (id == S_MAX_FRAME_SIZE) {
+			if (value < H2_MAX_FRAME_SIZE || value > 0xffffff) {
+				return H2_PROTOCOL_ERROR;
+			}
+			c->peer_max_frame = value;
+		}
+	}
+	return 0;
+}
+
+static void handle_frame(h2_conn *c, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+	h2_stream *s;
+
+	//nothing may come between a HEADERS frame and its CONTINUATION frames
+	if (c->block != NULL && type != F_CONTINUATION) {
+		conn_error(c, H2_PROTOCOL_ERROR);
+		return;
+	}
+
+	switch (type) {
+	case F_DATA:
+		if (id == 0 || id > c->last_stream_id) {
+			conn_error(c, H2_PROTOCOL_ERROR);
+			return;
+		}
+		//request bodies are not read, the window is handed straight back
+		s = find_stream(c, id);
+		if (len > 0) {
+			queue_window_update(c, 0, len);
+			if (s != NULL && !(flags & FLAG_END_STREAM)) {
+				queue_window_update(c, id, len);
+			}
+		}
+		if (s != NULL && (flags & FLAG_END_STREAM)) {
+			s->remote_closed = 1;
+		}
+		return;
+
+	case F_HEADERS: {
+		if (id == 0 || id % 2 == 0) {
+			conn_error(c, H2_PROTOCOL_ERROR);
+			return;
+		}
+		size_t pad = 0;
+		if (flags & FLAG_PADDED) {
+			if (len < 1 || p[0] >= len) {
+				conn_error(c, H2_PROTOCOL_ERROR);
+				return;
+			}
+			pad = p[0];
+			p += 1;
+			len -= 1 + pad;
+		}
+		if (flags & FLAG_PRIORITY) {
+			if (len < 5) {
+				conn_error(c, H2_FRAME_SIZE_ERROR);
+				return;
+			}
+			p += 5;
+			len -= 5;
+		}
+
+		if (flags & FLAG_END_HEADERS) {
+			process_block(c, id, p, len, flags & FLAG_END_STREAM);
+		} else {
+			c->block = malloc(len > 0 ? len : 1);
+			memcpy(c->block, p, len);
+			c->block_len = len;
+			c->block_stream = id;
+			c->block_end_stream = flags & FLAG_END_STREAM;
+		}
+		return;
+	}
+
+	case F_CONTINUATION:
+		if (c->block == NULL || id != c->block_stream) {
+			conn_error(c, H2_PROTOCOL_ERROR);
+			return;
+		} else if (c->block_len + len > MAX_HEADER_BLOCK) {
+			conn_error(c, H2_ENHANCE_YOUR_CALM);
+			return;
+		}
+		c->block = realloc(c->block, c->block_len + len + 1);
+		memcpy(c->block + c->block_len, p, len);
+		c->block_len += len;
+
+		if (flags & FLAG_END_HEADERS) {
+			uint8_t *block = c->block;
+			c->block = NULL;
+			process_block(c, c->block_stream, block, c->block_len, c->block_end_stream);
+			free(block);
+		}
+		return;
+
+	case F_PRIORITY:
+		//RFC 7540 priorities are replaced by the priority field
+		if (len != 5) {
+			conn_error(c, H2_FRAME_SIZE_ERROR);
+		}
+		return;
+
+	case F_RST_STREAM:
+		if (len != 4) {
+			conn_error(c, H2_FRAME_SIZE_ERROR);
+		} else if (id == 0 || id > c->last_stream_id) {
+			conn_error(c, H2_PROTOCOL_ERROR);
+		} else if ((s = find_stream(c, id)) != NULL) {
+			s->reset = 1;
+		}
+		return;
+
+	case F_SETTINGS:
+		if (id != 0) {
+			conn_error(c, H2_PROTOCOL_ERROR);
+		} else if (flags & FLAG_ACK) {
+			if (len != 0) {
+				conn_error(c, H2_FRAME_SIZE_ERROR);
+			}
+		} else if (len % 6 != 0) {
+			conn_error(c, H2_FRAME_SIZE_ERROR);
+		} else {
+			uint32_t error = apply_settings(c, p, len);
+			if (error != 0) {
+				conn_error(c, error);
+			} else {
+				queue_frame(c, F_SETTINGS, FLAG_ACK, 0, 0);
+				c->settings_received = 1;
+			}
+		}
+		return;
+
+	case F_PING:
+		if (len != 8) {
+			conn_error(c, H2_FRAME_SIZE_ERROR);
+		} else if (id != 0) {
+			conn_error(c, H2_PROTOCOL_ERROR);
+		} else if (!(flags & FLAG_ACK)) {
+			memcpy(queue_frame(c, F_PING, FLAG_ACK, 0, 8), p, 8);
+		}
+		return;
+
+	case F_GOAWAY:
+		c->goaway = 1;
+		return;
+
+	case F_WINDOW_UPDATE: {
+		if (len != 4) {
+			conn_error(c, H2_FRAME_SIZE_ERROR);
+			return;
+		}
+		uint32_t increment = get32(p) & MAX_WINDOW;
+		if (id == 0) {
+			c->send_window += increment;
+			if (increment == 0) {
+				conn_error(c, H2_PROTOCOL_ERROR);
+			} else if (c->send_window > MAX_WINDOW) {
+				conn_error(c, H2_FLOW_CONTROL_ERROR);
+			}
+		} else if ((s = find_stream(c, id)) != NULL && !s->reset) {
+			s->send_window += increment;
+			if (increment == 0) {
+				h2_stream_reset(s, H2_PROTOCOL_ERROR);
+			} else if (s->send_window > MAX_WINDOW) {
+				h2_stream_reset(s, H2_FLOW_CONTROL_ERROR);
+			}
+		}
+		return;
+	}
+
+	case F_PRIORITY_UPDATE: {
+		if (id != 0) {
+			conn_error(c, H2_PROTOCOL_ERROR);
+			return;
+		} else if (len < 4) {
+			conn_error(c, H2_FRAME_SIZE_ERROR);
+			return;
+		}
+		//a stream that is not open yet keeps the priority of its header field
+		if ((s = find_stream(c, get32(p) & MAX_WINDOW)) != NULL) {
+			s->urgency = H2_DEFAULT_URGENCY;
+			s->incremental = 0;
+			parse_priority((const char *)p + 4, len - 4, &s->urgency, &s->incremental);
+		}
+		return;
+	}
+
+	case F_PUSH_PROMISE:
+		//clients never push
+		conn_error(c, H2_PROTOCOL_ERROR);
+		return;
+
+	default:
+		//unknown frame types are ignored
+		return;
+	}
+}
+
+//returns 1 if anything was read
+static int read_frames(h2_conn *c) {
+	int progress = 0;
+
+	while (!c->error) {
+		ssize_t n = c->cb->recv != NULL
+				? c->cb->recv(c->conn_data, c->in + c->in_len, sizeof(c->in) - c->in_len)
+				: read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return progress;
+		} else if (n <= 0) {
+			c->eof = 1;
+			return progress;
+		}
+		progress = 1;
+		c->in_len += n;
+
+		size_t pos = 0;
+		if (c->preface_left > 0) {
+			size_t take = c->preface_left < c->in_len ? c->preface_left : c->in_len;
+			if (memcmp(c->in, H2_PREFACE + H2_PREFACE_LEN - c->preface_left, take) != 0) {
+				conn_error(c, H2_PROTOCOL_ERROR);
+				return progress;
+			}
+			c->preface_left -= take;
+			pos = take;
+		}
+
+		while (c->preface_left == 0 && !c->error && c->in_len - pos >= H2_FRAME_HEADER) {
+			uint8_t *f = c->in + pos;
+			size_t len = (size_t)f[0] << 16 | f[1] << 8 | f[2];
+			if (len > H2_MAX_FRAME_SIZE) {
+				conn_error(c, H2_FRAME_SIZE_ERROR);
+				return progress;
+			} else if (c->in_len - pos < H2_FRAME_HEADER + len) {
+				break;
+			}
+			handle_frame(c, f[3], f[4], get32(f + 5) & MAX_WINDOW, f + H2_FRAME_HEADER, len);
+			pos += H2_FRAME_HEADER + len;
+		}
+
+		memmove(c->in, c->in + pos, c->in_len - pos);
+		c->in_len -= pos;
+	}
+	return progress;
+}
+
+//the response head a handler wrote, as HEADERS and CONTINUATION frames
+//returns -1 if it is not a status line and fields
+static int send_headers(h2_stream *s) {
+	h2_conn *c = s->conn;
+	uint8_t block[2 * MAX_HEADER_SIZE];
+	size_t block_len = 0;
+	ssize_t used;
+
+	char *line = s->head;
+	char *end = s->head + s->head_len;
+	char *eol = memchr(line, '\n', end - line);
+	char *status = memchr(line, ' ', eol - line);
+	if (status == NULL || eol - status < 4) {
+		return -1;
+	}
+	if ((used = hpack_encode(&c->encoder, block, sizeof(block), ":status", 7, status + 1, 3)) == -1) {
+		return -1;
+	}
+	block_len += used;
+
+	for (line = eol + 1; line < end && *line != '\n' && *line != '\r'; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		char *colon = memchr(line, ':', eol - line);
+		if (colon == NULL || colon == line) {
+			continue;
+		}
+
+		char name[256];
+		size_t name_len = colon - line < (long)sizeof(name) ? (size_t)(colon - line) : sizeof(name) - 1;
+		for (size_t i = 0; i < name_len; i++) {
+			name[i] = line[i] >= 'A' && line[i] <= 'Z' ? line[i] + 32 : line[i];
+		}
+		if (is_connection_field(name, name_len)) {
+			continue;
+		}
+
+		char *value = colon + 1;
+		char *value_end = eol;
+		while (value < value_end && (*value == ' ' || *value == '\t')) {
+			value += 1;
+		}
+		while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ')) {
+			value_end -= 1;
+		}
+
+		if ((used = hpack_encode(&c->encoder, block + block_len, sizeof(block) - block_len,
+				name, name_len, value, value_end - value)) == -1) {
+			return -1;
+		}
+		block_len += used;
+	}
+
+	//split to the peer's frame size, nothing else may be queued in between
+	size_t sent = 0;
+	do {
+		size_t chunk = block_len - sent < c->peer_max_frame ? block_len - sent : c->peer_max_frame;
+		uint8_t flags = sent + chunk == block_len ? FLAG_END_HEADERS : 0;
+		memcpy(queue_frame(c, sent == 0 ? F_HEADERS : F_CONTINUATION, flags, s->id, chunk), block + sent, chunk);
+		sent += chunk;
+	} while (sent < block_len);
+	return 0;
+}
+
+ssize_t h2_stream_write(h2_stream *s, const char *buf, size_t len) {
+	if (s->reset) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	errno = 0;
+	size_t used = 0;
+	if (!s->head_done) {
+		if (s->head == NULL) {
+			s->head = malloc(MAX_HEADER_SIZE);
+			memory_charge(MEM_H2, MAX_HEADER_SIZE);
+		}
+		size_t from = s->head_len > 2 ? s->head_len - 2 : 0;
+		size_t take = MAX_HEADER_SIZE - s->head_len < len ? MAX_HEADER_SIZE - s->head_len : len;
+		memcpy(s->head + s->head_len, buf, take);
+		s->head_len += take;
+
+		//the head ends at a blank line, with or without CR
+		size_t head_end = 0;
+		for (size_t i = from; i + 1 < s->head_len && head_end == 0; i++) {
+			if (s->head[i] == '\n' && s->head[i + 1] == '\n') {
+				head_end = i + 2;
+			} else if (s->head[i] == '\n' && s->head[i + 1] == '\r' && i + 2 < s->head_len && s->head[i + 2] == '\n') {
+				head_end = i + 3;
+			}
+		}
+		if (head_end == 0 && s->head_len == MAX_HEADER_SIZE) {
+			h2_stream_reset(s, H2_INTERNAL_ERROR);
+			errno = EMSGSIZE;
+			return -1;
+		} else if (head_end == 0) {
+			return take;
+		}
+
+		used = take - (s->head_len - head_end);
+		s->head_len = head_end;
+		if (send_headers(s) == -1) {
+			h2_stream_reset(s, H2_INTERNAL_ERROR);
+			errno = EPROTO;
+			return -1;
+		}
+		s->head_done = 1;
+		free(s->head);
+		s->head = NULL;
+		s->buf = malloc(H2_STREAM_BUFFER);
+		memory_charge(MEM_H2, H2_STREAM_BUFFER - MAX_HEADER_SIZE);
+	}
+
+	if (s->start + s->len + (len - used) > H2_STREAM_BUFFER && s->start > 0) {
+		memmove(s->buf, s->buf + s->start, s->len);
+		s->start = 0;
+	}
+	size_t n = H2_STREAM_BUFFER - s->start - s->len;
+	n = n < len - used ? n : len - used;
+	memcpy(s->buf + s->start + s->len, buf + used, n);
+	s->len += n;
+
+	if (used + n < len) {
+		errno = EAGAIN;
+	}
+	return used + n;
+}
+
+size_t h2_stream_space(h2_stream *s) {
+	return s->reset ? 0 : H2_STREAM_BUFFER - s->len;
+}
+
+void h2_stream_reset(h2_stream *s, uint32_t error) {
+	if (!s->reset) {
+		s->reset = 1;
+		queue_rst(s->conn, s->id, error);
+	}
+}
+
+//let handlers fill their buffers, returns 1 if any of them moved
+static int run_streams(h2_conn *c) {
+	int progress = 0;
+	for (h2_stream *s = c->streams; s != NULL; s = s->next) {
+		if (s->finished || s->reset || h2_stream_space(s) == 0) {
+			continue;
+		}
+
+		size_t before = s->head_len + s->len;
+		int status = c->cb->run(s->data);
+		if (status == 1 && !s->head_done) {
+			h2_stream_reset(s, H2_INTERNAL_ERROR);
+		} else if (status == 1) {
+			s->finished = 1;
+		} else if (status > 1) {
+			h2_stream_reset(s, H2_INTERNAL_ERROR);
+		}
+		progress |= status != 0 || s->head_len + s->len != before;
+	}
+	return progress;
+}
+
+static int sendable(h2_conn *c, h2_stream *s) {
+	if (s->reset || s->ended || !s->head_done) {
+		return 0;
+	}
+	return (s->len > 0 && s->send_window > 0 && c->send_window > 0) || (s->finished && s->len == 0);
+}
+
+//lowest urgency first, then one response after another in stream order,
+//incremental responses share what is left frame by frame
+static h2_stream *next_stream(h2_conn *c) {
+	h2_stream *best = NULL;
+	for (h2_stream *s = c->streams; s != NULL; s = s->next) {
+		if (!sendable(c, s)) {
+			continue;
+		}
+		if (best == NULL || s->urgency < best->urgency) {
+			best = s;
+		} else if (s->urgency == best->urgency && best->incremental) {
+			if (!s->incremental) {
+				best = s;
+			} else if (best->id <= c->last_sent_id && s->id > c->last_sent_id) {
+				best = s;
+			}
+		}
+	}
+	return best;
+}
+
+//frame DATA while the socket is likely to take it, so priorities decide
+//the order bytes go out in and not the order handlers produced them
+static void schedule(h2_conn *c) {
+	h2_stream *s;
+
+	//after an upgrade, the client is not reading frames until it sent its own preface
+	if (!c->settings_received) {
+		return;
+	}
+	while (c->out_len - c->out_start < OUT_LOW_WATER && (s = next_stream(c)) != NULL) {
+		size_t n = s->len;
+		if ((int64_t)n > s->send_window) {
+			n = s->send_window;
+		}
+		if ((int64_t)n > c->send_window) {
+			n = c->send_window;
+		}
+		if (n > c->peer_max_frame) {
+			n = c->peer_max_frame;
+		}
+
+		int end = s->finished && n == s->len;
+		memcpy(queue_frame(c, F_DATA, end ? FLAG_END_STREAM : 0, s->id, n), s->buf + s->start, n);
+		s->start += n;
+		s->len -= n;
+		if (s->len == 0) {
+			s->start = 0;
+		}
+		s->send_window -= n;
+		c->send_window -= n;
+		c->last_sent_id = s->id;
+
+		if (end) {
+			s->ended = 1;
+			//the rest of a request body is not wanted
+			if (!s->remote_closed) {
+				queue_rst(c, s->id, H2_NO_ERROR);
+			}
+		}
+	}
+}
+
+//returns the bytes written, -1 if the client is gone
+static ssize_t flush(h2_conn *c) {
+	size_t total = 0;
+	while (c->out_start < c->out_len) {
+		ssize_t n = c->cb->send != NULL
+				? c->cb->send(c->conn_data, c->out + c->out_start, c->out_len - c->out_start)
+				: write(c->fd, c->out + c->out_start, c->out_len - c->out_start);
+		if (n > 0) {
+			c->out_start += n;
+			total += n;
+			metrics_add(M_BYTES_SENT, n);
+		} else if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else {
+			return -1;
+		}
+	}
+	if (c->out_start == c->out_len) {
+		c->out_start = 0;
+		c->out_len = 0;
+	}
+	return total;
+}
+
+h2_conn *h2_conn_new(int fd, const h2_callbacks *cb, void *conn_data, size_t preface_read) {
+	h2_conn *c = calloc(1, sizeof(h2_conn));
+	c->fd = fd;
+	c->cb = cb;
+	c->conn_data = conn_data;
+	c->preface_left = H2_PREFACE_LEN - preface_read;
+	c->out_cap = 2 * OUT_LOW_WATER;
+	c->out = malloc(c->out_cap);
+	memory_charge(MEM_H2, sizeof(h2_conn) + c->out_cap);
+	hpack_table_init(&c->decoder, HPACK_DEFAULT_TABLE_SIZE);
+	hpack_table_init(&c->encoder, HPACK_DEFAULT_TABLE_SIZE);
+	c->send_window = H2_DEFAULT_WINDOW;
+	c->initial_window = H2_DEFAULT_WINDOW;
+	c->peer_max_frame = H2_MAX_FRAME_SIZE;
+
+	//the server preface
+	uint8_t *p = queue_frame(c, F_SETTINGS, 0, 0, 12);
+	p[0] = 0;
+	p[1] = S_MAX_CONCURRENT_STREAMS;
+	put32(p + 2, H2_MAX_STREAMS);
+	p[6] = 0;
+	p[7] = S_NO_RFC7540_PRIORITIES;
+	put32(p + 8, 1);
+	return c;
+}
+
+int h2_conn_upgrade(h2_conn *c, const char *settings, size_t settings_len, const char *head, size_t len) {
+
+	//base64url without padding
+	uint8_t payload[256];
+	size_t payload_len = 0;
+	uint32_t bits = 0;
+	int nbits = 0;
+	for (size_t i = 0; i < settings_len && settings[i] != '='; i++) {
+		char ch = settings[i];
+		int v = ch >= 'A' && ch <= 'Z' ? ch - 'A' : ch >= 'a' && ch <= 'z' ? ch - 'a' + 26
+				: ch >= '0' && ch <= '9' ? ch - '0' + 52 : ch == '-' || ch == '+' ? 62
+				: ch == '_' || ch == '/' ? 63 : -1;
+		if (v == -1 || payload_len == sizeof(payload)) {
+			return -1;
+		}
+		bits = bits << 6 | v;
+		nbits += 6;
+		if (nbits >= 8) {
+			nbits -= 8;
+			payload[payload_len++] = bits >> nbits;
+		}
+	}
+	if (payload_len % 6 != 0 || apply_settings(c, payload, payload_len) != 0) {
+		return -1;
+	}
+
+	//the request that asked for the upgrade is stream 1, its body already came
+	c->last_stream_id = 1;
+	h2_stream *s = new_stream(c, 1);
+	s->remote_closed = 1;
+	s->data = c->cb->open(s, head, len, c->conn_data);
+	if (s->data == NULL) {
+		h2_stream_reset(s, H2_REFUSED_STREAM);
+	}
+	return 0;
+}
+
+int h2_conn_service(h2_conn *c) {
+	while (1) {
+		int progress = 0;
+		if (!c->eof) {
+			progress |= read_frames(c);
+		}
+		if (!c->error) {
+			progress |= run_streams(c);
+			schedule(c);
+		}
+
+		//finished and abandoned streams go back to their owner
+		h2_stream *s = c->streams;
+		while (s != NULL) {
+			h2_stream *next = s->next;
+			if (s->ended || s->reset) {
+				close_stream(c, s);
+			}
+			s = next;
+		}
+
+		ssize_t flushed = flush(c);
+		if (flushed == -1 || c->error) {
+			return 3;
+		}
+		progress |= flushed > 0;
+
+		if (c->eof) {
+			return c->num_streams == 0 ? 1 : 3;
+		} else if (c->goaway && c->num_streams == 0 && c->out_len == 0) {
+			return 1;
+		} else if (!progress) {
+			return 0;
+		}
+	}
+}
+
+int h2_conn_idle(h2_conn *c) {
+	return c->num_streams == 0 && c->out_len == c->out_start;
+}
+
+size_t h2_conn_trim(h2_conn *c) {
+	if (!h2_conn_idle(c) || c->out == NULL) {
+		return 0;
+	}
+	size_t freed = c->out_cap;
+	memory_release(MEM_H2, c->out_cap);
+	free(c->out);
+	c->out = NULL;
+	c->out_cap = 0;
+	c->out_start = c->out_len = 0;
+	return freed;
+}
+
+void h2_conn_free(h2_conn *c) {
+	if (c == NULL) {
+		return;
+	}
+	while (c->streams != NULL) {
+		close_stream(c, c->streams);
+	}
+	hpack_table_free(&c->decoder);
+	hpack_table_free(&c->encoder);
+	memory_release(MEM_H2, sizeof(h2_conn) + c->out_cap);
+	free(c->block);
+	free(c->out);
+	free(c);
+}
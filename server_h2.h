@@ -0,0 +1,104 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "server_hpack.h"
+
+//cleartext HTTP/2 (RFC 9113) on a client socket, by prior knowledge or
+//after an Upgrade: h2c request
+//every stream is an ordinary request: its handler writes an HTTP/1.1 style
+//head and body into the stream, which are sent as HEADERS and DATA frames
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME_SIZE 16384 //largest frame we accept, the protocol default
+#define H2_MAX_STREAMS 100 //concurrent streams a client may open
+#define H2_STREAM_BUFFER 65536 //response bytes queued per stream
+#define H2_DEFAULT_WINDOW 65535
+#define H2_DEFAULT_URGENCY 3 //RFC 9218
+
+//error codes
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_CANCEL 0x8
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+#define H2_HTTP_1_1_REQUIRED 0xd
+
+typedef struct h2_conn h2_conn;
+
+typedef struct h2_stream {
+	uint32_t id;
+	h2_conn *conn;
+	void *data; //from open, handed back to run and close
+
+	int64_t send_window;
+	int urgency; //0 is sent first
+	int incremental; //shares bandwidth with its urgency instead of waiting its turn
+
+	char *head; //response head until its blank line arrives
+	size_t head_len;
+	int head_done; //HEADERS queued
+
+	char *buf; //body waiting for DATA frames
+	size_t start;
+	size_t len;
+
+	int finished; //the handler is done writing
+	int ended; //END_STREAM sent
+	int remote_closed; //the request has no more frames coming
+	int reset; //RST_STREAM sent or received, nothing more is sent
+	struct h2_stream *next;
+} h2_stream;
+
+typedef struct h2_callbacks {
+	//a request arrived, head is "METHOD target HTTP/2\r\nHost: ...\r\n...\r\n\r\n"
+	//returns the request's state, NULL refuses the stream
+	void *(*open)(h2_stream *, const char *head, size_t len, void *conn_data);
+	//write more of the response, returns 0 when blocked, 1 when done, 3 on error
+	int (*run)(void *data);
+	//the stream is gone, data is not used again
+	void (*close)(void *data);
+	//socket I/O like read and write, NULL to use the fd directly
+	ssize_t (*recv)(void *conn_data, void *buf, size_t len);
+	ssize_t (*send)(void *conn_data, const void *buf, size_t len);
+} h2_callbacks;
+
+//preface_read is how much of the preface the HTTP/1.1 reader already took
+//the socket must be nonblocking
+h2_conn *h2_conn_new(int fd, const h2_callbacks *, void *conn_data, size_t preface_read);
+
+//continue an HTTP/1.1 request that asked for h2c after the 101 was sent:
+//settings is the HTTP2-Settings value, the request becomes stream 1
+//returns -1 if the settings are malformed
+int h2_conn_upgrade(h2_conn *, const char *settings, size_t settings_len, const char *head, size_t len);
+
+//read frames, run streams that have buffer space and send what the
+//peer's windows allow, in priority order
+//returns 0 to wait for the socket, 1 once the connection ended cleanly, 3 on error
+int h2_conn_service(h2_conn *);
+
+//closes every stream that is left
+void h2_conn_free(h2_conn *);
+
+//no streams open and nothing left to send, the connection is only being kept alive
+int h2_conn_idle(h2_conn *);
+
+//give an idle connection's output buffer back, it is allocated again by the next frame
+//returns the bytes freed
+size_t h2_conn_trim(h2_conn *);
+
+//queue response bytes, returns how many fit (errno EAGAIN if not all of them)
+//or -1 if the stream was reset or its head is malformed
+ssize_t h2_stream_write(h2_stream *, const char *buf, size_t len);
+
+//body bytes h2_stream_write would take now
+size_t h2_stream_space(h2_stream *);
+
+//abandon the response with RST_STREAM
+void h2_stream_reset(h2_stream *, uint32_t error);
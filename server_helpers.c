@@ -1,4 +1,21 @@
 #include "server_helpers.h"
+#include "server_metrics.h"
+#include <time.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <strings.h>
+
+long long monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long long monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
 ssize_t read_header(int socket, char *buffer, size_t count) {
 
@@ -47,9 +64,13 @@ ssize_t write_all_to_socket(int socket, char *buffer, size_t count) {
         ssize_t result = write(socket, buffer + progress, count - progress);
         if (result > 0) {
             progress += result;
+            metrics_add(M_BYTES_SENT, result);
         } else if (result == -1 && errno == EINTR) {
             errno = 0;
             continue;
+        } else if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            //nonblocking socket is full, errno tells the caller to resume later
+            return progress;
         } else if (result == -1) {
             perror("Write Error");
             return -1;
@@ -87,6 +108,7 @@ ssize_t write_all_to_socket_from_file(int socket, FILE *file, size_t count, size
             if (result > 0) {
                 progress += result;
                 buf_progress += result;
+                metrics_add(M_BYTES_SENT, result);
 		writes += 1;
 	    } else if ( result == -1 && errno == EINTR) {
                 errno = 0;
@@ -154,3 +176,80 @@ ssize_t read_all_from_socket_to_file(int socket, FILE *file, size_t count, size_
     }
     return progress;
 }
+
+int resolve_stream_address(const char *address, struct sockaddr_storage *addr, socklen_t *addr_len) {
+    memset(addr, 0, sizeof(*addr));
+
+    const char *path = strncmp(address, "unix:", 5) == 0 ? address + 5 : address[0] == '/' ? address : NULL;
+    if (path != NULL) {
+        struct sockaddr_un *un = (struct sockaddr_un *)addr;
+        if (strlen(path) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "Socket path %s is too long\n", path);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        *addr_len = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    size_t host_len = colon != NULL ? (size_t)(colon - address) : 0;
+    const char *start = address;
+    if (host_len >= 2 && start[0] == '[' && start[host_len - 1] == ']') {
+        start += 1;
+        host_len -= 2;
+    }
+    if (colon == NULL || host_len == 0 || host_len >= sizeof(host)) {
+        fprintf(stderr, "Address %s is not unix:/path or host:port\n", address);
+        return -1;
+    }
+    memcpy(host, start, host_len);
+    host[host_len] = '\0';
+
+    struct addrinfo hints = { 0 }, *res = NULL;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, colon + 1, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "Address %s: %s\n", address, gai_strerror(err));
+        return -1;
+    }
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+const char *header_field(const char *request_h, const char *name, size_t *len) {
+    size_t name_len = strlen(name);
+    for (const char *line = strchr(request_h, '\n'); line != NULL; line = strchr(line + 1, '\n')) {
+        if (strncasecmp(line + 1, name, name_len) == 0 && line[name_len + 1] == ':') {
+            const char *value = line + name_len + 2;
+            value += strspn(value, " \t");
+            *len = strcspn(value, "\r\n");
+            while (*len > 0 && (value[*len - 1] == ' ' || value[*len - 1] == '\t')) {
+                *len -= 1;
+            }
+            return value;
+        }
+    }
+    return NULL;
+}
+
+const char *mime_type_by_extension(const char *path) {
+    if (strstr(path, ".html") != NULL) {
+        return "text/html";
+    } else if (strstr(path, ".css") != NULL) {
+        return "text/css";
+    } else if (strstr(path, ".js") != NULL) {
+        return "text/javascript";
+    } else if (strstr(path, ".mp4") != NULL) {
+        return "video/mp4";
+    } else if (strstr(path, ".jpg") != NULL) {
+        return "image/jpeg";
+    } else if (strstr(path, ".png") != NULL) {
+        return "image/png";
+    }
+    return NULL;
+}
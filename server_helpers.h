@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <string.h>
+#include <sys/socket.h>
 
 #ifdef DEBUG
     #define LOG(args...) fprintf(stderr, args)
@@ -20,6 +21,9 @@
 
 typedef enum { GET, HEAD, POST, PUT, DELETE, CONNECT, OPTIONS, TRACE, V_UNKNOWN } verb;
 
+long long monotonic_ms();
+long long monotonic_us();
+
 ssize_t read_header(int socket, char *buffer, size_t max_length);
 
 ssize_t write_all_to_socket(int, char *, size_t);
@@ -29,3 +33,14 @@ ssize_t write_all_to_socket_from_file(int, FILE *, size_t, size_t);
 ssize_t read_all_from_socket(int, char *, size_t);
 
 ssize_t read_all_from_socket_to_file(int, FILE *, size_t, size_t);
+
+//value of a request header field to the end of its line, NULL if there is none
+const char *header_field(const char *request_h, const char *name, size_t *len);
+
+//MIME type for the common web file extensions, NULL to ask libmagic
+//shared with http_mkarchive so archived files get the same types
+const char *mime_type_by_extension(const char *path);
+
+//"unix:/path", "/path", "host:port" or "[v6]:port", resolved once
+//returns -1 with a message on stderr if it cannot be used
+int resolve_stream_address(const char *address, struct sockaddr_storage *addr, socklen_t *addr_len);
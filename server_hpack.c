@@ -0,0 +1,458 @@
+#include "server_hpack.h"
+#include "server_helpers.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct hpack_entry {
+	size_t name_len;
+	size_t value_len;
+	char data[]; //name then value
+};
+
+typedef struct static_field {
+	const char *name;
+	const char *value;
+} static_field;
+
+//RFC 7541 appendix A, index 1 first
+static const static_field STATIC_TABLE[] = {
+	{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+	{ ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+	{ ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+	{ ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" }, { "accept-language", "" }, { "accept-ranges", "" },
+	{ "accept", "" }, { "access-control-allow-origin", "" }, { "age", "" }, { "allow", "" },
+	{ "authorization", "" }, { "cache-control", "" }, { "content-disposition", "" },
+	{ "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+	{ "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+	{ "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" }, { "from", "" },
+	{ "host", "" }, { "if-match", "" }, { "if-modified-since", "" }, { "if-none-match", "" },
+	{ "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" }, { "link", "" },
+	{ "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+	{ "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+	{ "retry-after", "" }, { "server", "" }, { "set-cookie", "" },
+	{ "strict-transport-security", "" }, { "transfer-encoding", "" }, { "user-agent", "" },
+	{ "vary", "" }, { "via", "" }, { "www-authenticate", "" },
+};
+#define STATIC_ENTRIES (sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]))
+
+//fields that change with every response only waste table space
+static const char *VOLATILE_FIELDS[] = { "date", "content-length", "content-range", "last-modified",
+		"etag", "location", "age", "expires" };
+//and these must never be stored by an intermediary either
+static const char *SENSITIVE_FIELDS[] = { "set-cookie", "authorization", "cookie" };
+
+//code lengths of the canonical Huffman code in RFC 7541 appendix B, EOS last
+static const uint8_t HUFFMAN_LENGTHS[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_LENGTH 30
+
+//codes of one length are consecutive, so a code is found from its length
+static uint16_t huffman_symbols[257]; //ordered by code
+static uint32_t huffman_first[HUFFMAN_MAX_LENGTH + 1]; //first code of each length
+static uint16_t huffman_offset[HUFFMAN_MAX_LENGTH + 1]; //its place in huffman_symbols
+static uint16_t huffman_count[HUFFMAN_MAX_LENGTH + 1];
+static int huffman_ready = 0;
+
+static void huffman_init() {
+	for (int sym = 0; sym < 257; sym++) {
+		huffman_count[HUFFMAN_LENGTHS[sym]] += 1;
+	}
+
+	uint32_t code = 0;
+	uint16_t index = 0;
+	for (int len = 1; len <= HUFFMAN_MAX_LENGTH; len++) {
+		huffman_first[len] = code;
+		huffman_offset[len] = index;
+		for (int sym = 0; sym < 257; sym++) {
+			if (HUFFMAN_LENGTHS[sym] == len) {
+				huffman_symbols[index++] = sym;
+			}
+		}
+		code = (code + huffman_count[len]) << 1;
+	}
+	huffman_ready = 1;
+}
+
+//returns the decoded length, -1 on EOS, bad padding or an unknown code
+static ssize_t huffman_decode(const uint8_t *in, size_t len, char *out) {
+	if (!huffman_ready) {
+		huffman_init();
+	}
+
+	size_t out_len = 0;
+	uint32_t code = 0;
+	int bits = 0;
+	for (size_t i = 0; i < len; i++) {
+		for (int bit = 7; bit >= 0; bit--) {
+			code = (code << 1) | ((in[i] >> bit) & 1);
+			bits += 1;
+
+			if (code - huffman_first[bits] < huffman_count[bits]) {
+				uint16_t sym = huffman_symbols[huffman_offset[bits] + code - huffman_first[bits]];
+				if (sym == HUFFMAN_EOS) {
+					return -1;
+				}
+				out[out_len++] = (char)sym;
+				code = 0;
+				bits = 0;
+			} else if (bits == HUFFMAN_MAX_LENGTH) {
+				return -1;
+			}
+		}
+	}
+
+	//padding is the most significant bits of EOS, all ones, shorter than a byte
+	if (bits > 7 || code != (1u << bits) - 1) {
+		return -1;
+	}
+	return out_len;
+}
+
+void hpack_table_init(hpack_table *table, size_t limit) {
+	memset(table, 0, sizeof(*table));
+	table->capacity = limit / HPACK_ENTRY_OVERHEAD + 1;
+	table->entries = calloc(table->capacity, sizeof(hpack_entry *));
+	table->max_size = limit;
+	table->limit = limit;
+}
+
+void hpack_table_free(hpack_table *table) {
+	for (size_t i = 0; i < table->count; i++) {
+		free(table->entries[(table->head + i) % table->capacity]);
+	}
+	free(table->entries);
+	table->entries = NULL;
+	table->count = 0;
+}
+
+static size_t entry_size(const hpack_entry *e) {
+	return e->name_len + e->value_len + HPACK_ENTRY_OVERHEAD;
+}
+
+//0 is the newest entry
+static hpack_entry *table_get(hpack_table *table, size_t i) {
+	return table->entries[(table->head + i) % table->capacity];
+}
+
+static void evict_to(hpack_table *table, size_t size) {
+	while (table->count > 0 && table->size > size) {
+		hpack_entry *oldest = table_get(table, table->count - 1);
+		table->size -= entry_size(oldest);
+		free(oldest);
+		table->count -= 1;
+	}
+}
+
+static void table_insert(hpack_table *table, const char *name, size_t name_len,
+		const char *value, size_t value_len) {
+
+	//copied first, name may point into an entry that is about to be evicted
+	hpack_entry *e = malloc(sizeof(hpack_entry) + name_len + value_len);
+	e->name_len = name_len;
+	e->value_len = value_len;
+	memcpy(e->data, name, name_len);
+	memcpy(e->data + name_len, value, value_len);
+
+	size_t size = entry_size(e);
+	if (size > table->max_size) {
+		evict_to(table, 0);
+		free(e);
+		return;
+	}
+	evict_to(table, table->max_size - size);
+
+	table->head = (table->head + table->capacity - 1) % table->capacity;
+	table->entries[table->head] = e;
+	table->count += 1;
+	table->size += size;
+}
+
+//name and value of a 1-based index into the static then dynamic table
+static int lookup(hpack_table *table, uint64_t index, const char **name, size_t *name_len,
+		const char **value, size_t *value_len) {
+	if (index == 0) {
+		return -1;
+	} else if (index <= STATIC_ENTRIES) {
+		*name = STATIC_TABLE[index - 1].name;
+		*name_len = strlen(*name);
+		*value = STATIC_TABLE[index - 1].value;
+		*value_len = strlen(*value);
+		return 0;
+	} else if (index - STATIC_ENTRIES - 1 < table->count) {
+		hpack_entry *e = table_get(table, index - STATIC_ENTRIES - 1);
+		*name = e->data;
+		*name_len = e->name_len;
+		*value = e->data + e->name_len;
+		*value_len = e->value_len;
+		return 0;
+	}
+	return -1;
+}
+
+//prefixed integer (RFC 7541 5.1), returns the bytes used or -1
+static ssize_t decode_int(const uint8_t *in, size_t len, int prefix_bits, uint64_t *value) {
+	if (len == 0) {
+		return -1;
+	}
+
+	uint64_t max = (1u << prefix_bits) - 1;
+	*value = in[0] & max;
+	if (*value < max) {
+		return 1;
+	}
+
+	for (size_t i = 1, shift = 0; i < len && shift <= 56; i++, shift += 7) {
+		*value += (uint64_t)(in[i] & 0x7f) << shift;
+		if ((in[i] & 0x80) == 0) {
+			return i + 1;
+		}
+	}
+	return -1;
+}
+
+//string literal (RFC 7541 5.2) into a fresh buffer, returns the bytes used or -1
+static ssize_t decode_string(const uint8_t *in, size_t len, char **out, size_t *out_len) {
+	uint64_t str_len;
+	ssize_t used = decode_int(in, len, 7, &str_len);
+	if (used == -1 || str_len > len - used) {
+		return -1;
+	}
+
+	if (in[0] & 0x80) {
+		//the shortest code is 5 bits
+		*out = malloc(str_len * 8 / 5 + 1);
+		ssize_t decoded = huffman_decode(in + used, str_len, *out);
+		if (decoded == -1) {
+			free(*out);
+			return -1;
+		}
+		*out_len = decoded;
+	} else {
+		*out = malloc(str_len + 1);
+		memcpy(*out, in + used, str_len);
+		*out_len = str_len;
+	}
+	return used + str_len;
+}
+
+int hpack_decode(hpack_table *table, const uint8_t *block, size_t len, hpack_field_cb field, void *arg) {
+	size_t pos = 0;
+	int fields = 0;
+
+	while (pos < len) {
+		uint8_t first = block[pos];
+		uint64_t index;
+		ssize_t used;
+
+		//indexed field
+		if (first & 0x80) {
+			const char *name, *value;
+			size_t name_len, value_len;
+			if ((used = decode_int(block + pos, len - pos, 7, &index)) == -1
+					|| lookup(table, index, &name, &name_len, &value, &value_len) == -1
+					|| field(arg, name, name_len, value, value_len) != 0) {
+				return -1;
+			}
+			pos += used;
+			fields += 1;
+			continue;
+		}
+
+		//size updates only come before the first field
+		if ((first & 0xe0) == 0x20) {
+			if (fields > 0 || (used = decode_int(block + pos, len - pos, 5, &index)) == -1
+					|| index > table->limit) {
+				return -1;
+			}
+			table->max_size = index;
+			evict_to(table, index);
+			pos += used;
+			continue;
+		}
+
+		//literal, with incremental indexing (01), without (0000) or never indexed (0001)
+		int indexing = (first & 0xc0) == 0x40;
+		if ((used = decode_int(block + pos, len - pos, indexing ? 6 : 4, &index)) == -1) {
+			return -1;
+		}
+		pos += used;
+
+		const char *name, *value;
+		size_t name_len, value_len;
+		char *new_name = NULL, *new_value = NULL;
+		if (index == 0) {
+			if ((used = decode_string(block + pos, len - pos, &new_name, &name_len)) == -1) {
+				return -1;
+			}
+			name = new_name;
+			pos += used;
+		} else if (lookup(table, index, &name, &name_len, &value, &value_len) == -1) {
+			return -1;
+		}
+
+		if ((used = decode_string(block + pos, len - pos, &new_value, &value_len)) == -1) {
+			free(new_name);
+			return -1;
+		}
+		value = new_value;
+		pos += used;
+
+		int result = field(arg, name, name_len, value, value_len);
+		if (result == 0 && indexing) {
+			table_insert(table, name, name_len, value, value_len);
+		}
+		free(new_name);
+		free(new_value);
+		if (result != 0) {
+			return -1;
+		}
+		fields += 1;
+	}
+	return 0;
+}
+
+void hpack_encoder_limit(hpack_table *table, size_t peer_size) {
+	size_t size = peer_size < table->limit ? peer_size : table->limit;
+	if (size != table->max_size) {
+		table->max_size = size;
+		evict_to(table, size);
+		table->update_pending = 1;
+	}
+}
+
+static ssize_t encode_int(uint8_t *out, size_t cap, uint8_t flags, int prefix_bits, uint64_t value) {
+	uint64_t max = (1u << prefix_bits) - 1;
+	if (cap == 0) {
+		return -1;
+	}
+	if (value < max) {
+		out[0] = flags | value;
+		return 1;
+	}
+
+	out[0] = flags | max;
+	value -= max;
+	size_t pos = 1;
+	while (pos < cap) {
+		out[pos++] = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+		if (value < 0x80) {
+			return pos;
+		}
+		value >>= 7;
+	}
+	return -1;
+}
+
+//raw literal, the Huffman code rarely pays for itself on response fields
+static ssize_t encode_string(uint8_t *out, size_t cap, const char *str, size_t len) {
+	ssize_t used = encode_int(out, cap, 0, 7, len);
+	if (used == -1 || len > cap - used) {
+		return -1;
+	}
+	memcpy(out + used, str, len);
+	return used + len;
+}
+
+static int in_list(const char **list, size_t count, const char *name, size_t name_len) {
+	for (size_t i = 0; i < count; i++) {
+		if (strlen(list[i]) == name_len && memcmp(list[i], name, name_len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+ssize_t hpack_encode(hpack_table *table, uint8_t *out, size_t cap, const char *name, size_t name_len,
+		const char *value, size_t value_len) {
+	size_t pos = 0;
+	ssize_t used;
+
+	if (table->update_pending) {
+		if ((used = encode_int(out, cap, 0x20, 5, table->max_size)) == -1) {
+			return -1;
+		}
+		pos += used;
+		table->update_pending = 0;
+	}
+
+	//exact matches become a single index, fixed response fields end up
+	//here from their second use on the connection
+	uint64_t name_index = 0;
+	for (size_t i = 0; i < STATIC_ENTRIES; i++) {
+		const static_field *f = &STATIC_TABLE[i];
+		if (strlen(f->name) != name_len || memcmp(f->name, name, name_len) != 0) {
+			continue;
+		}
+		if (strlen(f->value) == value_len && memcmp(f->value, value, value_len) == 0) {
+			used = encode_int(out + pos, cap - pos, 0x80, 7, i + 1);
+			return used == -1 ? -1 : (ssize_t)pos + used;
+		}
+		if (name_index == 0) {
+			name_index = i + 1;
+		}
+	}
+	for (size_t i = 0; i < table->count; i++) {
+		hpack_entry *e = table_get(table, i);
+		if (e->name_len != name_len || memcmp(e->data, name, name_len) != 0) {
+			continue;
+		}
+		if (e->value_len == value_len && memcmp(e->data + name_len, value, value_len) == 0) {
+			used = encode_int(out + pos, cap - pos, 0x80, 7, STATIC_ENTRIES + 1 + i);
+			return used == -1 ? -1 : (ssize_t)pos + used;
+		}
+		if (name_index == 0) {
+			name_index = STATIC_ENTRIES + 1 + i;
+		}
+	}
+
+	int sensitive = in_list(SENSITIVE_FIELDS, sizeof(SENSITIVE_FIELDS) / sizeof(SENSITIVE_FIELDS[0]),
+			name, name_len);
+	int indexing = !sensitive && name_len + value_len + HPACK_ENTRY_OVERHEAD <= table->max_size / 2
+			&& !in_list(VOLATILE_FIELDS, sizeof(VOLATILE_FIELDS) / sizeof(VOLATILE_FIELDS[0]),
+			name, name_len);
+
+	if (indexing) {
+		used = encode_int(out + pos, cap - pos, 0x40, 6, name_index);
+	} else {
+		used = encode_int(out + pos, cap - pos, sensitive ? 0x10 : 0x00, 4, name_index);
+	}
+	if (used == -1) {
+		return -1;
+	}
+	pos += used;
+
+	if (name_index == 0) {
+		if ((used = encode_string(out + pos, cap - pos, name, name_len)) == -1) {
+			return -1;
+		}
+		pos += used;
+	}
+	if ((used = encode_string(out + pos, cap - pos, value, value_len)) == -1) {
+		return -1;
+	}
+	pos += used;
+
+	if (indexing) {
+		table_insert(table, name, name_len, value, value_len);
+	}
+	return pos;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+//HPACK (RFC 7541) header compression for HTTP/2 connections
+//every connection has one table per direction, both sides must see the
+//header blocks in the order they were encoded
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32 //counted against the table size per entry
+
+typedef struct hpack_entry hpack_entry;
+
+typedef struct hpack_table {
+	hpack_entry **entries; //ring, newest at head
+	size_t capacity;
+	size_t head;
+	size_t count;
+	size_t size; //names, values and overhead of the entries
+	size_t max_size; //current limit
+	size_t limit; //largest max_size a size update may ask for
+	int update_pending; //encoder: a smaller limit must be announced in the next block
+} hpack_table;
+
+typedef int (*hpack_field_cb)(void *arg, const char *name, size_t name_len,
+		const char *value, size_t value_len);
+
+void hpack_table_init(hpack_table *, size_t limit);
+void hpack_table_free(hpack_table *);
+
+//decode a complete header block, calling field for every field in order
+//returns 0, -1 on a compression error or if field returned nonzero
+int hpack_decode(hpack_table *, const uint8_t *block, size_t len, hpack_field_cb field, void *arg);
+
+//the peer's SETTINGS_HEADER_TABLE_SIZE, the encoder never uses more than its own limit
+void hpack_encoder_limit(hpack_table *, size_t peer_size);
+
+//append one field to a header block, names must be lowercase
+//the table is used for fields likely to repeat on the connection
+//returns the bytes written, -1 if cap is too small
+ssize_t hpack_encode(hpack_table *, uint8_t *out, size_t cap, const char *name, size_t name_len,
+		const char *value, size_t value_len);
@@ -0,0 +1,126 @@
+#include "server_listen.h"
+#include "server_helpers.h"
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+void listener_options(int fd, const listener_spec *spec) {
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr *)&addr, &len) == -1 || addr.ss_family == AF_UNIX) {
+		return;
+	}
+
+	//a failing option costs its optimization, not the listener
+	if (spec->defer_accept > 0 && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+			&spec->defer_accept, sizeof(spec->defer_accept)) == -1) {
+		perror("TCP_DEFER_ACCEPT");
+	}
+	if (spec->fastopen > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+			&spec->fastopen, sizeof(spec->fastopen)) == -1) {
+		perror("TCP_FASTOPEN");
+	}
+	if (spec->nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &spec->nodelay, sizeof(spec->nodelay)) == -1) {
+		perror("TCP_NODELAY");
+	}
+	if (spec->sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &spec->sndbuf, sizeof(spec->sndbuf)) == -1) {
+		perror("SO_SNDBUF");
+	}
+	if (spec->rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &spec->rcvbuf, sizeof(spec->rcvbuf)) == -1) {
+		perror("SO_RCVBUF");
+	}
+}
+
+int listener_open(const listener_spec *spec) {
+	struct sockaddr_storage addr;
+	socklen_t len;
+	if (resolve_stream_address(spec->address, &addr, &len) == -1) {
+		return -1;
+	}
+
+	int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	int on = 1;
+	if (addr.ss_family == AF_UNIX) {
+		//a socket file left by a previous run, anything else is not ours to remove
+		struct stat st;
+		const char *path = ((struct sockaddr_un *)&addr)->sun_path;
+		if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+			unlink(path);
+		}
+	} else if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
+		perror("SO_REUSEADDR");
+	}
+	//"[::]:port" and "0.0.0.0:port" can then be listed side by side
+	if (addr.ss_family == AF_INET6) {
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+	}
+
+	//options set before listen() are in place for the first connection
+	listener_options(fd, spec);
+
+	if (bind(fd, (struct sockaddr *)&addr, len) == -1) {
+		fprintf(stderr, "Bind %s: %s\n", spec->address, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (listen(fd, spec->backlog) == -1) {
+		fprintf(stderr, "Listen %s: %s\n", spec->address, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	LOG("Listening on file descriptor %d, %s%s\n", fd, spec->address, spec->tls ? " (TLS)" : "");
+	return fd;
+}
+
+int listener_matches(int fd, const listener_spec *spec) {
+	struct sockaddr_storage want, have;
+	socklen_t want_len, have_len = sizeof(have);
+	if (resolve_stream_address(spec->address, &want, &want_len) == -1
+			|| getsockname(fd, (struct sockaddr *)&have, &have_len) == -1
+			|| want.ss_family != have.ss_family) {
+		return 0;
+	}
+
+	switch (want.ss_family) {
+	case AF_INET: {
+		struct sockaddr_in *a = (struct sockaddr_in *)&want, *b = (struct sockaddr_in *)&have;
+		return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+	}
+	case AF_INET6: {
+		struct sockaddr_in6 *a = (struct sockaddr_in6 *)&want, *b = (struct sockaddr_in6 *)&have;
+		return a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+	}
+	case AF_UNIX:
+		return strcmp(((struct sockaddr_un *)&want)->sun_path, ((struct sockaddr_un *)&have)->sun_path) == 0;
+	}
+	return 0;
+}
+
+int listener_specs_equal(const listener_spec *a, int count_a, const listener_spec *b, int count_b) {
+	if (count_a != count_b) {
+		return 0;
+	}
+	for (int i = 0; i < count_a; i++) {
+		if (strcmp(a[i].address, b[i].address) != 0 || a[i].tls != b[i].tls || a[i].backlog != b[i].backlog
+				|| a[i].defer_accept != b[i].defer_accept || a[i].fastopen != b[i].fastopen
+				|| a[i].nodelay != b[i].nodelay || a[i].sndbuf != b[i].sndbuf || a[i].rcvbuf != b[i].rcvbuf) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void listener_specs_free(listener_spec *specs, int count) {
+	for (int i = 0; specs != NULL && i < count; i++) {
+		free(specs[i].address);
+	}
+	free(specs);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+
+//listening sockets
+//addresses are "host:port" with a numeric or resolvable host, "[v6]:port"
+//or "unix:/path". every listener is nonblocking and in the event loop's
+//epoll set, so accepts happen when connections arrive rather than once a pass
+
+#define DEFAULT_BACKLOG 511
+#define MAX_LISTENERS 16
+
+//one entry of listen in server.conf, or the listener port and tls_port stand for
+typedef struct listener_spec {
+	char *address;
+	int tls;
+	int backlog;
+	int defer_accept; //seconds to wait for a connection's first bytes before accepting it, 0 off
+	int fastopen; //TCP Fast Open requests queued before the handshake finishes, 0 off
+	int nodelay;
+	int sndbuf; //0 leaves the kernel's default
+	int rcvbuf;
+} listener_spec;
+
+//bind and listen on spec's address with its options, -1 on failure
+int listener_open(const listener_spec *);
+
+//apply spec's options to an open listener, one handed down by an upgrade included
+//accepted sockets inherit them
+void listener_options(int fd, const listener_spec *);
+
+//the listening socket fd is bound to spec's address
+int listener_matches(int fd, const listener_spec *);
+
+//both lists bind the same addresses with the same options
+int listener_specs_equal(const listener_spec *, int, const listener_spec *, int);
+
+void listener_specs_free(listener_spec *, int count);
@@ -0,0 +1,269 @@
+#include "server_memory.h"
+#include "server_helpers.h"
+#include "server_metrics.h"
+#include <stdlib.h>
+#include <malloc.h>
+#include <limits.h>
+
+const char *memory_class_names[MEM_CLASSES] = {
+	[MEM_FILE_CACHE] = "file_cache",
+	[MEM_WARMUP] = "warmup",
+	[MEM_H2] = "http2",
+	[MEM_CONNECTIONS] = "connections",
+	[MEM_UPSTREAM] = "upstream",
+};
+
+typedef struct reclaimer {
+	memory_class class;
+	memory_reclaimer reclaim;
+	void *arg;
+} reclaimer;
+
+static size_t used[MEM_CLASSES];
+static size_t budget = 0; //memory_budget_mb, 0 for none
+static size_t cgroup_budget = 0; //share of memory.max, 0 without a limit
+
+//the cgroup's memory.stat and the line counting its anonymous memory
+static char cgroup_stat[PATH_MAX];
+static const char *anon_key = NULL;
+static size_t cgroup_anon = 0; //last sample, less what was reclaimed since
+static long long last_check_ms = 0;
+static long long last_reclaim_ms = 0;
+
+static reclaimer *reclaimers = NULL;
+static size_t num_reclaimers = 0;
+
+static int exhausted = 0;
+static size_t published_total = 0;
+static size_t published_limit = 0;
+
+#define ADD(field, amount) __atomic_fetch_add(&(field), (amount), __ATOMIC_RELAXED)
+#define SUB(field, amount) __atomic_fetch_sub(&(field), (amount), __ATOMIC_RELAXED)
+#define READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static int read_size(const char *path, size_t *value) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+	unsigned long long v;
+	int ok = fscanf(f, "%llu", &v) == 1;
+	fclose(f);
+	if (!ok) {
+		return -1; //"max", no limit
+	}
+	*value = v;
+	return 0;
+}
+
+static size_t read_anon() {
+	FILE *f = fopen(cgroup_stat, "r");
+	if (f == NULL) {
+		return 0;
+	}
+	char key[64];
+	unsigned long long v;
+	size_t anon = 0;
+	while (fscanf(f, "%63s %llu", key, &v) == 2) {
+		if (strcmp(key, anon_key) == 0) {
+			anon = v;
+			break;
+		}
+	}
+	fclose(f);
+	return anon;
+}
+
+//the cgroup v2 directory of this process, or its v1 memory controller's
+//inside a container the namespace root is mounted in place of the path /proc shows
+static size_t find_cgroup_limit() {
+	char unified[PATH_MAX] = "";
+	char controller[PATH_MAX] = "";
+	char line[PATH_MAX];
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		char *path = strchr(line, ':') != NULL ? strchr(strchr(line, ':') + 1, ':') : NULL;
+		if (path == NULL) {
+			continue;
+		}
+		if (strncmp(line, "0::", 3) == 0) {
+			snprintf(unified, sizeof(unified), "%s", path + 1);
+		} else if (strstr(line, ":memory:") != NULL) {
+			snprintf(controller, sizeof(controller), "%s", path + 1);
+		}
+	}
+	if (f != NULL) {
+		fclose(f);
+	}
+
+	const struct {
+		const char *dir;
+		const char *own;
+		const char *max;
+		const char *anon;
+	} layouts[] = {
+		{ "/sys/fs/cgroup", unified, "memory.max", "anon" },
+		{ "/sys/fs/cgroup/memory", controller, "memory.limit_in_bytes", "total_rss" },
+	};
+	for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+		const char *subdirs[] = { layouts[i].own, "" };
+		for (int j = 0; j < 2; j++) {
+			char path[PATH_MAX];
+			size_t limit = 0;
+			snprintf(cgroup_stat, sizeof(cgroup_stat), "%s%s/memory.stat", layouts[i].dir, subdirs[j]);
+			snprintf(path, sizeof(path), "%s%s/%s", layouts[i].dir, subdirs[j], layouts[i].max);
+			if (access(cgroup_stat, R_OK) != 0 || access(path, R_OK) != 0) {
+				continue;
+			}
+			anon_key = layouts[i].anon;
+			//v1 spells no limit as the largest page aligned count
+			if (read_size(path, &limit) == -1 || limit >= (1ull << 60)) {
+				LOG("No memory limit in %s\n", path);
+				return 0;
+			}
+			LOG("Memory limit of %zu bytes in %s\n", limit, path);
+			return limit;
+		}
+	}
+	fprintf(stderr, "memory_cgroup is set but no memory cgroup was found\n");
+	return 0;
+}
+
+static size_t excess() {
+	size_t total = memory_total();
+	size_t over = budget > 0 && total > budget ? total - budget : 0;
+	if (cgroup_budget > 0 && cgroup_anon > cgroup_budget && cgroup_anon - cgroup_budget > over) {
+		over = cgroup_anon - cgroup_budget;
+	}
+	return over;
+}
+
+static void set_exhausted(int on) {
+	if (on == exhausted) {
+		return;
+	}
+	exhausted = on;
+	metrics_add(M_MEMORY_EXHAUSTED, on ? 1 : -1);
+	fprintf(stderr, "%s: %zu bytes charged, limit %zu\n",
+			on ? "Memory budget exhausted, refusing clients" : "Memory back under budget",
+			memory_total(), memory_limit());
+}
+
+void memory_configure(int budget_mb, int cgroup) {
+	budget = (size_t)budget_mb << 20;
+	cgroup_budget = 0;
+	anon_key = NULL;
+	if (cgroup) {
+		size_t max = find_cgroup_limit();
+		cgroup_budget = max / 100 * MEMORY_CGROUP_SHARE;
+		if (anon_key != NULL) {
+			cgroup_anon = read_anon();
+		}
+	}
+
+	metrics_add(M_MEMORY_LIMIT, (int64_t)memory_limit() - (int64_t)published_limit);
+	published_limit = memory_limit();
+	if (memory_limit() == 0) {
+		set_exhausted(0);
+	}
+	LOG("Memory budget: %zu bytes configured, %zu from the cgroup\n", budget, cgroup_budget);
+}
+
+void memory_charge(memory_class class, size_t bytes) {
+	ADD(used[class], bytes);
+}
+
+void memory_release(memory_class class, size_t bytes) {
+	SUB(used[class], bytes);
+}
+
+size_t memory_used(memory_class class) {
+	return READ(used[class]);
+}
+
+size_t memory_total() {
+	size_t total = 0;
+	for (int i = 0; i < MEM_CLASSES; i++) {
+		total += READ(used[i]);
+	}
+	return total;
+}
+
+size_t memory_limit() {
+	if (budget > 0 && cgroup_budget > 0) {
+		return budget < cgroup_budget ? budget : cgroup_budget;
+	}
+	return budget > 0 ? budget : cgroup_budget;
+}
+
+void memory_reclaimer_add(memory_class class, memory_reclaimer reclaim, void *arg) {
+	reclaimers = realloc(reclaimers, (num_reclaimers + 1) * sizeof(reclaimer));
+	reclaimers[num_reclaimers++] = (reclaimer){ class, reclaim, arg };
+}
+
+void memory_reclaimer_remove(memory_reclaimer reclaim, void *arg) {
+	for (size_t i = 0; i < num_reclaimers; i++) {
+		if (reclaimers[i].reclaim == reclaim && reclaimers[i].arg == arg) {
+			reclaimers[i] = reclaimers[--num_reclaimers];
+			return;
+		}
+	}
+}
+
+void memory_pass(long long now_ms) {
+	if (anon_key != NULL && now_ms - last_check_ms >= MEMORY_CHECK_MS) {
+		last_check_ms = now_ms;
+		cgroup_anon = read_anon();
+	}
+
+	size_t total = memory_total();
+	metrics_add(M_MEMORY_BYTES, (int64_t)total - (int64_t)published_total);
+	published_total = total;
+
+	size_t over = excess();
+	if (over == 0) {
+		set_exhausted(0);
+		return;
+	}
+	if (now_ms - last_reclaim_ms < MEMORY_RECLAIM_MS) {
+		return;
+	}
+	last_reclaim_ms = now_ms;
+
+	//leave some room, or every pass would reclaim a little
+	size_t want = over + memory_limit() / 100 * (100 - MEMORY_RECLAIM_TARGET);
+	size_t freed = 0;
+	for (int class = 0; class < MEM_CLASSES && freed < want; class++) {
+		for (size_t i = 0; i < num_reclaimers && freed < want; i++) {
+			if (reclaimers[i].class != (memory_class)class) {
+				continue;
+			}
+			size_t n = reclaimers[i].reclaim(reclaimers[i].arg, want - freed);
+			freed += n;
+			//mapped files are page cache, not anonymous memory
+			if (class != MEM_FILE_CACHE) {
+				cgroup_anon -= n < cgroup_anon ? n : cgroup_anon;
+			}
+		}
+	}
+
+	//hand freed heap back so the cgroup sees it too
+	malloc_trim(0);
+	metrics_add(M_MEMORY_RECLAIMED, freed);
+	LOG("Reclaimed %zu of %zu bytes wanted, %zu charged\n", freed, want, memory_total());
+	set_exhausted(excess() > 0);
+}
+
+void memory_render(char **buf, size_t *length, size_t *capacity) {
+	metrics_appendf(buf, length, capacity, "# HELP http_memory_class_bytes Bytes charged by each class\n"
+			"# TYPE http_memory_class_bytes gauge\n");
+	for (int i = 0; i < MEM_CLASSES; i++) {
+		metrics_appendf(buf, length, capacity, "http_memory_class_bytes{class=\"%s\"} %zu\n",
+				memory_class_names[i], memory_used(i));
+	}
+}
+
+int memory_exhausted() {
+	return exhausted;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <stddef.h>
+
+//memory governor
+//every class of long lived allocation charges its bytes here, so the server
+//knows what it holds against one budget. the budget is memory_budget_mb, or
+//a share of the cgroup's memory.max when memory_cgroup is on (the smaller of
+//the two when both are set). with the cgroup, its count of anonymous memory is
+//sampled as well, which also sees what no class charges (OpenSSL, libmagic,
+//malloc's own slack).
+//past the budget the event loop asks the classes' reclaimers to give memory
+//back, caches first, down to MEMORY_RECLAIM_TARGET percent of it; while still
+//over, the accept path turns new clients away
+
+//charged classes, reclaimed in this order
+typedef enum {
+	MEM_FILE_CACHE, //mapped files kept between requests, by mapped size
+	MEM_WARMUP, //the warm-up index
+	MEM_H2, //HTTP/2 output and stream buffers
+	MEM_CONNECTIONS, //request state and header buffers
+	MEM_UPSTREAM, //FastCGI and proxy response buffers
+	MEM_CLASSES
+} memory_class;
+
+#define MEMORY_CGROUP_SHARE 80 //percent of memory.max the server budgets for
+#define MEMORY_RECLAIM_TARGET 75 //percent of the budget reclaiming stops at
+#define MEMORY_CHECK_MS 1000 //how often the cgroup's usage is read
+#define MEMORY_RECLAIM_MS 100 //reclaimers walk whole tables, at most this often
+
+extern const char *memory_class_names[MEM_CLASSES];
+
+//frees up to want bytes of its class, returns how many it freed
+typedef size_t (*memory_reclaimer)(void *arg, size_t want);
+
+//budget_mb of 0 and cgroup off leave memory unbounded, charges are still counted
+void memory_configure(int budget_mb, int cgroup);
+
+//safe from the warm-up workers, everything else is the event loop's
+void memory_charge(memory_class, size_t bytes);
+void memory_release(memory_class, size_t bytes);
+
+size_t memory_used(memory_class);
+size_t memory_total();
+size_t memory_limit(); //0 when unbounded
+
+//arg's reclaimer is asked for memory of its class, until it is removed again
+void memory_reclaimer_add(memory_class, memory_reclaimer, void *arg);
+void memory_reclaimer_remove(memory_reclaimer, void *arg);
+
+//once per loop pass, reclaims when over the budget
+void memory_pass(long long now_ms);
+
+//append the bytes charged by each class to a buffer from metrics_render
+void memory_render(char **buf, size_t *length, size_t *capacity);
+
+//still over the budget after reclaiming, new clients are refused
+int memory_exhausted();
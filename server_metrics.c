@@ -0,0 +1,249 @@
+#include "server_metrics.h"
+#include "server_helpers.h"
+#include <stdlib.h>
+#include <stdarg.h>
+
+static worker_metrics workers[METRICS_MAX_WORKERS];
+static __thread worker_metrics *mine = &workers[0];
+
+static const char *verb_names[METRICS_VERBS] = {
+	"GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE", "UNKNOWN"
+};
+
+const char *metrics_stage_names[METRICS_STAGES] = {
+	"header_read", "resolve", "status_write", "body_write"
+};
+
+//gauges can go down, everything else only counts up
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+} counter_info[M_COUNTERS] = {
+	[M_ACCEPTS] = { "http_accepted_connections_total", "counter", "Connections accepted" },
+	[M_REJECTED] = { "http_rejected_connections_total", "counter", "Connections refused from the accept path" },
+	[M_ACTIVE_CONNECTIONS] = { "http_active_connections", "gauge", "Connections currently open" },
+	[M_BYTES_SENT] = { "http_sent_bytes_total", "counter", "Bytes written to clients" },
+	[M_CACHE_HITS] = { "http_file_cache_hits_total", "counter", "Mapped file cache hits" },
+	[M_CACHE_MISSES] = { "http_file_cache_misses_total", "counter", "Mapped file cache misses" },
+	[M_EAGAIN_RESUMES] = { "http_eagain_resumes_total", "counter", "Requests parked on EAGAIN to resume later" },
+	[M_TLS_HANDSHAKES] = { "http_tls_handshakes_total", "counter", "TLS handshakes completed" },
+	[M_TLS_RESUMED] = { "http_tls_resumed_total", "counter", "TLS handshakes that resumed a session" },
+	[M_TLS_KERNEL] = { "http_tls_kernel_total", "counter", "TLS connections encrypting in the kernel" },
+	[M_ARCHIVE_HITS] = { "http_archive_hits_total", "counter", "Files served from a site archive" },
+	[M_WARMUP_HITS] = { "http_warmup_hits_total", "counter", "MIME types found in the warm-up index" },
+	[M_OVERLOADED] = { "http_overloaded", "gauge", "1 while the server is shedding load" },
+	[M_SHED] = { "http_shed_total", "counter", "Connections and requests answered 503 because of overload" },
+	[M_IDLE_CLOSED] = { "http_idle_closed_total", "counter", "Idle connections closed while shedding load" },
+	[M_LOOP_LAG_US] = { "http_loop_lag_microseconds", "gauge", "Smoothed time one event loop pass takes" },
+	[M_QUEUE_DELAY_US] = { "http_queue_delay_microseconds", "gauge", "Smoothed time requests wait in their socket before being read" },
+	[M_MEMORY_BYTES] = { "http_memory_bytes", "gauge", "Bytes charged to the memory governor" },
+	[M_MEMORY_LIMIT] = { "http_memory_limit_bytes", "gauge", "Memory budget, 0 when unbounded" },
+	[M_MEMORY_EXHAUSTED] = { "http_memory_exhausted", "gauge", "1 while over the memory budget after reclaiming" },
+	[M_MEMORY_RECLAIMED] = { "http_memory_reclaimed_bytes_total", "counter", "Bytes reclaimed under memory pressure" },
+	[M_MEMORY_REFUSED] = { "http_memory_refused_total", "counter", "Connections refused while over the memory budget" },
+	[M_BUSY_POLLING] = { "http_busy_polling", "gauge", "1 while the event loop spins on epoll_wait" },
+	[M_EVENT_BATCH] = { "http_event_batch", "gauge", "Events taken per epoll_wait in busy poll mode" },
+	[M_ZEROCOPY_BYTES] = { "http_zerocopy_bytes_total", "counter", "Body bytes sent with MSG_ZEROCOPY" },
+	[M_ZEROCOPY_COPIED] = { "http_zerocopy_copied_total", "counter", "Zerocopy sends the kernel copied anyway" },
+	[M_ZEROCOPY_PINNED] = { "http_zerocopy_pinned", "gauge", "Zerocopy sends whose buffers the kernel still holds" },
+};
+
+#define BUMP(field, amount) __atomic_fetch_add(&(field), (amount), __ATOMIC_RELAXED)
+#define READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+void metrics_set_worker(int worker) {
+	assert(worker >= 0 && worker < METRICS_MAX_WORKERS);
+	mine = &workers[worker];
+}
+
+void metrics_add(metric m, int64_t amount) {
+	BUMP(mine->counters[m], (uint64_t)amount);
+}
+
+void metrics_request(int verb) {
+	if (verb >= 0 && verb < METRICS_VERBS) {
+		BUMP(mine->requests[verb], 1);
+	}
+}
+
+void metrics_response(int status, uint64_t latency_us) {
+	if (status >= 0 && status < METRICS_MAX_STATUS) {
+		BUMP(mine->responses[status], 1);
+	}
+	hist_record(&mine->latency, latency_us);
+}
+
+void metrics_stage(int stage, uint64_t us) {
+	if (stage >= 0 && stage < METRICS_STAGES) {
+		hist_record(&mine->stages[stage], us);
+	}
+}
+
+static int hist_index(uint64_t us) {
+	if (us < HIST_SUB) {
+		return (int)us;
+	}
+	int shift = 63 - __builtin_clzll(us) - HIST_SUB_BITS;
+	int index = (shift + 1) * HIST_SUB + (int)((us >> shift) & (HIST_SUB - 1));
+	return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+uint64_t hist_bucket_upper(int index) {
+	if (index < HIST_SUB) {
+		return index + 1;
+	}
+	int shift = index / HIST_SUB - 1;
+	return (uint64_t)(HIST_SUB + index % HIST_SUB + 1) << shift;
+}
+
+void hist_record(latency_hist *hist, uint64_t us) {
+	hist_record_n(hist, us, 1);
+}
+
+void hist_record_n(latency_hist *hist, uint64_t us, uint64_t count) {
+	BUMP(hist->counts[hist_index(us)], count);
+	BUMP(hist->total, count);
+	BUMP(hist->sum_us, us * count);
+}
+
+uint64_t hist_quantile(const latency_hist *hist, double quantile) {
+	uint64_t rank = (uint64_t)(quantile * hist->total);
+	if (rank > 0 && rank >= hist->total) {
+		rank = hist->total - 1;
+	}
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen > rank) {
+			return hist_bucket_upper(i);
+		}
+	}
+	return 0;
+}
+
+static void hist_merge(latency_hist *into, const latency_hist *from) {
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		into->counts[i] += READ(from->counts[i]);
+	}
+	into->total += READ(from->total);
+	into->sum_us += READ(from->sum_us);
+}
+
+void metrics_appendf(char **buf, size_t *length, size_t *capacity, const char *format, ...) {
+	va_list args;
+	while (1) {
+		va_start(args, format);
+		int written = vsnprintf(*buf + *length, *capacity - *length, format, args);
+		va_end(args);
+
+		if (written < 0) {
+			return;
+		}
+		if ((size_t)written < *capacity - *length) {
+			*length += written;
+			return;
+		}
+		*capacity *= 2;
+		*buf = realloc(*buf, *capacity);
+	}
+}
+
+void metrics_render_hist(char **buf, size_t *length, size_t *capacity,
+		const char *name, const char *labels, const latency_hist *hist) {
+
+	const char *sep = labels[0] ? "," : "";
+
+	//export at power of two bounds, which are exact bucket edges
+	uint64_t cumulative = 0;
+	int index = 0;
+	for (uint64_t le = 1; le <= (1ull << 25); le <<= 1) {
+		while (index < HIST_BUCKETS && hist_bucket_upper(index) <= le) {
+			cumulative += hist->counts[index];
+			index += 1;
+		}
+		metrics_appendf(buf, length, capacity, "%s_bucket{%s%sle=\"%g\"} %llu\n",
+				name, labels, sep, le / 1e6, (unsigned long long)cumulative);
+	}
+	metrics_appendf(buf, length, capacity, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+			name, labels, sep, (unsigned long long)hist->total);
+	const char *open = labels[0] ? "{" : "";
+	const char *close = labels[0] ? "}" : "";
+	metrics_appendf(buf, length, capacity, "%s_sum%s%s%s %g\n",
+			name, open, labels, close, hist->sum_us / 1e6);
+	metrics_appendf(buf, length, capacity, "%s_count%s%s%s %llu\n",
+			name, open, labels, close, (unsigned long long)hist->total);
+}
+
+char *metrics_render(size_t *length) {
+
+	static worker_metrics total;
+	memset(&total, 0, sizeof(total));
+
+	for (int w = 0; w < METRICS_MAX_WORKERS; w++) {
+		for (int i = 0; i < M_COUNTERS; i++) {
+			total.counters[i] += READ(workers[w].counters[i]);
+		}
+		for (int i = 0; i < METRICS_VERBS; i++) {
+			total.requests[i] += READ(workers[w].requests[i]);
+		}
+		for (int i = 0; i < METRICS_MAX_STATUS; i++) {
+			total.responses[i] += READ(workers[w].responses[i]);
+		}
+		hist_merge(&total.latency, &workers[w].latency);
+		for (int i = 0; i < METRICS_STAGES; i++) {
+			hist_merge(&total.stages[i], &workers[w].stages[i]);
+		}
+	}
+
+	size_t capacity = 8192;
+	char *buf = malloc(capacity);
+	*length = 0;
+
+	for (int i = 0; i < M_COUNTERS; i++) {
+		metrics_appendf(&buf, length, &capacity, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n",
+				counter_info[i].name, counter_info[i].help,
+				counter_info[i].name, counter_info[i].type,
+				counter_info[i].name, (long long)total.counters[i]);
+	}
+
+	metrics_appendf(&buf, length, &capacity, "# HELP http_requests_total Requests by verb\n"
+			"# TYPE http_requests_total counter\n");
+	for (int i = 0; i < METRICS_VERBS; i++) {
+		metrics_appendf(&buf, length, &capacity, "http_requests_total{verb=\"%s\"} %llu\n",
+				verb_names[i], (unsigned long long)total.requests[i]);
+	}
+
+	metrics_appendf(&buf, length, &capacity, "# HELP http_responses_total Responses by status\n"
+			"# TYPE http_responses_total counter\n");
+	for (int i = 0; i < METRICS_MAX_STATUS; i++) {
+		if (total.responses[i] > 0) {
+			metrics_appendf(&buf, length, &capacity, "http_responses_total{status=\"%d\"} %llu\n",
+					i, (unsigned long long)total.responses[i]);
+		}
+	}
+
+	metrics_appendf(&buf, length, &capacity, "# HELP http_request_duration_seconds Accept to last byte\n"
+			"# TYPE http_request_duration_seconds histogram\n");
+	metrics_render_hist(&buf, length, &capacity, "http_request_duration_seconds", "", &total.latency);
+
+	metrics_appendf(&buf, length, &capacity, "# HELP http_request_stage_seconds Time spent in each request stage\n"
+			"# TYPE http_request_stage_seconds histogram\n");
+	for (int i = 0; i < METRICS_STAGES; i++) {
+		char labels[32];
+		snprintf(labels, sizeof(labels), "stage=\"%s\"", metrics_stage_names[i]);
+		metrics_render_hist(&buf, length, &capacity, "http_request_stage_seconds", labels, &total.stages[i]);
+	}
+
+	metrics_appendf(&buf, length, &capacity, "# HELP http_request_duration_quantile_seconds "
+			"Quantiles from the full resolution histogram\n"
+			"# TYPE http_request_duration_quantile_seconds gauge\n");
+	const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+		metrics_appendf(&buf, length, &capacity,
+				"http_request_duration_quantile_seconds{quantile=\"%g\"} %g\n",
+				quantiles[i], hist_quantile(&total.latency, quantiles[i]) / 1e6);
+	}
+
+	return buf;
+}
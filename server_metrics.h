@@ -0,0 +1,83 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_MAX_WORKERS 8
+#define METRICS_MAX_STATUS 600
+#define METRICS_VERBS 9 //matches the verb enum, V_UNKNOWN last
+#define METRICS_STAGES 4 //matches TRACE_STAGES
+
+//HDR-style log-linear histogram of microseconds
+//each power of two is split into HIST_SUB buckets, ~12% relative error
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (38 * HIST_SUB) //up to 2^40us
+
+typedef struct latency_hist {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t sum_us;
+} latency_hist;
+
+typedef enum {
+	M_ACCEPTS,
+	M_REJECTED,
+	M_ACTIVE_CONNECTIONS, //gauge, owned by the accepting worker
+	M_BYTES_SENT,
+	M_CACHE_HITS,
+	M_CACHE_MISSES,
+	M_EAGAIN_RESUMES,
+	M_TLS_HANDSHAKES,
+	M_TLS_RESUMED,
+	M_TLS_KERNEL, //handshakes that handed their keys to kTLS
+	M_ARCHIVE_HITS,
+	M_WARMUP_HITS, //MIME types the warm-up index answered instead of libmagic
+	M_OVERLOADED, //gauge, 1 while shedding load
+	M_SHED, //503s answered because of overload
+	M_IDLE_CLOSED, //idle connections closed while shedding
+	M_LOOP_LAG_US, //gauges, smoothed
+	M_QUEUE_DELAY_US,
+	M_MEMORY_BYTES, //gauges, charged to the memory governor and its budget
+	M_MEMORY_LIMIT,
+	M_MEMORY_EXHAUSTED, //gauge, 1 while over the budget after reclaiming
+	M_MEMORY_RECLAIMED, //bytes given back under pressure
+	M_MEMORY_REFUSED, //connections refused while over the budget
+	M_BUSY_POLLING, //gauge, 1 while the loop spins
+	M_EVENT_BATCH, //gauge, events asked for per wait in busy poll mode
+	M_ZEROCOPY_BYTES, //body bytes sent with MSG_ZEROCOPY
+	M_ZEROCOPY_COPIED, //zerocopy sends the kernel copied after all
+	M_ZEROCOPY_PINNED, //gauge, sends whose buffers wait for the kernel
+	M_COUNTERS
+} metric;
+
+//one per worker, written only by its owner and read with relaxed loads
+typedef struct worker_metrics {
+	uint64_t counters[M_COUNTERS];
+	uint64_t requests[METRICS_VERBS];
+	uint64_t responses[METRICS_MAX_STATUS];
+	latency_hist latency;
+	latency_hist stages[METRICS_STAGES];
+} __attribute__((aligned(64))) worker_metrics;
+
+//select the worker_metrics slot the calling thread writes to
+void metrics_set_worker(int worker);
+
+void metrics_add(metric, int64_t amount);
+void metrics_request(int verb);
+void metrics_response(int status, uint64_t latency_us);
+void metrics_stage(int stage, uint64_t us);
+extern const char *metrics_stage_names[METRICS_STAGES];
+
+void hist_record(latency_hist *, uint64_t us);
+void hist_record_n(latency_hist *, uint64_t us, uint64_t count);
+uint64_t hist_quantile(const latency_hist *, double quantile);
+uint64_t hist_bucket_upper(int index); //exclusive, in microseconds
+
+//aggregate every worker into Prometheus text format
+//returns a malloc'd buffer, length in *length
+char *metrics_render(size_t *length);
+
+//append a histogram in Prometheus text format to a buffer from metrics_render
+void metrics_render_hist(char **buf, size_t *length, size_t *capacity,
+		const char *name, const char *labels, const latency_hist *);
+void metrics_appendf(char **buf, size_t *length, size_t *capacity, const char *format, ...);
@@ -0,0 +1,130 @@
+#include "server_overload.h"
+#include "server_helpers.h"
+#include "server_metrics.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static long long lag_threshold_us = 0;
+static long long queue_threshold_us = 0;
+static int idle_ms = DEFAULT_OVERLOAD_IDLE_MS;
+static int retry_after = DEFAULT_OVERLOAD_RETRY_AFTER;
+
+static long long lag_us = 0; //smoothed
+static long long queue_us = 0;
+static int queue_sampled = 0; //a connection was sampled since the last pass
+static long long published_lag_us = 0; //gauge values last handed to the metrics
+static long long published_queue_us = 0;
+
+static int shedding = 0;
+static long long calm_since_ms = 0; //both signals low since, 0 while they are not
+static int shed_left = OVERLOAD_SHED_BUDGET;
+
+static char response[128];
+static size_t response_len = 0;
+
+static long long ewma(long long average, long long sample) {
+	return average + (sample - average) / (1 << OVERLOAD_EWMA_SHIFT);
+}
+
+static void set_shedding(int on) {
+	if (on == shedding) {
+		return;
+	}
+	shedding = on;
+	calm_since_ms = 0;
+	metrics_add(M_OVERLOADED, on ? 1 : -1);
+	fprintf(stderr, "%s: loop lag %lldus, queueing delay %lldus\n",
+			on ? "Overloaded, shedding load" : "Recovered from overload", lag_us, queue_us);
+}
+
+void overload_configure(int lag_ms, int queue_ms, int idle, int retry) {
+	lag_threshold_us = (long long)lag_ms * 1000;
+	queue_threshold_us = (long long)queue_ms * 1000;
+	idle_ms = idle;
+	retry_after = retry;
+
+	response_len = snprintf(response, sizeof(response), "HTTP/1.1 503 Service Unavailable\n"
+			"Connection: close\n"
+			"Retry-After: %d\n"
+			"Content-Length: 0\n\n", retry_after);
+
+	if (lag_threshold_us == 0 && queue_threshold_us == 0) {
+		set_shedding(0);
+	}
+	LOG("Overload thresholds: loop lag %dms, queueing delay %dms\n", lag_ms, queue_ms);
+}
+
+void overload_pass(long long work_us, long long now_ms) {
+	shed_left = OVERLOAD_SHED_BUDGET;
+	if (lag_threshold_us == 0 && queue_threshold_us == 0) {
+		return;
+	}
+
+	lag_us = ewma(lag_us, work_us);
+	//nobody gets through to be sampled while shedding, so the signal fades instead
+	if (shedding && !queue_sampled) {
+		queue_us = ewma(queue_us, 0);
+	}
+	queue_sampled = 0;
+
+	int over = (lag_threshold_us > 0 && lag_us >= lag_threshold_us)
+			|| (queue_threshold_us > 0 && queue_us >= queue_threshold_us);
+	int calm = (lag_threshold_us == 0 || lag_us < lag_threshold_us / 2)
+			&& (queue_threshold_us == 0 || queue_us < queue_threshold_us / 2);
+
+	if (!shedding && over) {
+		set_shedding(1);
+	} else if (shedding && calm) {
+		if (calm_since_ms == 0) {
+			calm_since_ms = now_ms;
+		} else if (now_ms - calm_since_ms >= OVERLOAD_RECOVER_MS) {
+			set_shedding(0);
+		}
+	} else {
+		calm_since_ms = 0;
+	}
+
+	metrics_add(M_LOOP_LAG_US, lag_us - published_lag_us);
+	metrics_add(M_QUEUE_DELAY_US, queue_us - published_queue_us);
+	published_lag_us = lag_us;
+	published_queue_us = queue_us;
+}
+
+void overload_first_service(int fd) {
+	if (queue_threshold_us == 0) {
+		return;
+	}
+
+	//time since the kernel last queued data for the socket, the request has waited that long
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+		return;
+	}
+	queue_us = ewma(queue_us, (long long)info.tcpi_last_data_recv * 1000);
+	queue_sampled = 1;
+}
+
+int overload_shedding() {
+	return shedding;
+}
+
+int overload_shed() {
+	if (shed_left > 0) {
+		shed_left -= 1;
+	}
+	return shed_left > 0;
+}
+
+int overload_idle_ms() {
+	return shedding ? idle_ms : 0;
+}
+
+const char *overload_response(size_t *length) {
+	*length = response_len;
+	return response;
+}
+
+int overload_retry_after() {
+	return retry_after;
+}
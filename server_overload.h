@@ -0,0 +1,42 @@
+#pragma once
+#include <stddef.h>
+
+//overload control for the event loop
+//two signals are smoothed: loop lag (how long one pass over a batch of events
+//kept the loop from polling again) and queueing delay (how long a connection's
+//first bytes sat in its socket before the server read them, from TCP_INFO).
+//once either passes its threshold the server sheds: the accept path answers
+//with a pre-rendered 503 instead of taking clients on, requests read after that
+//get a 503 too, new HTTP/2 streams are refused and idle connections are closed
+//after overload_idle_ms. it recovers once both signals have stayed below half
+//their thresholds for OVERLOAD_RECOVER_MS
+
+#define OVERLOAD_EWMA_SHIFT 3 //every sample moves the average by 1/8
+#define OVERLOAD_RECOVER_MS 2000
+#define OVERLOAD_SHED_BUDGET 64 //connections refused per pass, the rest wait in the backlog
+#define OVERLOAD_SWEEP_MS 100 //how often idle connections are looked for while shedding
+#define DEFAULT_OVERLOAD_IDLE_MS 2000
+#define DEFAULT_OVERLOAD_RETRY_AFTER 1
+
+//thresholds of 0 ignore that signal, both 0 turn shedding off
+void overload_configure(int lag_ms, int queue_ms, int idle_ms, int retry_after);
+
+//one pass of the loop spent work_us handling its events
+void overload_pass(long long work_us, long long now_ms);
+
+//socket fd is being serviced for the first time, samples how long its data waited
+void overload_first_service(int fd);
+
+int overload_shedding();
+
+//count a connection refused from the accept path, false once this pass's budget is spent
+int overload_shed();
+
+//idle time after which connections are closed, 0 when not shedding
+int overload_idle_ms();
+
+//pre-rendered 503 for the accept path
+const char *overload_response(size_t *length);
+
+//seconds clients are asked to wait in 503 responses
+int overload_retry_after();
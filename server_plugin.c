@@ -0,0 +1,534 @@
+#include "server_plugin.h"
+#include "server_router.h"
+#include "server_memory.h"
+#include "server_metrics.h"
+#include "server_chunked.h"
+#include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <strings.h>
+#include <dlfcn.h>
+
+enum { BODY_NONE, BODY_LENGTH, BODY_CHUNKED };
+
+typedef struct handler {
+	char *prefix; //"" for every path
+	size_t prefix_len;
+	unsigned verbs; //0 for any
+	ews_handler fn;
+	void *arg;
+	const char *module; //path of the module that registered it
+} handler;
+
+typedef struct timer {
+	int ms;
+	long long next_ms;
+	ews_callback fn;
+	void *arg;
+} timer;
+
+struct ews_request {
+	int fd;
+	int handler; //index of the handler it is offered to
+	int result; //EWS_DONE or EWS_ERROR once settled, EWS_AGAIN before
+	const char *request_h;
+	const char *ip;
+	verb method;
+	char method_name[16];
+	char *path;
+	char *query;
+
+	void *data;
+	ews_callback free_data;
+
+	//request body, BODY_NONE once there is nothing left to read
+	int body_mode;
+	int body_error; //status it was refused with
+	unsigned long long body_remaining; //of a Content-Length body
+	chunk_decoder decoder;
+	char *request_body;
+	size_t request_body_len;
+	size_t request_body_cap;
+
+	int status;
+	int streaming; //flushed, the header is on its way
+	char *headers;
+	size_t headers_len;
+	char *body;
+	size_t body_sent; //from the front, by the server
+	size_t body_len;
+	size_t body_cap;
+
+	long long wake_ms; //0 while not waiting
+	struct ews_request *prev_waiting;
+	struct ews_request *next_waiting;
+};
+
+static handler handlers[MAX_PLUGIN_HANDLERS];
+static int num_handlers = 0;
+static timer timers[MAX_PLUGIN_TIMERS];
+static int num_timers = 0;
+static plugin_call *waiting = NULL;
+
+static void (*wake_client)(int fd) = NULL;
+static char **status_text = NULL;
+static int num_status_text = 0;
+static const char *loading = NULL; //module whose init is running, registration is only open then
+
+void plugin_init(void (*wake)(int fd), char **text, int num_status) {
+	wake_client = wake;
+	status_text = text;
+	num_status_text = num_status;
+}
+
+static int api_handle(const char *prefix, unsigned verbs, ews_handler fn, void *arg) {
+	if (loading == NULL || fn == NULL || num_handlers == MAX_PLUGIN_HANDLERS) {
+		fprintf(stderr, "Plugin %s: handler not registered\n", loading != NULL ? loading : "?");
+		return -1;
+	}
+	handler *h = &handlers[num_handlers++];
+	h->prefix = strdup(prefix != NULL ? prefix : "");
+	h->prefix_len = strlen(h->prefix);
+	h->verbs = verbs;
+	h->fn = fn;
+	h->arg = arg;
+	h->module = loading;
+	LOG("Plugin %s handles %s\n", loading, h->prefix_len > 0 ? h->prefix : "every path");
+	return 0;
+}
+
+static const char *api_method(ews_request *r) {
+	return r->method_name;
+}
+
+static const char *api_path(ews_request *r) {
+	return r->path;
+}
+
+static const char *api_query(ews_request *r) {
+	return r->query;
+}
+
+static const char *api_header(ews_request *r, const char *name, size_t *len) {
+	size_t ignored;
+	return header_field(r->request_h, name, len != NULL ? len : &ignored);
+}
+
+static const char *api_client_ip(ews_request *r) {
+	return r->ip;
+}
+
+static void api_set_data(ews_request *r, void *data, ews_callback free_data) {
+	r->data = data;
+	r->free_data = free_data;
+}
+
+static void *api_data(ews_request *r) {
+	return r->data;
+}
+
+static const char *api_body(ews_request *r, size_t *len) {
+	*len = r->request_body_len;
+	return r->request_body != NULL ? r->request_body : "";
+}
+
+static int api_status(ews_request *r, int code) {
+	if (r->streaming || code < 0 || code >= num_status_text || status_text[code] == NULL) {
+		return -1;
+	}
+	r->status = code;
+	return 0;
+}
+
+static int api_add_header(ews_request *r, const char *name, const char *value) {
+	//the line must not smuggle in more fields, and all of them share the response header's buffer
+	size_t line_len = strlen(name) + strlen(value) + 3;
+	if (r->streaming || strpbrk(name, ":\r\n") != NULL || strpbrk(value, "\r\n") != NULL
+			|| r->headers_len + line_len >= MAX_HEADER_SIZE / 2) {
+		return -1;
+	}
+	r->headers = realloc(r->headers, r->headers_len + line_len + 1);
+	sprintf(r->headers + r->headers_len, "%s: %s\n", name, value);
+	r->headers_len += line_len;
+	return 0;
+}
+
+//request and response bodies double as they grow, charged to the connection
+static void grow(char **buf, size_t *cap, size_t need) {
+	if (need <= *cap) {
+		return;
+	}
+	size_t new_cap = *cap > 0 ? *cap : 1024;
+	while (new_cap < need) {
+		new_cap *= 2;
+	}
+	*buf = realloc(*buf, new_cap);
+	memory_charge(MEM_CONNECTIONS, new_cap - *cap);
+	*cap = new_cap;
+}
+
+static int api_write(ews_request *r, const char *data, size_t len) {
+	if (r->body_len + len > PLUGIN_BODY_MAX) {
+		return -1;
+	}
+	grow(&r->body, &r->body_cap, r->body_len + len);
+	memcpy(r->body + r->body_len, data, len);
+	r->body_len += len;
+	return 0;
+}
+
+static int api_flush(ews_request *r) {
+	r->streaming = 1;
+	return 0;
+}
+
+static void stop_waiting(plugin_call *r) {
+	if (r->wake_ms == 0) {
+		return;
+	}
+	if (r->prev_waiting != NULL) {
+		r->prev_waiting->next_waiting = r->next_waiting;
+	} else {
+		waiting = r->next_waiting;
+	}
+	if (r->next_waiting != NULL) {
+		r->next_waiting->prev_waiting = r->prev_waiting;
+	}
+	r->prev_waiting = r->next_waiting = NULL;
+	r->wake_ms = 0;
+}
+
+static void api_wake_after(ews_request *r, int ms) {
+	stop_waiting(r);
+	r->wake_ms = monotonic_ms() + (ms > 0 ? ms : 0);
+	if (r->wake_ms == 0) {
+		r->wake_ms = 1;
+	}
+	r->next_waiting = waiting;
+	if (waiting != NULL) {
+		waiting->prev_waiting = r;
+	}
+	waiting = r;
+}
+
+static int api_every(int ms, ews_callback fn, void *arg) {
+	if (ms <= 0 || fn == NULL || num_timers == MAX_PLUGIN_TIMERS) {
+		return -1;
+	}
+	timers[num_timers++] = (timer){ ms, monotonic_ms() + ms, fn, arg };
+	return 0;
+}
+
+static void api_log(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+static const ews_api api = {
+	.abi = EWS_PLUGIN_ABI,
+	.handle = api_handle,
+	.method = api_method,
+	.path = api_path,
+	.query = api_query,
+	.header = api_header,
+	.client_ip = api_client_ip,
+	.set_data = api_set_data,
+	.data = api_data,
+	.status = api_status,
+	.add_header = api_add_header,
+	.write = api_write,
+	.wake_after = api_wake_after,
+	.every = api_every,
+	.log = api_log,
+	.flush = api_flush,
+	.body = api_body,
+};
+
+int plugin_load(const plugin_spec *spec) {
+	//never closed once it starts, handlers and timers live as long as the process
+	void *module = dlopen(spec->path, RTLD_NOW | RTLD_LOCAL);
+	if (module == NULL) {
+		fprintf(stderr, "Plugin %s: %s\n", spec->path, dlerror());
+		return -1;
+	}
+	int (*init)(const ews_api *, const char *) = (int (*)(const ews_api *, const char *))dlsym(module, "ews_plugin_init");
+	if (init == NULL) {
+		fprintf(stderr, "Plugin %s has no ews_plugin_init\n", spec->path);
+		dlclose(module);
+		return -1;
+	}
+
+	int first_handler = num_handlers;
+	int first_timer = num_timers;
+	char *path = strdup(spec->path);
+	loading = path;
+	int result = init(&api, spec->args);
+	loading = NULL;
+	if (result != 0) {
+		//take back what it registered before failing, nothing may call into it
+		fprintf(stderr, "Plugin %s failed to start\n", spec->path);
+		for (int i = first_handler; i < num_handlers; i++) {
+			free(handlers[i].prefix);
+		}
+		num_handlers = first_handler;
+		num_timers = first_timer;
+		free(path);
+		dlclose(module);
+		return -1;
+	}
+	LOG("Loaded plugin %s\n", spec->path);
+	return 0;
+}
+
+//next handler from index start taking this request, -1 for none
+static int find_handler(const plugin_call *r, int start) {
+	for (int i = start; i < num_handlers; i++) {
+		const handler *h = &handlers[i];
+		if (h->verbs != 0 && (r->method == V_UNKNOWN || !(h->verbs & (1u << r->method)))) {
+			continue;
+		}
+		//on a segment boundary, so /health does not take /healthz
+		if (strncmp(r->path, h->prefix, h->prefix_len) != 0) {
+			continue;
+		}
+		char next = r->path[h->prefix_len];
+		if (h->prefix_len == 0 || h->prefix[h->prefix_len - 1] == '/' || next == '\0' || next == '/' || next == '?') {
+			return i;
+		}
+	}
+	return -1;
+}
+
+plugin_call *plugin_match(const char *request_h, verb method, const char *ip, int fd) {
+	if (num_handlers == 0) {
+		return NULL;
+	}
+
+	//the same normalized path the router sees, so a prefix cannot be dodged with ./ or %2e
+	char raw[MAX_PATHNAME_SIZE + 1];
+	char url[MAX_PATHNAME_SIZE + 1];
+	if (sscanf(request_h, "%*s %4096s", raw) != 1 || url_normalize(raw, url, sizeof(url)) != 0) {
+		return NULL;
+	}
+
+	plugin_call *r = calloc(1, sizeof(plugin_call));
+	r->method = method;
+	r->path = strdup(url);
+	if ((r->handler = find_handler(r, 0)) == -1) {
+		free(r->path);
+		free(r);
+		return NULL;
+	}
+
+	r->fd = fd;
+	r->request_h = request_h;
+	r->ip = ip;
+	const char *query = strchr(raw, '?');
+	r->query = strdup(query != NULL ? query + 1 : "");
+	snprintf(r->method_name, sizeof(r->method_name), "%.*s", (int)strcspn(request_h, " "), request_h);
+	r->status = 200;
+	r->result = EWS_AGAIN;
+
+	//the body is read before the handler runs, chunked has to be the only coding
+	size_t len;
+	const char *coding = header_field(request_h, "Transfer-Encoding", &len);
+	const char *length = coding == NULL ? header_field(request_h, "Content-Length", &len) : NULL;
+	if (coding != NULL && len == 7 && strncasecmp(coding, "chunked", 7) == 0) {
+		r->body_mode = BODY_CHUNKED;
+	} else if (coding != NULL) {
+		r->body_error = 501;
+	} else if (length != NULL) {
+		char *digits_end;
+		r->body_remaining = strtoull(length, &digits_end, 10);
+		if (len == 0 || !isdigit((unsigned char)length[0]) || digits_end != length + len) {
+			r->body_error = 400;
+		} else if (r->body_remaining > PLUGIN_BODY_MAX) {
+			r->body_error = 413;
+		} else if (r->body_remaining > 0) {
+			r->body_mode = BODY_LENGTH;
+		}
+	}
+	return r;
+}
+
+int plugin_body_expected(const plugin_call *r) {
+	return r->body_mode != BODY_NONE && r->body_error == 0;
+}
+
+int plugin_body_read(plugin_call *r, ssize_t (*read)(void *arg, void *buf, size_t len), void *arg) {
+	while (r->body_mode != BODY_NONE && r->body_error == 0) {
+		//a chunked body is read with its framing, which is decoded out in place
+		size_t want = r->body_mode == BODY_LENGTH && r->body_remaining < CHUNK_BUFFER
+				? r->body_remaining : CHUNK_BUFFER;
+		grow(&r->request_body, &r->request_body_cap, r->request_body_len + want);
+		ssize_t n = read(arg, r->request_body + r->request_body_len, want);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		} else if (n <= 0) {
+			LOG("Request body on %d cut short\n", r->fd);
+			return -1;
+		}
+
+		if (r->body_mode == BODY_LENGTH) {
+			r->request_body_len += n;
+			r->body_remaining -= n;
+			if (r->body_remaining == 0) {
+				r->body_mode = BODY_NONE;
+			}
+			continue;
+		}
+		size_t out, used;
+		int ret = chunk_decode(&r->decoder, r->request_body + r->request_body_len, n, &out, &used);
+		r->request_body_len += out;
+		if (ret == -1) {
+			LOG("Broken chunked body on %d\n", r->fd);
+			r->body_error = 400;
+		} else if (r->request_body_len > PLUGIN_BODY_MAX) {
+			r->body_error = 413;
+		} else if (ret == 1) {
+			r->body_mode = BODY_NONE;
+		}
+	}
+	return r->body_error != 0 ? r->body_error : 1;
+}
+
+int plugin_run(plugin_call *r) {
+	//settled, or still waiting for its timer
+	if (r->result != EWS_AGAIN || r->wake_ms != 0) {
+		return r->result;
+	}
+
+	while (r->handler != -1) {
+		const handler *h = &handlers[r->handler];
+		int result = h->fn(r, h->arg);
+		if (result == EWS_NEXT && !r->streaming) {
+			//a later handler starts from an empty response
+			r->status = 200;
+			r->headers_len = 0;
+			r->body_sent = r->body_len = 0;
+			r->handler = find_handler(r, r->handler + 1);
+			continue;
+		}
+		if (result == EWS_AGAIN) {
+			//a handler that set no timer is run again on the next pass
+			if (r->wake_ms == 0) {
+				api_wake_after(r, 0);
+			}
+			return EWS_AGAIN;
+		}
+		if (result != EWS_DONE) {
+			fprintf(stderr, "Plugin %s failed on %s\n", h->module, r->path);
+			result = EWS_ERROR;
+		}
+		r->result = result;
+		return result;
+	}
+	return EWS_NEXT;
+}
+
+int plugin_response_status(const plugin_call *r) {
+	return r->status;
+}
+
+const char *plugin_response_headers(const plugin_call *r, size_t *len) {
+	*len = r->headers_len;
+	return r->headers_len > 0 ? r->headers : NULL;
+}
+
+const char *plugin_response_body(const plugin_call *r, size_t *len) {
+	*len = r->body_len - r->body_sent;
+	return r->body != NULL ? r->body + r->body_sent : "";
+}
+
+void plugin_response_sent(plugin_call *r, size_t len) {
+	r->body_sent += len;
+	if (r->body_sent == r->body_len) {
+		r->body_sent = r->body_len = 0;
+	}
+}
+
+int plugin_streaming(const plugin_call *r) {
+	return r->streaming;
+}
+
+void plugin_call_free(plugin_call *r) {
+	if (r == NULL) {
+		return;
+	}
+	stop_waiting(r);
+	if (r->free_data != NULL) {
+		r->free_data(r->data);
+	}
+	memory_release(MEM_CONNECTIONS, r->body_cap + r->request_body_cap);
+	free(r->body);
+	free(r->request_body);
+	free(r->headers);
+	free(r->path);
+	free(r->query);
+	free(r);
+}
+
+void plugin_pass(long long now_ms) {
+	for (int i = 0; i < num_timers; i++) {
+		if (now_ms >= timers[i].next_ms) {
+			timers[i].next_ms = now_ms + timers[i].ms;
+			timers[i].fn(timers[i].arg);
+		}
+	}
+
+	//taken off the list first, a woken request may finish, be freed or wait again
+	int due[PLUGIN_WAKES_PER_PASS];
+	int num_due = 0;
+	plugin_call *r = waiting;
+	while (r != NULL && num_due < PLUGIN_WAKES_PER_PASS) {
+		plugin_call *next = r->next_waiting;
+		if (now_ms >= r->wake_ms) {
+			stop_waiting(r);
+			due[num_due++] = r->fd;
+		}
+		r = next;
+	}
+	for (int i = 0; i < num_due; i++) {
+		wake_client(due[i]);
+	}
+}
+
+int plugin_timeout(int blocking_ms, long long now_ms) {
+	long long next = now_ms + blocking_ms;
+	for (int i = 0; i < num_timers; i++) {
+		if (timers[i].next_ms < next) {
+			next = timers[i].next_ms;
+		}
+	}
+	for (plugin_call *r = waiting; r != NULL; r = r->next_waiting) {
+		if (r->wake_ms < next) {
+			next = r->wake_ms;
+		}
+	}
+	return next > now_ms ? (int)(next - now_ms) : 0;
+}
+
+int plugin_specs_equal(const plugin_spec *a, int count_a, const plugin_spec *b, int count_b) {
+	if (count_a != count_b) {
+		return 0;
+	}
+	for (int i = 0; i < count_a; i++) {
+		if (strcmp(a[i].path, b[i].path) != 0
+				|| strcmp(a[i].args != NULL ? a[i].args : "", b[i].args != NULL ? b[i].args : "") != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void plugin_specs_free(plugin_spec *specs, int count) {
+	for (int i = 0; specs != NULL && i < count; i++) {
+		free(specs[i].path);
+		free(specs[i].args);
+	}
+	free(specs);
+}
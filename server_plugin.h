@@ -0,0 +1,68 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+#include "server_plugin_api.h"
+#include "server_helpers.h"
+
+//handler modules
+//shared objects listed in plugins are loaded once at startup and register
+//handlers through the table in server_plugin_api.h. a request whose path and
+//verb match a handler is offered to it before the server routes it; the
+//handler answers with a buffered or streamed response, waits on a timer, or
+//passes it on. on HTTP/1.1 it sees the request body, read before it first runs.
+//a reload keeps the modules of the process, changing them needs an upgrade
+
+#define MAX_PLUGIN_HANDLERS 64
+#define MAX_PLUGIN_TIMERS 64
+#define PLUGIN_WAKES_PER_PASS 256 //the rest wait for the next pass
+#define PLUGIN_BODY_MAX (16 * 1024 * 1024) //request bodies past this get a 413, response writes past it fail
+
+//one entry of plugins in server.conf
+typedef struct plugin_spec {
+	char *path;
+	char *args; //NULL without one
+} plugin_spec;
+
+//a request taken by a handler
+typedef struct ews_request plugin_call;
+
+//wake runs the client on fd again, status_text is indexed by status code
+void plugin_init(void (*wake)(int fd), char **status_text, int num_status);
+
+//dlopen the module and run its ews_plugin_init, -1 if either fails
+int plugin_load(const plugin_spec *);
+
+//the first handler for the request, NULL when none matches
+//request_h and ip must outlive the call
+plugin_call *plugin_match(const char *request_h, verb, const char *ip, int fd);
+
+//the request names a body, which plugin_body_read has not finished
+int plugin_body_expected(const plugin_call *);
+
+//read the request body with read (like read on a nonblocking socket)
+//returns 1 once it is complete, 0 to wait for more, -1 when the client is
+//gone, or the error status to answer with (400, 413, 501), from then on
+int plugin_body_read(plugin_call *, ssize_t (*read)(void *arg, void *buf, size_t len), void *arg);
+
+//run the request's handler unless it is waiting on its timer
+//returns EWS_DONE once the response is complete, and from then on
+int plugin_run(plugin_call *);
+
+int plugin_response_status(const plugin_call *);
+const char *plugin_response_headers(const plugin_call *, size_t *len);
+//what has been written and not sent yet
+const char *plugin_response_body(const plugin_call *, size_t *len);
+void plugin_response_sent(plugin_call *, size_t len);
+//the handler flushed, the response has no Content-Length
+int plugin_streaming(const plugin_call *);
+
+void plugin_call_free(plugin_call *);
+
+//once per loop pass, wakes requests whose timers are due and runs housekeeping
+void plugin_pass(long long now_ms);
+
+//timeout for the next epoll_wait, no later than the next timer
+int plugin_timeout(int blocking_ms, long long now_ms);
+
+int plugin_specs_equal(const plugin_spec *, int, const plugin_spec *, int);
+void plugin_specs_free(plugin_spec *, int count);
@@ -0,0 +1,82 @@
+#pragma once
+#include <stddef.h>
+
+//ABI for handler modules
+//a module is a shared object listed in plugins in server.conf. it exports
+//ews_plugin_init, which the server calls once at startup with its function
+//table; the module registers handlers for path prefixes and verbs from there.
+//handlers run on the event loop, so they must never block: to wait, arm
+//wake_after and return EWS_AGAIN, the handler is called again once it fires.
+//this header is all a module includes, build one with
+//  gcc -shared -fPIC -I/path/to/epoll-webserver module.c -o module.so
+
+#define EWS_PLUGIN_ABI 2 //bumped when the table grows, a module needs a server with at least the one it was built for
+
+//handler results
+#define EWS_DONE 1 //the response is complete, the server sends it
+#define EWS_AGAIN 0 //not yet, call again once the wake_after timer fires
+#define EWS_NEXT -1 //not for this handler: the next matching one, then the server, take the request
+#define EWS_ERROR 2 //the server answers 500
+
+//verbs a handler is registered for, 0 for any
+#define EWS_GET (1u << 0)
+#define EWS_HEAD (1u << 1)
+#define EWS_POST (1u << 2)
+#define EWS_PUT (1u << 3)
+#define EWS_DELETE (1u << 4)
+#define EWS_CONNECT (1u << 5)
+#define EWS_OPTIONS (1u << 6)
+#define EWS_TRACE (1u << 7)
+
+//one request a handler is working on
+typedef struct ews_request ews_request;
+
+typedef int (*ews_handler)(ews_request *, void *arg);
+typedef void (*ews_callback)(void *arg);
+
+typedef struct ews_api {
+	int abi;
+
+	//from ews_plugin_init only. prefix is a path prefix ("/health", "/api/"),
+	//NULL or "" for every path. it matches whole segments, so "/health" takes
+	//"/health/x" but not "/healthz". handlers are tried in registration order
+	int (*handle)(const char *prefix, unsigned verbs, ews_handler, void *arg);
+
+	//request view, valid while the request is being handled
+	const char *(*method)(ews_request *);
+	const char *(*path)(ews_request *); //decoded and normalized, without the query string
+	const char *(*query)(ews_request *); //after the '?', "" without one
+	const char *(*header)(ews_request *, const char *name, size_t *len); //not NUL terminated, NULL if absent
+	const char *(*client_ip)(ews_request *);
+
+	//the handler's own state for this request, free_data runs when the request ends for any reason
+	void (*set_data)(ews_request *, void *data, ews_callback free_data);
+	void *(*data)(ews_request *);
+
+	//response writer, buffered until the handler returns EWS_DONE or flushes
+	//the server adds Date, Content-Length and the site's security headers
+	int (*status)(ews_request *, int code); //200 unless set, -1 for codes the server has no text for
+	int (*add_header)(ews_request *, const char *name, const char *value);
+	int (*write)(ews_request *, const char *data, size_t len);
+
+	//timers, as precise as the event loop's timeout
+	void (*wake_after)(ews_request *, int ms);
+	int (*every)(int ms, ews_callback, void *arg); //housekeeping, every ms for the life of the process
+
+	void (*log)(const char *format, ...);
+
+	//since ABI 2
+	//send what has been written so far and stream the rest: the header goes out
+	//without a Content-Length (chunked on HTTP/1.1), and status and headers are
+	//fixed from then on. to produce more, return EWS_AGAIN, the handler runs again
+	//once the client has taken what was flushed and its timer (if any) fired
+	int (*flush)(ews_request *);
+
+	//the request body, read before the handler first runs: Content-Length or
+	//chunked, up to 16MB. empty without one, and over HTTP/2
+	const char *(*body)(ews_request *, size_t *len);
+} ews_api;
+
+//exported by every module; args is the entry's args string, NULL without one
+//returns 0, or -1 to keep the server from starting
+int ews_plugin_init(const ews_api *api, const char *args);
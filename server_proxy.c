@@ -0,0 +1,1004 @@
+#define _GNU_SOURCE
+#include "server_proxy.h"
+#include "server_helpers.h"
+#include "server_memory.h"
+#include "server_chunked.h"
+#include <stdlib.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+//HTTP/1.1 reverse proxy for the event loop
+//upstream connections are nonblocking, share the main epoll set and are kept
+//open between requests; the response header is peeked at and consumed exactly,
+//so the body is still in the socket and is spliced through a pipe to the client
+//upstreams take turns, one that failed max_fails times in a row is skipped
+//until a health probe succeeds; a request that fails before its response starts
+//is retried on the next upstream, which is safe since only GET and HEAD are proxied
+
+enum { FRAME_NONE, FRAME_LENGTH, FRAME_CHUNKED, FRAME_CLOSE };
+
+#define MAX_SPLICE (1 << 20)
+#define COPY_BUFFER 16384 //proxy_copy reads a TLS record's worth at a time
+#define SPARE_PIPES 16
+
+typedef struct proxy_conn {
+	int fd;
+	int connecting;
+	int reused; //carried a request before, the upstream may have closed it since
+	int keep_alive; //the current response leaves the connection usable
+	int probe; //health check rather than a request
+	int probe_sent;
+	int upstream;
+	proxy_pool *pool;
+	proxy_request *request;
+	long long deadline_ms; //probes only, requests carry their own
+
+	struct proxy_conn **list; //idle or busy list it is on, NULL for probes
+	struct proxy_conn *next;
+} proxy_conn;
+
+typedef struct upstream {
+	char *name;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+
+	int fails; //in a row
+	int down;
+	long long next_probe_ms;
+	proxy_conn *probe;
+
+	proxy_conn *idle; //LIFO, the most recently used is the least likely to be stale
+	int num_idle;
+} upstream;
+
+struct proxy_pool {
+	upstream upstreams[MAX_UPSTREAMS];
+	int count;
+	int turn; //round-robin position
+
+	int idle_connections;
+	int timeout_ms;
+	int max_fails;
+	int health_interval_ms;
+	char *health_path;
+	int closing;
+
+	proxy_conn *busy; //carrying a request
+
+	struct proxy_pool *next;
+};
+
+static int epoll_fd = -1;
+static void (*notify)(int client_fd) = NULL;
+static proxy_pool *pools = NULL;
+
+//connections by fd, for events
+static proxy_conn **by_fd = NULL;
+static int by_fd_size = 0;
+
+//clients to notify, each entry holds a reference
+static proxy_request *ready_head = NULL;
+static proxy_request *ready_tail = NULL;
+
+//empty pipes of finished requests
+static int spare_pipes[SPARE_PIPES][2];
+static int num_spare_pipes = 0;
+
+static void conn_failed(proxy_conn *, int status);
+
+void proxy_init(int epollfd, void (*ready)(int client_fd)) {
+	epoll_fd = epollfd;
+	notify = ready;
+}
+
+static void append(char **buf, size_t *len, size_t *cap, const void *data, size_t n) {
+	if (*len + n > *cap) {
+		*cap = *cap == 0 ? 1024 : *cap;
+		while (*len + n > *cap) {
+			*cap *= 2;
+		}
+		*buf = realloc(*buf, *cap);
+	}
+	memcpy(*buf + *len, data, n);
+	*len += n;
+}
+
+static void unref(proxy_request *r) {
+	if (--r->refcount > 0) {
+		return;
+	}
+	if (r->copy != NULL) {
+		memory_release(MEM_UPSTREAM, COPY_BUFFER);
+	}
+	free(r->head);
+	free(r->headers);
+	free(r->copy);
+	free(r);
+}
+
+static void queue_ready(proxy_request *r) {
+	if (r->client_fd < 0 || r->ready_queued) {
+		return;
+	}
+	r->ready_queued = 1;
+	r->refcount += 1;
+	r->next_ready = NULL;
+	if (ready_tail != NULL) {
+		ready_tail->next_ready = r;
+	} else {
+		ready_head = r;
+	}
+	ready_tail = r;
+}
+
+static void dispatch_ready() {
+	while (ready_head != NULL) {
+		proxy_request *r = ready_head;
+		ready_head = r->next_ready;
+		if (ready_head == NULL) {
+			ready_tail = NULL;
+		}
+		r->ready_queued = 0;
+
+		if (r->client_fd >= 0 && notify != NULL) {
+			notify(r->client_fd);
+		}
+		unref(r);
+	}
+}
+
+static void fail_request(proxy_request *r, int status) {
+	if (r->error != 0) {
+		return;
+	}
+	r->error = status;
+	queue_ready(r);
+}
+
+static void list_push(proxy_conn **list, proxy_conn *conn) {
+	conn->list = list;
+	conn->next = *list;
+	*list = conn;
+}
+
+static void list_remove(proxy_conn *conn) {
+	if (conn->list == NULL) {
+		return;
+	}
+	proxy_conn **slot = conn->list;
+	while (*slot != conn) {
+		slot = &(*slot)->next;
+	}
+	*slot = conn->next;
+	conn->list = NULL;
+	conn->next = NULL;
+}
+
+static proxy_conn *conn_open(proxy_pool *pool, int u, int probe) {
+	upstream *up = &pool->upstreams[u];
+	int fd = socket(up->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("Upstream socket");
+		return NULL;
+	}
+	if (up->addr.ss_family != AF_UNIX) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	int connecting = 0;
+	if (connect(fd, (struct sockaddr *)&up->addr, up->addr_len) == -1) {
+		if (errno != EINPROGRESS) {
+			LOG("Connecting to %s: %s\n", up->name, strerror(errno));
+			close(fd);
+			return NULL;
+		}
+		connecting = 1;
+	}
+
+	proxy_conn *conn = calloc(1, sizeof(proxy_conn));
+	conn->fd = fd;
+	conn->connecting = connecting;
+	conn->probe = probe;
+	conn->upstream = u;
+	conn->pool = pool;
+
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.fd = fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+	if (fd >= by_fd_size) {
+		int size = by_fd_size == 0 ? 1024 : by_fd_size;
+		while (size <= fd) {
+			size *= 2;
+		}
+		by_fd = realloc(by_fd, size * sizeof(proxy_conn *));
+		memset(by_fd + by_fd_size, 0, (size - by_fd_size) * sizeof(proxy_conn *));
+		by_fd_size = size;
+	}
+	by_fd[fd] = conn;
+
+	LOG("Opened %s connection %d to %s\n", probe ? "probe" : "upstream", fd, up->name);
+	return conn;
+}
+
+//the request on it, if any, has to be dealt with by the caller
+static void conn_close(proxy_conn *conn) {
+	list_remove(conn);
+	if (conn->request != NULL) {
+		conn->request->conn = NULL;
+	}
+	by_fd[conn->fd] = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	LOG("Closed upstream connection %d\n", conn->fd);
+	free(conn);
+}
+
+//the response on conn is over, keep it for the next request if possible
+static void conn_done(proxy_conn *conn) {
+	proxy_pool *pool = conn->pool;
+	upstream *up = &pool->upstreams[conn->upstream];
+
+	conn->request->conn = NULL;
+	conn->request = NULL;
+	if (!conn->keep_alive || pool->closing || up->num_idle >= pool->idle_connections) {
+		conn_close(conn);
+		return;
+	}
+	list_remove(conn);
+	list_push(&up->idle, conn);
+	up->num_idle += 1;
+	conn->reused = 1;
+}
+
+static void upstream_failed(proxy_pool *pool, int u) {
+	upstream *up = &pool->upstreams[u];
+	up->fails += 1;
+	if (!up->down && up->fails >= pool->max_fails) {
+		up->down = 1;
+		fprintf(stderr, "Upstream %s is down after %d failures\n", up->name, up->fails);
+	}
+}
+
+static void upstream_ok(proxy_pool *pool, int u) {
+	upstream *up = &pool->upstreams[u];
+	up->fails = 0;
+	if (up->down) {
+		up->down = 0;
+		fprintf(stderr, "Upstream %s is up\n", up->name);
+	}
+}
+
+//next upstream in turn that is not down, any upstream if all of them are
+static int pick_upstream(proxy_pool *pool) {
+	for (int i = 0; i < pool->count; i++) {
+		int u = pool->turn;
+		pool->turn = (pool->turn + 1) % pool->count;
+		if (!pool->upstreams[u].down) {
+			return u;
+		}
+	}
+	int u = pool->turn;
+	pool->turn = (pool->turn + 1) % pool->count;
+	return u;
+}
+
+//returns -1 if the connection broke
+static int conn_write(proxy_conn *conn) {
+	proxy_request *r = conn->request;
+	while (!conn->connecting && r->head_sent < r->head_len) {
+		ssize_t n = send(conn->fd, r->head + r->head_sent, r->head_len - r->head_sent, MSG_NOSIGNAL);
+		if (n > 0) {
+			r->head_sent += n;
+		} else if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		} else {
+			LOG("Writing to upstream: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+//hand r to upstream u, on an idle connection if there is one
+//returns -1 if the connection failed, stale is set if it had been idle
+static int send_to(proxy_request *r, int u, int *stale) {
+	proxy_pool *pool = r->pool;
+	upstream *up = &pool->upstreams[u];
+
+	proxy_conn *conn = up->idle;
+	if (conn != NULL) {
+		list_remove(conn);
+		up->num_idle -= 1;
+	} else if ((conn = conn_open(pool, u, 0)) == NULL) {
+		*stale = 0;
+		return -1;
+	}
+	list_push(&pool->busy, conn);
+	*stale = conn->reused;
+
+	conn->request = r;
+	r->conn = conn;
+	r->head_sent = 0;
+	r->deadline_ms = monotonic_ms() + pool->timeout_ms;
+
+	if (conn_write(conn) == -1) {
+		conn_close(conn);
+		return -1;
+	}
+	return 0;
+}
+
+//upstream to try after u failed r, -1 once r has failed with status
+//a stale keep-alive connection is not the upstream's fault, so u gets another go
+static int next_upstream(proxy_request *r, int u, int stale, int status) {
+	proxy_pool *pool = r->pool;
+	if (r->client_fd < 0) {
+		return -1;
+	}
+	if (stale) {
+		return u;
+	}
+	upstream_failed(pool, u);
+	r->attempts += 1;
+	if (r->attempts >= pool->count) {
+		fail_request(r, status);
+		return -1;
+	}
+	return pick_upstream(pool);
+}
+
+static void dispatch(proxy_request *r, int u) {
+	int stale = 0;
+	while (u >= 0 && send_to(r, u, &stale) == -1) {
+		u = next_upstream(r, u, stale, 502);
+	}
+}
+
+//the connection broke or timed out, before the response started r can move on
+static void conn_failed(proxy_conn *conn, int status) {
+	proxy_request *r = conn->request;
+	int u = conn->upstream;
+	int stale = conn->reused && status != 504;
+	conn_close(conn);
+
+	if (r == NULL) {
+		return;
+	}
+	if (r->header_done) {
+		fail_request(r, status);
+		return;
+	}
+	dispatch(r, next_upstream(r, u, stale, status));
+}
+
+//end of the blank line closing a header section, NULL if it is not all there yet
+static char *section_end(char *buf, size_t len) {
+	char *crlf = memmem(buf, len, "\n\r\n", 3);
+	char *lf = memmem(buf, len, "\n\n", 2);
+	if (lf != NULL && (crlf == NULL || lf < crlf)) {
+		return lf + 2;
+	}
+	return crlf != NULL ? crlf + 3 : NULL;
+}
+
+static int has_token(const char *value, size_t len, const char *token) {
+	size_t token_len = strlen(token);
+	for (size_t i = 0; i + token_len <= len; i++) {
+		if (strncasecmp(value + i, token, token_len) == 0
+				&& (i == 0 || value[i - 1] == ' ' || value[i - 1] == ',')
+				&& (i + token_len == len || value[i + token_len] == ' ' || value[i + token_len] == ',')) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int is_field(const char *line, size_t name_len, const char *name) {
+	return name_len == strlen(name) && strncasecmp(line, name, name_len) == 0;
+}
+
+//status line and fields of a complete response header
+//returns 1 for the final response, 0 for an interim 1xx one, -1 if it is malformed
+static int parse_response(proxy_conn *conn, char *buf, size_t len) {
+	proxy_request *r = conn->request;
+
+	if (len < 13 || strncmp(buf, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)buf[7])
+			|| buf[8] != ' ' || !isdigit((unsigned char)buf[9])) {
+		return -1;
+	}
+	int minor = buf[7] - '0';
+	int status = atoi(buf + 9);
+	if (status < 100 || status > 509 || status == 101) {
+		return -1;
+	} else if (status < 200) {
+		return 0;
+	}
+
+	int chunked = 0, other_coding = 0, has_length = 0, close = 0, keep = 0;
+	unsigned long long length = 0;
+	size_t headers_len = 0, headers_cap = 0;
+	free(r->headers);
+	r->headers = NULL;
+
+	char *end = buf + len;
+	char *line = (char *)memchr(buf, '\n', len) + 1;
+	while (line < end) {
+		char *eol = memchr(line, '\n', end - line);
+		size_t line_len = eol - line;
+		if (line_len > 0 && line[line_len - 1] == '\r') {
+			line_len -= 1;
+		}
+		if (line_len == 0) {
+			break;
+		}
+
+		char *colon = memchr(line, ':', line_len);
+		if (colon == NULL || colon == line) {
+			return -1;
+		}
+		size_t name_len = colon - line;
+		char *value = colon + 1;
+		while (value < line + line_len && (*value == ' ' || *value == '\t')) {
+			value += 1;
+		}
+		size_t value_len = line + line_len - value;
+		while (value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+			value_len -= 1;
+		}
+
+		int keep_field = 1;
+		if (is_field(line, name_len, "Transfer-Encoding")) {
+			chunked = value_len >= 7 && strncasecmp(value + value_len - 7, "chunked", 7) == 0;
+			other_coding = !chunked;
+		} else if (is_field(line, name_len, "Content-Length")) {
+			char *digits_end;
+			length = strtoull(value, &digits_end, 10);
+			if (value_len == 0 || !isdigit((unsigned char)value[0]) || digits_end != value + value_len
+					|| (has_length && length != r->remaining)) {
+				return -1;
+			}
+			has_length = 1;
+			r->remaining = length;
+		} else if (is_field(line, name_len, "Connection")) {
+			close |= has_token(value, value_len, "close");
+			keep |= has_token(value, value_len, "keep-alive");
+			keep_field = 0;
+		} else if (is_field(line, name_len, "Keep-Alive") || is_field(line, name_len, "Proxy-Connection")
+				|| is_field(line, name_len, "Upgrade") || is_field(line, name_len, "Date")) {
+			keep_field = 0; //hop-by-hop, or sent by the server itself
+		}
+
+		if (keep_field) {
+			append(&r->headers, &headers_len, &headers_cap, line, line_len);
+			append(&r->headers, &headers_len, &headers_cap, "\n", 1);
+		}
+		line = eol + 1;
+	}
+	append(&r->headers, &headers_len, &headers_cap, "", 1);
+
+	r->status = status;
+	conn->keep_alive = !close && (minor >= 1 || keep);
+
+	if (r->no_body || status == 204 || status == 304) {
+		r->framing = FRAME_NONE;
+		r->body_done = 1;
+	} else if (chunked) {
+		r->framing = FRAME_CHUNKED;
+		r->remaining = 0;
+	} else if (has_length && !other_coding) {
+		r->framing = FRAME_LENGTH;
+		r->body_done = length == 0;
+	} else {
+		r->framing = FRAME_CLOSE;
+		conn->keep_alive = 0;
+	}
+	return 1;
+}
+
+//peek at the response header and consume exactly it, the body stays in the socket
+//returns -1 if the connection is gone
+static int read_response_header(proxy_conn *conn) {
+	proxy_request *r = conn->request;
+	proxy_pool *pool = conn->pool;
+	char buf[MAX_HEADER_SIZE];
+
+	while (!r->header_done) {
+		ssize_t n = recv(conn->fd, buf, sizeof(buf), MSG_PEEK);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		} else if (n <= 0) {
+			LOG("Upstream %d closed before responding\n", conn->fd);
+			conn_failed(conn, 502);
+			return -1;
+		}
+		r->deadline_ms = monotonic_ms() + pool->timeout_ms;
+
+		char *end = section_end(buf, n);
+		if (end == NULL && n < (ssize_t)sizeof(buf)) {
+			return 0;
+		}
+		int parsed = end != NULL ? parse_response(conn, buf, end - buf) : -1;
+		if (parsed == -1) {
+			//a broken response is not retried, the upstream may have acted on it
+			fprintf(stderr, "Malformed response header from %s\n", pool->upstreams[conn->upstream].name);
+			fail_request(r, 502);
+			conn_close(conn);
+			return -1;
+		}
+
+		size_t header_len = end - buf;
+		while (header_len > 0) {
+			n = recv(conn->fd, buf, header_len, 0);
+			if (n > 0) {
+				header_len -= n;
+			} else if (n == -1 && errno == EINTR) {
+				continue;
+			} else {
+				conn_failed(conn, 502);
+				return -1;
+			}
+		}
+		r->header_done = parsed == 1;
+	}
+
+	upstream_ok(pool, conn->upstream);
+	queue_ready(r);
+	if (r->body_done) {
+		conn_done(conn);
+	}
+	return 0;
+}
+
+//peek at the chunk size line and work out the next stretch to splice verbatim:
+//the line, the data and its CRLF, or after the last chunk the trailer section
+//returns 1 once remaining is set, 0 to wait for more, -1 for a broken chunk
+static int next_chunk(proxy_request *r) {
+	char line[MAX_CHUNK_LINE];
+	ssize_t n = recv(r->conn->fd, line, sizeof(line), MSG_PEEK);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return 0;
+	} else if (n <= 0) {
+		return -1;
+	}
+
+	char *eol = memchr(line, '\n', n);
+	if (eol == NULL) {
+		return n == sizeof(line) ? -1 : 0;
+	}
+	char *digits_end;
+	unsigned long long size = strtoull(line, &digits_end, 16);
+	if (!isxdigit((unsigned char)line[0]) || size > (1ULL << 40)
+			|| (*digits_end != ';' && *digits_end != '\r' && *digits_end != '\n'
+			&& *digits_end != ' ' && *digits_end != '\t')) {
+		return -1;
+	}
+
+	if (size > 0) {
+		r->remaining = (eol + 1 - line) + size + 2;
+		return 1;
+	}
+	char *end = section_end(line, n);
+	if (end == NULL) {
+		return n == sizeof(line) ? -1 : 0;
+	}
+	r->remaining = end - line;
+	r->last_chunk = 1;
+	return 1;
+}
+
+//upstream -> pipe, up to the end of the body, returns bytes moved
+static size_t fill(proxy_request *r) {
+	size_t moved = 0;
+	while (r->conn != NULL && !r->body_done && r->error == 0) {
+		proxy_conn *conn = r->conn;
+
+		if (r->framing == FRAME_CHUNKED && r->remaining == 0) {
+			int ret = next_chunk(r);
+			if (ret == 0) {
+				break;
+			} else if (ret == -1) {
+				LOG("Broken chunked body from upstream %d\n", conn->fd);
+				fail_request(r, 502);
+				conn_close(conn);
+				break;
+			}
+		}
+
+		size_t want = r->framing == FRAME_CLOSE || r->remaining > MAX_SPLICE ? MAX_SPLICE : r->remaining;
+		ssize_t n = splice(conn->fd, NULL, r->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break; //nothing to read, or the pipe is full
+		} else if (n == 0 && r->framing == FRAME_CLOSE) {
+			r->body_done = 1;
+			conn_close(conn);
+			break;
+		} else if (n <= 0) {
+			LOG("Upstream %d cut the body short\n", conn->fd);
+			fail_request(r, 502);
+			conn_close(conn);
+			break;
+		}
+
+		r->piped += n;
+		moved += n;
+		r->deadline_ms = monotonic_ms() + conn->pool->timeout_ms;
+		if (r->framing != FRAME_CLOSE) {
+			r->remaining -= n;
+			if (r->remaining == 0 && (r->framing == FRAME_LENGTH || r->last_chunk)) {
+				r->body_done = 1;
+				conn_done(conn);
+			}
+		}
+	}
+	return moved;
+}
+
+ssize_t proxy_splice(proxy_request *r) {
+	ssize_t sent = 0;
+	while (1) {
+		size_t moved = fill(r);
+
+		while (r->piped > 0) {
+			ssize_t n = splice(r->pipe[0], NULL, r->client_fd, NULL, r->piped,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0) {
+				r->piped -= n;
+				sent += n;
+				moved += n;
+			} else if (n == -1 && errno == EINTR) {
+				continue;
+			} else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				break;
+			} else {
+				return -1;
+			}
+		}
+
+		//stop once neither side moves, the next event picks it up
+		if (moved == 0 || (r->body_done && r->piped == 0)) {
+			return sent;
+		}
+	}
+}
+
+ssize_t proxy_copy(proxy_request *r, ssize_t (*send)(void *arg, const void *buf, size_t len), void *arg) {
+	ssize_t sent = 0;
+	if (r->copy == NULL) {
+		r->copy = malloc(COPY_BUFFER);
+		memory_charge(MEM_UPSTREAM, COPY_BUFFER);
+	}
+
+	while (1) {
+		size_t moved = fill(r);
+
+		while (r->piped > 0) {
+			//a write that would block is retried with the same bytes
+			if (r->copy_start == r->copy_len) {
+				ssize_t n = read(r->pipe[0], r->copy, r->piped < COPY_BUFFER ? r->piped : COPY_BUFFER);
+				if (n == -1 && errno == EINTR) {
+					continue;
+				} else if (n <= 0) {
+					return -1;
+				}
+				r->copy_start = 0;
+				r->copy_len = n;
+			}
+
+			ssize_t n = send(arg, r->copy + r->copy_start, r->copy_len - r->copy_start);
+			if (n > 0) {
+				r->copy_start += n;
+				r->piped -= n;
+				sent += n;
+				moved += n;
+			} else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				break;
+			} else {
+				return -1;
+			}
+		}
+
+		if (moved == 0 || (r->body_done && r->piped == 0)) {
+			return sent;
+		}
+	}
+}
+
+static int take_pipe(int fds[2]) {
+	if (num_spare_pipes > 0) {
+		num_spare_pipes -= 1;
+		fds[0] = spare_pipes[num_spare_pipes][0];
+		fds[1] = spare_pipes[num_spare_pipes][1];
+		return 0;
+	}
+	return pipe2(fds, O_NONBLOCK | O_CLOEXEC);
+}
+
+static void put_pipe(int fds[2], size_t piped) {
+	if (fds[0] < 0) {
+		return;
+	}
+	if (piped == 0 && num_spare_pipes < SPARE_PIPES) {
+		spare_pipes[num_spare_pipes][0] = fds[0];
+		spare_pipes[num_spare_pipes][1] = fds[1];
+		num_spare_pipes += 1;
+	} else {
+		close(fds[0]);
+		close(fds[1]);
+	}
+}
+
+proxy_pool *proxy_pool_new(const char **addresses, int count, int idle_connections, int timeout_ms,
+		int max_fails, int health_interval_ms, const char *health_path) {
+
+	if (count < 1 || count > MAX_UPSTREAMS) {
+		fprintf(stderr, "A proxy needs 1 to %d upstreams\n", MAX_UPSTREAMS);
+		return NULL;
+	}
+
+	proxy_pool *pool = calloc(1, sizeof(proxy_pool));
+	pool->idle_connections = idle_connections;
+	pool->timeout_ms = timeout_ms;
+	pool->max_fails = max_fails;
+	pool->health_interval_ms = health_interval_ms;
+	pool->health_path = health_path != NULL ? strdup(health_path) : NULL;
+
+	long long now = monotonic_ms();
+	for (int i = 0; i < count; i++) {
+		upstream *up = &pool->upstreams[i];
+		up->name = strdup(addresses[i]);
+		pool->count += 1;
+		if (resolve_stream_address(addresses[i], &up->addr, &up->addr_len) == -1) {
+			proxy_pool_free(pool);
+			return NULL;
+		}
+		up->next_probe_ms = now + health_interval_ms;
+	}
+
+	pool->next = pools;
+	pools = pool;
+	return pool;
+}
+
+//only called once no client holds a request of the pool
+void proxy_pool_free(proxy_pool *pool) {
+	if (pool == NULL) {
+		return;
+	}
+	pool->closing = 1;
+	while (pool->busy != NULL) {
+		conn_close(pool->busy);
+	}
+	for (int i = 0; i < pool->count; i++) {
+		upstream *up = &pool->upstreams[i];
+		while (up->idle != NULL) {
+			conn_close(up->idle);
+		}
+		if (up->probe != NULL) {
+			conn_close(up->probe);
+		}
+		free(up->name);
+	}
+
+	proxy_pool **slot = &pools;
+	while (*slot != NULL && *slot != pool) {
+		slot = &(*slot)->next;
+	}
+	if (*slot != NULL) {
+		*slot = pool->next;
+	}
+	free(pool->health_path);
+	free(pool);
+}
+
+proxy_request *proxy_request_new(proxy_pool *pool, int client_fd, const char *head, size_t len, int no_body) {
+	proxy_request *r = calloc(1, sizeof(proxy_request));
+	r->refcount = 1;
+	r->client_fd = client_fd;
+	r->pool = pool;
+	r->status = 200;
+	r->no_body = no_body;
+	r->head = malloc(len);
+	memcpy(r->head, head, len);
+	r->head_len = len;
+
+	if (take_pipe(r->pipe) == -1) {
+		perror("pipe2");
+		r->pipe[0] = r->pipe[1] = -1;
+		fail_request(r, 502);
+		return r;
+	}
+
+	dispatch(r, pick_upstream(pool));
+	return r;
+}
+
+void proxy_release(proxy_request *r) {
+	if (r == NULL) {
+		return;
+	}
+	r->client_fd = -1;
+
+	//the rest of the response would be mistaken for the next one
+	if (r->conn != NULL) {
+		conn_close(r->conn);
+	}
+	put_pipe(r->pipe, r->piped);
+	r->pipe[0] = r->pipe[1] = -1;
+	unref(r);
+}
+
+static void probe_start(proxy_pool *pool, int u, long long now_ms) {
+	upstream *up = &pool->upstreams[u];
+	up->next_probe_ms = now_ms + pool->health_interval_ms;
+
+	proxy_conn *conn = conn_open(pool, u, 1);
+	if (conn == NULL) {
+		upstream_failed(pool, u);
+		return;
+	}
+	conn->deadline_ms = now_ms + (pool->timeout_ms < pool->health_interval_ms
+			? pool->timeout_ms : pool->health_interval_ms);
+	up->probe = conn;
+}
+
+static void probe_finish(proxy_conn *conn, int healthy) {
+	proxy_pool *pool = conn->pool;
+	int u = conn->upstream;
+	pool->upstreams[u].probe = NULL;
+	conn_close(conn);
+
+	if (healthy) {
+		upstream_ok(pool, u);
+	} else {
+		LOG("Health probe of %s failed\n", pool->upstreams[u].name);
+		upstream_failed(pool, u);
+	}
+}
+
+static void probe_event(proxy_conn *conn, uint32_t events) {
+	proxy_pool *pool = conn->pool;
+	upstream *up = &pool->upstreams[conn->upstream];
+
+	if (conn->connecting) {
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+		getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+		if (err != 0) {
+			probe_finish(conn, 0);
+			return;
+		}
+		if (!(events & EPOLLOUT)) {
+			return;
+		}
+		conn->connecting = 0;
+	}
+
+	//without a path, accepting the connection is enough
+	if (pool->health_path == NULL) {
+		probe_finish(conn, 1);
+		return;
+	}
+
+	if (!conn->probe_sent) {
+		char request[MAX_PATHNAME_SIZE + 512];
+		int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n"
+				"Connection: close\r\n\r\n", pool->health_path,
+				up->addr.ss_family == AF_UNIX ? "localhost" : up->name);
+		if (send(conn->fd, request, len, MSG_NOSIGNAL) != len) {
+			probe_finish(conn, 0);
+			return;
+		}
+		conn->probe_sent = 1;
+	}
+
+	char status_line[16];
+	ssize_t n = recv(conn->fd, status_line, sizeof(status_line) - 1, MSG_PEEK);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	} else if (n < 12) {
+		if (n <= 0 || (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+			probe_finish(conn, 0);
+		}
+		return;
+	}
+	status_line[n] = '\0';
+	int status = strncmp(status_line, "HTTP/1.", 7) == 0 ? atoi(status_line + 9) : 0;
+	probe_finish(conn, status >= 200 && status < 400);
+}
+
+int proxy_handle_event(int fd, uint32_t events) {
+	if (fd < 0 || fd >= by_fd_size || by_fd[fd] == NULL) {
+		return 0;
+	}
+	proxy_conn *conn = by_fd[fd];
+	proxy_request *r = conn->request;
+
+	if (conn->probe) {
+		probe_event(conn, events);
+
+	} else if (r == NULL) {
+		//idle, so anything but write space means the upstream closed it
+		if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+			upstream *up = &conn->pool->upstreams[conn->upstream];
+			up->num_idle -= 1;
+			conn_close(conn);
+		}
+
+	} else if (conn->connecting) {
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+		if (err != 0) {
+			LOG("Connecting to %s: %s\n", conn->pool->upstreams[conn->upstream].name, strerror(err));
+			conn_failed(conn, 502);
+		} else if (events & EPOLLOUT) {
+			conn->connecting = 0;
+			if (conn_write(conn) == -1) {
+				conn_failed(conn, 502);
+			} else if (r->head_sent == r->head_len) {
+				read_response_header(conn);
+			}
+		}
+
+	} else if (r->head_sent < r->head_len) {
+		if (conn_write(conn) == -1) {
+			conn_failed(conn, 502);
+		} else if (r->head_sent == r->head_len) {
+			read_response_header(conn);
+		}
+
+	} else if (!r->header_done) {
+		read_response_header(conn);
+
+	} else {
+		//body bytes, the client splices them when it runs
+		queue_ready(r);
+	}
+
+	dispatch_ready();
+	return 1;
+}
+
+void proxy_expire(long long now_ms) {
+	for (proxy_pool *pool = pools; pool != NULL; pool = pool->next) {
+
+		//a timed-out connection is dropped, the request moves on or fails with 504
+		//while the pipe holds data it is the client that is behind, not the upstream
+		proxy_conn *conn = pool->busy;
+		while (conn != NULL) {
+			proxy_request *r = conn->request;
+			if (r != NULL && r->piped == 0 && now_ms >= r->deadline_ms) {
+				LOG("Upstream %s timed out\n", pool->upstreams[conn->upstream].name);
+				conn_failed(conn, 504);
+				conn = pool->busy;
+				continue;
+			}
+			conn = conn->next;
+		}
+
+		for (int i = 0; pool->health_interval_ms > 0 && i < pool->count; i++) {
+			upstream *up = &pool->upstreams[i];
+			if (up->probe != NULL && now_ms >= up->probe->deadline_ms) {
+				probe_finish(up->probe, 0);
+			} else if (up->probe == NULL && now_ms >= up->next_probe_ms) {
+				probe_start(pool, i, now_ms);
+			}
+		}
+	}
+
+	dispatch_ready();
+}
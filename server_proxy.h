@@ -0,0 +1,78 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MAX_UPSTREAMS 16
+#define DEFAULT_PROXY_IDLE_CONNECTIONS 8 //kept open per upstream between requests
+#define DEFAULT_PROXY_TIMEOUT_MS 30000
+#define DEFAULT_PROXY_MAX_FAILS 2 //failures in a row before an upstream is skipped
+#define DEFAULT_PROXY_HEALTH_INTERVAL_MS 5000
+
+typedef struct proxy_pool proxy_pool;
+struct proxy_conn;
+
+//one request to an upstream, the response body goes upstream -> pipe -> client
+//through proxy_splice without being copied into the server
+typedef struct proxy_request {
+	int refcount;
+	int client_fd; //-1 once the client let go
+	proxy_pool *pool;
+	struct proxy_conn *conn; //NULL once the body has been read off it
+	int attempts; //upstreams that failed this request
+	long long deadline_ms; //pushed back by everything read from the upstream
+
+	char *head; //request line and header fields sent upstream
+	size_t head_len;
+	size_t head_sent;
+	int no_body; //HEAD, the response never has a body
+
+	int header_done;
+	int status;
+	char *headers; //"Name: value\n" lines without hop-by-hop fields
+
+	int pipe[2];
+	size_t piped; //spliced in, not yet sent to the client
+	char *copy; //read back out of the pipe by proxy_copy, counted in piped
+	size_t copy_start;
+	size_t copy_len;
+	int framing; //how the end of the body is found
+	size_t remaining; //bytes of the body, or of the current chunk, left to splice
+	int last_chunk;
+	int body_done;
+	int error; //502 or 504 once the request failed
+
+	struct proxy_request *next_ready;
+	int ready_queued;
+} proxy_request;
+
+//clients are told about progress through ready(client_fd), only ever
+//from proxy_handle_event and proxy_expire
+void proxy_init(int epollfd, void (*ready)(int client_fd));
+
+//upstreams are "host:port" or "unix:/path", resolved once here
+//health_path is fetched every health_interval_ms, NULL to only check that a connect succeeds
+//returns NULL if an address cannot be resolved
+proxy_pool *proxy_pool_new(const char **upstreams, int count, int idle_connections, int timeout_ms,
+		int max_fails, int health_interval_ms, const char *health_path);
+void proxy_pool_free(proxy_pool *);
+
+//send head (ending with the blank line) to the next live upstream
+//never NULL, error is set if no upstream could take it
+proxy_request *proxy_request_new(proxy_pool *, int client_fd, const char *head, size_t len, int no_body);
+
+//move as much of the body towards the client as both sides allow
+//returns the bytes that reached the client, -1 if writing to it failed
+ssize_t proxy_splice(proxy_request *);
+
+//like proxy_splice for clients that cannot take a splice (TLS without kTLS),
+//the body is read out of the pipe and handed to send, which works like write
+ssize_t proxy_copy(proxy_request *, ssize_t (*send)(void *arg, const void *buf, size_t len), void *arg);
+
+void proxy_release(proxy_request *);
+
+//returns 0 if fd is not an upstream connection
+int proxy_handle_event(int fd, uint32_t events);
+
+//fail requests past their deadline, run health probes and deliver pending notifications
+void proxy_expire(long long now_ms);
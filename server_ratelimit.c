@@ -0,0 +1,190 @@
+#include "server_ratelimit.h"
+#include "server_helpers.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/random.h>
+
+//token buckets live in one fixed array with open addressing
+//a slot is free for reuse once its client has no connections and its bucket
+//has refilled, so spoofed or one-off addresses decay out without a sweep
+
+typedef struct rl_entry {
+	ip_key key;
+	int in_use;
+	int connections;
+	int64_t tokens; //thousandths of a request
+	long long last_ms;
+} rl_entry;
+
+static rl_entry *table = NULL;
+static size_t table_mask = 0;
+static uint32_t hash_seed = 0;
+
+static int64_t rate = 0; //tokens refilled per ms, in thousandths
+static int64_t burst = 0;
+static int max_connections = 0;
+
+void ip_key_from_sockaddr(ip_key *key, const struct sockaddr *addr) {
+	memset(key, 0, sizeof(ip_key));
+
+	if (addr->sa_family == AF_INET6) {
+		memcpy(key->addr, &((struct sockaddr_in6 *)addr)->sin6_addr, 16);
+	} else if (addr->sa_family == AF_INET) {
+		key->addr[10] = 0xff;
+		key->addr[11] = 0xff;
+		memcpy(key->addr + 12, &((struct sockaddr_in *)addr)->sin_addr, 4);
+	} else if (addr->sa_family == AF_UNIX) {
+		key->addr[15] = 1; //local peers count as loopback, all against one key
+	}
+}
+
+int ip_key_is_loopback(const ip_key *key) {
+	static const unsigned char v6_loopback[16] = { [15] = 1 };
+	static const unsigned char v4_mapped[12] = { [10] = 0xff, [11] = 0xff };
+
+	if (memcmp(key->addr, v4_mapped, 12) == 0) {
+		return key->addr[12] == 127;
+	}
+	return memcmp(key->addr, v6_loopback, 16) == 0;
+}
+
+void ratelimit_configure(int rps, int burst_size, int max_conns, int table_size) {
+
+	size_t size = 1;
+	while (size < (size_t)table_size) {
+		size <<= 1;
+	}
+
+	//keep counts across reloads unless the table changes shape
+	if (table == NULL || size != table_mask + 1) {
+		free(table);
+		table = calloc(size, sizeof(rl_entry));
+		table_mask = size - 1;
+	}
+
+	if (hash_seed == 0 && getrandom(&hash_seed, sizeof(hash_seed), 0) != sizeof(hash_seed)) {
+		hash_seed = (uint32_t)monotonic_ms();
+	}
+
+	rate = rps;
+	burst = (int64_t)(burst_size > 0 ? burst_size : rps) * 1000;
+	max_connections = max_conns;
+
+	LOG("Rate limit: %d req/s, burst %d, %d connections per ip, %zu slots\n",
+			rps, burst_size, max_conns, size);
+}
+
+static size_t hash_key(const ip_key *key) {
+	uint32_t hash = 2166136261u ^ hash_seed;
+	for (int i = 0; i < 16; i++) {
+		hash = (hash ^ key->addr[i]) * 16777619u;
+	}
+	return hash & table_mask;
+}
+
+static void refill(rl_entry *entry, long long now) {
+	entry->tokens += (now - entry->last_ms) * rate;
+	if (entry->tokens > burst) {
+		entry->tokens = burst;
+	}
+	entry->last_ms = now;
+}
+
+static int reclaimable(rl_entry *entry, long long now) {
+	if (!entry->in_use) {
+		return 1;
+	}
+	if (entry->connections > 0) {
+		return 0;
+	}
+	return rate == 0 || entry->tokens + (now - entry->last_ms) * rate >= burst;
+}
+
+//find key's slot, or claim a reclaimable one in its probe window
+static rl_entry *lookup(const ip_key *key, int create, long long now) {
+	size_t start = hash_key(key);
+	rl_entry *free_slot = NULL;
+
+	for (size_t i = 0; i < RATE_LIMIT_PROBE; i++) {
+		rl_entry *entry = &table[(start + i) & table_mask];
+
+		if (entry->in_use && memcmp(&entry->key, key, sizeof(ip_key)) == 0) {
+			return entry;
+		}
+		if (free_slot == NULL && reclaimable(entry, now)) {
+			free_slot = entry;
+		}
+	}
+
+	if (!create || free_slot == NULL) {
+		return NULL;
+	}
+
+	free_slot->key = *key;
+	free_slot->in_use = 1;
+	free_slot->connections = 0;
+	free_slot->tokens = burst;
+	free_slot->last_ms = now;
+	return free_slot;
+}
+
+rl_result ratelimit_connect(const ip_key *key) {
+
+	if (table == NULL || (rate == 0 && max_connections == 0)) {
+		return RL_ALLOW;
+	}
+
+	long long now = monotonic_ms();
+	rl_entry *entry = lookup(key, 1, now);
+	if (entry == NULL) {
+		return RL_TABLE_FULL;
+	}
+
+	if (max_connections > 0 && entry->connections >= max_connections) {
+		return RL_TOO_MANY;
+	}
+
+	if (rate > 0) {
+		refill(entry, now);
+		if (entry->tokens < 1000) {
+			return RL_TOO_MANY;
+		}
+		entry->tokens -= 1000;
+	}
+
+	entry->connections += 1;
+	return RL_ALLOW;
+}
+
+rl_result ratelimit_request(const ip_key *key) {
+
+	if (table == NULL || rate == 0) {
+		return RL_ALLOW;
+	}
+
+	long long now = monotonic_ms();
+	rl_entry *entry = lookup(key, 1, now);
+	if (entry == NULL) {
+		return RL_TABLE_FULL;
+	}
+
+	refill(entry, now);
+	if (entry->tokens < 1000) {
+		return RL_TOO_MANY;
+	}
+	entry->tokens -= 1000;
+	return RL_ALLOW;
+}
+
+void ratelimit_disconnect(const ip_key *key) {
+
+	if (table == NULL) {
+		return;
+	}
+
+	rl_entry *entry = lookup(key, 0, monotonic_ms());
+	if (entry != NULL && entry->connections > 0) {
+		entry->connections -= 1;
+	}
+}
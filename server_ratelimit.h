@@ -0,0 +1,32 @@
+#pragma once
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define DEFAULT_RATE_LIMIT_TABLE_SIZE 4096
+#define RATE_LIMIT_PROBE 8 //slots searched per lookup
+
+//client address as a binary key, IPv4 is stored IPv4-mapped (::ffff:a.b.c.d)
+typedef struct ip_key {
+	unsigned char addr[16];
+} ip_key;
+
+typedef enum { RL_ALLOW, RL_TOO_MANY, RL_TABLE_FULL } rl_result;
+
+//fill key from an accepted peer address
+void ip_key_from_sockaddr(ip_key *, const struct sockaddr *);
+
+//127.0.0.0/8 or ::1
+int ip_key_is_loopback(const ip_key *);
+
+//rps/burst of 0 disables the request limit, max_conns of 0 the connection limit
+//table_size is rounded up to a power of two and fixes the memory used
+void ratelimit_configure(int rps, int burst, int max_conns, int table_size);
+
+//account a new connection (and its request) from key
+rl_result ratelimit_connect(const ip_key *);
+
+//connection from key closed
+void ratelimit_disconnect(const ip_key *);
+
+//account another request on a connection from key, an HTTP/2 stream
+rl_result ratelimit_request(const ip_key *);
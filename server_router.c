@@ -0,0 +1,248 @@
+#include "server_router.h"
+#include "server_helpers.h"
+#include "server_proxy.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+//radix trie over location prefixes
+//edges carry whole substrings, so a lookup touches one node per branching
+//point instead of one per character, and walks the path exactly once
+
+typedef struct trie_node {
+	char *label;
+	size_t label_len;
+	location *loc; //set if a prefix ends here
+
+	struct trie_node *child; //first child, children differ in their first byte
+	struct trie_node *sibling;
+} trie_node;
+
+struct router {
+	trie_node root; //empty label
+};
+
+router *router_new() {
+	return calloc(1, sizeof(router));
+}
+
+void location_free(location *loc) {
+	if (loc == NULL) {
+		return;
+	}
+	if (loc->root_fd >= 0) {
+		close(loc->root_fd);
+	}
+	free(loc->prefix);
+	free(loc->root);
+	free(loc->redirect);
+	proxy_pool_free(loc->proxy);
+	for (int i = 0; i < loc->num_index; i++) {
+		free(loc->index[i]);
+	}
+	free(loc->headers);
+	free(loc);
+}
+
+static void free_node(trie_node *node) {
+	while (node != NULL) {
+		trie_node *next = node->sibling;
+		free_node(node->child);
+		location_free(node->loc);
+		free(node->label);
+		free(node);
+		node = next;
+	}
+}
+
+void router_free(router *r) {
+	if (r == NULL) {
+		return;
+	}
+	free_node(r->root.child);
+	location_free(r->root.loc);
+	free(r);
+}
+
+static trie_node *new_node(const char *label, size_t len) {
+	trie_node *node = calloc(1, sizeof(trie_node));
+	node->label = strndup(label, len);
+	node->label_len = len;
+	return node;
+}
+
+int router_add(router *r, location *loc) {
+	trie_node *node = &r->root;
+	const char *key = loc->prefix;
+	size_t key_len = loc->prefix_len;
+
+	while (key_len > 0) {
+		trie_node *child = node->child;
+		while (child != NULL && child->label[0] != key[0]) {
+			child = child->sibling;
+		}
+
+		if (child == NULL) {
+			child = new_node(key, key_len);
+			child->sibling = node->child;
+			node->child = child;
+			node = child;
+			break;
+		}
+
+		//length of the common prefix of the edge and the key
+		size_t common = 0;
+		while (common < child->label_len && common < key_len && child->label[common] == key[common]) {
+			common += 1;
+		}
+
+		//split the edge so the common part gets its own node
+		if (common < child->label_len) {
+			trie_node *rest = new_node(child->label + common, child->label_len - common);
+			rest->loc = child->loc;
+			rest->child = child->child;
+
+			child->label[common] = '\0';
+			child->label_len = common;
+			child->loc = NULL;
+			child->child = rest;
+		}
+
+		node = child;
+		key += common;
+		key_len -= common;
+	}
+
+	if (node->loc != NULL) {
+		return -1;
+	}
+	node->loc = loc;
+	return 0;
+}
+
+location *router_match(const router *r, const char *path) {
+	const trie_node *node = &r->root;
+	location *best = node->loc;
+
+	while (*path) {
+		const trie_node *child = node->child;
+		while (child != NULL && child->label[0] != *path) {
+			child = child->sibling;
+		}
+		if (child == NULL || strncmp(child->label, path, child->label_len) != 0) {
+			break;
+		}
+
+		path += child->label_len;
+		node = child;
+		if (node->loc != NULL) {
+			best = node->loc;
+		}
+	}
+
+	return best;
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+int url_normalize(const char *raw, char *url, size_t size) {
+	if (raw[0] != '/' || size < 2) {
+		return -1;
+	}
+
+	size_t len = 0;
+	size_t segment = 1; //start of the segment being copied
+	url[len++] = '/';
+
+	for (const char *c = raw + 1; ; c++) {
+		char ch = *c;
+		if (ch == '%') {
+			int high = hex_value(c[1]);
+			int low = high < 0 ? -1 : hex_value(c[2]);
+			if (low < 0 || (high == 0 && low == 0)) {
+				return -1;
+			}
+			ch = (char)(high * 16 + low);
+			c += 2;
+		} else if (ch == '?' || ch == '#') {
+			ch = '\0';
+		}
+
+		if (ch != '/' && ch != '\0') {
+			if (len + 1 >= size) {
+				return -1;
+			}
+			url[len++] = ch;
+			continue;
+		}
+
+		//end of a segment, drop "." and back up over ".."
+		size_t segment_len = len - segment;
+		if (segment_len == 1 && url[segment] == '.') {
+			len = segment;
+		} else if (segment_len == 2 && url[segment] == '.' && url[segment + 1] == '.') {
+			if (segment == 1) {
+				return -2;
+			}
+			len = segment - 1;
+			while (url[len - 1] != '/') {
+				len -= 1;
+			}
+		}
+
+		if (ch == '\0') {
+			break;
+		}
+		if (url[len - 1] != '/') {
+			if (len + 1 >= size) {
+				return -1;
+			}
+			url[len++] = '/';
+		}
+		segment = len;
+	}
+
+	url[len] = '\0';
+	return 0;
+}
+
+const char *location_relative(const location *loc, const char *url) {
+	const char *rest = loc->alias ? url + loc->prefix_len : url;
+	while (*rest == '/') {
+		rest += 1;
+	}
+	return *rest ? rest : ".";
+}
+
+int location_path(const location *loc, const char *url, char *path, size_t size) {
+	int written = snprintf(path, size, "%s/%s", loc->root, location_relative(loc, url));
+	return written < 0 || (size_t)written >= size ? -1 : 0;
+}
+
+int open_beneath(int dir_fd, const char *relative) {
+	static int have_openat2 = 1;
+
+	if (have_openat2) {
+		struct open_how how = {
+			.flags = O_RDONLY | O_CLOEXEC,
+			.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+		};
+		int fd = syscall(SYS_openat2, dir_fd, relative, &how, sizeof(how));
+		if (fd >= 0 || errno != ENOSYS) {
+			return fd;
+		}
+
+		//kernels before 5.6, urls are normalized but symlinks may still leave the root
+		LOG("openat2 is not available, falling back to openat\n");
+		have_openat2 = 0;
+	}
+
+	return openat(dir_fd, relative, O_RDONLY | O_CLOEXEC);
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stddef.h>
+
+#define MAX_INDEX_FILES 8
+
+//one locations entry from server.conf, compiled once per config snapshot
+typedef struct location {
+	char *prefix;
+	size_t prefix_len;
+
+	char *root; //files are looked up under root (or alias)
+	size_t root_len;
+	int root_fd; //root opened once, lookups never leave it
+	int alias; //strip prefix before appending the request path
+	int site_root; //root is the site's own, which its archive stands in for
+
+	char *redirect; //301 to redirect + rest of the path, when set
+	struct proxy_pool *proxy; //upstreams the prefix is passed to, when set
+
+	int listing; //list directories without an index
+	char *index[MAX_INDEX_FILES];
+	int num_index;
+
+	char *headers; //security and custom headers, ends with the blank line
+	size_t headers_len;
+} location;
+
+typedef struct router router;
+
+router *router_new();
+void router_free(router *);
+
+//router takes ownership of loc, returns -1 for a duplicate prefix
+int router_add(router *, location *loc);
+
+//longest prefix match, NULL if nothing (not even "/") matches
+location *router_match(const router *, const char *path);
+
+//percent-decode raw and collapse "//", "." and ".." in one pass, stopping at the query
+//returns -1 for a malformed escape or a NUL, -2 if ".." climbs above "/"
+int url_normalize(const char *raw, char *url, size_t size);
+
+//path of a normalized url relative to the location root, "." for the root itself
+const char *location_relative(const location *, const char *url);
+
+//filesystem path for url under loc, for logging and cache keys only
+//returns -1 if it does not fit in size
+int location_path(const location *, const char *url, char *path, size_t size);
+
+//open a relative path beneath dir_fd without following symlinks or ".." out of it
+int open_beneath(int dir_fd, const char *relative);
+
+void location_free(location *);
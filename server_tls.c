@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include "server_tls.h"
+#include "server_helpers.h"
+#include "server_metrics.h"
+#include <stdlib.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+
+#define TLS_FILE_BUFFER 16384 //one full record per write without kTLS
+
+struct tls_context {
+	SSL_CTX *ctx;
+	int http2;
+};
+
+struct tls_conn {
+	SSL *ssl;
+	int fd;
+	int established;
+	int kernel_send;
+};
+
+//one ticket key for the life of the process, so tickets survive reloads
+static unsigned char ticket_keys[80];
+static int ticket_keys_ready = 0;
+
+static const unsigned char ALPN_PROTOCOLS[] = "\x02h2\x08http/1.1";
+
+static void print_errors(const char *what) {
+	unsigned long error;
+	while ((error = ERR_get_error()) != 0) {
+		char buf[256];
+		ERR_error_string_n(error, buf, sizeof(buf));
+		fprintf(stderr, "%s: %s\n", what, buf);
+	}
+}
+
+//our preference wins, h2 only when it is enabled
+static int select_protocol(SSL *ssl, const unsigned char **out, unsigned char *out_len,
+		const unsigned char *in, unsigned int in_len, void *arg) {
+	tls_context *t = arg;
+	const unsigned char *protocols = t->http2 ? ALPN_PROTOCOLS : ALPN_PROTOCOLS + 3;
+	unsigned int len = sizeof(ALPN_PROTOCOLS) - 1 - (t->http2 ? 0 : 3);
+
+	if (SSL_select_next_proto((unsigned char **)out, out_len, protocols, len, in, in_len)
+			!= OPENSSL_NPN_NEGOTIATED) {
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+	return SSL_TLSEXT_ERR_OK;
+}
+
+tls_context *tls_context_new(const char *certificate, const char *key, int http2) {
+
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == NULL) {
+		print_errors("TLS context");
+		return NULL;
+	}
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, certificate) != 1) {
+		print_errors(certificate);
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+		print_errors(key);
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+	//kTLS once the handshake is done, renegotiation would take the keys back
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+	//writes resume with whatever is left of the caller's buffer
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+			| SSL_MODE_RELEASE_BUFFERS);
+
+	//stateless resumption, a reconnect skips the key exchange and certificate
+	if (!ticket_keys_ready && RAND_bytes(ticket_keys, sizeof(ticket_keys)) == 1) {
+		ticket_keys_ready = 1;
+	}
+	if (ticket_keys_ready) {
+		SSL_CTX_set_tlsext_ticket_keys(ctx, ticket_keys, sizeof(ticket_keys));
+	}
+
+	tls_context *t = calloc(1, sizeof(tls_context));
+	t->ctx = ctx;
+	t->http2 = http2;
+	SSL_CTX_set_alpn_select_cb(ctx, select_protocol, t);
+
+	LOG("TLS certificate %s\n", certificate);
+	return t;
+}
+
+void tls_context_free(tls_context *t) {
+	if (t == NULL) {
+		return;
+	}
+	//connections hold their own reference to the SSL_CTX
+	SSL_CTX_set_alpn_select_cb(t->ctx, NULL, NULL);
+	SSL_CTX_free(t->ctx);
+	free(t);
+}
+
+tls_conn *tls_conn_new(tls_context *ctx, int fd) {
+	SSL *ssl = SSL_new(ctx->ctx);
+	if (ssl == NULL || SSL_set_fd(ssl, fd) != 1) {
+		print_errors("TLS connection");
+		SSL_free(ssl);
+		return NULL;
+	}
+	SSL_set_accept_state(ssl);
+
+	tls_conn *t = calloc(1, sizeof(tls_conn));
+	t->ssl = ssl;
+	t->fd = fd;
+	return t;
+}
+
+void tls_conn_free(tls_conn *t) {
+	if (t == NULL) {
+		return;
+	}
+	if (t->established) {
+		SSL_shutdown(t->ssl); //never waits for the client's close_notify
+	}
+	SSL_free(t->ssl);
+	free(t);
+}
+
+int tls_handshake(tls_conn *t) {
+	if (t->established) {
+		return 1;
+	}
+
+	ERR_clear_error();
+	int ret = SSL_do_handshake(t->ssl);
+	if (ret != 1) {
+		int error = SSL_get_error(t->ssl, ret);
+		if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+			return 0;
+		}
+		LOG("TLS handshake failed on %d\n", t->fd);
+		ERR_clear_error();
+		return 3;
+	}
+
+	t->established = 1;
+	t->kernel_send = BIO_get_ktls_send(SSL_get_wbio(t->ssl)) > 0;
+
+	metrics_add(M_TLS_HANDSHAKES, 1);
+	if (SSL_session_reused(t->ssl)) {
+		metrics_add(M_TLS_RESUMED, 1);
+	}
+	if (t->kernel_send) {
+		metrics_add(M_TLS_KERNEL, 1);
+	}
+	LOG("%s %s on %d%s, kTLS send %s, receive %s\n", SSL_get_version(t->ssl), SSL_get_cipher_name(t->ssl),
+			t->fd, SSL_session_reused(t->ssl) ? " resumed" : "", t->kernel_send ? "on" : "off",
+			BIO_get_ktls_recv(SSL_get_rbio(t->ssl)) > 0 ? "on" : "off");
+	return 1;
+}
+
+int tls_alpn_h2(tls_conn *t) {
+	const unsigned char *protocol;
+	unsigned int len;
+	SSL_get0_alpn_selected(t->ssl, &protocol, &len);
+	return len == 2 && memcmp(protocol, "h2", 2) == 0;
+}
+
+int tls_kernel_send(tls_conn *t) {
+	return t->kernel_send;
+}
+
+//sets errno from a failed SSL call, 0 means the client closed cleanly
+static ssize_t tls_failed(tls_conn *t, int ret) {
+	int error = SSL_get_error(t->ssl, ret);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+		errno = EAGAIN;
+		return -1;
+	} else if (error == SSL_ERROR_ZERO_RETURN) {
+		return 0;
+	}
+	ERR_clear_error();
+	errno = error == SSL_ERROR_SYSCALL && errno != 0 ? errno : EIO;
+	return -1;
+}
+
+ssize_t tls_read(tls_conn *t, void *buf, size_t len) {
+	ERR_clear_error();
+	int ret = SSL_read(t->ssl, buf, len);
+	return ret > 0 ? ret : tls_failed(t, ret);
+}
+
+ssize_t tls_write(tls_conn *t, const void *buf, size_t len) {
+	ERR_clear_error();
+	int ret = SSL_write(t->ssl, buf, len);
+	return ret > 0 ? ret : tls_failed(t, ret);
+}
+
+ssize_t tls_read_header(tls_conn *t, char *buffer, size_t count) {
+
+	errno = 0;
+	size_t progress = 0;
+	while (progress < count) {
+		//a byte at a time leaves the body in OpenSSL's record buffer
+		ssize_t result = tls_read(t, buffer + progress, 1);
+
+		if (result > 0) {
+			progress += result;
+			if ((progress >= 2 && strncmp(buffer + progress - 2, "\n\n", 2) == 0)
+					|| (progress >= 4 && strncmp(buffer + progress - 4, "\r\n\r\n", 4) == 0)) {
+				return progress;
+			}
+		} else if (result == -1 && errno == EAGAIN) {
+			return progress;
+		} else if (result == -1) {
+			return -1;
+		} else {
+			return progress;
+		}
+	}
+	return -1;
+}
+
+ssize_t tls_write_all(tls_conn *t, const char *buf, size_t len) {
+
+	errno = 0;
+	size_t progress = 0;
+	while (progress < len) {
+		ssize_t result = tls_write(t, buf + progress, len - progress);
+		if (result > 0) {
+			progress += result;
+			metrics_add(M_BYTES_SENT, result);
+		} else if (result == -1 && errno == EAGAIN) {
+			return progress;
+		} else {
+			if (result == 0) {
+				errno = EPIPE;
+			}
+			return -1;
+		}
+	}
+	return progress;
+}
+
+ssize_t tls_write_file(tls_conn *t, int file_fd, size_t count, size_t offset) {
+
+	errno = 0;
+	size_t progress = 0;
+	while (progress < count) {
+		ssize_t result;
+
+		if (t->kernel_send) {
+			//the kernel encrypts the page cache pages on their way out
+			ERR_clear_error();
+			result = SSL_sendfile(t->ssl, file_fd, offset + progress, count - progress, 0);
+			if (result <= 0) {
+				result = tls_failed(t, result);
+			}
+		} else {
+			//a retry after EAGAIN reads the same bytes again, as OpenSSL expects
+			char buf[TLS_FILE_BUFFER];
+			size_t want = count - progress < sizeof(buf) ? count - progress : sizeof(buf);
+			ssize_t got = pread(file_fd, buf, want, offset + progress);
+			if (got <= 0) {
+				errno = got == 0 ? EIO : errno;
+				return -1;
+			}
+			result = tls_write(t, buf, got);
+		}
+
+		if (result > 0) {
+			progress += result;
+			metrics_add(M_BYTES_SENT, result);
+		} else if (result == -1 && errno == EAGAIN) {
+			return progress;
+		} else {
+			if (result == 0) {
+				errno = EPIPE;
+			}
+			return -1;
+		}
+	}
+	return progress;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+//TLS termination for clients of the tls_port listener
+//the handshake runs in OpenSSL, which hands the session keys to the kernel
+//(TCP_ULP "tls") when it can, so file bodies still go out with sendfile
+//without kTLS every record is encrypted here instead
+
+typedef struct tls_context tls_context;
+typedef struct tls_conn tls_conn;
+
+//certificate chain and key in PEM, offers h2 by ALPN when http2 is set
+//returns NULL with a message on stderr if they cannot be used
+tls_context *tls_context_new(const char *certificate, const char *key, int http2);
+void tls_context_free(tls_context *);
+
+//the socket must be nonblocking
+tls_conn *tls_conn_new(tls_context *, int fd);
+
+//sends close_notify if it can, the socket is left open
+void tls_conn_free(tls_conn *);
+
+//returns 0 when blocked, 1 once established (and on every later call), 3 on error
+int tls_handshake(tls_conn *);
+
+//the client picked h2 by ALPN
+int tls_alpn_h2(tls_conn *);
+
+//the kernel encrypts what is written to the socket, so it can be spliced into
+int tls_kernel_send(tls_conn *);
+
+//like read and write on a nonblocking socket: -1 with errno EAGAIN when blocked
+ssize_t tls_read(tls_conn *, void *buf, size_t len);
+ssize_t tls_write(tls_conn *, const void *buf, size_t len);
+
+//like read_header: stops after the blank line, progress with errno EAGAIN
+//when blocked, -1 if it does not fit
+ssize_t tls_read_header(tls_conn *, char *buf, size_t max_length);
+
+//like write_all_to_socket, errno is EAGAIN when not everything was sent
+ssize_t tls_write_all(tls_conn *, const char *buf, size_t len);
+
+//send a part of a file, with sendfile under kTLS
+ssize_t tls_write_file(tls_conn *, int file_fd, size_t count, size_t offset);
@@ -0,0 +1,106 @@
+#include "server_trace.h"
+#include "server_helpers.h"
+#include "server_metrics.h"
+#include <stdlib.h>
+#include <time.h>
+
+//USDT probes for bpftrace/perf, e.g.
+//  bpftrace -e 'usdt:/bin/http_server:http_server:stage { @[arg1] = hist(arg2); }'
+//arg0 is the connection id, arg1 the point reached, arg2 us since the previous point
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(conn_id, point, us) DTRACE_PROBE3(http_server, stage, conn_id, point, us)
+#endif
+#endif
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(conn_id, point, us)
+#endif
+
+typedef struct slow_request {
+	time_t when;
+	uint64_t conn_id;
+	char ip[46];
+	char request[SLOW_REQUEST_LINE];
+	int status;
+	long long stage_us[TRACE_STAGES];
+	long long total_us;
+} slow_request;
+
+static slow_request slow_ring[SLOW_RING_SIZE];
+static uint64_t slow_count = 0;
+
+void trace_mark(request_trace *trace, trace_point point, uint64_t conn_id) {
+	if (trace->at_us[point] != 0) {
+		return;
+	}
+	trace->at_us[point] = monotonic_us();
+
+	long long since = point > 0 && trace->at_us[point - 1] ? trace->at_us[point] - trace->at_us[point - 1] : 0;
+	TRACE_PROBE(conn_id, (int)point, since);
+	(void)since;
+}
+
+void trace_finish(request_trace *trace, uint64_t conn_id, const char *ip,
+		const char *request, int status, int slow_ms) {
+
+	trace_mark(trace, TRACE_DONE, conn_id);
+
+	//points a request skipped (errors, HEAD) count as zero-length stages
+	long long stage_us[TRACE_STAGES];
+	for (int i = 1; i < TRACE_POINTS; i++) {
+		if (trace->at_us[i] == 0) {
+			trace->at_us[i] = trace->at_us[i - 1];
+		}
+		stage_us[i - 1] = trace->at_us[i] - trace->at_us[i - 1];
+		metrics_stage(i - 1, stage_us[i - 1]);
+	}
+
+	long long total_us = trace->at_us[TRACE_DONE] - trace->at_us[TRACE_ACCEPT];
+	if (slow_ms <= 0 || total_us < (long long)slow_ms * 1000) {
+		return;
+	}
+
+	slow_request *slow = &slow_ring[slow_count++ % SLOW_RING_SIZE];
+	slow->when = time(NULL);
+	slow->conn_id = conn_id;
+	snprintf(slow->ip, sizeof(slow->ip), "%s", ip);
+	slow->request[0] = '\0';
+	if (request != NULL) {
+		snprintf(slow->request, sizeof(slow->request), "%.*s",
+				(int)strcspn(request, "\r\n"), request);
+	}
+	slow->status = status;
+	memcpy(slow->stage_us, stage_us, sizeof(stage_us));
+	slow->total_us = total_us;
+}
+
+char *trace_render_slow(size_t *length) {
+	size_t capacity = 4096;
+	char *buf = malloc(capacity);
+	*length = 0;
+	buf[0] = '\0';
+
+	uint64_t first = slow_count > SLOW_RING_SIZE ? slow_count - SLOW_RING_SIZE : 0;
+	for (uint64_t i = first; i < slow_count; i++) {
+		slow_request *slow = &slow_ring[i % SLOW_RING_SIZE];
+
+		char date[32];
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&slow->when));
+		metrics_appendf(&buf, length, &capacity, "%s conn=%llu ip=%s status=%d total=%lldus",
+				date, (unsigned long long)slow->conn_id, slow->ip, slow->status, slow->total_us);
+		for (int s = 0; s < TRACE_STAGES; s++) {
+			metrics_appendf(&buf, length, &capacity, " %s=%lldus", metrics_stage_names[s], slow->stage_us[s]);
+		}
+		metrics_appendf(&buf, length, &capacity, " \"%s\"\n", slow->request);
+	}
+	return buf;
+}
+
+void trace_dump_slow(FILE *out) {
+	size_t length;
+	char *text = trace_render_slow(&length);
+	fprintf(out, "%llu slow requests so far, last %d:\n%s",
+			(unsigned long long)slow_count, SLOW_RING_SIZE, text);
+	free(text);
+}
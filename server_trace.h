@@ -0,0 +1,36 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//per-stage request timing
+//a request passes these points in order, the stages are the gaps between them
+typedef enum {
+	TRACE_ACCEPT,
+	TRACE_HEADER_READ, //request header complete
+	TRACE_RESOLVED, //path resolved, response header being written
+	TRACE_STATUS_SENT, //response header on the wire
+	TRACE_DONE, //body written
+	TRACE_POINTS
+} trace_point;
+
+#define TRACE_STAGES (TRACE_POINTS - 1)
+#define SLOW_RING_SIZE 64
+#define SLOW_REQUEST_LINE 128
+#define DEFAULT_SLOW_REQUEST_MS 1000
+
+typedef struct request_trace {
+	long long at_us[TRACE_POINTS]; //0 until reached
+} request_trace;
+
+//record the first time a request reaches point (fires the USDT probe too)
+void trace_mark(request_trace *, trace_point, uint64_t conn_id);
+
+//fold a finished request into the stage histograms, and into the slow
+//request ring if it took longer than slow_ms (0 disables the ring)
+void trace_finish(request_trace *, uint64_t conn_id, const char *ip,
+		const char *request, int status, int slow_ms);
+
+//slow requests, oldest first, as text
+char *trace_render_slow(size_t *length);
+void trace_dump_slow(FILE *);
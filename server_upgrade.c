@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include "server_upgrade.h"
+#include "server_helpers.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+pid_t upgrade_exec(char **argv, const int *fds, int count, int *ready_fd) {
+
+	int ready[2];
+	if (pipe2(ready, O_CLOEXEC) == -1) {
+		perror("pipe");
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		close(ready[0]);
+		close(ready[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		//only the listeners and the ready pipe survive the exec
+		char list[16 * 12] = "";
+		size_t length = 0;
+		for (int i = 0; i < count && length + 12 < sizeof(list); i++) {
+			fcntl(fds[i], F_SETFD, fcntl(fds[i], F_GETFD) & ~FD_CLOEXEC);
+			length += sprintf(list + length, "%s%d", i > 0 ? "," : "", fds[i]);
+		}
+		setenv(LISTEN_FD_ENV, list, 1);
+		unsetenv(TLS_LISTEN_FD_ENV);
+		fcntl(ready[1], F_SETFD, 0);
+
+		char buf[16];
+		sprintf(buf, "%d", ready[1]);
+		setenv(READY_FD_ENV, buf, 1);
+
+		signal(SIGHUP, SIG_DFL);
+		signal(SIGUSR2, SIG_DFL);
+
+		execvp(argv[0], argv);
+		perror("execvp");
+		_exit(127);
+	}
+
+	close(ready[1]);
+	LOG("Started upgraded binary %s as pid %d\n", argv[0], pid);
+
+	//the loop keeps serving while the new process starts up
+	fcntl(ready[0], F_SETFL, fcntl(ready[0], F_GETFL) | O_NONBLOCK);
+	*ready_fd = ready[0];
+	return pid;
+}
+
+int upgrade_ready(int ready_fd) {
+	char ok = 0;
+	ssize_t n;
+	while ((n = read(ready_fd, &ok, 1)) == -1 && errno == EINTR);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	//closed without a word: it exited or failed before serving
+	return n == 1 && ok == '1' ? 1 : -1;
+}
+
+void upgrade_abort(pid_t pid, int ready_fd) {
+	fprintf(stderr, "Upgraded binary did not become ready, keep serving\n");
+	close(ready_fd);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+static int inherited_listener(const char *value) {
+	int fd = atoi(value);
+	int listening = 0;
+	socklen_t len = sizeof(listening);
+	if (fd <= 2 || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1 || !listening) {
+		fprintf(stderr, "Ignoring invalid inherited listener %s\n", value);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	LOG("Inherited listening socket %d\n", fd);
+	return fd;
+}
+
+int upgrade_inherited_listeners(int *fds, int max) {
+
+	int count = 0;
+	const char *names[] = { LISTEN_FD_ENV, TLS_LISTEN_FD_ENV };
+	for (int i = 0; i < 2; i++) {
+		char *env = getenv(names[i]);
+		if (env == NULL) {
+			continue;
+		}
+		env = strdupa(env);
+		unsetenv(names[i]);
+
+		char *save = NULL;
+		for (char *value = strtok_r(env, ",", &save); value != NULL; value = strtok_r(NULL, ",", &save)) {
+			int fd = inherited_listener(value);
+			if (fd == -1) {
+				continue;
+			}
+			if (count == max) {
+				close(fd);
+				continue;
+			}
+			fds[count++] = fd;
+		}
+	}
+	return count;
+}
+
+void upgrade_notify_ready() {
+
+	char *env = getenv(READY_FD_ENV);
+	if (env == NULL) {
+		return;
+	}
+	unsetenv(READY_FD_ENV);
+
+	int fd = atoi(env);
+	if (write(fd, "1", 1) != 1) {
+		perror("Upgrade ready notification");
+	}
+	close(fd);
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <sys/types.h>
+
+//zero-downtime binary upgrade
+//the old process execs the new binary with the listening sockets inherited,
+//keeps serving until it reports ready, then stops accepting and drains its clients
+
+#define LISTEN_FD_ENV "EPOLL_WEBSERVER_LISTEN_FD" //comma separated
+#define TLS_LISTEN_FD_ENV "EPOLL_WEBSERVER_TLS_LISTEN_FD" //only set by older binaries
+#define READY_FD_ENV "EPOLL_WEBSERVER_READY_FD"
+#define UPGRADE_READY_TIMEOUT_MS 10000 //deadline for the ready report, checked by the loop
+
+//fork and exec argv with the count listening sockets in fds inherited
+//returns the child's pid, -1 if it could not be started. *ready_fd is the
+//nonblocking read end of the pipe it reports on, for the event loop to watch
+pid_t upgrade_exec(char **argv, const int *fds, int count, int *ready_fd);
+
+//read the child's report once ready_fd is readable
+//returns 1 once it is serving, 0 if nothing has arrived, -1 if it failed
+int upgrade_ready(int ready_fd);
+
+//give up on a child that failed or ran out of time: close ready_fd, kill and reap it
+void upgrade_abort(pid_t pid, int ready_fd);
+
+//listening sockets handed down by the previous process, up to max of them
+//returns how many were stored in fds
+int upgrade_inherited_listeners(int *fds, int max);
+
+//tell the previous process we are accepting connections
+void upgrade_notify_ready();
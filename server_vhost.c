@@ -0,0 +1,146 @@
+#include "server_vhost.h"
+#include "server_helpers.h"
+#include <stdlib.h>
+#include <ctype.h>
+
+//open addressing with linear probing over every host name
+//sized at startup to at most half full, so probes stay short
+
+typedef struct vhost_entry {
+	const char *name; //NULL for an empty slot
+	vhost *host;
+} vhost_entry;
+
+struct vhost_table {
+	vhost_entry *entries;
+	size_t mask;
+
+	vhost **hosts;
+	int num_hosts;
+};
+
+static size_t hash_name(const char *name, size_t len) {
+	size_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+void vhost_free(vhost *host) {
+	if (host == NULL) {
+		return;
+	}
+	for (int i = 0; i < host->num_names; i++) {
+		free(host->names[i]);
+	}
+	free(host->names);
+	free(host->root_site);
+	free(host->security_headers);
+	router_free(host->router);
+	file_cache_free(host->cache);
+	fastcgi_pool_free(host->fastcgi);
+	archive_close(host->archive);
+	free(host);
+}
+
+static vhost_entry *find(const vhost_table *table, const char *name, size_t len) {
+	size_t slot = hash_name(name, len) & table->mask;
+	while (table->entries[slot].name != NULL) {
+		if (strncmp(table->entries[slot].name, name, len) == 0 && table->entries[slot].name[len] == '\0') {
+			return &table->entries[slot];
+		}
+		slot = (slot + 1) & table->mask;
+	}
+	return &table->entries[slot];
+}
+
+vhost_table *vhost_table_build(vhost **hosts, int count) {
+	vhost_table *table = calloc(1, sizeof(vhost_table));
+	table->hosts = hosts;
+	table->num_hosts = count;
+
+	size_t names = 0;
+	for (int i = 0; i < count; i++) {
+		names += hosts[i]->num_names;
+	}
+	size_t capacity = 8;
+	while (capacity < names * 2) {
+		capacity *= 2;
+	}
+	table->entries = calloc(capacity, sizeof(vhost_entry));
+	table->mask = capacity - 1;
+
+	for (int i = 0; i < count; i++) {
+		for (int j = 0; j < hosts[i]->num_names; j++) {
+			const char *name = hosts[i]->names[j];
+			vhost_entry *entry = find(table, name, strlen(name));
+			if (entry->name != NULL) {
+				fprintf(stderr, "vhost name %s is used twice\n", name);
+				vhost_table_free(table);
+				return NULL;
+			}
+			entry->name = name;
+			entry->host = hosts[i];
+		}
+	}
+
+	LOG("Built vhost table of %zu names in %zu slots\n", names, capacity);
+	return table;
+}
+
+void vhost_table_free(vhost_table *table) {
+	if (table == NULL) {
+		return;
+	}
+	for (int i = 0; i < table->num_hosts; i++) {
+		vhost_free(table->hosts[i]);
+	}
+	free(table->hosts);
+	free(table->entries);
+	free(table);
+}
+
+vhost *vhost_lookup(const vhost_table *table, const char *host, size_t len) {
+
+	//"[::1]:8080" keeps its brackets, "example.com:8080" loses the port
+	const char *end = host + len;
+	if (len > 0 && host[0] == '[') {
+		const char *bracket = memchr(host, ']', len);
+		end = bracket != NULL ? bracket + 1 : end;
+	} else {
+		const char *colon = memchr(host, ':', len);
+		end = colon != NULL ? colon : end;
+	}
+	if (end > host && end[-1] == '.') {
+		end -= 1;
+	}
+
+	//room for the "*" of a wildcard key in front
+	char key[MAX_HOST_NAME + 2];
+	size_t key_len = end - host;
+	if (key_len == 0 || key_len > MAX_HOST_NAME) {
+		return NULL;
+	}
+	for (size_t i = 0; i < key_len; i++) {
+		key[i + 1] = tolower((unsigned char)host[i]);
+	}
+
+	vhost_entry *entry = find(table, key + 1, key_len);
+	if (entry->name != NULL) {
+		return entry->host;
+	}
+
+	//"*.b.example.com" then "*.example.com" then "*.com"
+	for (size_t dot = 1; dot < key_len + 1; dot++) {
+		if (key[dot] == '.') {
+			key[dot - 1] = '*';
+			entry = find(table, key + dot - 1, key_len - dot + 2);
+			if (entry->name != NULL) {
+				return entry->host;
+			}
+		}
+	}
+
+	return NULL;
+}
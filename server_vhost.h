@@ -0,0 +1,36 @@
+#pragma once
+#include <stddef.h>
+#include "server_router.h"
+#include "server_filecache.h"
+#include "server_fastcgi.h"
+#include "server_archive.h"
+
+#define MAX_HOST_NAME 255
+
+//one site served by this process
+typedef struct vhost {
+	char **names; //lowercase, "*.example.com" matches any subdomain
+	int num_names;
+
+	char *root_site;
+	char *security_headers; //pre-rendered, ends with the blank line
+	size_t security_headers_len;
+
+	router *router;
+	file_cache *cache; //mappings of this site's files, with its own budget
+	fastcgi_pool *fastcgi; //runs .php files, NULL to send them as files
+	site_archive *archive; //the root packed by http_mkarchive, NULL to serve it from disk
+} vhost;
+
+void vhost_free(vhost *);
+
+typedef struct vhost_table vhost_table;
+
+//hash every name of every host, the table owns the hosts afterwards
+//returns NULL if a name is claimed twice
+vhost_table *vhost_table_build(vhost **hosts, int count);
+void vhost_table_free(vhost_table *);
+
+//site for the value of a Host header, port and case ignored
+//an exact name wins over a wildcard, a longer wildcard over a shorter one
+vhost *vhost_lookup(const vhost_table *, const char *host, size_t len);
@@ -0,0 +1,433 @@
+#define _GNU_SOURCE
+#include "server_warmup.h"
+#include "server_helpers.h"
+#include "server_memory.h"
+#include "server_metrics.h"
+#include <stdlib.h>
+#include <limits.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <magic.h>
+
+typedef struct warm_entry {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	const char *mime; //interned, shared by every file of the type
+	struct warm_entry *next;
+} warm_entry;
+
+//written by the crawl workers under index_lock, afterwards only by the event loop
+static warm_entry *buckets[WARMUP_BUCKETS];
+static size_t num_entries = 0;
+static size_t index_bytes = 0; //charged to MEM_WARMUP
+static char *index_root = NULL; //NULL until a crawl or snapshot filled the index
+static char **mime_types = NULL;
+static size_t num_mime_types = 0;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//directories waiting for a worker
+typedef struct crawl {
+	char **dirs;
+	size_t num_dirs;
+	size_t dirs_cap;
+	int busy; //workers inside a directory, they may still queue more
+	long files;
+	const char *magic_file;
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+} crawl;
+
+static unsigned int hash_path(const char *path) {
+	unsigned int hash = 2166136261u;
+	for (; *path; path++) {
+		hash = (hash ^ (unsigned char)*path) * 16777619u;
+	}
+	return hash % WARMUP_BUCKETS;
+}
+
+//a few dozen types cover a whole site, a list is enough
+static const char *intern_mime(const char *mime) {
+	for (size_t i = 0; i < num_mime_types; i++) {
+		if (strcmp(mime_types[i], mime) == 0) {
+			return mime_types[i];
+		}
+	}
+	mime_types = realloc(mime_types, (num_mime_types + 1) * sizeof(char *));
+	mime_types[num_mime_types] = strdup(mime);
+	return mime_types[num_mime_types++];
+}
+
+static warm_entry *find(const char *path) {
+	warm_entry *e = buckets[hash_path(path)];
+	while (e != NULL && strcmp(e->path, path) != 0) {
+		e = e->next;
+	}
+	return e;
+}
+
+static void insert(const char *path, const struct stat *file_stat, const char *mime) {
+	warm_entry *e = find(path);
+	if (e == NULL) {
+		unsigned int bucket = hash_path(path);
+		e = calloc(1, sizeof(warm_entry));
+		e->path = strdup(path);
+		e->next = buckets[bucket];
+		buckets[bucket] = e;
+		num_entries++;
+		index_bytes += sizeof(warm_entry) + strlen(path) + 1;
+		memory_charge(MEM_WARMUP, sizeof(warm_entry) + strlen(path) + 1);
+	}
+	e->dev = file_stat->st_dev;
+	e->ino = file_stat->st_ino;
+	e->size = file_stat->st_size;
+	e->mtime = file_stat->st_mtim;
+	e->mime = intern_mime(mime);
+}
+
+static void drop_entries() {
+	for (int i = 0; i < WARMUP_BUCKETS; i++) {
+		while (buckets[i] != NULL) {
+			warm_entry *e = buckets[i];
+			buckets[i] = e->next;
+			free(e->path);
+			free(e);
+		}
+	}
+	num_entries = 0;
+	memory_release(MEM_WARMUP, index_bytes);
+	index_bytes = 0;
+}
+
+//under memory pressure the entries go as a whole, libmagic answers again
+//and what it finds is remembered from scratch. the interned types stay,
+//requests in flight point at them
+static size_t reclaim(void *arg, size_t want) {
+	size_t freed = index_bytes;
+	if (freed > 0) {
+		fprintf(stderr, "Dropped the warm-up index of %zu files under memory pressure\n", num_entries);
+	}
+	drop_entries();
+	return freed;
+}
+
+//same form as location roots, so paths match the ones requests build
+static char *normalize_root(const char *root) {
+	char *normalized = strdup(root);
+	size_t len = strlen(normalized);
+	while (len > 1 && normalized[len - 1] == '/') {
+		normalized[--len] = '\0';
+	}
+	return normalized;
+}
+
+static void push_dir(crawl *c, char *path) {
+	pthread_mutex_lock(&c->lock);
+	if (c->num_dirs == c->dirs_cap) {
+		c->dirs_cap = c->dirs_cap ? c->dirs_cap * 2 : 64;
+		c->dirs = realloc(c->dirs, c->dirs_cap * sizeof(char *));
+	}
+	c->dirs[c->num_dirs++] = path;
+	pthread_cond_signal(&c->more);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void crawl_dir(crawl *c, magic_t magic, const char *dir) {
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		LOG("Warm-up skipped %s: %s\n", dir, strerror(errno));
+		return;
+	}
+
+	struct dirent *ent;
+	while ((ent = readdir(d)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+		char path[PATH_MAX];
+		int len = snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if (len < 0 || (size_t)len >= sizeof(path) || strpbrk(ent->d_name, "\t\n") != NULL) {
+			continue;
+		}
+
+		//symlinks are left to the request, which resolves them beneath the root
+		struct stat file_stat;
+		if (fstatat(dirfd(d), ent->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+			continue;
+		}
+		if (S_ISDIR(file_stat.st_mode)) {
+			push_dir(c, strdup(path));
+			continue;
+		} else if (!S_ISREG(file_stat.st_mode)) {
+			continue;
+		}
+
+		const char *mime = mime_type_by_extension(path);
+		int small = file_stat.st_size <= WARMUP_SMALL_FILE;
+		if (mime == NULL || small) {
+			int fd = openat(dirfd(d), ent->d_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+			if (fd != -1) {
+				if (small) {
+					posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+				}
+				if (mime == NULL && magic != NULL) {
+					mime = magic_descriptor(magic, fd);
+				}
+				close(fd);
+			}
+		}
+		if (mime == NULL) {
+			continue;
+		}
+
+		pthread_mutex_lock(&index_lock);
+		insert(path, &file_stat, mime);
+		c->files++;
+		pthread_mutex_unlock(&index_lock);
+	}
+	closedir(d);
+}
+
+static void *crawl_worker(void *arg) {
+	crawl *c = arg;
+
+	//signals stay with the main thread, whose handlers assume they own the process
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+	//a cookie is not safe to share between threads, each loads what the server's own did
+	magic_t magic = magic_open(MAGIC_MIME_TYPE);
+	if (magic != NULL) {
+		magic_load(magic, c->magic_file);
+	}
+
+	pthread_mutex_lock(&c->lock);
+	while (1) {
+		while (c->num_dirs == 0 && c->busy > 0) {
+			pthread_cond_wait(&c->more, &c->lock);
+		}
+		if (c->num_dirs == 0) {
+			break;
+		}
+		char *dir = c->dirs[--c->num_dirs];
+		c->busy++;
+		pthread_mutex_unlock(&c->lock);
+
+		crawl_dir(c, magic, dir);
+		free(dir);
+
+		pthread_mutex_lock(&c->lock);
+		c->busy--;
+	}
+	//wake the others, nothing is left for them either
+	pthread_cond_broadcast(&c->more);
+	pthread_mutex_unlock(&c->lock);
+
+	if (magic != NULL) {
+		magic_close(magic);
+	}
+	return NULL;
+}
+
+long warmup_crawl(const char *root, int threads, const char *magic_file) {
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	threads = threads < 1 ? 1 : threads > WARMUP_MAX_THREADS ? WARMUP_MAX_THREADS : threads;
+
+	crawl c = { .magic_file = magic_file };
+	pthread_mutex_init(&c.lock, NULL);
+	pthread_cond_init(&c.more, NULL);
+
+	free(index_root);
+	index_root = normalize_root(root);
+	push_dir(&c, strdup(index_root));
+	memory_reclaimer_remove(reclaim, NULL);
+	memory_reclaimer_add(MEM_WARMUP, reclaim, NULL);
+
+	long long start_ms = monotonic_ms();
+	pthread_t workers[WARMUP_MAX_THREADS];
+	int started = 0;
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&workers[started], NULL, crawl_worker, &c) == 0) {
+			started++;
+		}
+	}
+	if (started == 0) {
+		crawl_worker(&c);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	free(c.dirs);
+	pthread_cond_destroy(&c.more);
+	pthread_mutex_destroy(&c.lock);
+
+	fprintf(stderr, "Warm-up crawl of %s: %ld files in %lldms on %d threads\n",
+			index_root, c.files, monotonic_ms() - start_ms, started > 0 ? started : 1);
+	return c.files;
+}
+
+long warmup_load(const char *snapshot, const char *root) {
+	FILE *f = fopen(snapshot, "r");
+	if (f == NULL) {
+		LOG("No warm-up snapshot at %s\n", snapshot);
+		return -1;
+	}
+
+	char *normalized = normalize_root(root);
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	long count = -1;
+
+	//the snapshot only describes the root it was written for
+	if ((len = getline(&line, &cap, f)) <= 0 || strcmp(line, WARMUP_MAGIC "\n") != 0
+			|| (len = getline(&line, &cap, f)) <= 0 || line[len - 1] != '\n'
+			|| (line[len - 1] = '\0', strcmp(line, normalized) != 0)) {
+		fprintf(stderr, "%s is not a warm-up snapshot of %s\n", snapshot, normalized);
+		free(normalized);
+		goto done;
+	}
+	free(index_root);
+	index_root = normalized;
+	memory_reclaimer_remove(reclaim, NULL);
+	memory_reclaimer_add(MEM_WARMUP, reclaim, NULL);
+
+	count = 0;
+	while ((len = getline(&line, &cap, f)) > 0) {
+		if (line[len - 1] == '\n') {
+			line[len - 1] = '\0';
+		}
+		char *mime = strchr(line, '\t');
+		char *path = mime != NULL ? strchr(mime + 1, '\t') : NULL;
+		if (path == NULL) {
+			continue;
+		}
+		*mime++ = '\0';
+		*path++ = '\0';
+
+		unsigned long long dev, ino, sec, nsec;
+		long long size;
+		if (sscanf(line, "%llu %llu %lld %llu %llu", &dev, &ino, &size, &sec, &nsec) != 5) {
+			continue;
+		}
+		struct stat file_stat = {
+			.st_dev = dev,
+			.st_ino = ino,
+			.st_size = size,
+			.st_mtim = { .tv_sec = sec, .tv_nsec = nsec },
+		};
+		insert(path, &file_stat, mime);
+		count++;
+	}
+	fprintf(stderr, "Warm-up snapshot %s: %ld files\n", snapshot, count);
+
+done:
+	free(line);
+	fclose(f);
+	return count;
+}
+
+int warmup_save(const char *snapshot) {
+	if (index_root == NULL) {
+		return -1;
+	}
+
+	char temp[PATH_MAX];
+	if (snprintf(temp, sizeof(temp), "%s.XXXXXX", snapshot) >= (int)sizeof(temp)) {
+		return -1;
+	}
+	int fd = mkstemp(temp);
+	FILE *f = fd != -1 ? fdopen(fd, "w") : NULL;
+	if (f == NULL) {
+		perror(snapshot);
+		if (fd != -1) {
+			close(fd);
+			unlink(temp);
+		}
+		return -1;
+	}
+
+	fprintf(f, "%s\n%s\n", WARMUP_MAGIC, index_root);
+	for (int i = 0; i < WARMUP_BUCKETS; i++) {
+		for (warm_entry *e = buckets[i]; e != NULL; e = e->next) {
+			fprintf(f, "%llu %llu %lld %llu %llu\t%s\t%s\n", (unsigned long long)e->dev,
+					(unsigned long long)e->ino, (long long)e->size, (unsigned long long)e->mtime.tv_sec,
+					(unsigned long long)e->mtime.tv_nsec, e->mime, e->path);
+		}
+	}
+
+	//a crash mid-write leaves the previous snapshot in place
+	if (fflush(f) != 0 || fsync(fileno(f)) == -1 || fclose(f) != 0 || rename(temp, snapshot) == -1) {
+		perror(snapshot);
+		unlink(temp);
+		return -1;
+	}
+	LOG("Saved %zu warm-up entries to %s\n", num_entries, snapshot);
+	return 0;
+}
+
+void warmup_prime(file_cache *cache, size_t max_bytes) {
+	size_t primed = 0;
+	int files = 0;
+	for (int i = 0; i < WARMUP_BUCKETS; i++) {
+		for (warm_entry *e = buckets[i]; e != NULL; e = e->next) {
+			if (e->size == 0 || e->size > WARMUP_SMALL_FILE || primed + e->size > max_bytes) {
+				continue;
+			}
+			int fd = open(e->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+			if (fd == -1) {
+				continue;
+			}
+			file_map *map = file_cache_get(cache, e->path, fd);
+			close(fd);
+			if (map != NULL) {
+				primed += map->size;
+				files++;
+				file_map_release(map);
+			}
+		}
+	}
+	LOG("Warm-up mapped %d small files, %zu bytes\n", files, primed);
+}
+
+const char *warmup_mime(const char *path, const struct stat *file_stat) {
+	if (index_root == NULL) {
+		return NULL;
+	}
+	warm_entry *e = find(path);
+	if (e == NULL || e->ino != file_stat->st_ino || e->dev != file_stat->st_dev
+			|| e->size != file_stat->st_size
+			|| e->mtime.tv_sec != file_stat->st_mtim.tv_sec
+			|| e->mtime.tv_nsec != file_stat->st_mtim.tv_nsec) {
+		return NULL;
+	}
+	metrics_add(M_WARMUP_HITS, 1);
+	return e->mime;
+}
+
+void warmup_remember(const char *path, const struct stat *file_stat, const char *mime) {
+	if (index_root != NULL && mime != NULL && strpbrk(path, "\t\n") == NULL) {
+		insert(path, file_stat, mime);
+	}
+}
+
+void warmup_free() {
+	drop_entries();
+	memory_reclaimer_remove(reclaim, NULL);
+	for (size_t i = 0; i < num_mime_types; i++) {
+		free(mime_types[i]);
+	}
+	free(mime_types);
+	mime_types = NULL;
+	num_mime_types = 0;
+	free(index_root);
+	index_root = NULL;
+}
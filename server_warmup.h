@@ -0,0 +1,43 @@
+#pragma once
+#include <stddef.h>
+#include <sys/stat.h>
+#include "server_filecache.h"
+
+//startup warm-up of the webroot
+//worker threads walk the root before the server accepts, stat'ing every file
+//(which fills the kernel's dentry and inode caches), reading small files ahead
+//into the page cache and running libmagic once per file. the MIME types end up
+//in an index that set_mime_type consults instead of libmagic. the index is
+//written to a snapshot on exit and loaded by the next start in place of a crawl;
+//entries are checked against the request's own fstat, so stale ones are just misses
+//
+//snapshot layout, one text line each:
+//    WARMUP_MAGIC, then the root, then per file
+//    dev ino size mtime_sec mtime_nsec mime<TAB>path
+
+#define WARMUP_MAGIC "EWWARM1"
+#define WARMUP_BUCKETS 4096
+#define WARMUP_SMALL_FILE 65536 //files up to this size are read ahead and mapped
+#define WARMUP_MAX_THREADS 64
+
+//walk root with threads workers (0 for one per CPU) and fill the index
+//magic_file is the compiled database each worker loads, returns files indexed
+long warmup_crawl(const char *root, int threads, const char *magic_file);
+
+//fill the index from a snapshot of the same root, -1 if there is none or it does not match
+long warmup_load(const char *snapshot, const char *root);
+
+//write the index next to snapshot and rename it over, -1 on failure
+int warmup_save(const char *snapshot);
+
+//map the small files found by the crawl into cache, up to max_bytes
+void warmup_prime(file_cache *, size_t max_bytes);
+
+//MIME type of path if the index has it and file_stat is still the same file, else NULL
+const char *warmup_mime(const char *path, const struct stat *file_stat);
+
+//keep a type libmagic found after startup, so the next snapshot has it
+//does nothing unless the index was filled by a crawl or a snapshot
+void warmup_remember(const char *path, const struct stat *file_stat, const char *mime);
+
+void warmup_free();
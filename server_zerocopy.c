@@ -0,0 +1,223 @@
+#include "server_zerocopy.h"
+#include "server_helpers.h"
+#include "server_metrics.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+//the references of one zerocopy_write, released once all its sends complete
+typedef struct zerocopy_pin {
+	uint32_t first; //kernel's id of the first send
+	uint32_t count; //sends it made
+	uint32_t pending; //of those not yet completed
+	zerocopy_release release;
+	void *pinned;
+} zerocopy_pin;
+
+struct zerocopy_conn {
+	int off; //the socket refused SO_ZEROCOPY, or the kernel copies for it anyway
+	uint32_t next_id; //every successful MSG_ZEROCOPY send takes the next one
+
+	zerocopy_pin *pins;
+	size_t num_pins;
+	size_t pins_cap;
+
+	//lingering after the client was removed
+	int fd;
+	long long closed_ms;
+	struct zerocopy_conn *next;
+};
+
+static size_t threshold = DEFAULT_ZEROCOPY_THRESHOLD;
+static zerocopy_conn *lingering = NULL;
+
+void zerocopy_configure(size_t bytes) {
+	threshold = bytes;
+	LOG("Zerocopy sends: %s, from %zu bytes\n", bytes > 0 ? "on" : "off", bytes);
+}
+
+static void add_pin(zerocopy_conn *zc, uint32_t first, uint32_t count, zerocopy_release release, void *pinned) {
+	if (zc->num_pins == zc->pins_cap) {
+		zc->pins_cap = zc->pins_cap > 0 ? zc->pins_cap * 2 : 4;
+		zc->pins = realloc(zc->pins, zc->pins_cap * sizeof(zerocopy_pin));
+	}
+	zc->pins[zc->num_pins++] = (zerocopy_pin){ first, count, count, release, pinned };
+	metrics_add(M_ZEROCOPY_PINNED, 1);
+}
+
+//sends lo through hi completed, in any order relative to other ranges
+static void complete(zerocopy_conn *zc, uint32_t lo, uint32_t hi) {
+	for (size_t i = 0; i < zc->num_pins; i++) {
+		zerocopy_pin *pin = &zc->pins[i];
+		for (uint32_t id = lo; ; id++) {
+			if ((uint32_t)(id - pin->first) < pin->count && pin->pending > 0) {
+				pin->pending -= 1;
+			}
+			if (id == hi) {
+				break;
+			}
+		}
+	}
+
+	//pins finish in send order, so completed ones are a prefix
+	size_t done = 0;
+	for (size_t i = 0; i < zc->num_pins; i++) {
+		if (zc->pins[i].pending == 0) {
+			zc->pins[i].release(zc->pins[i].pinned);
+			metrics_add(M_ZEROCOPY_PINNED, -1);
+		} else {
+			zc->pins[done++] = zc->pins[i];
+		}
+	}
+	zc->num_pins = done;
+}
+
+//read every completion queued on fd
+static void reap(zerocopy_conn *zc, int fd) {
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+	while (zc->num_pins > 0) {
+		struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			break;
+		}
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+					|| (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+				continue;
+			}
+			struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+			//loopback and devices without scatter-gather copy after all,
+			//then pinning costs more than the copy it saves
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				metrics_add(M_ZEROCOPY_COPIED, err->ee_data - err->ee_info + 1);
+				zc->off = 1;
+			}
+			complete(zc, err->ee_info, err->ee_data);
+		}
+	}
+	errno = 0;
+}
+
+ssize_t zerocopy_write(zerocopy_conn **zcp, int fd, const char *buf, size_t len,
+		zerocopy_release release, void *pinned) {
+
+	if (threshold == 0 || len < threshold || (*zcp != NULL && (*zcp)->off)) {
+		release(pinned);
+		return write_all_to_socket(fd, (char *)buf, len);
+	}
+
+	if (*zcp == NULL) {
+		int on = 1;
+		*zcp = calloc(1, sizeof(zerocopy_conn));
+		(*zcp)->fd = -1;
+		(*zcp)->off = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == -1;
+		if ((*zcp)->off) {
+			LOG("No SO_ZEROCOPY on %d: %s\n", fd, strerror(errno));
+			release(pinned);
+			return write_all_to_socket(fd, (char *)buf, len);
+		}
+	}
+	zerocopy_conn *zc = *zcp;
+	reap(zc, fd);
+
+	uint32_t first = zc->next_id;
+	size_t progress = 0;
+	errno = 0;
+	while (progress < len) {
+		ssize_t result = send(fd, buf + progress, len - progress, MSG_ZEROCOPY | MSG_NOSIGNAL);
+		if (result > 0) {
+			progress += result;
+			zc->next_id += 1;
+			metrics_add(M_BYTES_SENT, result);
+			metrics_add(M_ZEROCOPY_BYTES, result);
+		} else if (result == -1 && errno == EINTR) {
+			errno = 0;
+		} else if (result == -1 && errno == ENOBUFS) {
+			//out of option memory for notifications, copy the rest
+			ssize_t copied = write_all_to_socket(fd, (char *)buf + progress, len - progress);
+			progress += copied > 0 ? copied : 0;
+			break;
+		} else {
+			if (result == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("Zerocopy send");
+			}
+			break;
+		}
+	}
+
+	int saved = errno;
+	if (zc->next_id != first) {
+		add_pin(zc, first, zc->next_id - first, release, pinned);
+	} else {
+		release(pinned);
+	}
+	errno = saved;
+	if (errno != 0 && errno != EAGAIN && errno != EWOULDBLOCK && progress == 0) {
+		return -1;
+	}
+	return progress;
+}
+
+int zerocopy_error(zerocopy_conn *zc, int fd) {
+	if (zc != NULL) {
+		reap(zc, fd);
+	}
+	int err = 0;
+	socklen_t len = sizeof(err);
+	getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	return err != 0 ? -1 : 0;
+}
+
+static void zerocopy_free(zerocopy_conn *zc) {
+	//what is left the kernel still has its own page references to
+	for (size_t i = 0; i < zc->num_pins; i++) {
+		zc->pins[i].release(zc->pins[i].pinned);
+		metrics_add(M_ZEROCOPY_PINNED, -1);
+	}
+	free(zc->pins);
+	free(zc);
+}
+
+int zerocopy_close(zerocopy_conn *zc, int fd) {
+	if (zc == NULL) {
+		return 0;
+	}
+	reap(zc, fd);
+	if (zc->num_pins == 0) {
+		zerocopy_free(zc);
+		return 0;
+	}
+
+	LOG("Socket %d lingers for %zu zerocopy sends\n", fd, zc->num_pins);
+	zc->fd = fd;
+	zc->closed_ms = monotonic_ms();
+	zc->next = lingering;
+	lingering = zc;
+	return 1;
+}
+
+void zerocopy_pass(long long now_ms) {
+	zerocopy_conn **link = &lingering;
+	while (*link != NULL) {
+		zerocopy_conn *zc = *link;
+		reap(zc, zc->fd);
+		if (zc->num_pins > 0 && now_ms - zc->closed_ms < ZEROCOPY_LINGER_MS) {
+			link = &zc->next;
+			continue;
+		}
+		*link = zc->next;
+		close(zc->fd);
+		zerocopy_free(zc);
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+//MSG_ZEROCOPY sends of large in-memory bodies
+//the kernel sends straight from the caller's pages instead of copying them
+//into the socket, and reports on the socket's error queue once it no longer
+//needs them. until then the pages belong to the kernel, so every send pins a
+//reference to whatever owns them (a cached mapping, the config snapshot
+//holding an archive) and drops it when the completion comes in. a client
+//closed with sends outstanding lingers until they complete.
+//writes under the threshold, TLS and HTTP/2 clients take the copying path
+
+#define DEFAULT_ZEROCOPY_THRESHOLD (64 * 1024)
+#define ZEROCOPY_LINGER_MS 5000 //closed sockets wait this long for completions
+
+//per connection state, NULL until its first zerocopy send
+typedef struct zerocopy_conn zerocopy_conn;
+
+//drops the reference a send pinned
+typedef void (*zerocopy_release)(void *pinned);
+
+//sends of threshold bytes and more go zerocopy, 0 turns it off
+void zerocopy_configure(size_t threshold);
+
+//like write_all_to_socket, errno is EAGAIN when not everything fit
+//pinned is a reference taken for this call, released once the kernel is done
+//with the part of buf it sent (at once when it sent nothing or copied)
+ssize_t zerocopy_write(zerocopy_conn **, int fd, const char *buf, size_t len,
+		zerocopy_release release, void *pinned);
+
+//EPOLLERR on the socket, reads the completions waiting in its error queue
+//returns 0 if that was all, -1 if the socket has a real error
+int zerocopy_error(zerocopy_conn *, int fd);
+
+//the client is going away, returns 1 if the fd was handed over to linger
+//until its sends complete, 0 if the caller should close it
+int zerocopy_close(zerocopy_conn *, int fd);
+
+//once per loop pass, closes lingering sockets once their sends complete
+void zerocopy_pass(long long now_ms);
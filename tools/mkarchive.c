@@ -0,0 +1,471 @@
+#define _GNU_SOURCE
+#include "../server_helpers.h"
+#include "../server_archive.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <magic.h>
+#include <zlib.h>
+
+//packs a site root into an archive the server maps with archive = "...";
+//the result is renamed over the output, so a running server keeps its old
+//mapping until a reload picks up the new one
+
+#define GZIP_MIN_SIZE 256 //smaller bodies do not gain enough to be worth it
+#define SMALL_ALIGN 64 //bodies under a page are packed on cache lines
+#define MAX_ATTEMPTS 64 //seeds tried before giving up on a perfect hash
+#define MAX_DISPLACEMENT (1u << 20)
+
+typedef struct item {
+	char *path; //url path, "/" + relative file name
+	int dir;
+	archive_entry entry;
+} item;
+
+static item *items = NULL;
+static size_t num_items = 0;
+static size_t items_cap = 0;
+static const char *root = NULL;
+
+static char *strings = NULL; //paths, fields and tags, placed after the bodies
+static size_t strings_len = 0;
+static size_t strings_cap = 0;
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [options] webserver_root archive\n"
+			"\t-z\t\talso store gzipped bodies of text files\n"
+			"\t-i names\tindex files of directories, comma separated (index.html)\n", name);
+	exit(1);
+}
+
+static item *add_item(const char *path, int dir) {
+	if (num_items == items_cap) {
+		items_cap = items_cap ? 2 * items_cap : 256;
+		items = realloc(items, items_cap * sizeof(item));
+	}
+	item *it = &items[num_items++];
+	memset(it, 0, sizeof(item));
+	it->path = strdup(path);
+	it->dir = dir;
+	return it;
+}
+
+//offset relative to the string area, fixed up once its place is known
+static uint64_t add_string(const char *s, size_t len) {
+	while (strings_len + len > strings_cap) {
+		strings_cap = strings_cap ? 2 * strings_cap : 65536;
+		strings = realloc(strings, strings_cap);
+	}
+	memcpy(strings + strings_len, s, len);
+	strings_len += len;
+	return strings_len - len;
+}
+
+static int visit(const char *fpath, const struct stat *sb, int type, struct FTW *ftw) {
+	const char *relative = fpath + strlen(root);
+	char path[MAX_PATHNAME_SIZE + 2];
+	if (snprintf(path, sizeof(path), "/%s", relative + strspn(relative, "/")) >= (int)sizeof(path)) {
+		fprintf(stderr, "Skipping %s, the path is too long\n", fpath);
+		return 0;
+	}
+
+	//the server never follows symlinks out of a root, so neither does the archive
+	if (type == FTW_D) {
+		add_item(path, 1);
+	} else if (type == FTW_F && S_ISREG(sb->st_mode)) {
+		add_item(path, 0);
+	}
+	return 0;
+}
+
+static int compressible(const char *mime) {
+	return strncmp(mime, "text/", 5) == 0 || strstr(mime, "javascript") != NULL
+			|| strstr(mime, "json") != NULL || strstr(mime, "xml") != NULL;
+}
+
+static size_t gzip(const char *data, size_t len, char **out) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return 0;
+	}
+	size_t cap = deflateBound(&zs, len);
+	*out = malloc(cap);
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = len;
+	zs.next_out = (Bytef *)*out;
+	zs.avail_out = cap;
+	int ret = deflate(&zs, Z_FINISH);
+	size_t gz_len = zs.total_out;
+	deflateEnd(&zs);
+	return ret == Z_STREAM_END ? gz_len : 0;
+}
+
+static uint64_t place(uint64_t *end, size_t len) {
+	uint64_t align = len >= ARCHIVE_PAGE ? ARCHIVE_PAGE : SMALL_ALIGN;
+	uint64_t offset = (*end + align - 1) / align * align;
+	*end = offset + len;
+	return offset;
+}
+
+//read, type, tag and optionally compress one file, writing its bodies at *end
+static int pack_file(item *it, int out, uint64_t *end, magic_t magic, int with_gzip, size_t *gzipped) {
+	char fpath[strlen(root) + strlen(it->path) + 1];
+	sprintf(fpath, "%s%s", root, it->path);
+
+	int fd = open(fpath, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	struct stat file_stat;
+	if (fd == -1 || fstat(fd, &file_stat) == -1) {
+		perror(fpath);
+		return -1;
+	}
+	size_t len = file_stat.st_size;
+	char *data = malloc(len > 0 ? len : 1);
+	size_t got = 0;
+	while (got < len) {
+		ssize_t n = read(fd, data + got, len - got);
+		if (n <= 0) {
+			fprintf(stderr, "%s changed while reading it\n", fpath);
+			close(fd);
+			free(data);
+			return -1;
+		}
+		got += n;
+	}
+	close(fd);
+
+	const char *mime = mime_type_by_extension(it->path);
+	if (mime == NULL) {
+		mime = magic_buffer(magic, data, len);
+	}
+	if (mime == NULL) {
+		mime = "application/octet-stream";
+	}
+
+	char etag[64];
+	int etag_len = sprintf(etag, "\"%zx-%016llx\"", len, (unsigned long long)archive_hash(data, len, 0));
+	char modified[64];
+	struct tm tm = *gmtime(&file_stat.st_mtime);
+	strftime(modified, sizeof modified, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	archive_entry *e = &it->entry;
+	e->body_len = len;
+	e->body_offset = place(end, len);
+	if (len > 0 && pwrite(out, data, len, e->body_offset) != (ssize_t)len) {
+		perror("write");
+		free(data);
+		return -1;
+	}
+
+	char *gz = NULL;
+	size_t gz_len = 0;
+	if (with_gzip && len >= GZIP_MIN_SIZE && compressible(mime)) {
+		gz_len = gzip(data, len, &gz);
+		//keep it only if it saves at least a tenth
+		if (gz_len > 0 && gz_len < len - len / 10) {
+			e->gzip_len = gz_len;
+			e->gzip_offset = place(end, gz_len);
+			if (pwrite(out, gz, gz_len, e->gzip_offset) != (ssize_t)gz_len) {
+				perror("write");
+				free(gz);
+				free(data);
+				return -1;
+			}
+			*gzipped += 1;
+		}
+	}
+	free(gz);
+	free(data);
+
+	char fields[1024];
+	const char *vary = e->gzip_len > 0 ? "Vary: Accept-Encoding\n" : "";
+	int fields_len = snprintf(fields, sizeof(fields), "Content-Type: %s\nETag: %s\nLast-Modified: %s\n%s",
+			mime, etag, modified, vary);
+	e->fields_offset = add_string(fields, fields_len);
+	e->fields_len = fields_len;
+	if (e->gzip_len > 0) {
+		fields_len = snprintf(fields, sizeof(fields), "Content-Type: %s\nContent-Encoding: gzip\n"
+				"ETag: %.*s-gz\"\nLast-Modified: %s\n%s", mime, etag_len - 1, etag, modified, vary);
+		add_string(fields, fields_len);
+		e->gzip_fields_len = fields_len;
+	}
+	e->etag_offset = add_string(etag, etag_len);
+	e->etag_len = etag_len;
+	return 0;
+}
+
+static item *find_file(const char *path) {
+	for (size_t i = 0; i < num_items; i++) {
+		if (!items[i].dir && strcmp(items[i].path, path) == 0) {
+			return &items[i];
+		}
+	}
+	return NULL;
+}
+
+//hash and displace: buckets with the most keys pick a displacement first,
+//while most slots are still free
+static int build_hash(archive_header *h, uint32_t *buckets, uint32_t *slot_of) {
+	uint32_t n = num_items;
+	uint32_t *order = malloc(h->num_buckets * sizeof(uint32_t));
+	uint32_t *count = calloc(h->num_buckets + 1, sizeof(uint32_t));
+	uint32_t *members = malloc(n * sizeof(uint32_t));
+	uint32_t *start = calloc(h->num_buckets + 1, sizeof(uint32_t));
+	char *taken = calloc(h->num_slots, 1);
+	uint32_t tried[64];
+	int ok = 1;
+
+	for (uint32_t i = 0; i < n; i++) {
+		count[items[i].entry.hash % h->num_buckets] += 1;
+	}
+	for (uint32_t b = 0; b < h->num_buckets; b++) {
+		start[b + 1] = start[b] + count[b];
+		order[b] = b;
+		count[b] = 0;
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t b = items[i].entry.hash % h->num_buckets;
+		members[start[b] + count[b]++] = i;
+	}
+
+	//counting sort, largest buckets first
+	uint32_t largest = 0;
+	for (uint32_t b = 0; b < h->num_buckets; b++) {
+		largest = count[b] > largest ? count[b] : largest;
+	}
+	if (largest > sizeof(tried) / sizeof(tried[0])) {
+		ok = 0;
+	}
+	size_t placed = 0;
+	for (uint32_t size = largest; ok && size > 0; size--) {
+		for (uint32_t b = 0; b < h->num_buckets; b++) {
+			if (count[b] == size) {
+				order[placed++] = b;
+			}
+		}
+	}
+
+	for (size_t o = 0; ok && o < placed; o++) {
+		uint32_t b = order[o];
+		uint32_t d;
+		for (d = 0; d < MAX_DISPLACEMENT; d++) {
+			uint32_t k;
+			for (k = 0; k < count[b]; k++) {
+				uint32_t slot = archive_slot(items[members[start[b] + k]].entry.hash, d, h->num_slots);
+				uint32_t j;
+				for (j = 0; j < k && tried[j] != slot; j++);
+				if (taken[slot] || j < k) {
+					break;
+				}
+				tried[k] = slot;
+			}
+			if (k == count[b]) {
+				break;
+			}
+		}
+		if (d == MAX_DISPLACEMENT) {
+			ok = 0;
+			break;
+		}
+		buckets[b] = d;
+		for (uint32_t k = 0; k < count[b]; k++) {
+			taken[tried[k]] = 1;
+			slot_of[members[start[b] + k]] = tried[k];
+		}
+	}
+
+	free(order);
+	free(count);
+	free(members);
+	free(start);
+	free(taken);
+	return ok ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+	int with_gzip = 0;
+	char *index_names = "index.html";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "zi:h")) != -1) {
+		switch (opt) {
+			case 'z': with_gzip = 1; break;
+			case 'i': index_names = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+	}
+
+	char *root_arg = strdup(argv[optind]);
+	size_t root_len = strlen(root_arg);
+	while (root_len > 1 && root_arg[root_len - 1] == '/') {
+		root_arg[--root_len] = '\0';
+	}
+	root = root_arg;
+	const char *output = argv[optind + 1];
+
+	if (nftw(root, visit, 64, FTW_PHYS) == -1) {
+		perror(root);
+		return 1;
+	}
+
+	magic_t magic = magic_open(MAGIC_MIME_TYPE);
+	if (magic == NULL || magic_load(magic, NULL) == -1) {
+		fprintf(stderr, "Could not load the libmagic database\n");
+		return 1;
+	}
+
+	//written next to the output so the final rename is atomic
+	char *tmp = malloc(strlen(output) + 8);
+	sprintf(tmp, "%s.XXXXXX", output);
+	int out = mkstemp(tmp);
+	if (out == -1) {
+		perror(tmp);
+		return 1;
+	}
+	fchmod(out, 0644);
+
+	//directories become "/dir/" entries sharing their index file, and "/dir" redirects
+	size_t num_files = 0;
+	size_t found = num_items;
+	for (size_t i = 0; i < found; i++) {
+		if (!items[i].dir) {
+			num_files += 1;
+			continue;
+		}
+		size_t len = strlen(items[i].path);
+		if (len > 1) {
+			items[i].entry.flags = ARCHIVE_REDIRECT;
+			char *slashed = malloc(len + 2);
+			sprintf(slashed, "%s/", items[i].path);
+			add_item(slashed, 1);
+			free(slashed);
+		}
+	}
+
+	//layout: header, displacements, entries, bodies, strings
+	archive_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, ARCHIVE_MAGIC, sizeof(h.magic));
+	h.version = ARCHIVE_VERSION;
+	h.num_buckets = num_items / ARCHIVE_BUCKET_LOAD + 1;
+	h.num_slots = num_items + num_items / 8 + 1;
+	h.buckets_offset = sizeof(archive_header);
+	h.slots_offset = (h.buckets_offset + h.num_buckets * sizeof(uint32_t) + 63) / 64 * 64;
+	uint64_t end = h.slots_offset + (uint64_t)h.num_slots * sizeof(archive_entry);
+	end = (end + ARCHIVE_PAGE - 1) / ARCHIVE_PAGE * ARCHIVE_PAGE;
+
+	size_t gzipped = 0;
+	for (size_t i = 0; i < num_items; i++) {
+		if (!items[i].dir && pack_file(&items[i], out, &end, magic, with_gzip, &gzipped) == -1) {
+			unlink(tmp);
+			return 1;
+		}
+	}
+
+	//index entries copy the file's bodies and fields, keep their own path
+	size_t num_indexed = 0;
+	for (size_t i = 0; i < num_items; i++) {
+		size_t len = strlen(items[i].path);
+		if (!items[i].dir || items[i].path[len - 1] != '/') {
+			continue;
+		}
+		char names[strlen(index_names) + 1];
+		strcpy(names, index_names);
+		for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+			char candidate[len + strlen(name) + 1];
+			sprintf(candidate, "%s%s", items[i].path, name);
+			item *file = find_file(candidate);
+			if (file != NULL) {
+				items[i].entry = file->entry;
+				num_indexed += 1;
+				break;
+			}
+		}
+	}
+
+	//directories without an index are left out, so they 404 (or list from disk)
+	size_t kept = 0;
+	for (size_t i = 0; i < num_items; i++) {
+		size_t len = strlen(items[i].path);
+		if (items[i].dir && items[i].path[len - 1] == '/' && items[i].entry.etag_len == 0) {
+			free(items[i].path);
+			continue;
+		}
+		items[kept++] = items[i];
+	}
+	num_items = kept;
+	h.num_entries = num_items;
+
+	for (size_t i = 0; i < num_items; i++) {
+		archive_entry *e = &items[i].entry;
+		e->path_len = strlen(items[i].path);
+		e->path_offset = add_string(items[i].path, e->path_len);
+	}
+
+	//strings go last, every relative offset moves by the same amount
+	uint64_t strings_offset = end;
+	if (pwrite(out, strings, strings_len, strings_offset) != (ssize_t)strings_len) {
+		perror("write");
+		unlink(tmp);
+		return 1;
+	}
+	h.size = strings_offset + strings_len;
+	for (size_t i = 0; i < num_items; i++) {
+		archive_entry *e = &items[i].entry;
+		e->path_offset += strings_offset;
+		e->fields_offset += strings_offset;
+		e->etag_offset += strings_offset;
+		if (e->etag_len == 0) { //redirects have no fields or body
+			e->fields_offset = e->etag_offset = e->body_offset = e->gzip_offset = 0;
+		}
+	}
+
+	uint32_t *buckets = calloc(h.num_buckets, sizeof(uint32_t));
+	uint32_t *slot_of = malloc((num_items + 1) * sizeof(uint32_t));
+	int attempt;
+	for (attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+		//the same tree always packs to the same file
+		h.seed = archive_hash((const char *)&attempt, sizeof(attempt), 0x5eed);
+		for (size_t i = 0; i < num_items; i++) {
+			items[i].entry.hash = archive_hash(items[i].path, items[i].entry.path_len, h.seed);
+		}
+		if (build_hash(&h, buckets, slot_of) == 0) {
+			break;
+		}
+	}
+	if (attempt == MAX_ATTEMPTS) {
+		fprintf(stderr, "No perfect hash found for %zu paths\n", num_items);
+		unlink(tmp);
+		return 1;
+	}
+
+	archive_entry *slots = calloc(h.num_slots, sizeof(archive_entry));
+	for (size_t i = 0; i < num_items; i++) {
+		slots[slot_of[i]] = items[i].entry;
+	}
+
+	if (pwrite(out, &h, sizeof(h), 0) != sizeof(h)
+			|| pwrite(out, buckets, h.num_buckets * sizeof(uint32_t), h.buckets_offset)
+			!= (ssize_t)(h.num_buckets * sizeof(uint32_t))
+			|| pwrite(out, slots, h.num_slots * sizeof(archive_entry), h.slots_offset)
+			!= (ssize_t)(h.num_slots * sizeof(archive_entry))
+			|| fsync(out) == -1 || close(out) == -1 || rename(tmp, output) == -1) {
+		perror(output);
+		unlink(tmp);
+		return 1;
+	}
+
+	printf("%s: %zu paths, %zu files (%zu gzipped), %zu directory indexes, %llu bytes\n",
+			output, num_items, num_files, gzipped, num_indexed, (unsigned long long)h.size);
+	magic_close(magic);
+	return 0;
+}
@@ -1,4 +1,25 @@
+#define _GNU_SOURCE
 #include "server_helpers.h"
+#include "server_config.h"
+#include "server_upgrade.h"
+#include "server_filecache.h"
+#include "server_ratelimit.h"
+#include "server_metrics.h"
+#include "server_capture.h"
+#include "server_trace.h"
+#include "server_fastcgi.h"
+#include "server_proxy.h"
+#include "server_h2.h"
+#include "server_tls.h"
+#include "server_archive.h"
+#include "server_warmup.h"
+#include "server_overload.h"
+#include "server_memory.h"
+#include "server_busypoll.h"
+#include "server_listen.h"
+#include "server_zerocopy.h"
+#include "server_plugin.h"
+#include "server_chunked.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -19,70 +40,133 @@
 //#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <magic.h>
-#include <libconfig.h>
 
-#define BACKLOG 10
 #define EVENT_BUFFER 100
-
-//default
-#define DEFAULT_TIMEOUT_MS 1000
+#define MAX_CLIENTS 1024 //client_requests is indexed by fd
+#define STREAMED_BODY ((size_t)-1) //content_length of a body written with body_write
 
 typedef struct request_info request_info;
 
 // main functions
 void init_server();
-void accept_connections();
-void add_client(int fd, char *ip);
+int listening_index(int fd);
+void accept_connections(int listener, int tls);
+void add_client(int fd, struct sockaddr *addr, int tls);
+void reject_client(int fd, const char *response, size_t length);
 void remove_client(int fd);
+void free_request(request_info *);
 int handle_request(int fd);
+int process_request(int fd, request_info *);
+void service_client(int fd);
+void close_idle_clients(long long now_ms);
+size_t shrink_clients(void *, size_t want);
+char *header_buffer();
 
 // signal functions
 void acknowledge_sigpipe(int);
 void graceful_exit(int);
+void request_reload(int);
+void request_upgrade(int);
+void request_slow_dump(int);
 
 // handle_request helper functions
 int get_header(request_info *);
+void parse_range(request_info *);
+int resolve_range(request_info *, size_t size);
+void begin_request(request_info *);
 verb check_verb(char *header);
 int v_unknown(request_info *);
 int get(request_info *);
+vhost *select_vhost(request_info *);
+int is_status_request(request_info *);
+int send_metrics(int fd, struct request_info *);
+int send_plugin(int fd, struct request_info *);
+void record_request(request_info *);
+int send_mapped(int fd, struct request_info *, const char *data, size_t size);
+int resolve_archived(int fd, const char *url, struct request_info *);
+static int accepts_gzip(const char *accept, size_t len);
+int start_fastcgi(int fd, const char *path, const char *url, const location *, struct request_info *);
+int send_fastcgi(int fd, struct request_info *);
+int start_proxy(int fd, struct request_info *);
+int send_proxy(int fd, struct request_info *);
+void stream_client(int fd, struct request_info *);
+int wants_h2c(request_info *);
+int start_h2(int fd, request_info *, int upgrade);
+ssize_t client_write(int fd, struct request_info *, char *buf, size_t len);
+ssize_t client_write_file(int fd, struct request_info *, FILE *file, size_t count, size_t offset);
+ssize_t body_write(int fd, struct request_info *, const char *buf, size_t len);
+int body_flush(int fd, struct request_info *);
+int body_finish(int fd, struct request_info *);
 int put(request_info *);
+const char *response_headers(struct request_info *, size_t *len);
+void append_response_headers(struct request_info *);
 int send_status(int fd, int status, struct request_info *);
 int send_status_n(int fd, int status, struct request_info *, size_t content_length);
-int send_list(int fd, char *path, struct request_info *);
+int send_list(int fd, int dir_fd, struct request_info *);
+int send_redirect(int fd, const char *target, const char *rest, struct request_info *);
 int send_error(int fd, int status, struct request_info *);
-void set_mime_type(char *path, struct request_info *);
-void parse_config(config_t *cf);
+void set_mime_type(char *path, const struct stat *, struct request_info *);
+void warm_up(server_config *);
+int apply_config(server_config *);
+void reload_config();
+void start_upgrade();
+void finish_upgrade();
+int upgrade_timeout(int blocking_ms);
+
+enum { RANGE_NONE, RANGE_FROM, RANGE_SUFFIX };
 
 //Constants
 static char *HTML_HEADER = "<!DOCTYPE html><html><head></head><body>";
 static char *HTML_FOOTER = "</body></html>";
 
+//sent from the accept path without reading the request
+static const char TOO_MANY_REQUESTS_RESPONSE[] = "HTTP/1.1 429 Too Many Requests\n"
+				"Connection: close\n"
+				"Retry-After: 1\n"
+				"Content-Length: 0\n\n";
+static const char UNAVAILABLE_RESPONSE[] = "HTTP/1.1 503 Service Unavailable\n"
+				"Connection: close\n"
+				"Retry-After: 1\n"
+				"Content-Length: 0\n\n";
+
 char *status_desc[510];
 
 //Config settings
 static const char *CONFIG_FILE = "/etc/epoll-webserver/server.conf";
 
 static const char *DEFAULT_LOG_FILE = "/etc/epoll-server/log.txt";
-static char *DEFAULT_SECURITY_HEADERS = "Cache-Control: private, max-age=0\n"
-				"X-Frame-Options: SAMEORIGIN\n"
-				"X-XSS-Protection: 1\n\n";
-				//"X-Content-Type-Options: nosniff\n\n";
-
-char *port = NULL;
-static int max_file_size = 0;
-static int timeout_ms = 0;
-char *root_site = NULL;
-char *security_headers = NULL;
+
+//settings for new requests; swapped on SIGHUP
+server_config *current_config = NULL;
+static volatile sig_atomic_t reload_pending = 0;
+static volatile sig_atomic_t slow_dump_pending = 0;
 FILE *http_log = NULL;
 
+//binary upgrade state (SIGUSR2)
+static char **saved_argv = NULL;
+static volatile sig_atomic_t upgrade_pending = 0;
+static int draining = 0;
+static long long drain_deadline_ms = 0;
+static pid_t upgrade_pid = -1; //started and not ready yet
+static int upgrade_fd = -1; //its ready pipe, in the epoll set
+static long long upgrade_deadline_ms = 0;
+
 //Server info
 static volatile int epollfd;
-static volatile int server_socket;
-struct request_info *client_requests[100];
+static int listen_fds[MAX_LISTENERS]; //in the epoll set, level triggered
+static int listen_tls[MAX_LISTENERS];
+static int num_listen_fds = 0;
+struct request_info *client_requests[MAX_CLIENTS];
+static int active_clients = 0;
+static uint64_t next_conn_id = 0;
 
 struct request_info {
 	struct epoll_event *event;
-	char *ip;
+	char ip[INET6_ADDRSTRLEN];
+	ip_key addr;
+
+	server_config *config; //snapshot taken when the client was accepted
+	vhost *host; //site named by the Host header, set once the header is read
 
 	verb req_type;
 	size_t stage;
@@ -92,15 +176,51 @@ struct request_info {
 	char *response_h;
 	char *body;
 
+	//the body to send, [range_start, range_end) once resolve_range has the size
 	size_t range_start;
 	size_t range_end;
+	size_t range_suffix; //bytes=-n
+	size_t range_size; //whole body, for Content-Range
+	int ranged; //RANGE_NONE, RANGE_FROM (a-b and a-) or RANGE_SUFFIX
 	
 	const char *mime_type;
+	const char *fields; //pre-rendered header lines in place of Content-Type
+	size_t fields_len;
+	FILE *file; //opened beneath the location root once the path resolves
+	file_map *map; //body being served in mmap mode
+	const archive_entry *archived; //file served from the site archive instead of disk
+	int archive_gzip; //its gzipped body is the one being sent
+	location *location; //routed location, NULL until the path is resolved
+	fastcgi_request *fcgi; //dynamic response relayed from the site's FastCGI pool
+	proxy_request *proxy; //response relayed from the location's upstreams
+	h2_conn *h2; //the connection switched to HTTP/2, its requests are streams
+	h2_stream *stream; //set on the request of one HTTP/2 stream, which shares event and fd
+	tls_conn *tls; //client of the TLS listener, everything on the socket goes through it
+	zerocopy_conn *zc; //sends the kernel still holds buffers of, NULL before the first
+	plugin_call *plugin; //taken by a handler module
+	chunk_writer *chunks; //body of unknown length, streamed with body_write
+	DIR *dir; //directory being listed, an entry at a time
+	int plugins_passed; //no module handler wants it, the server routes it
+	int upstream_error; //error page sent in place of a failed upstream response
+	char *redirect; //Location header of a redirect
+
+	int status; //response status once the header is built
+	int shed; //read while overloaded, answered with a 503
+	int limited; //status for a stream past its address's request rate, 429 or 503 with the table full
+	int h2_streams; //opened on this connection, the first was charged at accept
+	long long start_us;
+	long long last_active_ms; //last time the loop serviced it, 0 before the first
+	uint64_t conn_id; //identifies the connection in captures
+	request_trace trace;
 };
 
 void load_status_codes() {
 	status_desc[200] = "OK";
 	status_desc[204] = "No Content";
+	status_desc[206] = "Partial Content";
+	status_desc[301] = "Moved Permanently";
+	status_desc[302] = "Found";
+	status_desc[304] = "Not Modified";
 	status_desc[400] = "Bad Request";
 	status_desc[401] = "Unauthorized";
 	status_desc[403] = "Forbidden";
@@ -108,7 +228,14 @@ void load_status_codes() {
 	status_desc[405] = "Method Not Allowed";
 	status_desc[413] = "Payload Too Large";
 	status_desc[414] = "Too Long";
+	status_desc[416] = "Range Not Satisfiable";
+	status_desc[429] = "Too Many Requests";
 	status_desc[431] = "Request Header Fields Too Large";
+	status_desc[500] = "Internal Server Error";
+	status_desc[501] = "Not Implemented";
+	status_desc[502] = "Bad Gateway";
+	status_desc[503] = "Service Unavailable";
+	status_desc[504] = "Gateway Timeout";
 }
 
 magic_t magic;
@@ -124,21 +251,25 @@ void print_usage() {
 	puts("Please set port and webserver_root in the server.conf (i.e. port = \"80\")");
 	puts("Other configuration options:");
 	puts("\tlog_file, security_headers, max_file_size, timeout_ms");
+	puts("Send SIGHUP to reload server.conf without dropping connections");
+	puts("Send SIGUSR2 to start the installed binary and drain this one");
+	puts("Send SIGUSR1 to print the slowest recent requests to stderr");
 	exit(0);
 }
 
 //initialize server and poll for requests
 int main(int argc, char **argv) {
 
-	//Read config
-	config_t cfg, *cf;
-	cf = &cfg;
-	config_init(cf);
-	parse_config(cf);
-
 	if (argc > 1) {
 		print_usage();
 	}
+	saved_argv = argv;
+
+	//Read config
+	server_config *conf = server_config_load(CONFIG_FILE);
+	if (conf == NULL || apply_config(conf) == -1) {
+		print_usage();
+	}
 
 	load_status_codes();
 
@@ -150,68 +281,253 @@ int main(int argc, char **argv) {
 	//signal handling
 	signal(SIGINT, graceful_exit);
 	signal(SIGPIPE, acknowledge_sigpipe);
+	signal(SIGHUP, request_reload);
+	signal(SIGUSR2, request_upgrade);
+	signal(SIGUSR1, request_slow_dump);
+
+	if (current_config->warmup) {
+		warm_up(current_config);
+	}
+
+	//after the warm-up, its workers get every CPU
+	if (current_config->cpu_affinity != NULL) {
+		busypoll_pin(current_config->cpu_affinity, current_config->num_cpu_affinity);
+	}
+
+	//handler modules register before the first client can arrive
+	plugin_init(service_client, status_desc, sizeof(status_desc) / sizeof(status_desc[0]));
+	for (int i = 0; i < current_config->num_plugins; i++) {
+		if (plugin_load(&current_config->plugins[i]) == -1) {
+			graceful_exit(0);
+		}
+	}
 
 	//start server
 	init_server();
-	LOG("Server Initialized on port %s\n", port);
-
-	//mark file descriptors as non-blocking
-	int flags = fcntl(server_socket, F_GETFL, 0);
-	flags |= O_NONBLOCK;
-	fcntl(server_socket, F_SETFL, flags);
-	//start epolling
-	epollfd = epoll_create(1);
+	LOG("Server initialized with %d listeners\n", num_listen_fds);
+
+	//start epolling, new connections wake the loop like client data does
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	busypoll_epoll(epollfd);
+	for (int i = 0; i < num_listen_fds; i++) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = listen_fds[i] };
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, listen_fds[i], &ev);
+		busypoll_socket(listen_fds[i]);
+	}
+	fastcgi_init(epollfd, service_client);
+	proxy_init(epollfd, service_client);
+	memory_reclaimer_add(MEM_CONNECTIONS, shrink_clients, NULL);
 	LOG("Polling for requests\n");
+
+	//if we were started by an upgrade, the old process can start draining
+	upgrade_notify_ready();
+
+	long long pass_start_us = monotonic_us();
+	long long last_sweep_ms = 0;
 	while (1) {
-		accept_connections();
+		//everything since the last poll returned kept new events waiting
+		overload_pass(monotonic_us() - pass_start_us, monotonic_ms());
+		memory_pass(monotonic_ms());
+		zerocopy_pass(monotonic_ms());
+		plugin_pass(monotonic_ms());
 		
-		struct epoll_event array[EVENT_BUFFER];
+		struct epoll_event array[BUSY_POLL_MAX_EVENTS];
 
 		//Get events
-		int num_events = epoll_wait(epollfd, array, EVENT_BUFFER, timeout_ms);
-		if (num_events == -1) {
+		int num_events = epoll_wait(epollfd, array, busypoll_batch(EVENT_BUFFER),
+				busypoll_timeout(plugin_timeout(upgrade_timeout(current_config->timeout_ms), monotonic_ms()), monotonic_ms()));
+		pass_start_us = monotonic_us();
+		busypoll_events(num_events, pass_start_us / 1000);
+		if (num_events == -1 && errno == EINTR) {
+			num_events = 0;
+		} else if (num_events == -1) {
 			perror("epoll_wait");
 			graceful_exit(0);
 		}
 
+		if (reload_pending) {
+			reload_pending = 0;
+			reload_config();
+		}
+
+		if (upgrade_pending) {
+			upgrade_pending = 0;
+			start_upgrade();
+		}
+
+		if (slow_dump_pending) {
+			slow_dump_pending = 0;
+			trace_dump_slow(stderr);
+		}
+
 		//Handle events
 		for (int i = 0; i < num_events; i++) {
 			int fd = array[i].data.fd;
 			int event = array[i].events;
 
-			if (event & EPOLLIN) {
-
-				LOG("Working on request for %d\n", fd);
+			if (fd == upgrade_fd) {
+				finish_upgrade();
+				continue;
+			}
 
-				int status = handle_request(fd); //process request
-				LOG("Status for %d: %d\n", fd, status);
+			//listeners leave the set when draining starts
+			int listener = listening_index(fd);
+			if (listener != -1) {
+				accept_connections(fd, listen_tls[listener]);
+				continue;
+			}
 
-				if (status > 0) { //remove client on success, sigpipe, or error
-					remove_client(fd);
+			//everything else in the set is an upstream connection
+			if (fd >= MAX_CLIENTS || client_requests[fd] == NULL) {
+				if (!fastcgi_handle_event(fd, event)) {
+					proxy_handle_event(fd, event);
 				}
+				continue;
+			}
+
+			//zerocopy completions wake the socket as errors
+			if ((event & EPOLLERR) && client_requests[fd]->zc != NULL
+					&& zerocopy_error(client_requests[fd]->zc, fd) == 0) {
+				event &= ~EPOLLERR;
+			}
+
+			if (event & (EPOLLIN | EPOLLOUT)) {
+				service_client(fd);
 			}
 			if (event & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
 				remove_client(fd);
 			}
 		}
+
+		fastcgi_expire(monotonic_ms());
+		proxy_expire(monotonic_ms());
+
+		if (upgrade_fd != -1 && monotonic_ms() >= upgrade_deadline_ms) {
+			epoll_ctl(epollfd, EPOLL_CTL_DEL, upgrade_fd, NULL);
+			upgrade_abort(upgrade_pid, upgrade_fd);
+			upgrade_fd = upgrade_pid = -1;
+		}
+
+		if (overload_idle_ms() > 0 && monotonic_ms() - last_sweep_ms >= OVERLOAD_SWEEP_MS) {
+			last_sweep_ms = monotonic_ms();
+			close_idle_clients(last_sweep_ms);
+		}
+
+		//exit once in-flight responses are done or out of time
+		if (draining && (active_clients == 0 || monotonic_ms() >= drain_deadline_ms)) {
+			LOG("Drained with %d clients left, exiting\n", active_clients);
+			graceful_exit(0);
+		}
+	}
+}
+
+//run a client's request until it finishes or would block
+void service_client(int fd) {
+	if (client_requests[fd] == NULL) {
+		return;
+	}
+
+	LOG("Working on request for %d\n", fd);
+
+	if (client_requests[fd]->last_active_ms == 0) {
+		overload_first_service(fd);
+	}
+	client_requests[fd]->last_active_ms = monotonic_ms();
+
+	int status = handle_request(fd); //process request
+	LOG("Status for %d: %d\n", fd, status);
+
+	if (status > 0) { //remove client on success, sigpipe, or error
+		record_request(client_requests[fd]);
+		remove_client(fd);
+	} else {
+		metrics_add(M_EAGAIN_RESUMES, 1);
+	}
+}
+
+//while shedding, connections waiting on the client give their slot back
+void close_idle_clients(long long now_ms) {
+	for (int fd = 0; fd < MAX_CLIENTS; fd++) {
+		request_info *req_info = client_requests[fd];
+		if (req_info == NULL || req_info->fcgi != NULL || req_info->proxy != NULL) {
+			continue;
+		}
+
+		//an unfinished header or an HTTP/2 connection without streams
+		long long since = req_info->last_active_ms != 0 ? req_info->last_active_ms : req_info->start_us / 1000;
+		int waiting = req_info->h2 != NULL ? h2_conn_idle(req_info->h2) : req_info->stage == 0;
+		if (waiting && now_ms - since >= overload_idle_ms()) {
+			LOG("Closing idle client %d\n", fd);
+			remove_client(fd);
+			metrics_add(M_IDLE_CLOSED, 1);
+		}
+	}
+}
+
+//memory pressure: drop buffers that hold nothing yet, get_header allocates
+//again once bytes arrive. an HTTP/2 connection is done with its header for
+//good, its streams have their own, and its output buffer goes while idle
+size_t shrink_clients(void *arg, size_t want) {
+	size_t freed = 0;
+	for (int fd = 0; fd < MAX_CLIENTS && freed < want; fd++) {
+		request_info *req_info = client_requests[fd];
+		if (req_info == NULL || (req_info->h2 == NULL && (req_info->stage != 0 || req_info->progress != 0))) {
+			continue;
+		}
+		if (req_info->request_h != NULL) {
+			free(req_info->request_h);
+			req_info->request_h = NULL;
+			memory_release(MEM_CONNECTIONS, MAX_HEADER_SIZE);
+			freed += MAX_HEADER_SIZE;
+		}
+		if (req_info->h2 != NULL) {
+			freed += h2_conn_trim(req_info->h2);
+		}
 	}
+	return freed;
 }
 
 //add client to epoll and the requests array
-void add_client(int fd, char *ip) {
+void add_client(int fd, struct sockaddr *addr, int tls) {
 	struct epoll_event *ev = calloc(1, sizeof(struct epoll_event));
 	ev->events = EPOLLIN | EPOLLET;
 	ev->data.fd = fd;
 	epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, ev);
+	busypoll_socket(fd);
 
 	if (client_requests[fd] == NULL) {
 		struct request_info *req_info = calloc(1, sizeof(struct request_info));
+		memory_charge(MEM_CONNECTIONS, sizeof(struct request_info));
 		req_info->event = ev;
-		req_info->ip = ip;
+		ip_key_from_sockaddr(&req_info->addr, addr);
+		if (addr->sa_family == AF_INET6) {
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *)addr)->sin6_addr, req_info->ip, sizeof(req_info->ip));
+		} else if (addr->sa_family == AF_UNIX) {
+			strcpy(req_info->ip, "unix");
+		} else {
+			inet_ntop(AF_INET, &((struct sockaddr_in *)addr)->sin_addr, req_info->ip, sizeof(req_info->ip));
+		}
+		req_info->config = server_config_acquire(current_config);
+		req_info->start_us = monotonic_us();
+		req_info->conn_id = ++next_conn_id;
+		trace_mark(&req_info->trace, TRACE_ACCEPT, req_info->conn_id);
 
 		client_requests[fd] = req_info;		
+		active_clients += 1;
+		metrics_add(M_ACCEPTS, 1);
+		metrics_add(M_ACTIVE_CONNECTIONS, 1);
 		LOG("Added client %d\n", fd);
 
+		//the handshake must not block the loop
+		if (tls) {
+			req_info->tls = tls_conn_new(req_info->config->tls, fd);
+			if (req_info->tls == NULL) {
+				remove_client(fd);
+				return;
+			}
+			stream_client(fd, req_info);
+		}
+
 	} else {
 		LOG("add_client conflict on socket %d\n", fd);
 	}
@@ -224,20 +540,24 @@ void remove_client(int fd) {
 		epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
 
 		struct request_info *req_info = client_requests[fd];
-		free(req_info->event);
-		if (req_info->request_h) {
-			free(req_info->request_h);
-		}
-		if (req_info->response_h) {
-			free(req_info->response_h);
-		}
 
-		free(req_info);
+		//streams still open are closed first, they share the event
+		h2_conn_free(req_info->h2);
+		tls_conn_free(req_info->tls);
+		free(req_info->event);
+		ratelimit_disconnect(&req_info->addr);
+		zerocopy_conn *zc = req_info->zc;
+		free_request(req_info);
 
 		client_requests[fd] = NULL;
+		active_clients -= 1;
+		metrics_add(M_ACTIVE_CONNECTIONS, -1);
 
+		//the fd stays open while the kernel still sends from pinned buffers
 		shutdown(fd, SHUT_RDWR);
-		close(fd);
+		if (!zerocopy_close(zc, fd)) {
+			close(fd);
+		}
 
 		LOG("Removed client %d\n", fd);
 	} else { //for debugging
@@ -245,6 +565,43 @@ void remove_client(int fd) {
 	}
 }
 
+//release what one request holds, the connection itself is left alone
+void free_request(request_info *req_info) {
+	if (req_info->request_h) {
+		free(req_info->request_h);
+		memory_release(MEM_CONNECTIONS, MAX_HEADER_SIZE);
+	}
+	if (req_info->response_h) {
+		free(req_info->response_h);
+		memory_release(MEM_CONNECTIONS, MAX_HEADER_SIZE);
+	}
+	if (req_info->body) {
+		free(req_info->body);
+	}
+	free(req_info->redirect);
+	fastcgi_release(req_info->fcgi);
+	proxy_release(req_info->proxy);
+	if (req_info->file) {
+		fclose(req_info->file);
+	}
+	file_map_release(req_info->map);
+	plugin_call_free(req_info->plugin);
+	chunk_writer_free(req_info->chunks);
+	if (req_info->dir) {
+		closedir(req_info->dir);
+	}
+	server_config_release(req_info->config);
+
+	free(req_info);
+	memory_release(MEM_CONNECTIONS, sizeof(request_info));
+}
+
+//request and response headers are built in one of these
+char *header_buffer() {
+	memory_charge(MEM_CONNECTIONS, MAX_HEADER_SIZE);
+	return calloc(1, MAX_HEADER_SIZE);
+}
+
 //stage 0: read in header
 //stage 1+: process command
 //returns 0 on block, 1 on success, 2 on sigpipe/error
@@ -252,16 +609,61 @@ int handle_request(int fd) {
 	struct request_info *req_info = client_requests[fd];
 	errno = 0; //just in case for now
 
+	//every request on an HTTP/2 connection is one of its streams
+	if (req_info->h2 != NULL) {
+		return h2_conn_service(req_info->h2);
+	}
+
+	//TLS clients agree on h2 during the handshake instead
+	if (req_info->tls != NULL && req_info->stage == 0) {
+		int ret;
+		if ((ret = tls_handshake(req_info->tls)) != 1) {
+			return ret;
+		}
+		if (tls_alpn_h2(req_info->tls)) {
+			return start_h2(fd, req_info, 0);
+		}
+	}
+
 	//Stage 0: Read Header
 	if (req_info->stage == 0) {
 		int ret;
 		if ((ret = get_header(req_info)) != 1) {
 			return ret;
 		}
-		req_info->stage = 1;
+
+		//prior knowledge, the rest of the preface is read as HTTP/2
+		if (req_info->config->http2 && req_info->tls == NULL
+				&& strcmp(req_info->request_h, "PRI * HTTP/2.0\r\n\r\n") == 0) {
+			return start_h2(fd, req_info, 0);
+		}
+		if (wants_h2c(req_info)) {
+			return start_h2(fd, req_info, 1);
+		}
+		begin_request(req_info);
+	}
+
+	return process_request(fd, req_info);
+}
+
+//the header is complete: account and log the request once, not on every resume
+void begin_request(request_info *req_info) {
+	req_info->stage = 1;
+	trace_mark(&req_info->trace, TRACE_HEADER_READ, req_info->conn_id);
+	req_info->req_type = check_verb(req_info->request_h);
+	req_info->host = select_vhost(req_info);
+	metrics_request(req_info->req_type);
+
+	//the status page still answers, it shows the overload
+	req_info->shed = overload_shedding() && !is_status_request(req_info);
+	if (req_info->shed) {
+		metrics_add(M_SHED, 1);
 	}
 
-	//log
+	//full request bytes for replay, alongside the http_log sample below
+	capture_request(req_info->conn_id, req_info->start_us,
+			req_info->request_h, strlen(req_info->request_h));
+
 	if (http_log != NULL) {
 		int header_sample_len = (int)(strchr(req_info->request_h, '\n') - req_info->request_h) - 1;
 		char message[256];
@@ -273,17 +675,39 @@ int handle_request(int fd) {
 		fwrite(&message, message_len, 1, http_log);
 		LOG("Logged: %.*s", message_len, message); 
 	}
+}
 
+//Stage 1+: Process Request
+int process_request(int fd, request_info *req_info) {
 	LOG("Req enum: %d\n", req_info->req_type);
-	if (req_info->req_type == 0) {
-		req_info->req_type = check_verb(req_info->request_h);
+
+	//handler modules get the request before the server routes it
+	if (req_info->plugin == NULL && !req_info->plugins_passed && !req_info->shed && !req_info->limited) {
+		req_info->plugin = plugin_match(req_info->request_h, req_info->req_type, req_info->ip, fd);
+		req_info->plugins_passed = req_info->plugin == NULL;
+
+		//clients holding back a body until told to go ahead
+		size_t len;
+		const char *expect = header_field(req_info->request_h, "Expect", &len);
+		if (req_info->plugin != NULL && req_info->stream == NULL && plugin_body_expected(req_info->plugin)
+				&& expect != NULL && len == 12 && strncasecmp(expect, "100-continue", 12) == 0) {
+			client_write(fd, req_info, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+		}
 	}
 
-	//Stage 1+: Process Request
-	if (req_info->req_type == V_UNKNOWN) {
+	if (req_info->shed) {
+		return send_error(fd, 503, req_info);
+	} else if (req_info->limited) {
+		return send_error(fd, req_info->limited, req_info);
+	} else if (req_info->plugin != NULL) {
+		return send_plugin(fd, req_info);
+	} else if (req_info->req_type == V_UNKNOWN) {
 		return v_unknown(req_info);
 
 	} else if (req_info->req_type == GET || req_info->req_type == HEAD) {
+		if (is_status_request(req_info)) {
+			return send_metrics(fd, req_info);
+		}
 		return get(req_info);
 
 	//else if (req_info->req_type == PUT) {
@@ -294,7 +718,7 @@ int handle_request(int fd) {
 
 			//Allocate space for the response header
 			if (req_info->response_h == NULL) {
-				req_info->response_h = calloc(1, MAX_HEADER_SIZE);
+				req_info->response_h = header_buffer();
 			}
 
 			return send_error(fd, 405, req_info);
@@ -329,66 +753,132 @@ verb check_verb(char *header) {
 
 //initialize server
 void init_server() {
-	server_socket = socket(AF_INET, SOCK_STREAM, 0);
-
-	int optval = 1;
-	if (setsockopt(server_socket, SOL_SOCKET, SO_BROADCAST || SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
-		perror("setsockopt");
-		graceful_exit(0);
-	}
 
-	//set hints
-	struct addrinfo hints, *infoptr;
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
+	//reuse the listeners of the process we are replacing
+	int inherited[MAX_LISTENERS];
+	int num_inherited = upgrade_inherited_listeners(inherited, MAX_LISTENERS);
+
+	for (int i = 0; i < current_config->num_listeners; i++) {
+		const listener_spec *spec = &current_config->listeners[i];
+		int fd = -1;
+		for (int j = 0; j < num_inherited && fd == -1; j++) {
+			if (inherited[j] != -1 && listener_matches(inherited[j], spec)) {
+				fd = inherited[j];
+				inherited[j] = -1;
+			}
+		}
 
-	//get addrinfo for host from hints
-	int result = getaddrinfo("0.0.0.0", port, &hints, &infoptr);
-	if (result) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(result));
-		graceful_exit(0);
+		if (fd != -1) {
+			//the options and backlog are this config's, listen() again resizes the queue
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+			listener_options(fd, spec);
+			listen(fd, spec->backlog);
+		} else if ((fd = listener_open(spec)) == -1) {
+			graceful_exit(0);
+		}
+		listen_fds[num_listen_fds] = fd;
+		listen_tls[num_listen_fds] = spec->tls;
+		num_listen_fds += 1;
 	}
 
-	if (bind(server_socket, infoptr->ai_addr, infoptr->ai_addrlen) == -1) {
-		perror("Bind");
-		graceful_exit(0);
+	//addresses the new binary's config dropped
+	for (int j = 0; j < num_inherited; j++) {
+		if (inherited[j] != -1) {
+			LOG("Closing inherited listener %d, no longer configured\n", inherited[j]);
+			close(inherited[j]);
+		}
 	}
+}
 
-	if (listen(server_socket, BACKLOG) == -1) {
-		perror("Listen");
-		graceful_exit(0);
+//position of fd among the listeners, -1 for a client or upstream
+int listening_index(int fd) {
+	for (int i = 0; i < num_listen_fds; i++) {
+		if (listen_fds[i] == fd) {
+			return i;
+		}
 	}
-
-	LOG("Listening on file descriptor %d, port %s\n", server_socket, port);
-
-	freeaddrinfo(infoptr);
+	return -1;
 }
 
-//accept pending connections
-void accept_connections() {
+//accept pending connections, clients of the TLS listener start with a handshake
+void accept_connections(int listener, int tls) {
 
 	int fd = 0;
-	struct sockaddr client_addr;
+	struct sockaddr_storage client_addr;
 	socklen_t client_addr_len = sizeof(client_addr);
-	while ((fd = accept(server_socket, (struct sockaddr*)&client_addr, &client_addr_len)) > 0) {
+	while ((fd = accept4(listener, (struct sockaddr*)&client_addr, &client_addr_len, SOCK_CLOEXEC)) > 0) {
 
 		LOG("Found client\n");
+		client_addr_len = sizeof(client_addr); //for the next accept
 
 		if (fd == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
 			perror("accept");
 			LOG("Failed to connect to a client\n");
+		} else if (fd >= MAX_CLIENTS) {
+			LOG("No room for client on file descriptor %d\n", fd);
+			reject_client(fd, UNAVAILABLE_RESPONSE, sizeof(UNAVAILABLE_RESPONSE) - 1);
 		} else if (fd >= 0) {
-			struct sockaddr_in *client_addr_in = (struct sockaddr_in *)&client_addr;
-			add_client(fd, inet_ntoa(client_addr_in->sin_addr));
-			accept_connections();
-			LOG("Accepted %s on file descriptor %d\n", inet_ntoa(client_addr_in->sin_addr), fd);
+			ip_key key;
+			ip_key_from_sockaddr(&key, (struct sockaddr *)&client_addr);
+
+			//refused before any work is done for it, past the budget the rest wait in the backlog
+			//loopback clients get in so the status page stays reachable, their requests get the 503
+			if (overload_shedding() && !ip_key_is_loopback(&key)) {
+				size_t length;
+				const char *response = overload_response(&length);
+				reject_client(fd, response, length);
+				metrics_add(M_SHED, 1);
+				if (!overload_shed()) {
+					return;
+				}
+				continue;
+			}
+
+			//nothing left to give back, new clients would only add to it
+			if (memory_exhausted() && !ip_key_is_loopback(&key)) {
+				reject_client(fd, UNAVAILABLE_RESPONSE, sizeof(UNAVAILABLE_RESPONSE) - 1);
+				metrics_add(M_MEMORY_REFUSED, 1);
+				continue;
+			}
+
+			rl_result limit = ratelimit_connect(&key);
+			if (limit == RL_TOO_MANY) {
+				LOG("Rate limited client on %d\n", fd);
+				reject_client(fd, TOO_MANY_REQUESTS_RESPONSE, sizeof(TOO_MANY_REQUESTS_RESPONSE) - 1);
+				continue;
+			} else if (limit == RL_TABLE_FULL) {
+				LOG("Rate limit table full, rejecting %d\n", fd);
+				reject_client(fd, UNAVAILABLE_RESPONSE, sizeof(UNAVAILABLE_RESPONSE) - 1);
+				continue;
+			}
+
+			add_client(fd, (struct sockaddr *)&client_addr, tls);
+			accept_connections(listener, tls);
+			LOG("Accepted client on file descriptor %d\n", fd);
 		} else {
 			errno = 0;
 		}
 	}
 }
 
+//answer with a pre-rendered response and close, never blocks
+void reject_client(int fd, const char *response, size_t length) {
+	send(fd, response, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(fd);
+	metrics_add(M_REJECTED, 1);
+}
+
+//account a finished request, aborted ones never got a status
+void record_request(request_info *req_info) {
+	if (req_info != NULL && req_info->status != 0) {
+		long long now = monotonic_us();
+		metrics_response(req_info->status, now - req_info->start_us);
+		capture_status(req_info->conn_id, now, req_info->status);
+		trace_finish(&req_info->trace, req_info->conn_id, req_info->ip, req_info->request_h,
+				req_info->status, req_info->config->slow_request_ms);
+	}
+}
+
 void acknowledge_sigpipe(int arg) {
 	LOG("SIGPIPE!\n");
 }
@@ -396,35 +886,34 @@ void acknowledge_sigpipe(int arg) {
 void graceful_exit(int arg) {
 
 	//remove any existing clients
-	for (int i=0; i < 100; i += 1) {
+	for (int i=0; i < MAX_CLIENTS; i += 1) {
 		if (client_requests[i] != NULL) {
 			remove_client(i);
 		}
 	}
 
-	close(server_socket);
+	//socket files stay, an upgraded process may still be accepting on them
+	for (int i = 0; i < num_listen_fds; i++) {
+		close(listen_fds[i]);
+	}
 
 	//close log
 	if (http_log != NULL) {
 		fclose(http_log);
 	}
+	capture_close();
+
+	//types found since startup are there for the next start
+	if (current_config->warmup_snapshot != NULL) {
+		warmup_save(current_config->warmup_snapshot);
+	}
 
 	//close magic
 	if (magic != NULL) {
 		magic_close(magic);
 	}
 
-	if (security_headers != NULL) {
-		free(security_headers);
-	}
-
-	if (port != NULL) {
-		free(port);
-	}
-
-	if (root_site != NULL) {
-		free(root_site);
-	}
+	server_config_release(current_config);
 
 	exit(0);
 }
@@ -436,10 +925,12 @@ int get_header(request_info *req_info) {
 
 	if (req_info->request_h == NULL) {
 		LOG("\tHeader buffer allocated\n");
-		req_info->request_h = calloc(1, MAX_HEADER_SIZE*sizeof(char));
+		req_info->request_h = header_buffer();
 	}
 
-	ssize_t read_status = read_header(fd, req_info->request_h + req_info->progress, MAX_HEADER_SIZE - req_info->progress);
+	ssize_t read_status = req_info->tls != NULL
+			? tls_read_header(req_info->tls, req_info->request_h + req_info->progress, MAX_HEADER_SIZE - req_info->progress)
+			: read_header(fd, req_info->request_h + req_info->progress, MAX_HEADER_SIZE - req_info->progress);
 	LOG("\tRead status: %zd\n", read_status);
 
 	//is header too long?
@@ -496,20 +987,18 @@ int get_header(request_info *req_info) {
 		return send_error(fd, 414, req_info);
 	}
 
+	//HTTP/2 connection preface, it has no fields
+	if (req_info->config->http2 && req_info->tls == NULL && strcmp(req_info->request_h, "PRI * HTTP/2.0\r\n\r\n") == 0) {
+		req_info->progress = 0;
+		return 1;
+	}
+
 	//Host header
 	if (strstr(req_info->request_h, "Host:") == NULL) {
 		return send_error(fd, 400, req_info);
 	}
 
-	//Check range
-	req_info->range_start = 0;
-	req_info->range_end = 0;
-
-	//Scan in range
-	if (strstr(req_info->request_h, "Range:") != NULL) {
-		sscanf(req_info->request_h, "Range: bytes=%zu-%zu\n", &req_info->range_start, &req_info->range_end);
-	}
-	
+	parse_range(req_info);
 
 	LOG("completed reading header!\n");
 	req_info->stage = 1;
@@ -517,6 +1006,93 @@ int get_header(request_info *req_info) {
 
 	return 1;
 }
+
+//digits at *p, saturating, returns how many there were
+static int parse_size(const char **p, const char *end, size_t *value) {
+	int digits = 0;
+	*value = 0;
+	for (; *p < end && isdigit((unsigned char)**p); *p += 1, digits++) {
+		size_t digit = **p - '0';
+		*value = *value > (SIZE_MAX - digit) / 10 ? SIZE_MAX : *value * 10 + digit;
+	}
+	return digits;
+}
+
+//one byte range, a-b, a- or -n; anything else (several ranges, b < a, other
+//units) is ignored and the whole body sent
+void parse_range(request_info *req_info) {
+	req_info->ranged = RANGE_NONE;
+	req_info->range_start = 0;
+	req_info->range_end = 0;
+	req_info->range_suffix = 0;
+
+	size_t len;
+	const char *range = header_field(req_info->request_h, "Range", &len);
+	if (range == NULL || len < 6 || strncasecmp(range, "bytes=", 6) != 0) {
+		return;
+	}
+
+	const char *p = range + 6;
+	const char *end = range + len;
+	size_t first, last;
+	int first_digits = parse_size(&p, end, &first);
+	if (p == end || *p != '-') {
+		return;
+	}
+	p += 1;
+	int last_digits = parse_size(&p, end, &last);
+	if (p != end || (first_digits == 0 && last_digits == 0)) {
+		return;
+	}
+
+	if (first_digits == 0) {
+		req_info->ranged = RANGE_SUFFIX;
+		req_info->range_suffix = last;
+	} else if (last_digits == 0 || last >= first) {
+		//the end is inclusive on the wire, 0 leaves it open
+		req_info->ranged = RANGE_FROM;
+		req_info->range_start = first;
+		req_info->range_end = last_digits == 0 || last == SIZE_MAX ? 0 : last + 1;
+	}
+}
+
+//fit the requested range to a body of size bytes, before its header goes out
+//returns the status to answer with: 200 for the whole body, 206, or 416
+//when the range starts past the end
+int resolve_range(request_info *req_info, size_t size) {
+	req_info->range_size = size;
+	if (req_info->ranged == RANGE_NONE) {
+		req_info->range_start = 0;
+		req_info->range_end = size;
+		return 200;
+	}
+
+	if (req_info->ranged == RANGE_SUFFIX) {
+		req_info->range_start = req_info->range_suffix < size ? size - req_info->range_suffix : 0;
+		req_info->range_end = req_info->range_suffix > 0 ? size : 0;
+	} else if (req_info->range_end == 0 || req_info->range_end > size) {
+		req_info->range_end = size;
+	}
+
+	if (req_info->range_start >= req_info->range_end) {
+		req_info->range_start = req_info->range_end = 0;
+		return 416;
+	}
+	return 206;
+}
+
+void request_reload(int arg) {
+	reload_pending = 1;
+}
+
+void request_upgrade(int arg) {
+	upgrade_pending = 1;
+}
+
+void request_slow_dump(int arg) {
+	slow_dump_pending = 1;
+}
+
 int v_unknown(request_info *req_info) {
 	int fd = req_info->event->data.fd;
 
@@ -526,71 +1102,144 @@ int v_unknown(request_info *req_info) {
 int get(request_info *req_info) {
 	int fd = req_info->event->data.fd;
 
-	// path = root_site .. path (index.html if needed)
-	char path[MAX_PATHNAME_SIZE + strlen(root_site) + 1];
-	memcpy(path, root_site, strlen(root_site));
-
-	//Scan path
-	if (sscanf(req_info->request_h, "%*s %s", path + strlen(root_site)) != 1) {
-		return send_error(fd, 400, req_info);
+	if (req_info->fcgi != NULL) {
+		return send_fastcgi(fd, req_info);
+	} else if (req_info->proxy != NULL) {
+		return send_proxy(fd, req_info);
+	} else if (req_info->dir != NULL) {
+		return send_list(fd, -1, req_info);
 	}
 
-	//Append request path
-	LOG("\tGET %s\n", path);
+	//resolve and open once, a blocked response resumes on the open file
+	if (req_info->file == NULL && req_info->archived == NULL) {
 
-	//Attach \"index.html\" if they specified a directory
-	//as opposed to a file (i.e. favicon.ico)
-	if (strchr(path, '.') == NULL) {
-		if (path[strlen(path)-1] == '/') {
-			strncat(path, "index.php", 11);
-		} else {
-			strncat(path, "/index.php", 11);
+		//decoded and normalized request path, without the query string
+		char raw[MAX_PATHNAME_SIZE + 1];
+		char url[MAX_PATHNAME_SIZE + 1];
+		if (sscanf(req_info->request_h, "%*s %s", raw) != 1) {
+			return send_error(fd, 400, req_info);
 		}
 
-	} else if (strstr(path, "..") != NULL) {
-		return send_error(fd, 403, req_info);
-	}
+		int normalized = url_normalize(raw, url, sizeof(url));
+		if (normalized == -2) {
+			return send_error(fd, 403, req_info);
+		} else if (normalized != 0) {
+			return send_error(fd, 400, req_info);
+		}
 
-	//Check if resource exists
-	if (access(path, F_OK) != 0 && strstr(path + strlen(root_site), "/index.php")) {	
-		strstr(path, ".php")[0] = '\0';
-		strncat(path, ".html", 6);
-	}
-	
-	if (access(path, F_OK) != 0 && strstr(path + strlen(root_site), "/index.html")) {	
-		strstr(path, "index.html")[0] = '\0';
-		return send_list(fd, path, req_info);
-	}
+		//one walk of the location trie decides root, alias, redirect and headers
+		location *loc = router_match(req_info->host->router, url);
+		req_info->location = loc;
+		if (loc == NULL) {
+			return send_error(fd, 404, req_info);
+		}
+		if (loc->redirect != NULL) {
+			return send_redirect(fd, loc->redirect, url + loc->prefix_len, req_info);
+		}
+		if (loc->proxy != NULL) {
+			return start_proxy(fd, req_info);
+		}
 
-	if (access(path, F_OK) != 0) {
-		return send_error(fd, 404, req_info);
-	}
+		//paths the archive does not have are still looked for on disk
+		if (req_info->host->archive != NULL && loc->site_root) {
+			int ret = resolve_archived(fd, url, req_info);
+			if (ret != -1) {
+				return ret;
+			}
+		}
 
-	//Check file size
-	struct stat file_stat;
-	if (stat(path, &file_stat) == -1) {
-		perror("stat");
-		return 3;
-	}
-	size_t file_size = (size_t)file_stat.st_size;
+		//the kernel only walks the part of the path below the location root
+		int file_fd = open_beneath(loc->root_fd, location_relative(loc, url));
+		if (file_fd == -1) {
+			LOG("\tGET %s: %s\n", url, strerror(errno));
+			return send_error(fd, errno == ENOENT || errno == ENOTDIR ? 404 : 403, req_info);
+		}
 
-	LOG("Final file path: %s, File size: %zu\n", path, file_size);
+		struct stat file_stat;
+		if (fstat(file_fd, &file_stat) == -1) {
+			perror("fstat");
+			close(file_fd);
+			return 3;
+		}
 
-	if (req_info->range_end == 0) {
-		req_info->range_end = file_size;
-	}
+		// path = location root .. path (index file if needed), for mime types and the mmap cache
+		char path[loc->root_len + MAX_PATHNAME_SIZE + NAME_MAX + 3];
+		if (location_path(loc, url, path, sizeof(path)) == -1) {
+			close(file_fd);
+			return send_error(fd, 414, req_info);
+		}
+
+		if (S_ISDIR(file_stat.st_mode)) {
+
+			//relative links in the index or listing need the trailing slash
+			if (url[strlen(url) - 1] != '/') {
+				close(file_fd);
+				return send_redirect(fd, url, "/", req_info);
+			}
+
+			int index_fd = -1;
+			for (int i = 0; i < loc->num_index && index_fd == -1; i++) {
+				index_fd = open_beneath(file_fd, loc->index[i]);
+				if (index_fd != -1 && (fstat(index_fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode))) {
+					close(index_fd);
+					index_fd = -1;
+				} else if (index_fd != -1) {
+					strcat(path, "/");
+					strcat(path, loc->index[i]);
+				}
+			}
+
+			if (index_fd == -1) {
+				if (!loc->listing) {
+					close(file_fd);
+					return send_error(fd, 403, req_info);
+				}
+				return send_list(fd, file_fd, req_info);
+			}
+			close(file_fd);
+			file_fd = index_fd;
+		}
 
-	//range_end = max(range_end, file_size)
-	req_info->range_end = req_info->range_end <= file_size ? req_info->range_end : file_size;
-	LOG("Range: bytes=%zu-%zu\n", req_info->range_start, req_info->range_end);
+		size_t path_len = strlen(path);
+		if (req_info->host->fastcgi != NULL && path_len > strlen(FASTCGI_EXTENSION)
+				&& strcmp(path + path_len - strlen(FASTCGI_EXTENSION), FASTCGI_EXTENSION) == 0) {
+			close(file_fd);
+			return start_fastcgi(fd, path, url, loc, req_info);
+		}
+
+		req_info->file = fdopen(file_fd, "r");
+		size_t file_size = (size_t)file_stat.st_size;
+
+		LOG("Final file path: %s, File size: %zu\n", path, file_size);
+
+		if (resolve_range(req_info, file_size) == 416) {
+			return send_error(fd, 416, req_info);
+		}
+		LOG("Range: bytes %zu-%zu/%zu\n", req_info->range_start, req_info->range_end, file_size);
+
+		set_mime_type(path, &file_stat, req_info);
 
-	set_mime_type(path, req_info);
+		if (req_info->config->mmap_files && req_info->req_type != HEAD) {
+			req_info->map = file_cache_get(req_info->host->cache, path, file_fd);
+			if (req_info->map == NULL) {
+				perror("Mapping file");
+				return 3;
+			}
+			file_map_advise(req_info->map, req_info->range_start,
+					req_info->range_end - req_info->range_start);
+		}
+	}
 
 	if (req_info->stage == 1) {
 
+		//the client's archived copy is current, the 304 has no body
+		if (req_info->status == 304) {
+			return send_status(fd, 304, req_info);
+		}
+
 		//send response header, returning on block or error
 		int ret = 0;
-		if ((ret = send_status_n(fd, 200, req_info, 
+		if ((ret = send_status_n(fd, req_info->ranged != RANGE_NONE ? 206 : 200, req_info,
 				req_info->range_end - req_info->range_start)) != 1) {
 			return ret;
 		}
@@ -598,7 +1247,7 @@ int get(request_info *req_info) {
 		req_info->progress = 0;
 	}
 
-	//Get the actual file path, file size, and then write as much as possible
+	//write as much of the range as possible
 	if (req_info->stage == 2) {
 
 		//Do not send body if this is HEAD and not GET
@@ -606,55 +1255,607 @@ int get(request_info *req_info) {
 			return 1;
 		}
 
-		FILE *file = fopen(path, "r");
+		if (req_info->map != NULL) {
+			return send_mapped(fd, req_info, req_info->map->data, req_info->map->size);
+		} else if (req_info->archived != NULL) {
+			size_t size;
+			const char *body = archive_body(req_info->host->archive, req_info->archived,
+					req_info->archive_gzip, &size);
+			return send_mapped(fd, req_info, body, size);
+		}
 
-		ssize_t write_status = write_all_to_socket_from_file(fd, file, 
-				req_info->range_end - req_info->range_start - req_info->progress, 
+		size_t length = req_info->range_end - req_info->range_start;
+		ssize_t write_status = client_write_file(fd, req_info, req_info->file,
+				length - req_info->progress,
 				req_info->range_start + req_info->progress);
 
-		while (file != NULL) {
-			//Did we make progress?
-			if (write_status > 0) {
-				req_info->progress += write_status;
-			}
-
-			LOG("File GET progress: %zu\n", req_info->progress);
-
-			//Return on block/error, otherwise go to next stage
-			if (errno == EWOULDBLOCK || errno == EAGAIN) {
-				LOG("GET blocked!\n");
-				fclose(file);
-
-				//Resume request later
-				return 0;
-			} else if (errno == SIGPIPE) {
-				LOG("Sigpipe on %d\n", fd);
-				fclose(file);
+		//Did we make progress?
+		if (write_status > 0) {
+			req_info->progress += write_status;
+		}
 
-				//Ignore request
-				return 3;
-			} else if (errno != 0) { //SIGPIPE or error
-				LOG("Error GETTING file\n");
-				fclose(file);
+		LOG("File GET progress: %zu\n", req_info->progress);
 
+		//Return on block/error, otherwise go to next stage
+		if (errno == EWOULDBLOCK || errno == EAGAIN) {
+			LOG("GET blocked!\n");
+			//Resume request later
+			return 0;
+		} else if (errno == SIGPIPE) {
+			LOG("Sigpipe on %d\n", fd);
+			//Ignore request
+			return 3;
+		} else if (errno != 0) { //SIGPIPE or error
+			LOG("Error GETTING file\n");
+			//Ignore request
+			return 3;
+		}
+
+		return req_info->progress == length ? 1 : 0;
+	}
+	return 0;
+	
+}
+
+//a hit in the site archive, -1 to look for the path on disk instead
+int resolve_archived(int fd, const char *url, struct request_info *req_info) {
+	const site_archive *archive = req_info->host->archive;
+	size_t url_len = strlen(url);
+
+	//dynamic pages always run
+	if (req_info->host->fastcgi != NULL && url_len > strlen(FASTCGI_EXTENSION)
+			&& strcmp(url + url_len - strlen(FASTCGI_EXTENSION), FASTCGI_EXTENSION) == 0) {
+		return -1;
+	}
+
+	const archive_entry *e = archive_lookup(archive, url, url_len);
+	if (e == NULL) {
+		return -1;
+	}
+	if (e->flags & ARCHIVE_REDIRECT) {
+		return send_redirect(fd, url, "/", req_info);
+	}
+	metrics_add(M_ARCHIVE_HITS, 1);
+	req_info->archived = e;
+
+	//ranges are of the identity body
+	size_t len;
+	const char *accept = header_field(req_info->request_h, "Accept-Encoding", &len);
+	req_info->archive_gzip = e->gzip_len > 0 && req_info->ranged == RANGE_NONE
+			&& accept != NULL
+			&& accepts_gzip(accept, len);
+	req_info->fields = archive_fields(archive, e, req_info->archive_gzip, &req_info->fields_len);
+
+	size_t size;
+	archive_body(archive, e, req_info->archive_gzip, &size);
+	if (resolve_range(req_info, size) == 416) {
+		req_info->fields = NULL;
+		return send_error(fd, 416, req_info);
+	}
+	LOG("Archived %s%s, %zu bytes\n", url, req_info->archive_gzip ? " (gzip)" : "", size);
+
+	const char *tags = header_field(req_info->request_h, "If-None-Match", &len);
+	if (tags != NULL && archive_etag_matches(archive, e, req_info->archive_gzip, tags, len)) {
+		req_info->ranged = RANGE_NONE;
+		return send_status(fd, 304, req_info);
+	}
+	return get(req_info);
+}
+
+//send the requested range straight out of a shared read-only mapping
+static void release_map(void *map) {
+	file_map_release(map);
+}
+
+static void release_config(void *conf) {
+	server_config_release(conf);
+}
+
+int send_mapped(int fd, struct request_info *req_info, const char *data, size_t size) {
+
+	//file shrank since it was stat'ed
+	if (req_info->range_end > size) {
+		LOG("File changed size while being served\n");
+		return 3;
+	}
+
+	size_t length = req_info->range_end - req_info->range_start;
+	char *start = (char *)data + req_info->range_start + req_info->progress;
+	ssize_t write_status;
+	if (req_info->stream == NULL && req_info->tls == NULL) {
+		//the mapping, or the snapshot holding the archive, outlives the request until the kernel is done
+		write_status = req_info->map != NULL
+				? zerocopy_write(&req_info->zc, fd, start, length - req_info->progress,
+						release_map, file_map_acquire(req_info->map))
+				: zerocopy_write(&req_info->zc, fd, start, length - req_info->progress,
+						release_config, server_config_acquire(req_info->config));
+	} else {
+		write_status = client_write(fd, req_info, start, length - req_info->progress);
+	}
+
+	//Did we make progress?
+	if (write_status > 0) {
+		req_info->progress += write_status;
+	}
+
+	LOG("Mapped GET progress: %zu/%zu\n", req_info->progress, length);
+
+	//Return on block/error, otherwise go to next stage
+	if (errno == EWOULDBLOCK || errno == EAGAIN) {
+		LOG("GET blocked!\n");
+		//Resume request later
+		return 0;
+	} else if (errno == SIGPIPE) {
+		LOG("Sigpipe on %d\n", fd);
+		//Ignore request
+		return 3;
+	} else if (errno != 0) { //SIGPIPE or error
+		LOG("Error GETTING file\n");
+		//Ignore request
+		return 3;
+	}
+
+	return req_info->progress == length ? 1 : 0;
+}
+
+//hand a script to the site's FastCGI pool, the response comes back through service_client
+int start_fastcgi(int fd, const char *path, const char *url, const location *loc, struct request_info *req_info) {
+
+	fastcgi_request *f = fastcgi_request_new(req_info->host->fastcgi, fd);
+	if (f == NULL) {
+		return send_error(fd, 503, req_info);
+	}
+	req_info->fcgi = f;
+
+	//dynamic responses are not ranged
+	req_info->ranged = RANGE_NONE;
+
+	char *method = req_info->request_h;
+	char *target = strchr(method, ' ') + 1;
+	char *protocol = strchr(target, ' ') + 1;
+	char *query = memchr(target, '?', protocol - 1 - target);
+
+	fastcgi_param(f, "GATEWAY_INTERFACE", "CGI/1.1", 7);
+	fastcgi_param(f, "SERVER_SOFTWARE", "epoll-webserver", 15);
+	fastcgi_param(f, "SERVER_PROTOCOL", protocol, strcspn(protocol, "\r\n"));
+	//the port this client connected to, empty over a unix socket
+	char port[8] = "";
+	struct sockaddr_storage local;
+	socklen_t local_len = sizeof(local);
+	if (getsockname(fd, (struct sockaddr *)&local, &local_len) == 0 && local.ss_family != AF_UNIX) {
+		snprintf(port, sizeof(port), "%d", ntohs(local.ss_family == AF_INET6
+				? ((struct sockaddr_in6 *)&local)->sin6_port : ((struct sockaddr_in *)&local)->sin_port));
+	}
+	fastcgi_param(f, "SERVER_PORT", port, strlen(port));
+	fastcgi_param(f, "REQUEST_METHOD", method, target - 1 - method);
+	fastcgi_param(f, "REQUEST_URI", target, protocol - 1 - target);
+	fastcgi_param(f, "QUERY_STRING", query != NULL ? query + 1 : "",
+			query != NULL ? (size_t)(protocol - 1 - query - 1) : 0);
+	fastcgi_param(f, "SCRIPT_NAME", url, strlen(url));
+	fastcgi_param(f, "DOCUMENT_URI", url, strlen(url));
+	fastcgi_param(f, "SCRIPT_FILENAME", path, strlen(path));
+	fastcgi_param(f, "DOCUMENT_ROOT", loc->root, loc->root_len);
+	fastcgi_param(f, "REMOTE_ADDR", req_info->ip, strlen(req_info->ip));
+	fastcgi_param(f, "REDIRECT_STATUS", "200", 3); //php-cgi refuses to run without it
+	if (req_info->tls != NULL || (req_info->stream != NULL && client_requests[fd]->tls != NULL)) {
+		fastcgi_param(f, "HTTPS", "on", 2);
+	}
+
+	//request header fields become HTTP_NAME, except Proxy (httpoxy)
+	char *line = strchr(req_info->request_h, '\n');
+	while (line != NULL && line[1] != '\0' && line[1] != '\r' && line[1] != '\n') {
+		line += 1;
+		char *colon = strchr(line, ':');
+		char *eol = strchr(line, '\n');
+		if (colon != NULL && (eol == NULL || colon < eol) && colon - line < 64
+				&& !(colon - line == 5 && strncasecmp(line, "Proxy", 5) == 0)) {
+			char name[64 + 5] = "HTTP_";
+			for (int i = 0; i < colon - line; i++) {
+				name[i + 5] = line[i] == '-' ? '_' : toupper((unsigned char)line[i]);
+			}
+			name[colon - line + 5] = '\0';
+
+			char *value = colon + 1;
+			while (*value == ' ' || *value == '\t') {
+				value += 1;
+			}
+			fastcgi_param(f, name, value, strcspn(value, "\r\n"));
+		}
+		line = eol;
+	}
+
+	fastcgi_submit(f);
+	stream_client(fd, req_info);
+
+	return send_fastcgi(fd, req_info);
+}
+
+//the body arrives in pieces, so writes to this client must not block the loop
+void stream_client(int fd, struct request_info *req_info) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	req_info->event->events = EPOLLIN | EPOLLOUT | EPOLLET;
+	epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, req_info->event);
+}
+
+//writes to the client, through TLS or into the stream's buffer on an HTTP/2 connection
+//like write_all_to_socket, errno is EAGAIN when not everything fit
+ssize_t client_write(int fd, struct request_info *req_info, char *buf, size_t len) {
+	if (req_info->stream != NULL) {
+		return h2_stream_write(req_info->stream, buf, len);
+	} else if (req_info->tls != NULL) {
+		return tls_write_all(req_info->tls, buf, len);
+	}
+	return write_all_to_socket(fd, buf, len);
+}
+
+ssize_t client_write_file(int fd, struct request_info *req_info, FILE *file, size_t count, size_t offset) {
+	if (req_info->tls != NULL) {
+		return tls_write_file(req_info->tls, fileno(file), count, offset);
+	} else if (req_info->stream == NULL) {
+		return write_all_to_socket_from_file(fd, file, count, offset);
+	}
+
+	//only read what the stream has room for
+	char buf[SOCKET_BUFFER];
+	size_t progress = 0;
+	errno = 0;
+	while (progress < count) {
+		size_t want = count - progress < sizeof(buf) ? count - progress : sizeof(buf);
+		if (want > h2_stream_space(req_info->stream)) {
+			want = h2_stream_space(req_info->stream);
+		}
+		if (want == 0) {
+			errno = EAGAIN;
+			break;
+		}
+
+		ssize_t result = pread(fileno(file), buf, want, offset + progress);
+		if (result <= 0) {
+			errno = result == 0 ? EIO : errno;
+			return -1;
+		}
+		if (h2_stream_write(req_info->stream, buf, result) != result) {
+			return -1;
+		}
+		progress += result;
+	}
+	return progress;
+}
+
+static ssize_t send_body(void *data, const void *buf, size_t len) {
+	request_info *req_info = data;
+	return client_write(req_info->event->data.fd, req_info, (char *)buf, len);
+}
+
+//a body sent without Content-Length, after send_status_n with STREAMED_BODY
+//like client_write, errno is EAGAIN when not all of buf was taken
+ssize_t body_write(int fd, struct request_info *req_info, const char *buf, size_t len) {
+	return chunk_write(req_info->chunks, buf, len);
+}
+
+//send what body_write has collected, same returns as body_finish
+int body_flush(int fd, struct request_info *req_info) {
+	if (req_info->chunks == NULL) {
+		return 1;
+	}
+	int ret = chunk_flush(req_info->chunks);
+	return ret == -1 ? 3 : ret;
+}
+
+//returns 1 once the body has ended, 0 when blocked, 3 on error
+int body_finish(int fd, struct request_info *req_info) {
+	if (req_info->chunks == NULL) {
+		return 1;
+	}
+	int ret = chunk_finish(req_info->chunks);
+	return ret == -1 ? 3 : ret;
+}
+
+//Accept-Encoding lists gzip (or *) without q=0
+static int accepts_gzip(const char *accept, size_t len) {
+	size_t pos = 0;
+	while (pos < len) {
+		pos += strspn(accept + pos, " \t,");
+		const char *coding = accept + pos;
+		size_t coding_len = strcspn(coding, " \t,;");
+		pos += strcspn(coding, ",");
+		if (pos > len) {
+			pos = len;
+		}
+		if (coding_len > (size_t)(accept + pos - coding)) {
+			coding_len = accept + pos - coding;
+		}
+
+		if ((coding_len == 4 && strncasecmp(coding, "gzip", 4) == 0) || (coding_len == 1 && coding[0] == '*')) {
+			const char *q = memchr(coding, ';', accept + pos - coding);
+			if (q == NULL) {
+				return 1;
+			}
+			q += 1 + strspn(q + 1, " \t");
+			return strncmp(q, "q=", 2) != 0 || strtod(q + 2, NULL) > 0;
+		}
+	}
+	return 0;
+}
+
+//an HTTP/1.1 GET or HEAD asking to continue as cleartext HTTP/2
+int wants_h2c(request_info *req_info) {
+	size_t len;
+	const char *upgrade = header_field(req_info->request_h, "Upgrade", &len);
+	verb type = check_verb(req_info->request_h);
+	return req_info->config->http2 && req_info->tls == NULL && upgrade != NULL && len >= 3 && strncasecmp(upgrade, "h2c", 3) == 0
+			&& (len == 3 || upgrade[3] == ',')
+			&& header_field(req_info->request_h, "HTTP2-Settings", &len) != NULL
+			&& (type == GET || type == HEAD);
+}
+
+//every stream is a request of its own, sharing the connection's socket and event
+static void *open_h2_stream(h2_stream *stream, const char *head, size_t len, void *conn_data) {
+	request_info *conn_info = conn_data;
+	if (len >= MAX_HEADER_SIZE) {
+		return NULL;
+	}
+
+	request_info *req_info = calloc(1, sizeof(request_info));
+	memory_charge(MEM_CONNECTIONS, sizeof(request_info));
+	req_info->event = conn_info->event;
+	req_info->stream = stream;
+	memcpy(req_info->ip, conn_info->ip, sizeof(req_info->ip));
+	req_info->addr = conn_info->addr;
+
+	//a long lived connection picks up reloads with its next stream
+	req_info->config = server_config_acquire(current_config);
+	req_info->start_us = monotonic_us();
+	req_info->conn_id = conn_info->conn_id;
+	trace_mark(&req_info->trace, TRACE_ACCEPT, req_info->conn_id);
+
+	req_info->request_h = header_buffer();
+	memcpy(req_info->request_h, head, len);
+	parse_range(req_info);
+	begin_request(req_info);
+
+	//streams multiplex requests past the limit taken per connection
+	if (conn_info->h2_streams++ > 0 && !req_info->shed) {
+		rl_result limit = ratelimit_request(&req_info->addr);
+		req_info->limited = limit == RL_TOO_MANY ? 429 : limit == RL_TABLE_FULL ? 503 : 0;
+	}
+	return req_info;
+}
+
+static int run_h2_stream(void *data) {
+	request_info *req_info = data;
+	errno = 0;
+	return process_request(req_info->event->data.fd, req_info);
+}
+
+static void close_h2_stream(void *data) {
+	record_request(data);
+	free_request(data);
+}
+
+//frames of a TLS connection go through its records
+static ssize_t recv_h2_tls(void *conn_data, void *buf, size_t len) {
+	return tls_read(((request_info *)conn_data)->tls, buf, len);
+}
+
+static ssize_t send_h2_tls(void *conn_data, const void *buf, size_t len) {
+	return tls_write(((request_info *)conn_data)->tls, buf, len);
+}
+
+static const h2_callbacks h2_handlers = { open_h2_stream, run_h2_stream, close_h2_stream, NULL, NULL };
+static const h2_callbacks h2_tls_handlers = { open_h2_stream, run_h2_stream, close_h2_stream, recv_h2_tls, send_h2_tls };
+
+//switch the connection to HTTP/2, after a 101 if the request asked for it
+//a TLS client that picked h2 by ALPN has not sent anything yet
+int start_h2(int fd, request_info *req_info, int upgrade) {
+	static const char SWITCHING_PROTOCOLS[] = "HTTP/1.1 101 Switching Protocols\r\n"
+			"Connection: Upgrade\r\n"
+			"Upgrade: h2c\r\n\r\n";
+
+	if (upgrade && write_all_to_socket(fd, (char *)SWITCHING_PROTOCOLS,
+			sizeof(SWITCHING_PROTOCOLS) - 1) != sizeof(SWITCHING_PROTOCOLS) - 1) {
+		return 3;
+	}
+
+	stream_client(fd, req_info);
+	req_info->h2 = h2_conn_new(fd, req_info->tls != NULL ? &h2_tls_handlers : &h2_handlers, req_info,
+			upgrade || req_info->request_h == NULL ? 0 : strlen(req_info->request_h));
+	LOG("HTTP/2 on %d%s\n", fd, upgrade ? " after an upgrade" : "");
+
+	if (upgrade) {
+		size_t settings_len;
+		const char *settings = header_field(req_info->request_h, "HTTP2-Settings", &settings_len);
+		if (h2_conn_upgrade(req_info->h2, settings, settings_len, req_info->request_h,
+				strlen(req_info->request_h)) == -1) {
+			return 3;
+		}
+	}
+	return h2_conn_service(req_info->h2);
+}
+
+//relay whatever the responder has produced so far
+int send_fastcgi(int fd, struct request_info *req_info) {
+	fastcgi_request *f = req_info->fcgi;
+
+	//failed before the response started, send an error page instead
+	if (req_info->upstream_error == 0 && req_info->stage == 1
+			&& (f->error != 0 || (f->ended && !f->header_done))) {
+		req_info->upstream_error = f->error != 0 ? f->error : 502;
+	}
+	if (req_info->upstream_error != 0) {
+		return send_error(fd, req_info->upstream_error, req_info);
+	}
+
+	if (req_info->stage == 1) {
+		if (!f->header_done) {
+			return 0;
+		}
+
+		int ret;
+		if ((ret = send_status(fd, f->status, req_info)) != 1) {
+			return ret;
+		}
+		req_info->stage += 1;
+		req_info->progress = 0;
+	}
+
+	if (req_info->stage == 2) {
+		if (req_info->req_type == HEAD) {
+			return 1;
+		}
+
+		while (f->out_len > f->out_start) {
+			ssize_t write_status = client_write(fd, req_info, f->out + f->out_start, f->out_len - f->out_start);
+
+			//Did we make progress?
+			if (write_status > 0) {
+				req_info->progress += write_status;
+				fastcgi_consume(f, write_status);
+			}
+
+			//Return on block/error, otherwise go to next stage
+			if (errno == EWOULDBLOCK || errno == EAGAIN) {
+				LOG("FastCGI relay blocked!\n");
+				//Resume request later
+				return 0;
+			} else if (errno != 0) { //SIGPIPE or error
+				LOG("Error relaying FastCGI response\n");
 				//Ignore request
 				return 3;
-			} else if (req_info->progress == file_size) {
-				LOG("Completed GETTING file!\n");
-				fclose(file);
-				return 1; //Success!
 			}
 		}
 
-		return req_info->progress == file_size;
+		//cut off mid-body, the client sees the connection close early
+		if (f->error != 0) {
+			return 3;
+		}
+		return f->ended ? 1 : 0;
+	}
+	return 0;
+}
+
+//hop-by-hop fields stay with this connection, the upstream gets its own
+static int is_hop_by_hop(const char *name, size_t len) {
+	static const char *fields[] = { "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+			"Transfer-Encoding", "Upgrade", "Content-Length", "X-Forwarded-For", "X-Forwarded-Proto" };
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		if (len == strlen(fields[i]) && strncasecmp(name, fields[i], len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//pass the request to the location's upstreams, the response comes back through service_client
+int start_proxy(int fd, struct request_info *req_info) {
+
+	//the body is spliced into the socket, which a stream does not have to itself
+	if (req_info->stream != NULL) {
+		h2_stream_reset(req_info->stream, H2_HTTP_1_1_REQUIRED);
+		return 3;
+	}
+
+	//the upstream answers ranges itself
+	req_info->ranged = RANGE_NONE;
+
+	//request line with the target as the client sent it, always as HTTP/1.1
+	char *method = req_info->request_h;
+	char *target = strchr(method, ' ') + 1;
+	char *protocol = strchr(target, ' ');
+
+	size_t cap = 2 * strlen(req_info->request_h) + INET6_ADDRSTRLEN + 128;
+	char *head = malloc(cap);
+	size_t len = sprintf(head, "%.*s HTTP/1.1\r\n", (int)(protocol - method), method);
+
+	//fields are copied with CRLF endings, X-Forwarded-For gets the client added
+	const char *forwarded = NULL;
+	size_t forwarded_len = 0;
+	char *line = strchr(req_info->request_h, '\n');
+	while (line != NULL && line[1] != '\0' && line[1] != '\r' && line[1] != '\n') {
+		line += 1;
+		char *eol = strchr(line, '\n');
+		size_t line_len = eol != NULL ? (size_t)(eol - line) : strlen(line);
+		if (line_len > 0 && line[line_len - 1] == '\r') {
+			line_len -= 1;
+		}
+		char *colon = memchr(line, ':', line_len);
+
+		if (colon != NULL && colon - line == 15 && strncasecmp(line, "X-Forwarded-For", 15) == 0) {
+			forwarded = colon + 1 + strspn(colon + 1, " \t");
+			forwarded_len = line + line_len - forwarded;
+		} else if (colon != NULL && !is_hop_by_hop(line, colon - line)) {
+			len += sprintf(head + len, "%.*s\r\n", (int)line_len, line);
+		}
+		line = eol;
+	}
+
+	len += sprintf(head + len, "X-Forwarded-For: %.*s%s%s\r\n"
+			"X-Forwarded-Proto: %s\r\n"
+			"Connection: keep-alive\r\n\r\n",
+			(int)forwarded_len, forwarded != NULL ? forwarded : "",
+			forwarded_len > 0 ? ", " : "", req_info->ip, req_info->tls != NULL ? "https" : "http");
+
+	req_info->proxy = proxy_request_new(req_info->location->proxy, fd, head, len,
+			req_info->req_type == HEAD);
+	free(head);
+	stream_client(fd, req_info);
+
+	return send_proxy(fd, req_info);
+}
+
+static ssize_t send_tls(void *tls, const void *buf, size_t len) {
+	return tls_write(tls, buf, len);
+}
+
+//relay the upstream response, the body is spliced and never copied in here
+int send_proxy(int fd, struct request_info *req_info) {
+	proxy_request *p = req_info->proxy;
+
+	//failed before the response started, send an error page instead
+	if (req_info->upstream_error == 0 && req_info->stage == 1 && p->error != 0) {
+		req_info->upstream_error = p->error;
+	}
+	if (req_info->upstream_error != 0) {
+		return send_error(fd, req_info->upstream_error, req_info);
+	}
+
+	if (req_info->stage == 1) {
+		if (!p->header_done) {
+			return 0;
+		}
+
+		int ret;
+		if ((ret = send_status(fd, p->status, req_info)) != 1) {
+			return ret;
+		}
+		req_info->stage += 1;
+		req_info->progress = 0;
+	}
+
+	if (req_info->stage == 2) {
+		//spliced bytes are only encrypted if the kernel holds the keys
+		ssize_t sent = req_info->tls != NULL && !tls_kernel_send(req_info->tls)
+				? proxy_copy(p, send_tls, req_info->tls) : proxy_splice(p);
+		if (sent == -1) {
+			LOG("Error relaying proxied response\n");
+			return 3;
+		}
+		req_info->progress += sent;
+		LOG("Proxy progress: %zu\n", req_info->progress);
+
+		//cut off mid-body, the client sees the connection close early
+		if (p->error != 0) {
+			return 3;
+		}
+		return p->body_done && p->piped == 0 ? 1 : 0;
 	}
 	return 0;
-	
 }
 
 int put(request_info *req_info) {
 
 	int fd = req_info->event->data.fd;
+	char *root_site = req_info->config->root_site;
 
 	// path = root_site .. path (index.html if needed)
 	char path[MAX_PATHNAME_SIZE + strlen(root_site) + 1];
@@ -746,16 +1947,60 @@ int put(request_info *req_info) {
 	}
 }
 
+//security headers of the location, else the site, else the server
+const char *response_headers(struct request_info *req_info, size_t *len) {
+	if (req_info->location != NULL) {
+		*len = req_info->location->headers_len;
+		return req_info->location->headers;
+	} else if (req_info->host != NULL) {
+		*len = req_info->host->security_headers_len;
+		return req_info->host->security_headers;
+	}
+	*len = req_info->config->security_headers_len;
+	return req_info->config->security_headers;
+}
+
+//the security headers after fields a handler or an archive set: a
+//Cache-Control among them replaces the configured one, as a location's does
+void append_response_headers(struct request_info *req_info) {
+	size_t headers_len;
+	const char *headers = response_headers(req_info, &headers_len);
+
+	int own_policy = 0;
+	for (const char *f = req_info->fields; f != NULL && f < req_info->fields + req_info->fields_len; ) {
+		own_policy |= strncasecmp(f, "Cache-Control:", 14) == 0;
+		const char *next = memchr(f, '\n', req_info->fields + req_info->fields_len - f);
+		f = next != NULL ? next + 1 : NULL;
+	}
+	if (!own_policy) {
+		strncat(req_info->response_h, headers, headers_len);
+		return;
+	}
+
+	char *end = req_info->response_h + strlen(req_info->response_h);
+	for (const char *line = headers; line < headers + headers_len; ) {
+		const char *next = memchr(line, '\n', headers + headers_len - line);
+		size_t line_len = next != NULL ? (size_t)(next + 1 - line) : (size_t)(headers + headers_len - line);
+		if (strncasecmp(line, "Cache-Control:", 14) != 0) {
+			memcpy(end, line, line_len);
+			end += line_len;
+		}
+		line += line_len;
+	}
+	*end = '\0';
+}
+
 int send_status(int fd, int status, struct request_info *req_info) {
 	LOG("Preparing a status of %d\n", status);
 
 	//Allocate space for the response header
 	if (req_info->response_h == NULL) {
-		req_info->response_h = calloc(1, MAX_HEADER_SIZE);
+		req_info->response_h = header_buffer();
 	}
 
 	//in case of block and resume, dont overwrite response_h
 	if (strlen(req_info->response_h) < 1) {
+		trace_mark(&req_info->trace, TRACE_RESOLVED, req_info->conn_id);
 		char date[100];
 		time_t now = time(0);
 		struct tm tm = *gmtime(&now);
@@ -764,12 +2009,16 @@ int send_status(int fd, int status, struct request_info *req_info) {
 		sprintf(req_info->response_h, "HTTP/1.1 %d %s\n"
 				"Date: %s\n"
 				"Connection: close\n",
-				status, status_desc[status], date);
-
-		if (req_info->range_end != 0) {
-			sprintf(req_info->response_h + strlen(req_info->response_h), 
-					"Content-Range: bytes=%zu-%zu\n", req_info->range_start,
-					req_info->range_end);
+				status, status_desc[status] != NULL ? status_desc[status] : "", date);
+		req_info->status = status;
+
+		if (req_info->ranged != RANGE_NONE && status == 206) {
+			sprintf(req_info->response_h + strlen(req_info->response_h),
+					"Content-Range: bytes %zu-%zu/%zu\n", req_info->range_start,
+					req_info->range_end - 1, req_info->range_size);
+		} else if (req_info->ranged != RANGE_NONE && status == 416) {
+			sprintf(req_info->response_h + strlen(req_info->response_h),
+					"Content-Range: bytes */%zu\n", req_info->range_size);
 		}
 
 		if (req_info->mime_type != NULL) { //TODO: Make this work
@@ -777,11 +2026,32 @@ int send_status(int fd, int status, struct request_info *req_info) {
 					"Content-Type: %s\n", req_info->mime_type);
 		}	
 
-		strncat(req_info->response_h, security_headers, strlen(security_headers));
+		//Content-Type, ETag and the like rendered when the archive was built
+		if (req_info->fields != NULL) {
+			strncat(req_info->response_h, req_info->fields, req_info->fields_len);
+		}
+
+		//fields from a FastCGI responder or an upstream, cut to fit
+		const char *upstream_headers = req_info->fcgi != NULL ? req_info->fcgi->headers
+				: req_info->proxy != NULL ? req_info->proxy->headers : NULL;
+		size_t tail_len;
+		response_headers(req_info, &tail_len);
+		size_t used = strlen(req_info->response_h) + tail_len + 1;
+		if (upstream_headers != NULL && used < MAX_HEADER_SIZE) {
+			snprintf(req_info->response_h + strlen(req_info->response_h), MAX_HEADER_SIZE - used,
+					"%s", upstream_headers);
+		}
+
+		if (req_info->redirect != NULL) {
+			sprintf(req_info->response_h + strlen(req_info->response_h),
+					"Location: %s\n", req_info->redirect);
+		}
+
+		append_response_headers(req_info);
 	}
 
 
-	ssize_t write_status = write_all_to_socket(fd, 
+	ssize_t write_status = client_write(fd, req_info,
 			req_info->response_h + req_info->progress, 
 			strlen(req_info->response_h) - req_info->progress);
 
@@ -808,6 +2078,7 @@ int send_status(int fd, int status, struct request_info *req_info) {
 	}
 
 	LOG("Completed writing response!\n");
+	trace_mark(&req_info->trace, TRACE_STATUS_SENT, req_info->conn_id);
         return 1;
 }			
 
@@ -816,11 +2087,12 @@ int send_status_n(int fd, int status, struct request_info *req_info, size_t file
 
 	//Allocate space for the response header
 	if (req_info->response_h == NULL) {
-		req_info->response_h = calloc(1, MAX_HEADER_SIZE);
+		req_info->response_h = header_buffer();
 	}
 
 	//in case of block and resume, dont overwrite response_h
 	if (strlen(req_info->response_h) < 1) {
+		trace_mark(&req_info->trace, TRACE_RESOLVED, req_info->conn_id);
 		char date[100];
 		time_t now = time(0);
 		struct tm tm = *gmtime(&now);
@@ -828,14 +2100,39 @@ int send_status_n(int fd, int status, struct request_info *req_info, size_t file
 
 		sprintf(req_info->response_h, "HTTP/1.1 %d %s\n"
 				"Date: %s\n"
-				"Connection: close\n"
-				"Content-Length: %zu\n",
-				status, status_desc[status], date, file_size);
+				"Connection: close\n",
+				status, status_desc[status], date);
+		req_info->status = status;
 
-		if (req_info->range_end != 0) {
-			sprintf(req_info->response_h + strlen(req_info->response_h), 
-					"Content-Range: bytes=%zu-%zu\n", req_info->range_start,
-					req_info->range_end);
+		//HTTP/2 and HTTP/1.0 clients see a streamed body end with the stream or the connection
+		if (file_size != STREAMED_BODY) {
+			sprintf(req_info->response_h + strlen(req_info->response_h),
+					"Content-Length: %zu\n", file_size);
+		} else {
+			int major = 0, minor = 0;
+			sscanf(req_info->request_h, "%*s %*s HTTP/%d.%d", &major, &minor);
+			int framed = req_info->stream == NULL && (major > 1 || (major == 1 && minor >= 1));
+			if (framed) {
+				strcat(req_info->response_h, "Transfer-Encoding: chunked\n");
+			}
+			if (req_info->req_type != HEAD && req_info->chunks == NULL) {
+				int plain = req_info->stream == NULL && req_info->tls == NULL;
+				req_info->chunks = chunk_writer_new(plain ? fd : -1, send_body, req_info, framed);
+			}
+		}
+
+		if (status == 503) {
+			sprintf(req_info->response_h + strlen(req_info->response_h),
+					"Retry-After: %d\n", overload_retry_after());
+		}
+
+		if (req_info->ranged != RANGE_NONE && status == 206) {
+			sprintf(req_info->response_h + strlen(req_info->response_h),
+					"Content-Range: bytes %zu-%zu/%zu\n", req_info->range_start,
+					req_info->range_end - 1, req_info->range_size);
+		} else if (req_info->ranged != RANGE_NONE && status == 416) {
+			sprintf(req_info->response_h + strlen(req_info->response_h),
+					"Content-Range: bytes */%zu\n", req_info->range_size);
 		}
 		
 
@@ -844,10 +2141,20 @@ int send_status_n(int fd, int status, struct request_info *req_info, size_t file
 					"Content-Type: %s\n", req_info->mime_type);
 		}	
 
-		strncat(req_info->response_h, security_headers, strlen(security_headers));
+		//Content-Type, ETag and the like rendered when the archive was built
+		if (req_info->fields != NULL) {
+			strncat(req_info->response_h, req_info->fields, req_info->fields_len);
+		}
+
+		if (req_info->redirect != NULL) {
+			sprintf(req_info->response_h + strlen(req_info->response_h),
+					"Location: %s\n", req_info->redirect);
+		}
+
+		append_response_headers(req_info);
 	}
 
-	ssize_t write_status = write_all_to_socket(fd, 
+	ssize_t write_status = client_write(fd, req_info,
 			req_info->response_h + req_info->progress, 
 			strlen(req_info->response_h) - req_info->progress);
 
@@ -874,50 +2181,158 @@ int send_status_n(int fd, int status, struct request_info *req_info, size_t file
 	}
 
 	LOG("Completed writing response!\n");
+	trace_mark(&req_info->trace, TRACE_STATUS_SENT, req_info->conn_id);
 	
 	return 1;
 }			
 
-int send_list(int fd, char *path, struct request_info *req_info) {
+//takes ownership of dir_fd, which is -1 when a blocked listing resumes
+//streamed an entry at a time, so a directory of any size takes no more memory than one
+int send_list(int fd, int dir_fd, struct request_info *req_info) {
+
+	if (req_info->dir == NULL) {
+		req_info->dir = fdopendir(dir_fd);
+		if (req_info->dir == NULL) {
+			close(dir_fd);
+			return send_error(fd, 404, req_info);
+		}
+		LOG("Sending directory listing to %d\n", fd);
+	}
+
+	if (req_info->stage == 1) {
+		int ret;
+		if ((ret = send_status_n(fd, 200, req_info, STREAMED_BODY)) != 1) {
+			return ret;
+		}
+		if (req_info->req_type == HEAD) {
+			return 1;
+		}
+		req_info->stage += 1;
+		req_info->progress = 0;
+		req_info->body = strdup(HTML_HEADER);
+	}
 
-	//make list in html
-	char buff[8096];
-	buff[0] = '\0';
+	//stage 2 lists entries, stage 3 ends the body after the footer
+	while (req_info->stage == 2 || req_info->stage == 3) {
 
-        DIR *d = opendir(path);
-        struct dirent *dir;
+		//the line a blocked write left over goes first
+		if (req_info->body != NULL) {
+			size_t len = strlen(req_info->body);
+			ssize_t write_status = body_write(fd, req_info,
+					req_info->body + req_info->progress, len - req_info->progress);
 
-        if (d == NULL) {
-            return send_error(fd, 404, req_info);
-	} else {			
-	    strcat((char*)&buff, HTML_HEADER);
-            while ((dir = readdir(d)) != NULL) {
-	        if (dir->d_name[0] != '.' && dir->d_name[0] != '-') {
-	            sprintf((char*)&buff + strlen((char*)&buff), "<a href=\"%s%s\">%s</a></br>", path + strlen(root_site), dir->d_name, dir->d_name);
-	        }
-	    }
+			//Did we make progress?
+			if (write_status > 0) {
+				req_info->progress += write_status;
+			}
 
-            closedir(d);	
-	    strcat((char*)&buff, HTML_FOOTER);
-        }    	
+			//Return on block/error, otherwise go to next stage
+			if (errno == EWOULDBLOCK || errno == EAGAIN) {
+				LOG("Write blocked!\n");
+				//Resume request later
+				return 0;
+			} else if (errno != 0) { //SIGPIPE or error
+				LOG("Error writing listing\n");
+				//Ignore request
+				return 3;
+			}
+			free(req_info->body);
+			req_info->body = NULL;
+			req_info->progress = 0;
+		}
 
-    	int file_size = strlen((char*)&buff);
-	LOG("Sending directory listing to %d for %s\n", fd, path);
+		if (req_info->stage == 3) {
+			return body_finish(fd, req_info);
+		}
+
+		struct dirent *dir = readdir(req_info->dir);
+		if (dir == NULL) {
+			req_info->body = strdup(HTML_FOOTER);
+			req_info->stage += 1;
+		} else if (dir->d_name[0] != '.' && dir->d_name[0] != '-') {
+			//links are relative to the directory, its URL ends with a slash
+			size_t len = 2 * strlen(dir->d_name) + 32;
+			req_info->body = malloc(len);
+			snprintf(req_info->body, len, "<a href=\"./%s\">%s</a></br>", dir->d_name, dir->d_name);
+		}
+	}
+	return 0;
+}
+
+//site for the Host header, the top level site if there is none or it is unknown
+vhost *select_vhost(request_info *req_info) {
+	server_config *config = req_info->config;
+	if (config->vhosts == NULL) {
+		return config->default_host;
+	}
+
+	//field names are case-insensitive
+	char *line = strchr(req_info->request_h, '\n');
+	while (line != NULL && strncasecmp(line + 1, "Host:", 5) != 0) {
+		line = strchr(line + 1, '\n');
+	}
+	if (line == NULL) {
+		return config->default_host;
+	}
+
+	char *value = line + 6;
+	while (*value == ' ' || *value == '\t') {
+		value += 1;
+	}
+	size_t len = strcspn(value, " \t\r\n");
+
+	vhost *host = vhost_lookup(config->vhosts, value, len);
+	LOG("Host %.*s -> %s\n", (int)len, value, host != NULL ? host->root_site : "default");
+	return host != NULL ? host : config->default_host;
+}
+
+//GET/HEAD of the configured status_path from a loopback address
+int is_status_request(request_info *req_info) {
+	char *status_path = req_info->config->status_path;
+	if (status_path == NULL || !ip_key_is_loopback(&req_info->addr)) {
+		return 0;
+	}
+
+	char *path = strchr(req_info->request_h, ' ') + 1;
+	size_t len = strlen(status_path);
+	return strncmp(path, status_path, len) == 0 && (path[len] == ' ' || path[len] == '?');
+}
+
+int send_metrics(int fd, struct request_info *req_info) {
+
+	//render once so a blocked write resumes on the same snapshot
+	//?slow lists the slow request ring instead of the metrics
+	size_t body_len;
+	if (req_info->body == NULL) {
+		char *path = strchr(req_info->request_h, ' ') + 1;
+		if (strncmp(path + strlen(req_info->config->status_path), "?slow", 5) == 0) {
+			req_info->body = trace_render_slow(&body_len);
+			req_info->mime_type = "text/plain";
+		} else {
+			req_info->body = metrics_render(&body_len);
+			size_t capacity = body_len + 1;
+			memory_render(&req_info->body, &body_len, &capacity);
+			req_info->mime_type = "text/plain; version=0.0.4";
+		}
+	}
+	body_len = strlen(req_info->body);
 
 	if (req_info->stage == 1) {
 		int ret;
-		if ((ret = send_status_n(fd, 200, req_info, file_size)) != 1) {
-	        	return ret;
+		if ((ret = send_status_n(fd, 200, req_info, body_len)) != 1) {
+			return ret;
 		}
 		req_info->stage += 1;
 		req_info->progress = 0;
 	}
 
-	//Get the actual file path, file size, and then write as much as possible
 	if (req_info->stage == 2) {
-		ssize_t write_status = write_all_to_socket(fd, 
-				(char*)&buff + req_info->progress, 
-				strlen((char*)&buff - req_info->progress));
+		if (req_info->req_type == HEAD) {
+			return 1;
+		}
+
+		ssize_t write_status = client_write(fd, req_info,
+				req_info->body + req_info->progress, body_len - req_info->progress);
 
 		//Did we make progress?
 		if (write_status > 0) {
@@ -929,35 +2344,140 @@ int send_list(int fd, char *path, struct request_info *req_info) {
 			LOG("Write blocked!\n");
 			//Resume request later
 			return 0;
-		} else if (errno == SIGPIPE) {
-			LOG("Sigpipe on %d\n", fd);
-			//Ignore request
-			return 3;
 		} else if (errno != 0) { //SIGPIPE or error
-			LOG("Error writing header\n");
+			LOG("Error writing metrics\n");
 			//Ignore request
 			return 3;
 		}
-		return req_info->progress == strlen((char*)&buff);
+		return req_info->progress == body_len;
 	}
+	return 0;
+}
 
-}			
-int send_error(int fd, int status, struct request_info *req_info) {
+//request body bytes for a handler, without blocking the loop
+static ssize_t read_client(void *data, void *buf, size_t len) {
+	request_info *req_info = data;
+	if (req_info->tls != NULL) {
+		return tls_read(req_info->tls, buf, len);
+	}
+	return recv(req_info->event->data.fd, buf, len, MSG_DONTWAIT);
+}
 
-	//make list in html
-	char buff[8096];
-	buff[0] = '\0';
+//what the handler has written and the client not taken yet
+//returns 1 once it is all out, 0 when blocked, 3 on error
+static int send_plugin_body(int fd, struct request_info *req_info) {
+	size_t body_len;
+	const char *body = plugin_response_body(req_info->plugin, &body_len);
+	if (req_info->req_type == HEAD || body_len == 0) {
+		plugin_response_sent(req_info->plugin, body_len);
+		return 1;
+	}
 
-	strcat((char*)&buff, HTML_HEADER);
-	sprintf((char*)&buff + strlen((char*)&buff), "<h2>Error: %d %s</h2>", status, status_desc[status]);
-	strcat((char*)&buff, HTML_FOOTER);    	
+	ssize_t write_status = req_info->chunks != NULL
+			? body_write(fd, req_info, body, body_len)
+			: client_write(fd, req_info, (char *)body, body_len);
 
-    	int file_size = strlen((char*)&buff);
+	//Did we make progress?
+	if (write_status > 0) {
+		plugin_response_sent(req_info->plugin, write_status);
+	}
+
+	//Return on block/error, otherwise go to next stage
+	if (errno == EWOULDBLOCK || errno == EAGAIN) {
+		LOG("Write blocked!\n");
+		//Resume request later
+		return 0;
+	} else if (errno != 0) { //SIGPIPE or error
+		LOG("Error writing plugin response\n");
+		//Ignore request
+		return 3;
+	}
+	return 1;
+}
+
+//a handler module's response, sent once the handler has finished it or as it flushes
+int send_plugin(int fd, struct request_info *req_info) {
+	plugin_call *call = req_info->plugin;
+
+	//the handler sees the whole body, an HTTP/2 stream's is not read
+	//a refused one keeps answering with its error page
+	if (req_info->stream == NULL) {
+		int ret = plugin_body_read(call, read_client, req_info);
+		if (ret == 0) {
+			return 0;
+		} else if (ret == -1) {
+			return 3;
+		} else if (ret != 1) {
+			return send_error(fd, ret, req_info);
+		}
+	}
+
+	//a streamed body the client fell behind on goes out before the handler makes more
+	int ret;
+	if (req_info->stage == 2 && (ret = send_plugin_body(fd, req_info)) != 1) {
+		return ret;
+	}
+
+	int result = plugin_run(call);
+	if (result == EWS_AGAIN && !plugin_streaming(call)) {
+		return 0;
+	} else if (result == EWS_NEXT) {
+		//every matching handler passed, the request is the server's after all
+		plugin_call_free(call);
+		req_info->plugin = NULL;
+		req_info->plugins_passed = 1;
+		return process_request(fd, req_info);
+	} else if (result == EWS_ERROR) {
+		//a streamed response is cut off, its header may be out
+		return plugin_streaming(call) ? 3 : send_error(fd, 500, req_info);
+	}
+
+	if (req_info->stage == 1) {
+		size_t body_len;
+		plugin_response_body(call, &body_len);
+		req_info->fields = plugin_response_headers(call, &req_info->fields_len);
+		if ((ret = send_status_n(fd, plugin_response_status(call), req_info,
+				plugin_streaming(call) ? STREAMED_BODY : body_len)) != 1) {
+			return ret;
+		}
+		req_info->stage += 1;
+		req_info->progress = 0;
+	}
+
+	if ((ret = send_plugin_body(fd, req_info)) != 1) {
+		return ret;
+	} else if (result != EWS_DONE) {
+		//the handler has more to write, what it flushed goes out now
+		return body_flush(fd, req_info) == 3 ? 3 : 0;
+	} else if (req_info->req_type == HEAD) {
+		return 1;
+	}
+	return body_finish(fd, req_info);
+}
+
+//301 to target .. rest
+int send_redirect(int fd, const char *target, const char *rest, struct request_info *req_info) {
+	if (req_info->redirect == NULL) {
+		req_info->redirect = malloc(strlen(target) + strlen(rest) + 1);
+		sprintf(req_info->redirect, "%s%s", target, rest);
+		LOG("Redirecting %d to %s\n", fd, req_info->redirect);
+	}
+	return send_error(fd, 301, req_info);
+}
+
+int send_error(int fd, int status, struct request_info *req_info) {
+
+	//a few hundred bytes at most, the length is known up front
+	char buff[256];
+	snprintf(buff, sizeof(buff), "%s<h2>%s%d %s</h2>%s", HTML_HEADER,
+			status >= 400 ? "Error: " : "", status, status_desc[status], HTML_FOOTER);
+
+	size_t file_size = strlen(buff);
 	LOG("Sending Error page %d to %d\n", status, fd);
 
 	if (req_info->stage == 1) {
 		int ret;
-		if ((ret = send_status_n(fd, 200, req_info, file_size)) != 1) {
+		if ((ret = send_status_n(fd, status, req_info, file_size)) != 1) {
 	        	return ret;
 		}
 		req_info->stage += 1;
@@ -966,9 +2486,8 @@ int send_error(int fd, int status, struct request_info *req_info) {
 
 	//Get the actual file path, file size, and then write as much as possible
 	if (req_info->stage == 2) {
-		ssize_t write_status = write_all_to_socket(fd, 
-				(char*)&buff + req_info->progress, 
-				strlen((char*)&buff - req_info->progress));
+		ssize_t write_status = client_write(fd, req_info,
+				buff + req_info->progress, file_size - req_info->progress);
 
 		//Did we make progress?
 		if (write_status > 0) {
@@ -989,98 +2508,170 @@ int send_error(int fd, int status, struct request_info *req_info) {
 			//Ignore request
 			return 3;
 		}
-		return req_info->progress == strlen((char*)&buff);
+		return req_info->progress == file_size;
 	}
 
 }	
-void set_mime_type(char *path, struct request_info *req_info) {
+void set_mime_type(char *path, const struct stat *file_stat, struct request_info *req_info) {
 	//check mime type
-	if (strstr(path, ".html") != NULL) {
-		req_info->mime_type = "text/html";
-	} else if (strstr(path, ".css") != NULL) {
-		req_info->mime_type = "text/css";
-	} else if (strstr(path, ".js") != NULL) {
-		req_info->mime_type = "text/javascript";
-	} else if (strstr(path, ".mp4") != NULL) {
-		req_info->mime_type = "video/mp4";
-	} else if (strstr(path, ".jpg") != NULL) {
-		req_info->mime_type = "image/jpeg";
-	} else if (strstr(path, ".png") != NULL) {
-		req_info->mime_type = "image/png";
+	req_info->mime_type = mime_type_by_extension(path);
+	if (req_info->mime_type != NULL) {
+		return;
+	}
+	req_info->mime_type = warmup_mime(path, file_stat);
+	if (req_info->mime_type != NULL) {
+		return;
+	} else if (req_info->file != NULL) {
+		req_info->mime_type = magic_descriptor(magic, fileno(req_info->file));
 	} else {
 		req_info->mime_type = magic_file(magic, path);
 	}
+	warmup_remember(path, file_stat, req_info->mime_type);
 }
 
-void parse_config(config_t* cf) {
+//fill the caches before the first client, from the last snapshot when there is one
+void warm_up(server_config *conf) {
+	if (conf->warmup_snapshot != NULL && warmup_load(conf->warmup_snapshot, conf->root_site) != -1) {
+		return;
+	}
+	warmup_crawl(conf->root_site, conf->warmup_threads, MAGIC_FILE);
+	if (conf->mmap_files) {
+		warmup_prime(conf->default_host->cache, conf->mmap_cache_size);
+	}
+	if (conf->warmup_snapshot != NULL) {
+		warmup_save(conf->warmup_snapshot);
+	}
+}
+
+//swap in a new config snapshot for future requests
+//returns -1 if the snapshot could not be applied
+int apply_config(server_config *conf) {
+
+	if (current_config != NULL && !listener_specs_equal(conf->listeners, conf->num_listeners,
+			current_config->listeners, current_config->num_listeners)) {
+		fprintf(stderr, "Listener changes need a restart or an upgrade, still serving the old ones\n");
+	}
+	if (current_config != NULL && !plugin_specs_equal(conf->plugins, conf->num_plugins,
+			current_config->plugins, current_config->num_plugins)) {
+		fprintf(stderr, "Plugin changes need a restart or an upgrade, keeping the loaded ones\n");
+	}
+
+	//reopen the log so rotated files are picked up
+	if (conf->log_file != NULL) {
+		FILE *log = fopen(conf->log_file, "ae");
+		if (log == NULL) {
+			perror("Couldn't find log file");
+			server_config_release(conf);
+			return -1;
+		}
+		if (http_log != NULL) {
+			fclose(http_log);
+		}
+		http_log = log;
+	} else if (http_log != NULL) {
+		fclose(http_log);
+		http_log = NULL;
+	}
+
+	//every reload starts a new capture segment
+	if (conf->capture_file != NULL) {
+		if (capture_open(conf->capture_file) == -1) {
+			fprintf(stderr, "Capture disabled\n");
+		}
+	} else {
+		capture_close();
+	}
 
-	const char *log_file_path = NULL;
+	//mappings made under the old config are dropped with its sites once unused
+	server_config *old = current_config;
+	current_config = conf;
 
-	if (config_read_file(cf, CONFIG_FILE)) {
+	ratelimit_configure(conf->rate_limit_rps, conf->rate_limit_burst,
+			conf->max_connections_per_ip, conf->rate_limit_table_size);
+	overload_configure(conf->overload_lag_ms, conf->overload_queue_ms,
+			conf->overload_idle_ms, conf->overload_retry_after);
+	memory_configure(conf->memory_budget_mb, conf->memory_cgroup);
+	busypoll_configure(conf->busy_poll, conf->busy_poll_us, conf->busy_poll_idle_ms);
+	zerocopy_configure(conf->zerocopy_threshold);
 
-		//root path
-		const char* temp_root = NULL;
-		config_lookup_string(cf, "webserver_root", &temp_root);
-		root_site = strdup(temp_root);
-		LOG("Root of webserver: %s\n", root_site);
+	//in-flight requests keep their own reference
+	server_config_release(old);
+	return 0;
+}
 
-		//port
-		const char* temp_port = NULL;
-		config_lookup_string(cf, "port", &temp_port);
-		port = strdup(temp_port);
-		LOG("Host port: %s\n", port);
+//re-read server.conf, keeping the old settings if the new ones are invalid
+void reload_config() {
+	LOG("Reloading %s\n", CONFIG_FILE);
 
-		//log
-		config_lookup_string(cf, "log_file", &log_file_path);
-		if (log_file_path != NULL) {
+	server_config *conf = server_config_load(CONFIG_FILE);
+	if (conf == NULL || apply_config(conf) == -1) {
+		fprintf(stderr, "Reload failed, keeping previous configuration\n");
+		return;
+	}
 
-			http_log = fopen(log_file_path, "a");
-			if (http_log == NULL) {
-				perror("Couldn't find log file");
-				config_destroy(cf);
-				graceful_exit(0);
-			}
+	LOG("Reloaded configuration\n");
+}
 
-			LOG("Using log file at %s\n", log_file_path);
-		}
+//start a freshly exec'd binary on the listeners, the loop keeps serving
+//until finish_upgrade hears it is ready
+void start_upgrade() {
 
-		const config_setting_t* s_headers = config_lookup(cf, "security_headers");
-		if (s_headers == NULL) {
-			security_headers = DEFAULT_SECURITY_HEADERS;
-		} else {
-			security_headers = malloc(256);
-			security_headers[0] = '\0';
-			for (int i = 0; i < config_setting_length(s_headers); i++) {
-				const char* header = config_setting_get_string_elem(s_headers, i);
-
-				char buf[256];
-				sprintf((char*)&buf, "%s\n", header);
-				strcat(security_headers, (char*)&buf);
-			}
+	if (draining || upgrade_fd != -1) {
+		LOG("Upgrade already in progress\n");
+		return;
+	}
 
-			strcat(security_headers, "\n");
+	//the new process loads this instead of crawling
+	if (current_config->warmup_snapshot != NULL) {
+		warmup_save(current_config->warmup_snapshot);
+	}
 
-			LOG("Security headers:\n\n%s", security_headers);
-		}
+	upgrade_pid = upgrade_exec(saved_argv, listen_fds, num_listen_fds, &upgrade_fd);
+	if (upgrade_pid == -1) {
+		upgrade_fd = -1;
+		return;
+	}
 
-		config_lookup_int(cf, "max_file_size", &max_file_size);
-		LOG("Using max file size of %d\n", max_file_size);
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = upgrade_fd };
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, upgrade_fd, &ev);
+	upgrade_deadline_ms = monotonic_ms() + UPGRADE_READY_TIMEOUT_MS;
+}
 
-		config_lookup_int(cf, "timeout_ms", &timeout_ms);
-		if (timeout_ms <= 0) {
-			timeout_ms = DEFAULT_TIMEOUT_MS;
-		}
+//the new binary reported on its ready pipe: stop accepting and let
+//in-flight responses finish before exiting
+void finish_upgrade() {
 
-		LOG("Using timeout of %d\n", timeout_ms);
+	int ready = upgrade_ready(upgrade_fd);
+	if (ready == 0) {
+		return;
+	}
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, upgrade_fd, NULL);
+	if (ready == -1) {
+		upgrade_abort(upgrade_pid, upgrade_fd);
+		upgrade_fd = upgrade_pid = -1;
+		return;
+	}
+	close(upgrade_fd);
+	upgrade_fd = upgrade_pid = -1;
 
-	} else {
-		perror("Couldnt get config file");
-		config_destroy(cf);
-		graceful_exit(0);
+	//the new process holds them too, so closing alone would leave them in our set
+	for (int i = 0; i < num_listen_fds; i++) {
+		epoll_ctl(epollfd, EPOLL_CTL_DEL, listen_fds[i], NULL);
+		close(listen_fds[i]);
 	}
+	num_listen_fds = 0;
 
-	config_destroy(cf);
-	if (port == NULL || root_site == NULL) {
-		print_usage();
+	draining = 1;
+	drain_deadline_ms = monotonic_ms() + current_config->drain_timeout_ms;
+	LOG("Draining %d clients for up to %dms\n", active_clients, current_config->drain_timeout_ms);
+}
+
+//timeout for the next epoll_wait, no later than a pending upgrade's deadline
+int upgrade_timeout(int blocking_ms) {
+	if (upgrade_fd == -1) {
+		return blocking_ms;
 	}
+	long long left = upgrade_deadline_ms - monotonic_ms();
+	left = left < 0 ? 0 : left;
+	return blocking_ms < 0 || left < blocking_ms ? (int)left : blocking_ms;
 }